@@ -0,0 +1,862 @@
+// @file      bench_toolbox.cpp
+// @author    Roger Davies     [rdavies3000@gmail.com]
+//
+// Copyright (c) 2022 Roger Davies, all rights reserved
+#include <benchmark/benchmark.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <numeric>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include "lib/toolbox.hpp"
+
+namespace {
+/**
+ * @brief Create a matrix filled with a deterministic, non-trivial pattern.
+ *
+ * @param rows        The number of rows.
+ * @param cols        The number of columns.
+ * @return rtb::Matrix
+ */
+rtb::Matrix MakeMatrix(size_t rows, size_t cols) {
+  rtb::Matrix m(rows, cols);
+  for (size_t i = 0; i < rows; i++) {
+    for (size_t j = 0; j < cols; j++) {
+      m(i, j) = static_cast<double>((i * 31 + j * 17) % 101) * 0.01;
+    }
+  }
+  return m;
+}
+
+/**
+ * @brief Get the path of a scratch file. Files are created in a directory of
+ * their own under the temporary directory, which is removed with everything
+ * in it when the benchmarks exit.
+ *
+ * @param name          The file name.
+ * @return std::string  The path.
+ */
+std::string ScratchPath(const std::string& name) {
+  struct ScratchDirectory {
+    std::filesystem::path path;
+    ScratchDirectory() {
+      std::string pattern =
+          (std::filesystem::temp_directory_path() / "toolbox_bench.XXXXXX")
+              .string();
+      if (::mkdtemp(pattern.data()) == nullptr) {
+        throw std::system_error(errno, std::generic_category(), "mkdtemp");
+      }
+      path = pattern;
+    }
+    ~ScratchDirectory() {
+      std::error_code error;
+      std::filesystem::remove_all(path, error);
+    }
+    ScratchDirectory(const ScratchDirectory&) = delete;
+    ScratchDirectory& operator=(const ScratchDirectory&) = delete;
+    ScratchDirectory(const ScratchDirectory&&) = delete;
+    ScratchDirectory& operator=(const ScratchDirectory&&) = delete;
+  };
+  static const ScratchDirectory directory;
+  return (directory.path / name).string();
+}
+
+/**
+ * @brief Route every log type to the null sink so that benchmarks of code that
+ * logs as a side effect (e.g. Timer) do not measure terminal I/O.
+ *
+ */
+void SilenceLogger() {
+  rtb::Logger::SetErrorSink(rtb::Logger::kSinkNull);
+  rtb::Logger::SetWarningSink(rtb::Logger::kSinkNull);
+  rtb::Logger::SetInfoSink(rtb::Logger::kSinkNull);
+}
+}  // namespace
+
+// Matrix
+
+void BM_MatrixMultiply(benchmark::State& state) {
+  const auto n = static_cast<size_t>(state.range(0));
+  rtb::Matrix a = MakeMatrix(n, n);
+  rtb::Matrix b = MakeMatrix(n, n);
+  for (auto _ : state) {
+    rtb::Matrix c = a.Multiply(b);
+    benchmark::DoNotOptimize(c);
+  }
+  state.SetComplexityN(state.range(0));
+  state.counters["FLOPS"] = benchmark::Counter(
+      2.0 * static_cast<double>(n * n * n), benchmark::Counter::kIsRate);
+}
+BENCHMARK(BM_MatrixMultiply)
+    ->RangeMultiplier(2)
+    ->Range(16, 256)
+    ->Complexity(benchmark::oNCubed);
+
+void BM_MatrixPower(benchmark::State& state) {
+  rtb::Matrix a = MakeMatrix(64, 64) * (1.0 / 64.0);
+  const auto k = static_cast<unsigned int>(state.range(0));
+  for (auto _ : state) {
+    rtb::Matrix p = a.Power(k);
+    benchmark::DoNotOptimize(p);
+  }
+}
+BENCHMARK(BM_MatrixPower)->RangeMultiplier(4)->Range(2, 512);
+
+void BM_MatrixChainLeftToRight(benchmark::State& state) {
+  rtb::Matrix a = MakeMatrix(200, 10);
+  rtb::Matrix b = MakeMatrix(10, 200);
+  rtb::Matrix c = MakeMatrix(200, 10);
+  rtb::Matrix d = MakeMatrix(10, 200);
+  for (auto _ : state) {
+    rtb::Matrix p = a.Multiply(b).Multiply(c).Multiply(d);
+    benchmark::DoNotOptimize(p);
+  }
+}
+BENCHMARK(BM_MatrixChainLeftToRight);
+
+void BM_MatrixChainOptimal(benchmark::State& state) {
+  rtb::Matrix a = MakeMatrix(200, 10);
+  rtb::Matrix b = MakeMatrix(10, 200);
+  rtb::Matrix c = MakeMatrix(200, 10);
+  rtb::Matrix d = MakeMatrix(10, 200);
+  for (auto _ : state) {
+    rtb::Matrix p = rtb::Matrix::MultiplyChain({a, b, c, d});
+    benchmark::DoNotOptimize(p);
+  }
+}
+BENCHMARK(BM_MatrixChainOptimal);
+
+void BM_MatrixTranspose(benchmark::State& state) {
+  const auto n = static_cast<size_t>(state.range(0));
+  rtb::Matrix a = MakeMatrix(n, n);
+  for (auto _ : state) {
+    rtb::Matrix t = a.Transpose();
+    benchmark::DoNotOptimize(t);
+  }
+  state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) *
+                          static_cast<int64_t>(2 * n * n * sizeof(double)));
+}
+BENCHMARK(BM_MatrixTranspose)->RangeMultiplier(4)->Range(16, 1024);
+
+void BM_MatrixAdd(benchmark::State& state) {
+  const auto n = static_cast<size_t>(state.range(0));
+  rtb::Matrix a = MakeMatrix(n, n);
+  rtb::Matrix b = MakeMatrix(n, n);
+  for (auto _ : state) {
+    rtb::Matrix c = a + b;
+    benchmark::DoNotOptimize(c);
+  }
+  state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) *
+                          static_cast<int64_t>(3 * n * n * sizeof(double)));
+}
+BENCHMARK(BM_MatrixAdd)->RangeMultiplier(4)->Range(16, 1024);
+
+void BM_MatrixScalarMultiply(benchmark::State& state) {
+  const auto n = static_cast<size_t>(state.range(0));
+  rtb::Matrix a = MakeMatrix(n, n);
+  for (auto _ : state) {
+    rtb::Matrix c = a * 1.5;
+    benchmark::DoNotOptimize(c);
+  }
+  state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) *
+                          static_cast<int64_t>(2 * n * n * sizeof(double)));
+}
+BENCHMARK(BM_MatrixScalarMultiply)->RangeMultiplier(4)->Range(16, 1024);
+
+void BM_MatrixApply(benchmark::State& state) {
+  const auto n = static_cast<size_t>(state.range(0));
+  rtb::Matrix a = MakeMatrix(n, n);
+  for (auto _ : state) {
+    a.Apply([](double x) { return x < 0.5 ? x : 1.0 - x; });
+    benchmark::ClobberMemory();
+  }
+  state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) *
+                          static_cast<int64_t>(2 * n * n * sizeof(double)));
+}
+BENCHMARK(BM_MatrixApply)->RangeMultiplier(4)->Range(16, 1024);
+
+void BM_MatrixMapTanh(benchmark::State& state) {
+  const auto n = static_cast<size_t>(state.range(0));
+  rtb::Matrix a = MakeMatrix(n, n);
+  for (auto _ : state) {
+    rtb::Matrix c = a.Map([](double x) { return std::tanh(x); });
+    benchmark::DoNotOptimize(c);
+  }
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations()) *
+                          static_cast<int64_t>(n * n));
+}
+BENCHMARK(BM_MatrixMapTanh)->RangeMultiplier(4)->Range(16, 1024);
+
+void BM_MatrixReduceSum(benchmark::State& state) {
+  const auto n = static_cast<size_t>(state.range(0));
+  rtb::Matrix a = MakeMatrix(n, n);
+  for (auto _ : state) {
+    double sum = a.Reduce(0.0, [](double acc, double x) { return acc + x; });
+    benchmark::DoNotOptimize(sum);
+  }
+  state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) *
+                          static_cast<int64_t>(n * n * sizeof(double)));
+}
+BENCHMARK(BM_MatrixReduceSum)->RangeMultiplier(4)->Range(16, 1024);
+
+void BM_MatrixDotProduct(benchmark::State& state) {
+  const auto n = static_cast<size_t>(state.range(0));
+  rtb::Matrix a = MakeMatrix(1, n);
+  rtb::Matrix b = MakeMatrix(1, n);
+  for (auto _ : state) {
+    double dot = a.DotProduct(b);
+    benchmark::DoNotOptimize(dot);
+  }
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations()) *
+                          static_cast<int64_t>(n));
+}
+BENCHMARK(BM_MatrixDotProduct)->RangeMultiplier(8)->Range(64, 1 << 18);
+
+void BM_MatrixCorrelate2D(benchmark::State& state) {
+  const auto k = static_cast<size_t>(state.range(0));
+  rtb::Matrix image = MakeMatrix(512, 512);
+  // Not separable, so this measures the direct path.
+  rtb::Matrix kernel = MakeMatrix(k, k);
+  for (auto _ : state) {
+    rtb::Matrix out = image.Correlate2D(kernel);
+    benchmark::DoNotOptimize(out);
+  }
+  state.counters["MACs"] =
+      benchmark::Counter(static_cast<double>(512 * 512 * k * k),
+                         benchmark::Counter::kIsIterationInvariantRate);
+}
+BENCHMARK(BM_MatrixCorrelate2D)->DenseRange(3, 31, 4);
+
+void BM_MatrixCorrelate2DSeparable(benchmark::State& state) {
+  const auto k = static_cast<size_t>(state.range(0));
+  rtb::Matrix image = MakeMatrix(512, 512);
+  rtb::Matrix kernel(k, k);
+  kernel.Apply([](double) { return 1.0; });
+  for (auto _ : state) {
+    rtb::Matrix out =
+        image.Correlate2D(kernel, rtb::Matrix::BorderMode::kReplicate);
+    benchmark::DoNotOptimize(out);
+  }
+}
+BENCHMARK(BM_MatrixCorrelate2DSeparable)->DenseRange(3, 31, 4);
+
+// TaskScheduler
+
+void BM_TaskSpawn(benchmark::State& state) {
+  rtb::TaskScheduler& scheduler = rtb::TaskScheduler::GetInstance();
+  const auto task_count = static_cast<size_t>(state.range(0));
+  for (auto _ : state) {
+    rtb::TaskGroup group(scheduler);
+    for (size_t i = 0; i < task_count; i++) {
+      group.Run([]() {});
+    }
+    group.Wait();
+  }
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations()) *
+                          state.range(0));
+}
+BENCHMARK(BM_TaskSpawn)->RangeMultiplier(8)->Range(8, 4096)->UseRealTime();
+
+void BM_ParallelForEmpty(benchmark::State& state) {
+  const auto grain = static_cast<size_t>(state.range(0));
+  for (auto _ : state) {
+    rtb::ParallelFor(0, 1U << 16U, grain, [](size_t begin, size_t end) {
+      benchmark::DoNotOptimize(end - begin);
+    });
+  }
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations()) *
+                          ((1 << 16) / state.range(0)));
+}
+BENCHMARK(BM_ParallelForEmpty)
+    ->RangeMultiplier(8)
+    ->Range(8, 4096)
+    ->UseRealTime();
+
+/**
+ * @brief Irregular workload: the cost of index i grows quadratically, so an
+ * even static split would leave most threads idle. Reports the ratio of the
+ * busiest thread's time to the mean time over all participating threads.
+ *
+ */
+void BM_ParallelForIrregular(benchmark::State& state) {
+  rtb::TaskScheduler scheduler(static_cast<size_t>(state.range(0)));
+  const size_t n = 512;
+  std::vector<std::atomic<int64_t>> busy_ns(scheduler.WorkerCount() + 1);
+  auto work = [&](size_t begin, size_t end) {
+    const auto start = std::chrono::steady_clock::now();
+    double x = 0.0;
+    for (size_t i = begin; i < end; i++) {
+      for (size_t k = 0; k < i * i / 64; k++) {
+        x += std::sqrt(static_cast<double>(k));
+      }
+    }
+    benchmark::DoNotOptimize(x);
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+    busy_ns[scheduler.WorkerIndex()] +=
+        std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+  };
+
+  for (auto _ : state) {
+    scheduler.ParallelFor(0, n, 4, work);
+  }
+
+  int64_t max_busy = 0;
+  int64_t total_busy = 0;
+  for (auto& busy : busy_ns) {
+    max_busy = std::max(max_busy, busy.load());
+    total_busy += busy.load();
+  }
+  const double mean_busy =
+      static_cast<double>(total_busy) / static_cast<double>(busy_ns.size());
+  state.counters["imbalance"] =
+      mean_busy > 0.0 ? static_cast<double>(max_busy) / mean_busy : 0.0;
+  state.counters["steals"] = static_cast<double>(scheduler.StealCount());
+}
+BENCHMARK(BM_ParallelForIrregular)->DenseRange(0, 7)->UseRealTime();
+
+// Logger
+
+void BM_LoggerNullSink(benchmark::State& state) {
+  SilenceLogger();
+  for (auto _ : state) {
+    rtb::Logger::LogError(42, "value");
+  }
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+}
+BENCHMARK(BM_LoggerNullSink);
+
+// A call below the runtime level, the argument is not evaluated.
+void BM_LoggerDisabledLevel(benchmark::State& state) {
+  SilenceLogger();
+  const rtb::Matrix m = MakeMatrix(16, 16);
+  for (auto _ : state) {
+    RTB_LOG_DEBUG(m.Transpose()(0, 0), "matrix");
+  }
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+}
+BENCHMARK(BM_LoggerDisabledLevel);
+
+// An expensive payload logged eagerly to the null sink (0), lazily to the
+// null sink (1) and lazily below the level (2).
+void BM_LoggerLazyPayload(benchmark::State& state) {
+  SilenceLogger();
+  const rtb::Matrix m = MakeMatrix(16, 16);
+  auto to_string = [&m]() {
+    std::string text;
+    for (size_t i = 0; i < m.Rows(); i++) {
+      for (size_t j = 0; j < m.Cols(); j++) {
+        text += std::to_string(m(i, j));
+        text += ' ';
+      }
+    }
+    return text;
+  };
+  for (auto _ : state) {
+    switch (state.range(0)) {
+      case 0:
+        rtb::Logger::LogInfo(to_string(), "state");
+        break;
+      case 1:
+        RTB_LOG_LAZY(rtb_h::kInfo, "state", to_string());
+        break;
+      default:
+        RTB_LOG_LAZY(rtb_h::kDebug, "state", to_string());
+        break;
+    }
+  }
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+}
+BENCHMARK(BM_LoggerLazyPayload)->Arg(0)->Arg(1)->Arg(2);
+
+// A call below the level of its module, through a handle created once.
+void BM_ModuleLoggerDisabledLevel(benchmark::State& state) {
+  SilenceLogger();
+  static const rtb::ModuleLogger matrix_log("bench.matrix");
+  const rtb::Matrix m = MakeMatrix(16, 16);
+  for (auto _ : state) {
+    RTB_MODULE_LOG(matrix_log, rtb_h::kDebug, m.Transpose()(0, 0), "matrix");
+  }
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+}
+BENCHMARK(BM_ModuleLoggerDisabledLevel);
+
+// An enabled call of a module with its own sink.
+void BM_ModuleLoggerNullSink(benchmark::State& state) {
+  SilenceLogger();
+  rtb::ModuleLogger matrix_log("bench.matrix.null");
+  matrix_log.SetSink(std::make_shared<rtb_h::LogSinkNull>());
+  for (auto _ : state) {
+    matrix_log.Log(rtb_h::kInfo, 42, "value");
+  }
+  matrix_log.SetSink(nullptr);
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+}
+BENCHMARK(BM_ModuleLoggerNullSink);
+
+// A rate limited call site that refuses almost every call.
+void BM_LoggerRateLimitedDropped(benchmark::State& state) {
+  SilenceLogger();
+  for (auto _ : state) {
+    RTB_LOG_RATE_LIMITED(rtb_h::kError, 1, 1, 42, "value");
+  }
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+}
+BENCHMARK(BM_LoggerRateLimitedDropped)->Threads(1)->Threads(4);
+
+void BM_LoggerDedupRepeated(benchmark::State& state) {
+  SilenceLogger();
+  for (auto _ : state) {
+    RTB_LOG_DEDUP(rtb_h::kError, 42, "value");
+  }
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+}
+BENCHMARK(BM_LoggerDedupRepeated);
+
+void BM_LoggerFileSink(benchmark::State& state) {
+  SilenceLogger();
+  rtb::Logger::SetFileSinkPath(ScratchPath("bench.log"));
+  rtb::Logger::SetErrorSink(rtb::Logger::kSinkFile);
+  for (auto _ : state) {
+    rtb::Logger::LogError(42, "value");
+  }
+  rtb::Logger::SetErrorSink(rtb::Logger::kSinkNull);
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+}
+BENCHMARK(BM_LoggerFileSink);
+
+// File sink throughput by buffer size in bytes. A buffer of 0 writes every
+// line with its own system call, like an unbuffered stream.
+void BM_LogSinkFileThroughput(benchmark::State& state) {
+  rtb::FileSinkOptions options;
+  options.buffer_size = static_cast<size_t>(state.range(0));
+  options.flush_level = rtb_h::kFatal;
+  options.sync = state.range(1) != 0 ? rtb::FileSyncPolicy::kEveryFlush
+                                     : rtb::FileSyncPolicy::kNone;
+  rtb_h::LogSinkFile sink(ScratchPath("sink.log"), options);
+  const std::string line =
+      "[Info   ] 2022-03-04 05:06:07.123456 value: " + std::string(64, 'x');
+  for (auto _ : state) {
+    sink.Log(line, rtb_h::kInfo);
+  }
+  sink.Flush();
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+  state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) *
+                          static_cast<int64_t>(line.size() + 1));
+}
+BENCHMARK(BM_LogSinkFileThroughput)
+    ->ArgsProduct({{0, 4 << 10, 64 << 10, 1 << 20}, {0}})
+    ->Args({64 << 10, 1});
+
+// Lines to a redirected console, /dev/null: an ostream flushed with
+// std::endl per line as the console sinks used to (0), and LogSinkConsole,
+// which batches them (1).
+void BM_LogSinkConsoleThroughput(benchmark::State& state) {
+  const std::string line =
+      "[Info   ] 2022-03-04 05:06:07.123456 value: " + std::string(64, 'x');
+  if (state.range(0) == 0) {
+    std::ofstream out("/dev/null");
+    for (auto _ : state) {
+      out << line << std::endl;
+    }
+  } else {
+    const int fd = ::open("/dev/null", O_WRONLY);
+    {
+      rtb_h::LogSinkConsole sink(fd);
+      for (auto _ : state) {
+        sink.Log(line, rtb_h::kInfo);
+      }
+    }
+    ::close(fd);
+  }
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+  state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) *
+                          static_cast<int64_t>(line.size() + 1));
+}
+BENCHMARK(BM_LogSinkConsoleThroughput)->Arg(0)->Arg(1);
+
+void BM_LogSinkMmapThroughput(benchmark::State& state) {
+  rtb_h::LogSinkMmap sink(ScratchPath("mmap.log"));
+  const std::string line =
+      "[Info   ] 2022-03-04 05:06:07.123456 value: " + std::string(64, 'x');
+  for (auto _ : state) {
+    sink.Log(line, rtb_h::kInfo);
+  }
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+  state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) *
+                          static_cast<int64_t>(line.size() + 1));
+}
+BENCHMARK(BM_LogSinkMmapThroughput);
+
+// Per-call latency of file sinks while another thread streams 1 MiB blocks
+// to a second file and syncs them: LogSinkFile with a 64 KiB buffer, which
+// writes in the caller when it is full (0), LogSinkUring with io_uring (1)
+// and with its writer threads (2).
+void BM_LogSinkUringTailLatency(benchmark::State& state) {
+  const std::string path = ScratchPath("uring.log");
+  const std::string contention_path = ScratchPath("contention.dat");
+  std::unique_ptr<rtb_h::LogSink> sink;
+  if (state.range(0) == 0) {
+    rtb::FileSinkOptions options;
+    options.buffer_size = 64 << 10;
+    options.flush_level = rtb_h::kFatal;
+    sink = std::make_unique<rtb_h::LogSinkFile>(path, options);
+  } else {
+    sink = std::make_unique<rtb_h::LogSinkUring>(
+        path, rtb_h::LogSinkUring::kDefaultSlotSize, state.range(0) == 1);
+  }
+
+  std::atomic<bool> stop{false};
+  std::thread contention([&stop, &contention_path]() {
+    const int fd =
+        ::open(contention_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    const std::vector<char> block(1 << 20, 'x');
+    for (int i = 1; !stop.load(std::memory_order_relaxed); i++) {
+      if (::write(fd, block.data(), block.size()) < 0) {
+        break;
+      }
+      ::fdatasync(fd);
+      if (i % 64 == 0) {
+        ::ftruncate(fd, 0);
+        ::lseek(fd, 0, SEEK_SET);
+      }
+    }
+    ::close(fd);
+  });
+
+  const std::string line =
+      "[Info   ] 2022-03-04 05:06:07.123456 value: " + std::string(64, 'x');
+  std::vector<double> latencies;
+  latencies.reserve(1U << 20U);
+  for (auto _ : state) {
+    const auto start = std::chrono::steady_clock::now();
+    sink->Log(line, rtb_h::kInfo);
+    const auto stop_time = std::chrono::steady_clock::now();
+    latencies.push_back(
+        std::chrono::duration<double, std::nano>(stop_time - start).count());
+  }
+  sink.reset();
+  stop = true;
+  contention.join();
+  std::filesystem::remove(path);
+  std::filesystem::remove(contention_path);
+
+  std::sort(latencies.begin(), latencies.end());
+  const auto percentile = [&latencies](double p) {
+    return latencies[static_cast<size_t>(p * (latencies.size() - 1))];
+  };
+  state.counters["p50_ns"] = percentile(0.50);
+  state.counters["p99_ns"] = percentile(0.99);
+  state.counters["p999_ns"] = percentile(0.999);
+  state.counters["max_ns"] = latencies.back();
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+}
+BENCHMARK(BM_LogSinkUringTailLatency)->Arg(0)->Arg(1)->Arg(2);
+
+// Records per second to a local datagram collector that drains its socket
+// on another thread, sending every record on its own (1) and in batches of
+// 64 with one sendmmsg (64). Records the collector could not take in time
+// are counted as dropped.
+void BM_LogSinkSyslogThroughput(benchmark::State& state) {
+  const std::string path = ScratchPath("syslog.sock");
+  std::filesystem::remove(path);
+  const int collector = ::socket(AF_UNIX, SOCK_DGRAM, 0);
+  sockaddr_un address{};
+  address.sun_family = AF_UNIX;
+  std::strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+  ::bind(collector, reinterpret_cast<const sockaddr*>(&address),
+         sizeof(address));
+  timeval timeout{0, 100000};
+  ::setsockopt(collector, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  std::atomic<bool> stop{false};
+  std::thread drain([collector, &stop]() {
+    char buffer[4096];
+    while (!stop.load(std::memory_order_relaxed)) {
+      ::recv(collector, buffer, sizeof(buffer), 0);
+    }
+  });
+
+  rtb::SyslogSinkOptions options;
+  options.batch_size = static_cast<size_t>(state.range(0));
+  const std::string line =
+      "[Info   ] 2022-03-04 05:06:07.123456 value: " + std::string(64, 'x');
+  uint64_t dropped = 0;
+  {
+    rtb_h::LogSinkSyslog sink(path, options);
+    for (auto _ : state) {
+      sink.Log(line, rtb_h::kInfo);
+    }
+    sink.Flush();
+    dropped = sink.Dropped();
+  }
+  stop = true;
+  drain.join();
+  ::close(collector);
+  std::filesystem::remove(path);
+  state.counters["dropped"] = static_cast<double>(dropped);
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+}
+BENCHMARK(BM_LogSinkSyslogThroughput)->Arg(1)->Arg(64);
+
+// Recording a line in the calling thread's ring, no shared writes.
+void BM_FlightRecorderLog(benchmark::State& state) {
+  static rtb_h::LogSinkFlightRecorder recorder(ScratchPath("flight.log"));
+  const std::string line =
+      "[Debug  ] 2022-03-04 05:06:07.123456 value: " + std::string(64, 'x');
+  for (auto _ : state) {
+    recorder.Log(line, rtb_h::kDebug);
+  }
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+}
+BENCHMARK(BM_FlightRecorderLog)->Threads(1)->Threads(4);
+
+// The same message with fields as a text line (0) and as a JSON Lines
+// record (1), written to a file; bytes/s counts the file size.
+void BM_LoggerFields(benchmark::State& state) {
+  SilenceLogger();
+  const bool json = state.range(0) != 0;
+  const std::string path =
+      ScratchPath(json ? "fields.jsonl" : "fields.log");
+  if (json) {
+    rtb::Logger::SetJsonSinkPath(path);
+    rtb::Logger::SetInfoSink(rtb::Logger::kSinkJson);
+  } else {
+    rtb::Logger::SetFileSinkPath(path);
+    rtb::Logger::SetInfoSink(rtb::Logger::kSinkFile);
+  }
+  const std::string user = "some.user@example.com";
+  for (auto _ : state) {
+    rtb::Logger::LogFields(rtb_h::kInfo, "request served",
+                           rtb::Field("status", 200),
+                           rtb::Field("latency_ms", 12.75),
+                           rtb::Field("user", user),
+                           rtb::Field("path", "/api/v1/items"));
+  }
+  rtb::Logger::Flush();
+  rtb::Logger::SetInfoSink(rtb::Logger::kSinkNull);
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+  state.SetBytesProcessed(
+      static_cast<int64_t>(std::filesystem::file_size(path)));
+}
+BENCHMARK(BM_LoggerFields)->Arg(0)->Arg(1);
+
+// One message fanned out to a text file sink and a JSON Lines file sink, the
+// JSON sink written in the caller (0) or on its own thread (1). Each line is
+// formatted once per form.
+void BM_LoggerFanOut(benchmark::State& state) {
+  SilenceLogger();
+  const std::string text_path = ScratchPath("fanout.log");
+  const std::string json_path = ScratchPath("fanout.jsonl");
+  const rtb::Logger::SinkId text_id =
+      rtb::Logger::AddSink(std::make_shared<rtb_h::LogSinkFile>(text_path));
+  const rtb::Logger::SinkId json_id = rtb::Logger::AddSink(
+      std::make_shared<rtb_h::LogSinkJsonLines>(json_path), rtb_h::kTrace,
+      state.range(0) != 0);
+  for (auto _ : state) {
+    rtb::Logger::LogFields(rtb_h::kInfo, "request served",
+                           rtb::Field("status", 200),
+                           rtb::Field("path", "/api/v1/items"));
+  }
+  rtb::Logger::RemoveSink(text_id);
+  rtb::Logger::RemoveSink(json_id);
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+}
+BENCHMARK(BM_LoggerFanOut)->Arg(0)->Arg(1);
+
+// Log calls into a queue whose writer is slower than the caller, with each
+// backpressure policy (0 block, 1 drop newest, 2 drop oldest); the counter
+// is the fraction of messages dropped.
+void BM_AsyncBackpressure(benchmark::State& state) {
+  struct SlowSink : public rtb_h::LogSink {
+    void Log(std::string_view message, rtb_h::MessageType) override {
+      const auto until =
+          std::chrono::steady_clock::now() + std::chrono::microseconds(1);
+      while (std::chrono::steady_clock::now() < until) {
+        benchmark::DoNotOptimize(message.data());
+      }
+    }
+  };
+  SlowSink sink;
+  const rtb::BackpressurePolicy policy{
+      static_cast<rtb::Backpressure>(state.range(0))};
+  rtb::AsyncLogStats stats;
+  {
+    rtb_h::AsyncLogWriter writer(8192, policy);
+    const std::string line(80, 'x');
+    for (auto _ : state) {
+      writer.Enqueue(rtb_h::LogRecord{&sink, rtb_h::kInfo, line});
+    }
+    stats = writer.GetStats();
+  }
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+  state.counters["dropped"] =
+      static_cast<double>(stats.dropped[rtb_h::kInfo]) /
+      static_cast<double>(state.iterations());
+}
+BENCHMARK(BM_AsyncBackpressure)->Arg(0)->Arg(1)->Arg(2);
+
+// Per-call latency seen by the caller, synchronous (0) or asynchronous (1).
+void BM_LoggerCallLatency(benchmark::State& state) {
+  SilenceLogger();
+  rtb::Logger::SetFileSinkPath(ScratchPath("bench.log"));
+  rtb::Logger::SetErrorSink(rtb::Logger::kSinkFile);
+  rtb::Logger::SetAsync(state.range(0) != 0);
+  std::vector<double> latencies;
+  latencies.reserve(1U << 20U);
+  for (auto _ : state) {
+    const auto start = std::chrono::steady_clock::now();
+    rtb::Logger::LogError(42, "value");
+    const auto stop = std::chrono::steady_clock::now();
+    latencies.push_back(
+        std::chrono::duration<double, std::nano>(stop - start).count());
+  }
+  rtb::Logger::SetAsync(false);
+  rtb::Logger::SetErrorSink(rtb::Logger::kSinkNull);
+
+  std::sort(latencies.begin(), latencies.end());
+  const auto percentile = [&latencies](double p) {
+    return latencies[static_cast<size_t>(p * (latencies.size() - 1))];
+  };
+  state.counters["p50_ns"] = percentile(0.50);
+  state.counters["p99_ns"] = percentile(0.99);
+  state.counters["max_ns"] = latencies.back();
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+}
+BENCHMARK(BM_LoggerCallLatency)->Arg(0)->Arg(1);
+
+void BM_BinaryLoggerLog(benchmark::State& state) {
+  rtb::BinaryLogger::Open(ScratchPath("bench.blog"));
+  for (auto _ : state) {
+    RTB_BINARY_LOG_ERROR("value: {}", 42);
+  }
+  rtb::BinaryLogger::Close();
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+}
+BENCHMARK(BM_BinaryLoggerLog);
+
+void BM_BinaryLoggerLogString(benchmark::State& state) {
+  rtb::BinaryLogger::Open(ScratchPath("bench.blog"));
+  const std::string value(static_cast<size_t>(state.range(0)), 'x');
+  for (auto _ : state) {
+    RTB_BINARY_LOG_INFO("payload: {}", value);
+  }
+  rtb::BinaryLogger::Close();
+  state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) *
+                          state.range(0));
+}
+BENCHMARK(BM_BinaryLoggerLogString)->RangeMultiplier(8)->Range(8, 4096);
+
+void BM_LoggerStringValue(benchmark::State& state) {
+  SilenceLogger();
+  const std::string value(static_cast<size_t>(state.range(0)), 'x');
+  for (auto _ : state) {
+    rtb::Logger::LogInfo(value, "payload");
+  }
+  state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) *
+                          state.range(0));
+}
+BENCHMARK(BM_LoggerStringValue)->RangeMultiplier(8)->Range(8, 4096);
+
+void BM_LoggerGetTimestamp(benchmark::State& state) {
+  for (auto _ : state) {
+    std::string timestamp = rtb::Logger::GetTimestamp();
+    benchmark::DoNotOptimize(timestamp);
+  }
+}
+BENCHMARK(BM_LoggerGetTimestamp);
+
+// Formatted timestamps per second, by style and precision.
+void BM_TimestampFormat(benchmark::State& state) {
+  const rtb::TimestampFormatter formatter(
+      static_cast<rtb::TimestampStyle>(state.range(0)),
+      static_cast<rtb::TimestampPrecision>(state.range(1)));
+  char buffer[rtb::TimestampFormatter::kMaxLength];
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(
+        formatter.Format(std::chrono::system_clock::now(), buffer));
+  }
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+}
+BENCHMARK(BM_TimestampFormat)->ArgsProduct({{0, 1, 2, 3}, {0, 1, 2}});
+
+// Timer
+
+void BM_TimerElapsedTime(benchmark::State& state) {
+  SilenceLogger();
+  rtb::Timer timer;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(timer.ElapsedTime());
+  }
+}
+BENCHMARK(BM_TimerElapsedTime);
+
+void BM_TimerScope(benchmark::State& state) {
+  SilenceLogger();
+  for (auto _ : state) {
+    rtb::Timer timer("scope");
+  }
+}
+BENCHMARK(BM_TimerScope);
+
+// Instrumentor
+
+void BM_InstrumentationScope(benchmark::State& state) {
+  rtb::Instrumentor::GetInstance().BeginSession("bench",
+                                                ScratchPath("trace.json"));
+  for (auto _ : state) {
+    rtb::InstrumentationTimer timer("scope");
+  }
+  rtb::Instrumentor::GetInstance().EndSession();
+}
+BENCHMARK(BM_InstrumentationScope);
+
+// ClargParser
+
+void BM_ClargParserParse(benchmark::State& state) {
+  SilenceLogger();
+  const auto arg_count = static_cast<size_t>(state.range(0));
+  rtb::ClargParser* parser = rtb::ClargParser::GetInstance();
+
+  // Half of the arguments are parameters, half are flags.
+  std::vector<std::string> args{"bench"};
+  for (size_t k = 0; k < arg_count; k++) {
+    const std::string name = "arg" + std::to_string(k);
+    if (k % 2 == 0) {
+      parser->AddParamToSearchList(name, rtb::ClargParam::ParamType::kInt);
+      args.push_back("-" + name + "=" + std::to_string(k));
+    } else {
+      parser->AddFlagToSearchList(name);
+      args.push_back("-" + name);
+    }
+  }
+  std::vector<char*> argv;
+  argv.reserve(args.size());
+  for (auto& arg : args) {
+    argv.push_back(arg.data());
+  }
+
+  for (auto _ : state) {
+    parser->Parse(static_cast<int>(argv.size()), argv.data());
+  }
+  state.SetComplexityN(state.range(0));
+}
+BENCHMARK(BM_ClargParserParse)
+    ->RangeMultiplier(4)
+    ->Range(4, 256)
+    ->Complexity(benchmark::oNSquared);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,105 @@
+#!/usr/bin/env python3
+# @file      compare_benchmarks.py
+# @author    Roger Davies     [rdavies3000@gmail.com]
+#
+# Copyright (c) 2022 Roger Davies, all rights reserved
+"""Compare two Google Benchmark JSON result files and flag regressions.
+
+Usage:
+    compare_benchmarks.py baseline.json contender.json [--threshold 5]
+                          [--metric cpu_time|real_time]
+
+The exit status is 1 if any benchmark present in both runs got slower by more
+than the threshold (in percent), otherwise 0. Times are compared in
+nanoseconds, whatever time_unit each run reported them in, and shown in the
+unit of the baseline.
+"""
+
+import argparse
+import json
+import sys
+
+# Nanoseconds per Google Benchmark time_unit.
+TIME_UNITS = {"ns": 1.0, "us": 1e3, "ms": 1e6, "s": 1e9}
+
+
+def time_ns(bench, metric):
+    """Return a time metric of a benchmark in nanoseconds."""
+    unit = bench.get("time_unit", "ns")
+    if unit not in TIME_UNITS:
+        raise ValueError(f"{bench['name']}: unknown time_unit {unit!r}")
+    return bench[metric] * TIME_UNITS[unit]
+
+
+def load_results(path):
+    """Return a {name: benchmark} dict, ignoring aggregate rows."""
+    with open(path, encoding="utf-8") as f:
+        data = json.load(f)
+
+    results = {}
+    for bench in data.get("benchmarks", []):
+        if bench.get("run_type") == "aggregate":
+            # Prefer the mean when repetitions were used.
+            if bench.get("aggregate_name") != "mean":
+                continue
+            name = bench["run_name"]
+        else:
+            name = bench["name"]
+            if name in results:
+                continue
+        results[name] = bench
+    return results
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("baseline", help="JSON output of the reference run")
+    parser.add_argument("contender", help="JSON output of the new run")
+    parser.add_argument("--threshold", type=float, default=5.0,
+                        help="regression threshold in percent (default: 5)")
+    parser.add_argument("--metric", choices=["cpu_time", "real_time"],
+                        default="cpu_time",
+                        help="time metric to compare (default: cpu_time)")
+    args = parser.parse_args()
+
+    baseline = load_results(args.baseline)
+    contender = load_results(args.contender)
+
+    regressions = []
+    width = max((len(name) for name in baseline), default=10)
+    print(f"{'Benchmark':<{width}} {'Baseline':>14} {'Contender':>14} "
+          f"{'Change':>9}")
+    for name, old in baseline.items():
+        new = contender.get(name)
+        if new is None:
+            print(f"{name:<{width}} {'':>14} {'missing':>14}")
+            continue
+
+        old_ns = time_ns(old, args.metric)
+        new_ns = time_ns(new, args.metric)
+        change = 0.0 if old_ns == 0 else (new_ns - old_ns) / old_ns
+        flag = ""
+        if change * 100.0 > args.threshold:
+            flag = "  REGRESSION"
+            regressions.append(name)
+        unit = old.get("time_unit", "ns")
+        scale = TIME_UNITS[unit]
+        print(f"{name:<{width}} {old_ns / scale:>11.1f} {unit:<2} "
+              f"{new_ns / scale:>11.1f} {unit:<2} {change * 100.0:>+8.1f}%"
+              f"{flag}")
+
+    for name in contender:
+        if name not in baseline:
+            print(f"{name:<{width}} {'new':>14}")
+
+    if regressions:
+        print(f"\n{len(regressions)} regression(s) above "
+              f"{args.threshold:.1f}%:", file=sys.stderr)
+        for name in regressions:
+            print(f"  {name}", file=sys.stderr)
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,41 @@
+// @file      toolbox_logdecode.cpp
+// @author    Roger Davies     [rdavies3000@gmail.com]
+//
+// Copyright (c) 2022 Roger Davies, all rights reserved
+
+#include <exception>
+#include <fstream>
+#include <iostream>
+
+#include "lib/binary_logger.hpp"
+
+// Convert a log written by rtb::BinaryLogger to text.
+int main(int argc, char* argv[]) {
+  if (argc < 2 || argc > 3) {
+    std::cerr << "Usage: " << argv[0] << " <binary log> [output file]\n";
+    return 1;
+  }
+
+  std::ifstream in(argv[1], std::ios::in | std::ios::binary);
+  if (!in) {
+    std::cerr << "Cannot open " << argv[1] << "\n";
+    return 1;
+  }
+
+  try {
+    if (argc == 3) {
+      std::ofstream out(argv[2]);
+      if (!out) {
+        std::cerr << "Cannot open " << argv[2] << "\n";
+        return 1;
+      }
+      rtb::DecodeBinaryLog(in, out);
+    } else {
+      rtb::DecodeBinaryLog(in, std::cout);
+    }
+  } catch (const std::exception& e) {
+    std::cerr << e.what() << "\n";
+    return 1;
+  }
+  return 0;
+}
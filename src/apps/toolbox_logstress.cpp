@@ -0,0 +1,377 @@
+// @file      toolbox_logstress.cpp
+// @author    Roger Davies     [rdavies3000@gmail.com]
+//
+// Copyright (c) 2022 Roger Davies, all rights reserved
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <numeric>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <variant>
+#include <vector>
+
+#include "lib/toolbox.hpp"
+
+namespace {
+const char* const kUsage =
+    "Usage: toolbox_logstress [-threads=8] [-messages=100000] [-size=64]\n"
+    "           [-mix=0:0:90:9:1] [-level=info]\n"
+    "           [-sink=null|cout|file|json|uring] [-file=logstress.log]\n"
+    "           [-async] [-policy=block|drop_newest|drop_oldest|drop_below]\n"
+    "           [-trace=logstress_trace.json]\n"
+    "\n"
+    "Each of -threads producers logs -messages messages with a payload of\n"
+    "-size bytes. -mix weighs the trace:debug:info:warning:error messages.\n"
+    "Reports messages/s, per-call latency and lost messages; -trace writes\n"
+    "an Instrumentor trace of the run.\n";
+
+// Producer spans in the trace cover this many log calls.
+constexpr int kTraceBatch = 4096;
+
+struct Options {
+  int threads{8};
+  int messages{100000};
+  int size{64};
+  std::array<int, rtb_h::kFatal> mix{0, 0, 90, 9, 1};
+  rtb_h::MessageType level{rtb_h::kInfo};
+  std::string sink{"null"};
+  std::string file{"logstress.log"};
+  bool async{false};
+  rtb::Backpressure policy{rtb::Backpressure::kBlock};
+  std::string trace;
+};
+
+// Read a string parameter, or keep the default when it is absent.
+std::string GetString(rtb::ClargParser* parser, const std::string& name,
+                      const std::string& value) {
+  const rtb::ClargParam* param = parser->GetParam(name);
+  return param->found() ? param->raw_value() : value;
+}
+
+// Read an integer parameter, which must be positive when it is given.
+bool GetInt(rtb::ClargParser* parser, const std::string& name, int* value) {
+  rtb::ClargParam* param = parser->GetParam(name);
+  if (!param->found()) {
+    return true;
+  }
+  const auto* parsed = std::get_if<int>(&param->value());
+  if (parsed == nullptr || *parsed <= 0) {
+    std::cerr << "Invalid -" << name << "=" << param->raw_value() << "\n";
+    return false;
+  }
+  *value = *parsed;
+  return true;
+}
+
+/**
+ * @brief Parse the command line.
+ *
+ * @param argc      The command line argument count.
+ * @param argv      The command line arguments.
+ * @param options   Receives the options.
+ * @return true     The command line is valid.
+ */
+bool ParseOptions(int argc, char* argv[], Options* options) {
+  for (int i = 1; i < argc; i++) {
+    if (std::string(argv[i]) == "-help" || std::string(argv[i]) == "-h") {
+      return false;
+    }
+  }
+  rtb::ClargParser* parser = rtb::ClargParser::GetInstance();
+  for (const char* name : {"threads", "messages", "size"}) {
+    parser->AddParamToSearchList(name, rtb::ClargParam::ParamType::kInt);
+  }
+  for (const char* name : {"mix", "level", "sink", "file", "policy", "trace"}) {
+    parser->AddParamToSearchList(name, rtb::ClargParam::ParamType::kStdString);
+  }
+  parser->AddFlagToSearchList("async");
+  parser->Parse(argc, argv);
+
+  if (!GetInt(parser, "threads", &options->threads) ||
+      !GetInt(parser, "messages", &options->messages) ||
+      !GetInt(parser, "size", &options->size)) {
+    return false;
+  }
+  options->async = parser->GetFlag("async")->value();
+  options->file = GetString(parser, "file", options->file);
+  options->trace = GetString(parser, "trace", options->trace);
+
+  options->sink = GetString(parser, "sink", options->sink);
+  const std::vector<std::string> sinks{"null", "cout", "file", "json",
+                                       "uring"};
+  if (std::find(sinks.begin(), sinks.end(), options->sink) == sinks.end()) {
+    std::cerr << "Unknown sink " << options->sink << "\n";
+    return false;
+  }
+
+  const std::string level = GetString(parser, "level", "info");
+  bool level_found = false;
+  for (int type = rtb_h::kTrace; type <= rtb_h::kFatal; type++) {
+    if (rtb_h::MessageTypeName(static_cast<rtb_h::MessageType>(type)) ==
+        level) {
+      options->level = static_cast<rtb_h::MessageType>(type);
+      level_found = true;
+    }
+  }
+  if (!level_found) {
+    std::cerr << "Unknown level " << level << "\n";
+    return false;
+  }
+
+  const std::string policy = GetString(parser, "policy", "block");
+  const std::array<std::string, 4> policies{"block", "drop_newest",
+                                            "drop_oldest", "drop_below"};
+  const auto it = std::find(policies.begin(), policies.end(), policy);
+  if (it == policies.end()) {
+    std::cerr << "Unknown policy " << policy << "\n";
+    return false;
+  }
+  options->policy = static_cast<rtb::Backpressure>(it - policies.begin());
+
+  const std::string mix = GetString(parser, "mix", "");
+  if (!mix.empty()) {
+    std::istringstream stream(mix);
+    std::string weight;
+    size_t count = 0;
+    while (std::getline(stream, weight, ':') && count < options->mix.size()) {
+      options->mix[count++] = std::max(std::atoi(weight.c_str()), 0);
+    }
+    if (count != options->mix.size() || !stream.eof() ||
+        std::accumulate(options->mix.begin(), options->mix.end(), 0) == 0) {
+      std::cerr << "Invalid -mix=" << mix << "\n";
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * @brief Spread the message types over a table in proportion to their
+ * weights, so that producers pick them without a random number generator.
+ *
+ * @param mix The weight of each message type below fatal.
+ * @return std::vector<rtb_h::MessageType> The table.
+ */
+std::vector<rtb_h::MessageType> MakeTypeTable(
+    const std::array<int, rtb_h::kFatal>& mix) {
+  const int total = std::accumulate(mix.begin(), mix.end(), 0);
+  std::vector<rtb_h::MessageType> table;
+  for (int i = 0; i < total; i++) {
+    // Interleave the types rather than running them in blocks.
+    const int slot = static_cast<int>((i * 2654435761ULL) % total);
+    int type = 0;
+    for (int sum = mix[0]; slot >= sum; sum += mix[++type]) {
+    }
+    table.push_back(static_cast<rtb_h::MessageType>(type));
+  }
+  return table;
+}
+
+/**
+ * @brief Count the lines of a file.
+ *
+ * @param path      The file path.
+ * @return uint64_t The number of lines.
+ */
+uint64_t CountLines(const std::string& path) {
+  std::ifstream file(path, std::ios::binary);
+  std::vector<char> buffer(1 << 16);
+  const auto size = static_cast<std::streamsize>(buffer.size());
+  uint64_t lines = 0;
+  while (file.read(buffer.data(), size) || file.gcount() > 0) {
+    lines += static_cast<uint64_t>(
+        std::count(buffer.data(), buffer.data() + file.gcount(), '\n'));
+  }
+  return lines;
+}
+
+/**
+ * @brief Print the latency percentiles and a power of two histogram.
+ *
+ * @param latencies The latencies in nanoseconds, sorted.
+ */
+void PrintLatencies(const std::vector<uint32_t>& latencies) {
+  const auto percentile = [&latencies](double p) {
+    return latencies[static_cast<size_t>(p * (latencies.size() - 1))];
+  };
+  std::cout << "latency     p50 " << percentile(0.50) << " ns, p99 "
+            << percentile(0.99) << " ns, p99.9 " << percentile(0.999)
+            << " ns, max " << latencies.back() << " ns\n";
+
+  uint64_t bound = 64;
+  auto begin = latencies.begin();
+  while (begin != latencies.end()) {
+    const auto end = std::upper_bound(begin, latencies.end(), bound);
+    const double share = 100.0 * static_cast<double>(end - begin) /
+                         static_cast<double>(latencies.size());
+    if (end != begin) {
+      std::cout << "  <= " << std::setw(11) << bound << " ns "
+                << std::setw(6) << std::fixed << std::setprecision(2)
+                << share << "% " << std::string(static_cast<size_t>(share / 2),
+                                                 '#')
+                << "\n";
+    }
+    begin = end;
+    bound *= 2;
+  }
+}
+}  // namespace
+
+// Drive the logger from many threads and report throughput, per-call
+// latency and lost messages.
+int main(int argc, char* argv[]) {
+  Options options;
+  if (!ParseOptions(argc, argv, &options)) {
+    std::cerr << kUsage;
+    return 1;
+  }
+
+  rtb::Logger::SetLevel(options.level);
+  rtb::Logger::SetBackpressure({options.policy, rtb_h::kWarning});
+  rtb::Logger::SinkType type = rtb::Logger::kSinkNull;
+  rtb::Logger::SinkId uring_id{};
+  if (options.sink == "cout") {
+    type = rtb::Logger::kSinkCout;
+  } else if (options.sink == "file") {
+    rtb::Logger::SetFileSinkPath(options.file);
+    type = rtb::Logger::kSinkFile;
+  } else if (options.sink == "json") {
+    rtb::Logger::SetJsonSinkPath(options.file);
+    type = rtb::Logger::kSinkJson;
+  }
+  rtb::Logger::SetErrorSink(type);
+  rtb::Logger::SetWarningSink(type);
+  rtb::Logger::SetInfoSink(type);
+  if (options.sink == "uring") {
+    uring_id = rtb::Logger::AddSink(
+        std::make_shared<rtb_h::LogSinkUring>(options.file), rtb_h::kTrace,
+        options.async, {options.policy, rtb_h::kWarning});
+  } else {
+    rtb::Logger::SetAsync(options.async);
+  }
+  if (!options.trace.empty()) {
+    rtb::Instrumentor::GetInstance().BeginSession("logstress", options.trace);
+  }
+
+  const std::vector<rtb_h::MessageType> types = MakeTypeTable(options.mix);
+  const std::string payload(static_cast<size_t>(options.size), 'x');
+  const bool trace = !options.trace.empty();
+  std::vector<std::vector<uint32_t>> latencies(options.threads);
+  std::atomic<int> ready{0};
+  std::atomic<bool> go{false};
+  std::vector<std::thread> producers;
+  for (int t = 0; t < options.threads; t++) {
+    producers.emplace_back([&, t]() {
+      std::vector<uint32_t>& thread_latencies = latencies[t];
+      thread_latencies.reserve(static_cast<size_t>(options.messages));
+      ready++;
+      while (!go.load(std::memory_order_acquire)) {
+        std::this_thread::yield();
+      }
+
+      std::unique_ptr<rtb::InstrumentationTimer> producer_timer;
+      std::unique_ptr<rtb::InstrumentationTimer> batch_timer;
+      if (trace) {
+        producer_timer =
+            std::make_unique<rtb::InstrumentationTimer>("producer");
+      }
+      for (int i = 0; i < options.messages; i++) {
+        if (trace && i % kTraceBatch == 0) {
+          batch_timer.reset();
+          batch_timer = std::make_unique<rtb::InstrumentationTimer>("batch");
+        }
+        const rtb_h::MessageType message_type =
+            types[(static_cast<size_t>(i) + static_cast<size_t>(t) * 7) %
+                  types.size()];
+        const auto start = std::chrono::steady_clock::now();
+        rtb::Logger::Log(message_type, i, payload);
+        const auto stop = std::chrono::steady_clock::now();
+        thread_latencies.push_back(static_cast<uint32_t>(std::min<int64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start)
+                .count(),
+            UINT32_MAX)));
+      }
+      batch_timer.reset();
+    });
+  }
+  while (ready.load() < options.threads) {
+    std::this_thread::yield();
+  }
+
+  const auto start = std::chrono::steady_clock::now();
+  go.store(true, std::memory_order_release);
+  for (auto& producer : producers) {
+    producer.join();
+  }
+  const auto logged = std::chrono::steady_clock::now();
+  if (trace) {
+    rtb::InstrumentationTimer flush_timer("flush");
+    rtb::Logger::Flush();
+  } else {
+    rtb::Logger::Flush();
+  }
+  const auto drained = std::chrono::steady_clock::now();
+  if (trace) {
+    rtb::Instrumentor::GetInstance().EndSession();
+  }
+
+  // Messages below the logger level are filtered, not lost.
+  uint64_t enabled = 0;
+  for (int t = 0; t < options.threads; t++) {
+    for (int i = 0; i < options.messages; i++) {
+      enabled += types[(static_cast<size_t>(i) + static_cast<size_t>(t) * 7) %
+                       types.size()] >= options.level;
+    }
+  }
+  const rtb::AsyncLogStats stats = options.sink == "uring"
+                                       ? rtb::Logger::GetSinkStats(uring_id)
+                                       : rtb::Logger::GetAsyncStats();
+  const uint64_t dropped =
+      std::accumulate(stats.dropped.begin(), stats.dropped.end(), 0ULL);
+
+  const uint64_t total =
+      static_cast<uint64_t>(options.threads) * options.messages;
+  const double seconds = std::chrono::duration<double>(logged - start).count();
+  const double drain_seconds =
+      std::chrono::duration<double>(drained - start).count();
+  std::cout << "threads " << options.threads << ", messages " << total
+            << ", payload " << options.size << " bytes, sink " << options.sink
+            << (options.async ? ", async" : ", sync") << "\n";
+  std::cout << "logged      " << std::fixed << std::setprecision(3) << seconds
+            << " s, " << std::setprecision(0)
+            << static_cast<double>(total) / seconds << " msg/s, drained in "
+            << std::setprecision(3) << drain_seconds << " s\n";
+  std::cout << "filtered    " << total - enabled << " below the level\n";
+  std::cout << "lost        " << dropped << " dropped";
+  if (options.async) {
+    std::cout << ", " << stats.blocked << " calls blocked, queue high water "
+              << stats.high_water << "/" << stats.capacity;
+  }
+  std::cout << "\n";
+  if (options.sink == "file" || options.sink == "json" ||
+      options.sink == "uring") {
+    const uint64_t lines = CountLines(options.file);
+    const uint64_t expected = enabled - dropped;
+    std::cout << "file        " << lines << " lines, "
+              << (lines < expected ? expected - lines : 0) << " missing\n";
+  }
+
+  std::vector<uint32_t> merged;
+  merged.reserve(total);
+  for (const auto& thread_latencies : latencies) {
+    merged.insert(merged.end(), thread_latencies.begin(),
+                  thread_latencies.end());
+  }
+  std::sort(merged.begin(), merged.end());
+  PrintLatencies(merged);
+  return 0;
+}
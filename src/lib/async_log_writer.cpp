@@ -0,0 +1,221 @@
+// @file      async_log_writer.cpp
+// @author    Roger Davies     [rdavies3000@gmail.com]
+//
+// Copyright (c) 2022 Roger Davies, all rights reserved
+
+#include "async_log_writer.hpp"
+
+#include <algorithm>
+#include <array>
+
+namespace rtb_h {
+/**
+ * @brief Construct a new AsyncLogWriter object and start the writer thread.
+ *
+ * @param capacity The queue capacity in records.
+ * @param policy   What Enqueue() does when the queue is full.
+ */
+AsyncLogWriter::AsyncLogWriter(size_t capacity,
+                               const rtb::BackpressurePolicy& policy)
+    : queue_(capacity),
+      overflow_(policy.overflow),
+      drop_below_(policy.drop_below),
+      thread_(&AsyncLogWriter::Run, this) {}
+
+/**
+ * @brief Destroy the AsyncLogWriter object after writing all queued records.
+ *
+ */
+AsyncLogWriter::~AsyncLogWriter() {
+  stop_.store(true);
+  {
+    const std::lock_guard<std::mutex> lock(mutex_);
+    work_cv_.notify_one();
+  }
+  thread_.join();
+}
+
+/**
+ * @brief Queue a record for writing. If the queue is full the record is
+ * dropped, or the caller waits until the writer thread has made room,
+ * according to the backpressure policy.
+ *
+ * @param record The record.
+ */
+void AsyncLogWriter::Enqueue(LogRecord&& record) {
+  const MessageType type = record.type;
+  if (!queue_.TryPush(std::move(record)) && !PushFull(&record)) {
+    dropped_by_type_[type].fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  enqueued_by_type_[type].fetch_add(1, std::memory_order_relaxed);
+
+  // Sequentially consistent, pairs with the check in Run() so that either
+  // the writer sees the new record or we see that it sleeps.
+  enqueued_.fetch_add(1);
+  if (sleeping_.load()) {
+    const std::lock_guard<std::mutex> lock(mutex_);
+    work_cv_.notify_one();
+  }
+}
+
+/**
+ * @brief Queue a record that did not fit.
+ *
+ * @param record  The record, moved from if it is queued.
+ * @return true   The record was queued, false if it is to be dropped.
+ */
+bool AsyncLogWriter::PushFull(LogRecord* record) {
+  RaiseHighWater(queue_.Capacity());
+  const rtb::Backpressure overflow = overflow_.load(std::memory_order_relaxed);
+  if (record->type != kFatal) {
+    if (overflow == rtb::Backpressure::kDropNewest ||
+        (overflow == rtb::Backpressure::kDropBelowLevel &&
+         record->type < drop_below_.load(std::memory_order_relaxed))) {
+      return false;
+    }
+    if (overflow == rtb::Backpressure::kDropOldest) {
+      // The evicted record counts as retired so that Flush() and the writer
+      // do not wait for it.
+      LogRecord oldest;
+      while (!queue_.TryPush(std::move(*record))) {
+        if (queue_.TryPop(&oldest)) {
+          dropped_by_type_[oldest.type].fetch_add(1,
+                                                  std::memory_order_relaxed);
+          retired_.fetch_add(1);
+        }
+      }
+      return true;
+    }
+  }
+
+  blocked_.fetch_add(1, std::memory_order_relaxed);
+  while (!queue_.TryPush(std::move(*record))) {
+    std::this_thread::yield();
+  }
+  return true;
+}
+
+/**
+ * @brief Raise the high-water mark to a queue depth.
+ *
+ * @param depth The queue depth.
+ */
+void AsyncLogWriter::RaiseHighWater(size_t depth) {
+  size_t high_water = high_water_.load(std::memory_order_relaxed);
+  while (depth > high_water &&
+         !high_water_.compare_exchange_weak(high_water, depth,
+                                            std::memory_order_relaxed)) {
+  }
+}
+
+/**
+ * @brief Change what Enqueue() does when the queue is full.
+ *
+ * @param policy The backpressure policy.
+ */
+void AsyncLogWriter::SetPolicy(const rtb::BackpressurePolicy& policy) {
+  drop_below_.store(policy.drop_below, std::memory_order_relaxed);
+  overflow_.store(policy.overflow, std::memory_order_relaxed);
+}
+
+/**
+ * @brief Get the queue counters. Each counter is read separately, so they
+ * may not add up while messages are being logged.
+ *
+ * @return rtb::AsyncLogStats The counters.
+ */
+rtb::AsyncLogStats AsyncLogWriter::GetStats() const {
+  rtb::AsyncLogStats stats;
+  for (int t = 0; t < kMessageTypeCount; t++) {
+    stats.enqueued[t] = enqueued_by_type_[t].load(std::memory_order_relaxed);
+    stats.written[t] = written_by_type_[t].load(std::memory_order_relaxed);
+    stats.dropped[t] = dropped_by_type_[t].load(std::memory_order_relaxed);
+  }
+  stats.blocked = blocked_.load(std::memory_order_relaxed);
+  stats.high_water = high_water_.load(std::memory_order_relaxed);
+  stats.capacity = queue_.Capacity();
+  return stats;
+}
+
+/**
+ * @brief Wait until every record queued before this call has been written and
+ * the sinks have been flushed.
+ *
+ */
+void AsyncLogWriter::Flush() {
+  const uint64_t target = enqueued_.load();
+  flush_waiters_.fetch_add(1);
+  std::unique_lock<std::mutex> lock(mutex_);
+  work_cv_.notify_one();
+  flushed_cv_.wait(lock,
+                   [this, target]() { return retired_.load() >= target; });
+  flush_waiters_.fetch_sub(1);
+}
+
+/**
+ * @brief The writer thread loop.
+ *
+ */
+void AsyncLogWriter::Run() {
+  std::vector<LogSink*> touched;
+  while (true) {
+    if (WriteBatch(&touched) > 0) {
+      continue;
+    }
+
+    // The queue is empty. Stop once every enqueued record has been written,
+    // records counted in enqueued_ may not be visible in the queue yet.
+    std::unique_lock<std::mutex> lock(mutex_);
+    flushed_cv_.notify_all();
+    if (stop_.load() && retired_.load() == enqueued_.load()) {
+      break;
+    }
+    sleeping_.store(true);
+    work_cv_.wait(lock, [this]() {
+      return stop_.load() || retired_.load() != enqueued_.load();
+    });
+    sleeping_.store(false);
+  }
+}
+
+/**
+ * @brief Write up to kMaxBatch queued records, then flush every sink that was
+ * written to.
+ *
+ * @param touched   Scratch list of the sinks written to.
+ * @return size_t   The number of records written.
+ */
+size_t AsyncLogWriter::WriteBatch(std::vector<LogSink*>* touched) {
+  RaiseHighWater(queue_.Size());
+  touched->clear();
+  std::array<uint64_t, kMessageTypeCount> written{};
+  LogRecord record;
+  size_t count = 0;
+  while (count < kMaxBatch && queue_.TryPop(&record)) {
+    record.sink->Log(record.message, record.type);
+    written[record.type]++;
+    if (std::find(touched->begin(), touched->end(), record.sink) ==
+        touched->end()) {
+      touched->push_back(record.sink);
+    }
+    count++;
+  }
+
+  for (LogSink* sink : *touched) {
+    sink->Flush();
+  }
+  for (int t = 0; t < kMessageTypeCount; t++) {
+    if (written[t] > 0) {
+      written_by_type_[t].fetch_add(written[t], std::memory_order_relaxed);
+    }
+  }
+  retired_.fetch_add(count);
+
+  if (count > 0 && flush_waiters_.load() > 0) {
+    const std::lock_guard<std::mutex> lock(mutex_);
+    flushed_cv_.notify_all();
+  }
+  return count;
+}
+}  // namespace rtb_h
@@ -0,0 +1,243 @@
+// @file      async_log_writer.hpp
+// @author    Roger Davies     [rdavies3000@gmail.com]
+//
+// Copyright (c) 2022 Roger Davies, all rights reserved
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "log_sink.hpp"
+
+namespace rtb {
+enum class Backpressure : uint8_t {
+  kBlock = 0,     // Wait until the writer has made room.
+  kDropNewest,    // Discard the message being logged.
+  kDropOldest,    // Discard the oldest queued message to make room.
+  kDropBelowLevel  // Discard messages below drop_below, wait for the others.
+};
+
+/**
+ * @brief What an asynchronous log call does when the queue is full. Fatal
+ * messages are never dropped.
+ *
+ */
+struct BackpressurePolicy {
+  Backpressure overflow{Backpressure::kBlock};
+  rtb_h::MessageType drop_below{rtb_h::kWarning};
+};
+
+/**
+ * @brief Counters of an asynchronous log queue, per message type. Every
+ * message logged is either enqueued or dropped when the queue is full; an
+ * enqueued message is later written, or dropped if kDropOldest evicts it.
+ * high_water is the deepest the queue has been, sampled by the writer before
+ * each batch and set to the capacity when a log call finds the queue full.
+ *
+ */
+struct AsyncLogStats {
+  std::array<uint64_t, rtb_h::kMessageTypeCount> enqueued{};
+  std::array<uint64_t, rtb_h::kMessageTypeCount> written{};
+  std::array<uint64_t, rtb_h::kMessageTypeCount> dropped{};
+  uint64_t blocked{0};  // Log calls that waited for room.
+  size_t high_water{0};
+  size_t capacity{0};
+};
+}  // namespace rtb
+
+namespace rtb_h {
+/**
+ * @brief Bounded lock-free multi-producer multi-consumer queue (Vyukov).
+ * Every slot carries a sequence number that tells producers and consumers
+ * whether it is free or full, so each side only contends on one CAS of its
+ * index.
+ *
+ */
+template <typename T>
+class MpmcRingBuffer {
+ public:
+  explicit MpmcRingBuffer(size_t capacity);
+
+  bool TryPush(T&& value);
+  bool TryPop(T* value);
+  [[nodiscard]] size_t Capacity() const { return mask_ + 1; }
+  // Approximate number of queued values.
+  [[nodiscard]] size_t Size() const;
+
+ private:
+  struct Slot {
+    std::atomic<size_t> sequence;
+    T value;
+  };
+
+  size_t mask_;
+  std::unique_ptr<Slot[]> slots_;
+  alignas(64) std::atomic<size_t> tail_{0};
+  alignas(64) std::atomic<size_t> head_{0};
+};
+
+/**
+ * @brief A formatted log line waiting to be written to a sink.
+ *
+ */
+struct LogRecord {
+  LogSink* sink{nullptr};
+  MessageType type{kInfo};
+  std::string message;
+};
+
+/**
+ * @brief Writes log records on a dedicated background thread. Callers enqueue
+ * already formatted records into a bounded MpmcRingBuffer and return; the
+ * writer thread drains the queue in batches and flushes the sinks after every
+ * batch. A full queue is handled according to the rtb::BackpressurePolicy.
+ * The destructor writes all records that are still queued.
+ *
+ */
+class AsyncLogWriter {
+ public:
+  explicit AsyncLogWriter(size_t capacity,
+                          const rtb::BackpressurePolicy& policy = {});
+  ~AsyncLogWriter();
+
+  void Enqueue(LogRecord&& record);
+  void Flush();
+  void SetPolicy(const rtb::BackpressurePolicy& policy);
+  [[nodiscard]] rtb::AsyncLogStats GetStats() const;
+
+  AsyncLogWriter(const AsyncLogWriter&) = delete;
+  AsyncLogWriter& operator=(const AsyncLogWriter&) = delete;
+  AsyncLogWriter(const AsyncLogWriter&&) = delete;
+  AsyncLogWriter& operator=(const AsyncLogWriter&&) = delete;
+
+ private:
+  // Maximum number of records written between two sink flushes.
+  static constexpr size_t kMaxBatch = 256;
+
+  using Counters = std::array<std::atomic<uint64_t>, kMessageTypeCount>;
+
+  MpmcRingBuffer<LogRecord> queue_;
+  std::atomic<rtb::Backpressure> overflow_;
+  std::atomic<MessageType> drop_below_;
+  // Records enqueued, and records written or evicted, in total.
+  std::atomic<uint64_t> enqueued_{0};
+  std::atomic<uint64_t> retired_{0};
+  // Loss accounting, see rtb::AsyncLogStats.
+  Counters enqueued_by_type_{};
+  Counters written_by_type_{};
+  Counters dropped_by_type_{};
+  std::atomic<uint64_t> blocked_{0};
+  std::atomic<size_t> high_water_{0};
+  std::atomic<size_t> flush_waiters_{0};
+  std::atomic<bool> sleeping_{false};
+  std::atomic<bool> stop_{false};
+  std::mutex mutex_;
+  std::condition_variable work_cv_;
+  std::condition_variable flushed_cv_;
+  std::thread thread_;
+
+  void Run();
+  size_t WriteBatch(std::vector<LogSink*>* touched);
+  bool PushFull(LogRecord* record);
+  void RaiseHighWater(size_t depth);
+};
+
+/**
+ * @brief Construct a new MpmcRingBuffer object.
+ *
+ * @param capacity The capacity, rounded up to a power of two.
+ */
+template <typename T>
+MpmcRingBuffer<T>::MpmcRingBuffer(size_t capacity) {
+  size_t size = 2;
+  while (size < capacity) {
+    size <<= 1U;
+  }
+  mask_ = size - 1;
+  slots_ = std::make_unique<Slot[]>(size);
+  for (size_t i = 0; i < size; i++) {
+    slots_[i].sequence.store(i, std::memory_order_relaxed);
+  }
+}
+
+/**
+ * @brief Try to append a value.
+ *
+ * @param value   The value, moved from on success.
+ * @return true   The value was queued, false if the queue is full.
+ */
+template <typename T>
+bool MpmcRingBuffer<T>::TryPush(T&& value) {
+  size_t tail = tail_.load(std::memory_order_relaxed);
+  while (true) {
+    Slot& slot = slots_[tail & mask_];
+    const size_t sequence = slot.sequence.load(std::memory_order_acquire);
+    const auto diff = static_cast<std::ptrdiff_t>(sequence) -
+                      static_cast<std::ptrdiff_t>(tail);
+    if (diff == 0) {
+      if (tail_.compare_exchange_weak(tail, tail + 1,
+                                      std::memory_order_relaxed)) {
+        slot.value = std::move(value);
+        slot.sequence.store(tail + 1, std::memory_order_release);
+        return true;
+      }
+    } else if (diff < 0) {
+      return false;
+    } else {
+      tail = tail_.load(std::memory_order_relaxed);
+    }
+  }
+}
+
+/**
+ * @brief Try to remove the oldest value.
+ *
+ * @param value   Receives the value.
+ * @return true   A value was removed, false if the queue is empty.
+ */
+template <typename T>
+bool MpmcRingBuffer<T>::TryPop(T* value) {
+  size_t head = head_.load(std::memory_order_relaxed);
+  while (true) {
+    Slot& slot = slots_[head & mask_];
+    const size_t sequence = slot.sequence.load(std::memory_order_acquire);
+    const auto diff = static_cast<std::ptrdiff_t>(sequence) -
+                      static_cast<std::ptrdiff_t>(head + 1);
+    if (diff == 0) {
+      if (head_.compare_exchange_weak(head, head + 1,
+                                      std::memory_order_relaxed)) {
+        *value = std::move(slot.value);
+        slot.sequence.store(head + mask_ + 1, std::memory_order_release);
+        return true;
+      }
+    } else if (diff < 0) {
+      return false;
+    } else {
+      head = head_.load(std::memory_order_relaxed);
+    }
+  }
+}
+
+/**
+ * @brief The number of queued values, which may be out of date by the time it
+ * is returned.
+ *
+ * @return size_t The number of values.
+ */
+template <typename T>
+size_t MpmcRingBuffer<T>::Size() const {
+  const size_t head = head_.load(std::memory_order_relaxed);
+  const size_t tail = tail_.load(std::memory_order_relaxed);
+  return tail > head ? tail - head : 0;
+}
+}  // namespace rtb_h
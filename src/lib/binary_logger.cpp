@@ -0,0 +1,479 @@
+// @file      binary_logger.cpp
+// @author    Roger Davies     [rdavies3000@gmail.com]
+//
+// Copyright (c) 2022 Roger Davies, all rights reserved
+
+#include "binary_logger.hpp"
+
+#include <istream>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
+#include <utility>
+
+#include "timestamp.hpp"
+
+namespace rtb_h {
+// Identifies a binary log file.
+const char kBinaryLogMagic[8] = {'R', 'T', 'B', 'B', 'L', 'O', 'G', '1'};
+
+// Records with this site id define a call site instead of logging a message.
+const uint32_t kSiteDefinitionId = 0;
+
+/**
+ * @brief Write the published records up to a limit to a stream and release
+ * their space.
+ *
+ * @param out       The stream.
+ * @param limit     The end of the records to write, from Published().
+ * @return size_t   The number of bytes written.
+ */
+size_t StagingBuffer::Consume(std::ostream* out, uint64_t limit) {
+  const uint64_t published = limit;
+  uint64_t pos = read_pos_.load(std::memory_order_relaxed);
+  size_t written = 0;
+  while (pos < published) {
+    const size_t offset = pos & (kCapacity - 1);
+    const size_t contiguous = kCapacity - offset;
+    uint32_t site_id = kWrapMarker;
+    if (contiguous >= sizeof(site_id)) {
+      std::memcpy(&site_id, data_.get() + offset, sizeof(site_id));
+    }
+    if (site_id == kWrapMarker) {
+      pos += contiguous;
+      continue;
+    }
+
+    // Write all records up to the end of the buffer or the wrap marker at
+    // once.
+    const size_t run_begin = offset;
+    size_t run_end = offset;
+    while (pos < published && run_end < kCapacity) {
+      if (kCapacity - run_end >= sizeof(site_id)) {
+        std::memcpy(&site_id, data_.get() + run_end, sizeof(site_id));
+      } else {
+        site_id = kWrapMarker;
+      }
+      if (site_id == kWrapMarker) {
+        break;
+      }
+      RecordHeader header{};
+      std::memcpy(&header, data_.get() + run_end, sizeof(header));
+      run_end += header.size;
+      pos += header.size;
+    }
+    out->write(data_.get() + run_begin,
+               static_cast<std::streamsize>(run_end - run_begin));
+    written += run_end - run_begin;
+  }
+  read_pos_.store(pos, std::memory_order_release);
+  return written;
+}
+
+/**
+ * @brief Get the line prefix of a message type, the same as Logger uses.
+ *
+ * @param type          The message type.
+ * @return const char*  The prefix.
+ */
+const char* MessagePrefix(MessageType type) {
+  switch (type) {
+    case kTrace:
+      return "[Trace  ] ";
+    case kDebug:
+      return "[Debug  ] ";
+    case kInfo:
+      return "[Info   ] ";
+    case kWarning:
+      return "[Warning] ";
+    case kError:
+      return "[Error  ] ";
+    case kFatal:
+      return "[Fatal  ] ";
+  }
+  return "";
+}
+
+/**
+ * @brief Read a value from a record, checking that it lies inside the record.
+ *
+ * @param src The read position, advanced past the value.
+ * @param end The end of the record.
+ * @return T  The value.
+ */
+template <typename T>
+T ReadValue(const char** src, const char* end) {
+  if (end - *src < static_cast<std::ptrdiff_t>(sizeof(T))) {
+    throw std::runtime_error("DecodeBinaryLog: Truncated record");
+  }
+  T value;
+  std::memcpy(&value, *src, sizeof(T));
+  *src += sizeof(T);
+  return value;
+}
+
+/**
+ * @brief Decode one argument of a record and print it to a stream.
+ *
+ * @param type  The argument type.
+ * @param src   The read position, advanced past the argument.
+ * @param end   The end of the record.
+ * @param out   The stream.
+ */
+void PrintArg(ArgType type, const char** src, const char* end,
+              std::ostream& out) {
+  switch (type) {
+    case ArgType::kBool:
+      out << ReadValue<bool>(src, end);
+      break;
+    case ArgType::kChar:
+      out << ReadValue<char>(src, end);
+      break;
+    case ArgType::kInt8:
+      out << static_cast<int>(ReadValue<int8_t>(src, end));
+      break;
+    case ArgType::kUint8:
+      out << static_cast<unsigned>(ReadValue<uint8_t>(src, end));
+      break;
+    case ArgType::kInt16:
+      out << ReadValue<int16_t>(src, end);
+      break;
+    case ArgType::kUint16:
+      out << ReadValue<uint16_t>(src, end);
+      break;
+    case ArgType::kInt32:
+      out << ReadValue<int32_t>(src, end);
+      break;
+    case ArgType::kUint32:
+      out << ReadValue<uint32_t>(src, end);
+      break;
+    case ArgType::kInt64:
+      out << ReadValue<int64_t>(src, end);
+      break;
+    case ArgType::kUint64:
+      out << ReadValue<uint64_t>(src, end);
+      break;
+    case ArgType::kFloat:
+      out << ReadValue<float>(src, end);
+      break;
+    case ArgType::kDouble:
+      out << ReadValue<double>(src, end);
+      break;
+    case ArgType::kPointer:
+      out << "0x" << std::hex << ReadValue<uint64_t>(src, end) << std::dec;
+      break;
+    case ArgType::kString: {
+      const auto size = ReadValue<uint32_t>(src, end);
+      if (end - *src < static_cast<std::ptrdiff_t>(size)) {
+        throw std::runtime_error("DecodeBinaryLog: Truncated record");
+      }
+      out.write(*src, size);
+      *src += size;
+      break;
+    }
+    default:
+      throw std::runtime_error("DecodeBinaryLog: Unknown argument type");
+  }
+}
+}  // namespace rtb_h
+
+namespace rtb {
+/**
+ * @brief Destroy the BinaryLogger object, writing all pending records.
+ *
+ */
+BinaryLogger::~BinaryLogger() { CloseImpl(); }
+
+/**
+ * @brief Get the unique BinaryLogger instance.
+ *
+ * @return BinaryLogger&
+ */
+BinaryLogger& BinaryLogger::GetInstance() {
+  static BinaryLogger instance;
+  return instance;
+}
+
+/**
+ * @brief Start logging to a binary log file. A file that is already open is
+ * closed first.
+ *
+ * @param filepath The path to the binary log file.
+ */
+void BinaryLogger::Open(const std::string& filepath) {
+  GetInstance().OpenImpl(filepath);
+}
+
+/**
+ * @brief Stop logging, write all pending records and close the file.
+ *
+ */
+void BinaryLogger::Close() { GetInstance().CloseImpl(); }
+
+/**
+ * @brief Wait until all records logged before this call are in the file.
+ *
+ */
+void BinaryLogger::Flush() { GetInstance().FlushImpl(); }
+
+/**
+ * @brief Get the staging buffer of the calling thread. The buffer is created
+ * on first use and released once the thread has exited and the background
+ * thread has written its records.
+ *
+ * @return rtb_h::StagingBuffer*
+ */
+rtb_h::StagingBuffer* BinaryLogger::GetStagingBuffer() {
+  struct Handle {
+    rtb_h::StagingBuffer* buffer{nullptr};
+    Handle() = default;
+    ~Handle() {
+      if (buffer != nullptr) {
+        buffer->Retire();
+      }
+    }
+    Handle(const Handle&) = delete;
+    Handle& operator=(const Handle&) = delete;
+    Handle(const Handle&&) = delete;
+    Handle& operator=(const Handle&&) = delete;
+  };
+  thread_local Handle handle;
+
+  if (handle.buffer == nullptr) {
+    BinaryLogger& logger = GetInstance();
+    const std::lock_guard<std::mutex> lock(logger.mutex_);
+    logger.buffers_.push_back(std::make_unique<rtb_h::StagingBuffer>());
+    handle.buffer = logger.buffers_.back().get();
+  }
+  return handle.buffer;
+}
+
+/**
+ * @brief Assign an id to a call site that is logged for the first time.
+ *
+ * @param site        The call site.
+ * @param arg_types   The argument types of the site.
+ * @return uint32_t   The id.
+ */
+uint32_t BinaryLogger::RegisterSite(rtb_h::LogSite* site,
+                                    std::vector<rtb_h::ArgType> arg_types) {
+  const std::lock_guard<std::mutex> lock(mutex_);
+  uint32_t id = site->id.load(std::memory_order_relaxed);
+  if (id == 0) {
+    sites_.push_back(SiteInfo{site->type, site->format, std::move(arg_types)});
+    id = static_cast<uint32_t>(sites_.size());
+    site->id.store(id, std::memory_order_release);
+  }
+  return id;
+}
+
+/**
+ * @brief Open implementation.
+ *
+ * @param filepath
+ */
+void BinaryLogger::OpenImpl(const std::string& filepath) {
+  CloseImpl();
+
+  const std::lock_guard<std::mutex> lock(mutex_);
+  output_.open(filepath, std::ios::out | std::ios::binary | std::ios::trunc);
+  if (!output_) {
+    throw std::runtime_error("BinaryLogger: Cannot open " + filepath);
+  }
+  output_.write(rtb_h::kBinaryLogMagic, sizeof(rtb_h::kBinaryLogMagic));
+  sites_written_ = 0;
+  stop_ = false;
+  thread_ = std::thread(&BinaryLogger::Run, this);
+  enabled_.store(true, std::memory_order_relaxed);
+}
+
+/**
+ * @brief Close implementation.
+ *
+ */
+void BinaryLogger::CloseImpl() {
+  enabled_.store(false, std::memory_order_relaxed);
+  {
+    const std::lock_guard<std::mutex> lock(mutex_);
+    if (!thread_.joinable()) {
+      return;
+    }
+    stop_ = true;
+    work_cv_.notify_one();
+  }
+  thread_.join();
+  output_.close();
+}
+
+/**
+ * @brief Flush implementation.
+ *
+ */
+void BinaryLogger::FlushImpl() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (!thread_.joinable()) {
+    return;
+  }
+  const uint64_t target = ++flush_requests_;
+  work_cv_.notify_one();
+  flushed_cv_.wait(lock, [this, target]() { return flushes_done_ >= target; });
+}
+
+/**
+ * @brief The background thread loop. Every pass first writes the definitions
+ * of new call sites, so that the decoder knows a site before its first record,
+ * and then the records of all staging buffers. Only the records published
+ * before the definitions are written: a site is registered, under the mutex,
+ * before its first record is published, so those records only use sites
+ * that are already defined.
+ *
+ */
+void BinaryLogger::Run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  std::vector<std::pair<rtb_h::StagingBuffer*, uint64_t>> buffers;
+  while (true) {
+    const uint64_t request = flush_requests_;
+    const bool stop = stop_;
+
+    // Threads may add buffers while the records are written.
+    buffers.clear();
+    for (const auto& buffer : buffers_) {
+      buffers.emplace_back(buffer.get(), buffer->Published());
+    }
+
+    for (; sites_written_ < sites_.size(); sites_written_++) {
+      const SiteInfo& site = sites_[sites_written_];
+      const size_t size = sizeof(rtb_h::RecordHeader) + sizeof(uint32_t) + 2 +
+                          site.arg_types.size() + site.format.size();
+      const rtb_h::RecordHeader header{rtb_h::kSiteDefinitionId,
+                                       static_cast<uint32_t>(size), 0};
+      const auto id = static_cast<uint32_t>(sites_written_ + 1);
+      const auto type = static_cast<uint8_t>(site.type);
+      const auto arg_count = static_cast<uint8_t>(site.arg_types.size());
+      output_.write(reinterpret_cast<const char*>(&header), sizeof(header));
+      output_.write(reinterpret_cast<const char*>(&id), sizeof(id));
+      output_.write(reinterpret_cast<const char*>(&type), 1);
+      output_.write(reinterpret_cast<const char*>(&arg_count), 1);
+      output_.write(reinterpret_cast<const char*>(site.arg_types.data()),
+                    static_cast<std::streamsize>(site.arg_types.size()));
+      output_.write(site.format.data(),
+                    static_cast<std::streamsize>(site.format.size()));
+    }
+
+    lock.unlock();
+    size_t written = 0;
+    for (const auto& [buffer, published] : buffers) {
+      written += buffer->Consume(&output_, published);
+    }
+    lock.lock();
+
+    for (auto it = buffers_.begin(); it != buffers_.end();) {
+      it = (*it)->Retired() && (*it)->Empty() ? buffers_.erase(it) : it + 1;
+    }
+    if (request > flushes_done_) {
+      output_.flush();
+      flushes_done_ = request;
+      flushed_cv_.notify_all();
+    }
+    if (stop) {
+      break;
+    }
+    if (written == 0) {
+      work_cv_.wait_for(lock, kPollInterval, [this]() {
+        return stop_ || flush_requests_ != flushes_done_;
+      });
+    }
+  }
+  output_.flush();
+}
+
+/**
+ * @brief Convert a binary log to text, one line per record in the format of
+ * Logger.
+ *
+ * @param in  The binary log.
+ * @param out The text output.
+ */
+void DecodeBinaryLog(std::istream& in, std::ostream& out) {
+  char magic[sizeof(rtb_h::kBinaryLogMagic)];
+  in.read(magic, sizeof(magic));
+  if (in.gcount() != sizeof(magic) ||
+      std::memcmp(magic, rtb_h::kBinaryLogMagic, sizeof(magic)) != 0) {
+    throw std::runtime_error("DecodeBinaryLog: Not a binary log");
+  }
+
+  struct Site {
+    rtb_h::MessageType type{rtb_h::kInfo};
+    std::vector<rtb_h::ArgType> arg_types;
+    std::string format;
+  };
+  std::vector<Site> sites;
+  std::vector<char> body;
+  std::ostringstream line;
+  const TimestampFormatter formatter;
+
+  while (true) {
+    rtb_h::RecordHeader header{};
+    in.read(reinterpret_cast<char*>(&header), sizeof(header));
+    if (in.gcount() == 0) {
+      break;
+    }
+    if (in.gcount() != sizeof(header) || header.size < sizeof(header)) {
+      throw std::runtime_error("DecodeBinaryLog: Truncated record");
+    }
+    body.resize(header.size - sizeof(header));
+    in.read(body.data(), static_cast<std::streamsize>(body.size()));
+    if (static_cast<size_t>(in.gcount()) != body.size()) {
+      throw std::runtime_error("DecodeBinaryLog: Truncated record");
+    }
+    const char* src = body.data();
+    const char* end = body.data() + body.size();
+
+    if (header.site_id == rtb_h::kSiteDefinitionId) {
+      const auto id = rtb_h::ReadValue<uint32_t>(&src, end);
+      Site site;
+      site.type =
+          static_cast<rtb_h::MessageType>(rtb_h::ReadValue<uint8_t>(&src, end));
+      const auto arg_count = rtb_h::ReadValue<uint8_t>(&src, end);
+      for (uint8_t i = 0; i < arg_count; i++) {
+        site.arg_types.push_back(
+            static_cast<rtb_h::ArgType>(rtb_h::ReadValue<uint8_t>(&src, end)));
+      }
+      site.format.assign(src, end);
+      if (sites.size() < id) {
+        sites.resize(id);
+      }
+      sites[id - 1] = std::move(site);
+      continue;
+    }
+
+    if (header.site_id > sites.size()) {
+      throw std::runtime_error("DecodeBinaryLog: Unknown call site");
+    }
+    const Site& site = sites[header.site_id - 1];
+
+    const std::chrono::system_clock::time_point time(
+        std::chrono::duration_cast<std::chrono::system_clock::duration>(
+            std::chrono::nanoseconds(header.timestamp)));
+    line.str("");
+    line << rtb_h::MessagePrefix(site.type) << formatter.Format(time) << ' ';
+
+    // Replace every {} by the next argument, append any extra arguments.
+    size_t arg = 0;
+    for (size_t i = 0; i < site.format.size(); i++) {
+      if (site.format[i] == '{' && i + 1 < site.format.size() &&
+          site.format[i + 1] == '}' && arg < site.arg_types.size()) {
+        rtb_h::PrintArg(site.arg_types[arg++], &src, end, line);
+        i++;
+      } else {
+        line << site.format[i];
+      }
+    }
+    for (; arg < site.arg_types.size(); arg++) {
+      line << ' ';
+      rtb_h::PrintArg(site.arg_types[arg], &src, end, line);
+    }
+    out << line.str() << '\n';
+  }
+}
+}  // namespace rtb
@@ -0,0 +1,391 @@
+// @file      binary_logger.hpp
+// @author    Roger Davies     [rdavies3000@gmail.com]
+//
+// Copyright (c) 2022 Roger Davies, all rights reserved
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iosfwd>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "log_sink.hpp"
+
+//  Log a message in binary form. The format is a string literal in which
+//  every {} is replaced by the next argument when the log is decoded.
+//  Messages below the log level are skipped as with RTB_LOG.
+#define RTB_BINARY_LOG(type, format, ...)                                 \
+  do {                                                                    \
+    if ((type) >= RTB_MIN_LOG_LEVEL && rtb_h::LogLevelEnabled(type)) {   \
+      static rtb_h::LogSite rtb_log_site(type, format);                   \
+      rtb::BinaryLogger::Log(&rtb_log_site, ##__VA_ARGS__);               \
+    }                                                                     \
+  } while (false)
+#define RTB_BINARY_LOG_TRACE(format, ...) \
+  RTB_BINARY_LOG(rtb_h::kTrace, format, ##__VA_ARGS__)
+#define RTB_BINARY_LOG_DEBUG(format, ...) \
+  RTB_BINARY_LOG(rtb_h::kDebug, format, ##__VA_ARGS__)
+#define RTB_BINARY_LOG_ERROR(format, ...) \
+  RTB_BINARY_LOG(rtb_h::kError, format, ##__VA_ARGS__)
+#define RTB_BINARY_LOG_WARNING(format, ...) \
+  RTB_BINARY_LOG(rtb_h::kWarning, format, ##__VA_ARGS__)
+#define RTB_BINARY_LOG_INFO(format, ...) \
+  RTB_BINARY_LOG(rtb_h::kInfo, format, ##__VA_ARGS__)
+#define RTB_BINARY_LOG_FATAL(format, ...) \
+  RTB_BINARY_LOG(rtb_h::kFatal, format, ##__VA_ARGS__)
+
+namespace rtb_h {
+/**
+ * @brief The static part of a log call: message type and format string. One
+ * instance exists per call site; it is constant initialised and gets an id
+ * when the site is first logged.
+ *
+ */
+struct LogSite {
+  constexpr LogSite(MessageType message_type, const char* format_string)
+      : type(message_type), format(format_string) {}
+
+  MessageType type;
+  const char* format;
+  std::atomic<uint32_t> id{0};
+};
+
+/**
+ * @brief Encoding of a log argument in the binary log.
+ *
+ */
+enum class ArgType : uint8_t {
+  kBool = 0,
+  kChar,
+  kInt8,
+  kUint8,
+  kInt16,
+  kUint16,
+  kInt32,
+  kUint32,
+  kInt64,
+  kUint64,
+  kFloat,
+  kDouble,
+  kPointer,
+  kString
+};
+
+// Longer string arguments are truncated so that a record always fits into a
+// staging buffer.
+constexpr size_t kMaxStringArgSize = 16384;
+
+/**
+ * @brief Header of every record in a staging buffer and in the binary log.
+ *
+ */
+struct RecordHeader {
+  uint32_t site_id;
+  uint32_t size;  // Including the header.
+  int64_t timestamp;  // Nanoseconds since the epoch.
+};
+
+// The type an argument is encoded as: arrays decay to pointers and C strings
+// are always const.
+template <typename T>
+using ArgValue =
+    std::conditional_t<std::is_same_v<std::decay_t<T>, char*>, const char*,
+                       std::decay_t<T>>;
+
+template <typename T>
+constexpr bool kIsStringArg = std::is_same_v<T, const char*> ||
+                              std::is_same_v<T, std::string> ||
+                              std::is_same_v<T, std::string_view>;
+
+/**
+ * @brief Get the encoding of an argument type.
+ *
+ * @return ArgType
+ */
+template <typename T>
+constexpr ArgType ArgTypeOf() {
+  if constexpr (kIsStringArg<T>) {
+    return ArgType::kString;
+  } else if constexpr (std::is_same_v<T, bool>) {
+    return ArgType::kBool;
+  } else if constexpr (std::is_same_v<T, char>) {
+    return ArgType::kChar;
+  } else if constexpr (std::is_enum_v<T>) {
+    return ArgTypeOf<std::underlying_type_t<T>>();
+  } else if constexpr (std::is_integral_v<T>) {
+    constexpr bool kSigned = std::is_signed_v<T>;
+    if constexpr (sizeof(T) == 1) {
+      return kSigned ? ArgType::kInt8 : ArgType::kUint8;
+    } else if constexpr (sizeof(T) == 2) {
+      return kSigned ? ArgType::kInt16 : ArgType::kUint16;
+    } else if constexpr (sizeof(T) == 4) {
+      return kSigned ? ArgType::kInt32 : ArgType::kUint32;
+    } else {
+      static_assert(sizeof(T) == 8, "Unsupported integer size");
+      return kSigned ? ArgType::kInt64 : ArgType::kUint64;
+    }
+  } else if constexpr (std::is_same_v<T, float>) {
+    return ArgType::kFloat;
+  } else if constexpr (std::is_floating_point_v<T>) {
+    return ArgType::kDouble;
+  } else {
+    static_assert(std::is_pointer_v<T>, "Unsupported binary log argument");
+    return ArgType::kPointer;
+  }
+}
+
+/**
+ * @brief Get the view of a string argument.
+ *
+ */
+template <typename T>
+std::string_view StringArg(const T& value) {
+  std::string_view view;
+  if constexpr (std::is_pointer_v<T>) {
+    view = value == nullptr ? std::string_view() : std::string_view(value);
+  } else {
+    view = value;
+  }
+  return view.substr(0, kMaxStringArgSize);
+}
+
+/**
+ * @brief Get the number of bytes an argument occupies in a record.
+ *
+ */
+template <typename T>
+size_t EncodedSize(const T& value) {
+  if constexpr (kIsStringArg<T>) {
+    return sizeof(uint32_t) + StringArg(value).size();
+  } else if constexpr (std::is_same_v<T, long double>) {
+    return sizeof(double);
+  } else if constexpr (std::is_pointer_v<T>) {
+    return sizeof(uint64_t);
+  } else {
+    return sizeof(T);
+  }
+}
+
+/**
+ * @brief Copy the raw bytes of an argument into a record.
+ *
+ * @param dst   The write position, advanced past the argument.
+ * @param value The argument.
+ */
+template <typename T>
+void Encode(char** dst, const T& value) {
+  if constexpr (kIsStringArg<T>) {
+    const std::string_view view = StringArg(value);
+    const auto size = static_cast<uint32_t>(view.size());
+    std::memcpy(*dst, &size, sizeof(size));
+    std::memcpy(*dst + sizeof(size), view.data(), size);
+    *dst += sizeof(size) + size;
+  } else if constexpr (std::is_same_v<T, long double>) {
+    const auto narrowed = static_cast<double>(value);
+    std::memcpy(*dst, &narrowed, sizeof(narrowed));
+    *dst += sizeof(narrowed);
+  } else if constexpr (std::is_pointer_v<T>) {
+    const auto address = reinterpret_cast<uint64_t>(value);
+    std::memcpy(*dst, &address, sizeof(address));
+    *dst += sizeof(address);
+  } else {
+    std::memcpy(*dst, &value, sizeof(T));
+    *dst += sizeof(T);
+  }
+}
+
+/**
+ * @brief Per-thread single-producer single-consumer byte ring that holds
+ * encoded records until the background thread writes them. A record never
+ * wraps around the end of the buffer: the producer skips the remaining bytes
+ * instead and marks them if there is room for a marker.
+ *
+ */
+class StagingBuffer {
+ public:
+  static constexpr size_t kCapacity = 1U << 20U;
+  static constexpr uint32_t kWrapMarker = 0xFFFFFFFFU;
+
+  StagingBuffer() : data_(new char[kCapacity]) {}
+
+  char* Reserve(size_t size);
+  void Commit(size_t size);
+  size_t Consume(std::ostream* out, uint64_t limit);
+
+  // The end of the records published so far, a limit for Consume().
+  [[nodiscard]] uint64_t Published() const {
+    return published_.load(std::memory_order_acquire);
+  }
+  void Retire() { retired_.store(true, std::memory_order_release); }
+  [[nodiscard]] bool Retired() const {
+    return retired_.load(std::memory_order_acquire);
+  }
+  [[nodiscard]] bool Empty() const {
+    return read_pos_.load(std::memory_order_acquire) ==
+           published_.load(std::memory_order_acquire);
+  }
+
+ private:
+  std::unique_ptr<char[]> data_;
+
+  // Producer side.
+  alignas(64) uint64_t write_pos_{0};
+  std::atomic<uint64_t> published_{0};
+
+  // Consumer side.
+  alignas(64) std::atomic<uint64_t> read_pos_{0};
+  std::atomic<bool> retired_{false};
+};
+
+/**
+ * @brief Reserve contiguous space for a record, waiting for the consumer if
+ * the buffer is full.
+ *
+ * @param size    The record size, at most kCapacity / 2.
+ * @return char*  The space to write the record to.
+ */
+inline char* StagingBuffer::Reserve(size_t size) {
+  const size_t offset = write_pos_ & (kCapacity - 1);
+  const size_t contiguous = kCapacity - offset;
+  const size_t needed = size > contiguous ? contiguous + size : size;
+  while (write_pos_ + needed - read_pos_.load(std::memory_order_acquire) >
+         kCapacity) {
+    std::this_thread::yield();
+  }
+
+  if (size > contiguous) {
+    if (contiguous >= sizeof(kWrapMarker)) {
+      std::memcpy(data_.get() + offset, &kWrapMarker, sizeof(kWrapMarker));
+    }
+    write_pos_ += contiguous;
+  }
+  return data_.get() + (write_pos_ & (kCapacity - 1));
+}
+
+/**
+ * @brief Publish a record written to the space returned by Reserve().
+ *
+ * @param size The record size.
+ */
+inline void StagingBuffer::Commit(size_t size) {
+  write_pos_ += size;
+  published_.store(write_pos_, std::memory_order_release);
+}
+}  // namespace rtb_h
+
+namespace rtb {
+/**
+ * @brief Singleton logger that defers formatting. A log call only stores the
+ * id of its call site, a timestamp and the raw argument bytes in a buffer
+ * owned by the calling thread. A background thread copies the records to a
+ * binary file, which DecodeBinaryLog() or the toolbox_logdecode tool turn
+ * into the text format of Logger. Records of different threads are written
+ * per thread in batches, so lines from different threads may be out of order
+ * by up to a few milliseconds.
+ *
+ */
+class BinaryLogger {
+ public:
+  BinaryLogger() = default;
+  ~BinaryLogger();
+
+  static void Open(const std::string& filepath);
+  static void Close();
+  static void Flush();
+
+  template <typename... Args>
+  static void Log(rtb_h::LogSite* site, const Args&... args);
+
+  BinaryLogger(const BinaryLogger&) = delete;
+  BinaryLogger& operator=(const BinaryLogger&) = delete;
+  BinaryLogger(const BinaryLogger&&) = delete;
+  BinaryLogger& operator=(const BinaryLogger&&) = delete;
+
+ private:
+  struct SiteInfo {
+    rtb_h::MessageType type;
+    std::string format;
+    std::vector<rtb_h::ArgType> arg_types;
+  };
+
+  // Time the background thread sleeps when there is nothing to write.
+  static constexpr std::chrono::milliseconds kPollInterval{1};
+
+  std::atomic<bool> enabled_{false};
+  std::mutex mutex_;
+  std::vector<SiteInfo> sites_;
+  std::vector<std::unique_ptr<rtb_h::StagingBuffer>> buffers_;
+
+  // Background thread state, guarded by mutex_.
+  std::ofstream output_;
+  size_t sites_written_{0};
+  uint64_t flush_requests_{0};
+  uint64_t flushes_done_{0};
+  bool stop_{false};
+  std::condition_variable work_cv_;
+  std::condition_variable flushed_cv_;
+  std::thread thread_;
+
+  static BinaryLogger& GetInstance();
+  static rtb_h::StagingBuffer* GetStagingBuffer();
+
+  uint32_t RegisterSite(rtb_h::LogSite* site,
+                        std::vector<rtb_h::ArgType> arg_types);
+  void OpenImpl(const std::string& filepath);
+  void CloseImpl();
+  void FlushImpl();
+  void Run();
+  size_t WriteBuffers();
+};
+
+/**
+ * @brief Log the arguments of a call site. Use the RTB_BINARY_LOG macros
+ * instead of calling this directly.
+ *
+ * @param site  The call site.
+ * @param args  Arithmetic, pointer or string arguments.
+ */
+template <typename... Args>
+void BinaryLogger::Log(rtb_h::LogSite* site, const Args&... args) {
+  BinaryLogger& logger = GetInstance();
+  if (!logger.enabled_.load(std::memory_order_relaxed)) {
+    return;
+  }
+
+  uint32_t id = site->id.load(std::memory_order_acquire);
+  if (id == 0) {
+    id = logger.RegisterSite(
+        site, {rtb_h::ArgTypeOf<rtb_h::ArgValue<Args>>()...});
+  }
+
+  const size_t size =
+      sizeof(rtb_h::RecordHeader) +
+      (rtb_h::EncodedSize<rtb_h::ArgValue<Args>>(args) + ... + 0);
+  const rtb_h::RecordHeader header{
+      id, static_cast<uint32_t>(size),
+      std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::system_clock::now().time_since_epoch())
+          .count()};
+
+  rtb_h::StagingBuffer* buffer = GetStagingBuffer();
+  char* dst = buffer->Reserve(size);
+  std::memcpy(dst, &header, sizeof(header));
+  dst += sizeof(header);
+  (rtb_h::Encode<rtb_h::ArgValue<Args>>(&dst, args), ...);
+  buffer->Commit(size);
+}
+
+void DecodeBinaryLog(std::istream& in, std::ostream& out);
+}  // namespace rtb
@@ -0,0 +1,401 @@
+// @file      flight_recorder.cpp
+// @author    Roger Davies     [rdavies3000@gmail.com]
+//
+// Copyright (c) 2022 Roger Davies, all rights reserved
+
+#include "flight_recorder.hpp"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <memory>
+#include <utility>
+
+namespace rtb_h {
+// Signals that dump the flight recorder before the process dies.
+const std::array<int, 5> kFatalSignals = {SIGSEGV, SIGABRT, SIGBUS, SIGFPE,
+                                          SIGILL};
+
+// The recorder dumped by the signal handler, and the actions it replaced.
+std::atomic<LogSinkFlightRecorder*> g_signal_recorder{nullptr};
+std::array<struct sigaction, kFatalSignals.size()> g_previous_actions{};
+
+std::atomic<uint64_t> g_next_recorder_id{1};
+
+// Large enough for the handler, which only formats numbers and writes.
+constexpr size_t kSignalStackSize = 64 * 1024;
+
+/**
+ * @brief Write a whole buffer to a file descriptor. Async-signal-safe.
+ *
+ * @param fd      The file descriptor.
+ * @param data    The data.
+ * @param length  The number of bytes.
+ * @return true   Everything was written.
+ */
+bool WriteFully(int fd, const char* data, size_t length) {
+  while (length > 0) {
+    const ssize_t written = ::write(fd, data, length);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    data += written;
+    length -= static_cast<size_t>(written);
+  }
+  return true;
+}
+
+/**
+ * @brief Dump the installed recorder, restore the previous action and raise
+ * the signal again.
+ *
+ * @param signal The signal number.
+ */
+void FlightRecorderSignalHandler(int signal) {
+  LogSinkFlightRecorder* recorder = g_signal_recorder.exchange(nullptr);
+  if (recorder != nullptr) {
+    recorder->Dump();
+  }
+  for (size_t i = 0; i < kFatalSignals.size(); i++) {
+    if (kFatalSignals[i] == signal) {
+      ::sigaction(signal, &g_previous_actions[i], nullptr);
+    }
+  }
+  ::raise(signal);
+}
+
+/**
+ * @brief Give the calling thread an alternate signal stack unless it has
+ * one, so that the handler still runs after the thread's stack overflowed.
+ * The stack is disabled and freed when the thread exits.
+ *
+ */
+void InstallSignalStack() {
+  struct SignalStack {
+    std::unique_ptr<char[]> memory;
+    SignalStack() = default;
+    ~SignalStack() {
+      if (memory != nullptr) {
+        stack_t disable{};
+        disable.ss_flags = SS_DISABLE;
+        ::sigaltstack(&disable, nullptr);
+      }
+    }
+    SignalStack(const SignalStack&) = delete;
+    SignalStack& operator=(const SignalStack&) = delete;
+    SignalStack(const SignalStack&&) = delete;
+    SignalStack& operator=(const SignalStack&&) = delete;
+  };
+  thread_local SignalStack signal_stack;
+
+  stack_t current{};
+  if (::sigaltstack(nullptr, &current) != 0 ||
+      (current.ss_flags & SS_DISABLE) == 0) {
+    return;
+  }
+  auto memory = std::make_unique<char[]>(kSignalStackSize);
+  stack_t stack{};
+  stack.ss_sp = memory.get();
+  stack.ss_size = kSignalStackSize;
+  if (::sigaltstack(&stack, nullptr) == 0) {
+    signal_stack.memory = std::move(memory);
+  }
+}
+
+/**
+ * @brief Construct a new LineRing object.
+ *
+ * @param capacity The size of the ring in bytes.
+ */
+LineRing::LineRing(size_t capacity)
+    : capacity_(std::max<size_t>(capacity, 64)),
+      data_(new char[capacity_]) {}
+
+/**
+ * @brief Get the end of the record starting at a position, including the
+ * padding that skips to the start of the ring.
+ *
+ * @param pos         The position of the record.
+ * @return uint64_t   The position after it.
+ */
+uint64_t LineRing::RecordEnd(uint64_t pos) const {
+  const size_t offset = pos % capacity_;
+  uint32_t length = kWrapMarker;
+  if (capacity_ - offset >= sizeof(length)) {
+    std::memcpy(&length, data_.get() + offset, sizeof(length));
+  }
+  if (length == kWrapMarker) {
+    return pos + (capacity_ - offset);
+  }
+  return pos + sizeof(length) + length;
+}
+
+/**
+ * @brief Append a line, overwriting the oldest lines to make room. Lines
+ * longer than half the ring are truncated.
+ *
+ * @param line The line.
+ */
+void LineRing::Push(std::string_view line) {
+  const auto length =
+      static_cast<uint32_t>(std::min(line.size(), capacity_ / 2));
+  const size_t size = sizeof(length) + length;
+  const uint64_t head = head_.load(std::memory_order_relaxed);
+  const size_t offset = head % capacity_;
+  uint64_t start = head;
+  if (capacity_ - offset < size) {
+    start += capacity_ - offset;
+  }
+
+  // Move the tail past the lines about to be overwritten before writing.
+  uint64_t tail = tail_.load(std::memory_order_relaxed);
+  while (start + size - tail > capacity_) {
+    if (tail >= head) {
+      tail = start;
+      break;
+    }
+    tail = RecordEnd(tail);
+  }
+  tail_.store(tail, std::memory_order_release);
+
+  if (start != head && capacity_ - offset >= sizeof(kWrapMarker)) {
+    std::memcpy(data_.get() + offset, &kWrapMarker, sizeof(kWrapMarker));
+  }
+  char* record = data_.get() + start % capacity_;
+  std::memcpy(record, &length, sizeof(length));
+  std::memcpy(record + sizeof(length), line.data(), length);
+  head_.store(start + size, std::memory_order_release);
+}
+
+/**
+ * @brief Write the lines, oldest first. Async-signal-safe.
+ *
+ * @param fd      The file descriptor.
+ * @return true   Everything was written.
+ */
+bool LineRing::Dump(int fd) const {
+  const uint64_t head = head_.load(std::memory_order_acquire);
+  uint64_t pos = tail_.load(std::memory_order_acquire);
+  while (pos < head) {
+    const size_t offset = pos % capacity_;
+    uint32_t length = kWrapMarker;
+    if (capacity_ - offset >= sizeof(length)) {
+      std::memcpy(&length, data_.get() + offset, sizeof(length));
+    }
+    if (length == kWrapMarker) {
+      pos += capacity_ - offset;
+      continue;
+    }
+    if (length > capacity_ - offset - sizeof(length) ||
+        pos + sizeof(length) + length > head) {
+      // Overwritten while we read.
+      return true;
+    }
+    if (!WriteFully(fd, data_.get() + offset + sizeof(length), length) ||
+        !WriteFully(fd, "\n", 1)) {
+      return false;
+    }
+    pos += sizeof(length) + length;
+  }
+  return true;
+}
+
+/**
+ * @brief Construct a new LogSinkFlightRecorder object.
+ *
+ * @param dump_path       The file the lines are dumped to.
+ * @param thread_capacity The ring buffer size per thread in bytes.
+ */
+LogSinkFlightRecorder::LogSinkFlightRecorder(std::string dump_path,
+                                             size_t thread_capacity)
+    : dump_path_(std::move(dump_path)),
+      thread_capacity_(thread_capacity),
+      id_(g_next_recorder_id.fetch_add(1)) {}
+
+/**
+ * @brief Destroy the LogSinkFlightRecorder object, removing the signal
+ * handlers if they dump this recorder.
+ *
+ */
+LogSinkFlightRecorder::~LogSinkFlightRecorder() {
+  LogSinkFlightRecorder* self = this;
+  if (g_signal_recorder.compare_exchange_strong(self, nullptr)) {
+    for (size_t i = 0; i < kFatalSignals.size(); i++) {
+      ::sigaction(kFatalSignals[i], &g_previous_actions[i], nullptr);
+    }
+  }
+}
+
+/**
+ * @brief Record a message in the calling thread's ring.
+ *
+ * @param message       The message.
+ * @param message_type  The message type.
+ */
+void LogSinkFlightRecorder::Log(std::string_view message, const MessageType) {
+  LineRing* ring = GetRing();
+  if (ring != nullptr) {
+    ring->Push(message);
+  }
+}
+
+/**
+ * @brief Write the recorded lines of every thread to the dump file.
+ * Async-signal-safe.
+ *
+ * @return true   The dump was written.
+ */
+bool LogSinkFlightRecorder::Dump() const {
+  const int fd = ::open(dump_path_.c_str(),
+                        O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    return false;
+  }
+  const bool ok = Dump(fd);
+  ::close(fd);
+  return ok;
+}
+
+/**
+ * @brief Write the recorded lines to a file descriptor, one section per
+ * thread with the lines oldest first. Async-signal-safe.
+ *
+ * @param fd      The file descriptor.
+ * @return true   The dump was written.
+ */
+bool LogSinkFlightRecorder::Dump(int fd) const {
+  for (const auto& slot : rings_) {
+    const LineRing* ring = slot.load(std::memory_order_acquire);
+    if (ring == nullptr) {
+      break;
+    }
+    // "--- thread <id> ---", formatted without the allocator or stdio.
+    char header[64];
+    char digits[24];
+    size_t n = 0;
+    uint64_t id = ring->thread_id.load(std::memory_order_relaxed);
+    do {
+      digits[n++] = static_cast<char>('0' + id % 10);
+      id /= 10;
+    } while (id > 0);
+    const char kPrefix[] = "--- thread ";
+    const char kSuffix[] = " ---\n";
+    size_t length = sizeof(kPrefix) - 1;
+    std::memcpy(header, kPrefix, length);
+    while (n > 0) {
+      header[length++] = digits[--n];
+    }
+    std::memcpy(header + length, kSuffix, sizeof(kSuffix) - 1);
+    length += sizeof(kSuffix) - 1;
+    if (!WriteFully(fd, header, length) || !ring->Dump(fd)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * @brief Dump this recorder when the process receives SIGSEGV, SIGABRT,
+ * SIGBUS, SIGFPE or SIGILL, then let the previous action handle the signal.
+ * Only one recorder is dumped on signals, the last one installed. The
+ * handler runs on an alternate signal stack, which the calling thread gets
+ * here; a stack overflow in another thread is only dumped if that thread
+ * has set up an alternate stack itself.
+ *
+ */
+void LogSinkFlightRecorder::InstallSignalHandlers() {
+  InstallSignalStack();
+  LogSinkFlightRecorder* previous = g_signal_recorder.exchange(this);
+  if (previous != nullptr) {
+    return;
+  }
+  struct sigaction action {};
+  action.sa_handler = FlightRecorderSignalHandler;
+  sigemptyset(&action.sa_mask);
+  action.sa_flags = SA_ONSTACK;
+  for (size_t i = 0; i < kFatalSignals.size(); i++) {
+    ::sigaction(kFatalSignals[i], &action, &g_previous_actions[i]);
+  }
+}
+
+/**
+ * @brief Get the calling thread's ring, claiming one on first use. The ring
+ * is released for reuse when the thread exits. A thread keeps the rings of
+ * the last few recorders it logged to, so that alternating between them
+ * does not claim a ring on every line.
+ *
+ * @return LineRing*  The ring, or nullptr if all rings are taken.
+ */
+LineRing* LogSinkFlightRecorder::GetRing() {
+  struct Handle {
+    uint64_t recorder_id{0};
+    std::shared_ptr<LineRing> ring;
+    Handle() = default;
+    ~Handle() { Release(); }
+    void Release() {
+      if (ring != nullptr) {
+        ring->in_use.store(false, std::memory_order_release);
+        ring.reset();
+      }
+    }
+    Handle(const Handle&) = delete;
+    Handle& operator=(const Handle&) = delete;
+    Handle(const Handle&&) = delete;
+    Handle& operator=(const Handle&&) = delete;
+  };
+  thread_local std::array<Handle, kThreadHandles> handles;
+  thread_local size_t next_handle = 0;
+
+  for (const Handle& handle : handles) {
+    if (handle.recorder_id == id_) {
+      return handle.ring.get();
+    }
+  }
+  // Replaces the handle claimed least recently.
+  Handle& handle = handles[next_handle];
+  next_handle = (next_handle + 1) % handles.size();
+  handle.Release();
+  handle.ring = AcquireRing();
+  handle.recorder_id = id_;
+  return handle.ring.get();
+}
+
+/**
+ * @brief Claim a ring that no thread owns, or create one.
+ *
+ * @return std::shared_ptr<LineRing>  The ring, or nullptr if all rings are
+ *                                    taken.
+ */
+std::shared_ptr<LineRing> LogSinkFlightRecorder::AcquireRing() {
+  const std::lock_guard<std::mutex> lock(mutex_);
+  std::shared_ptr<LineRing> ring;
+  for (const auto& owned : owned_rings_) {
+    bool free = false;
+    if (owned->in_use.compare_exchange_strong(free, true,
+                                              std::memory_order_acquire)) {
+      ring = owned;
+      break;
+    }
+  }
+  if (ring == nullptr) {
+    if (owned_rings_.size() == kMaxThreads) {
+      return nullptr;
+    }
+    ring = std::make_shared<LineRing>(thread_capacity_);
+    owned_rings_.push_back(ring);
+    rings_[owned_rings_.size() - 1].store(ring.get(),
+                                          std::memory_order_release);
+  }
+  ring->thread_id.store(static_cast<uint64_t>(::gettid()),
+                        std::memory_order_relaxed);
+  return ring;
+}
+}  // namespace rtb_h
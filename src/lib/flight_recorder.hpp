@@ -0,0 +1,99 @@
+// @file      flight_recorder.hpp
+// @author    Roger Davies     [rdavies3000@gmail.com]
+//
+// Copyright (c) 2022 Roger Davies, all rights reserved
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "log_sink.hpp"
+
+namespace rtb_h {
+/**
+ * @brief Ring of the most recent log lines of one thread. Only the owning
+ * thread writes; readers may run in a signal handler. Lines are stored
+ * contiguously as a 32-bit length and the text, oldest first from tail.
+ *
+ */
+class LineRing {
+ public:
+  explicit LineRing(size_t capacity);
+
+  void Push(std::string_view line);
+  bool Dump(int fd) const;
+
+  // Whether a thread currently owns the ring.
+  std::atomic<bool> in_use{true};
+  std::atomic<uint64_t> thread_id{0};
+
+  LineRing(const LineRing&) = delete;
+  LineRing& operator=(const LineRing&) = delete;
+  LineRing(const LineRing&&) = delete;
+  LineRing& operator=(const LineRing&&) = delete;
+
+ private:
+  // Stored instead of a length where a line did not fit before the end.
+  static constexpr uint32_t kWrapMarker = 0xffffffff;
+
+  size_t capacity_;
+  std::unique_ptr<char[]> data_;
+  std::atomic<uint64_t> head_{0};
+  std::atomic<uint64_t> tail_{0};
+
+  [[nodiscard]] uint64_t RecordEnd(uint64_t pos) const;
+};
+
+/**
+ * @brief Flight recorder. Keeps the last lines of every severity logged by
+ * each thread in a per-thread ring buffer, without locks or shared writes,
+ * and writes them to a file on demand or when the process receives a fatal
+ * signal. The dump only uses async-signal-safe calls. Lines logged while a
+ * dump runs may appear torn.
+ *
+ */
+class LogSinkFlightRecorder : public LogSink {
+ public:
+  static constexpr size_t kDefaultThreadCapacity = 256 * 1024;
+  // Rings are reused by new threads once their thread has exited.
+  static constexpr size_t kMaxThreads = 256;
+  // The recorders per thread whose rings the thread keeps at once.
+  static constexpr size_t kThreadHandles = 4;
+
+  LogSinkFlightRecorder() = delete;
+  explicit LogSinkFlightRecorder(
+      std::string dump_path, size_t thread_capacity = kDefaultThreadCapacity);
+  ~LogSinkFlightRecorder() override;
+  void Log(std::string_view message, MessageType message_type) override;
+
+  bool Dump() const;
+  bool Dump(int fd) const;
+  void InstallSignalHandlers();
+
+  [[nodiscard]] const std::string& dump_path() const { return dump_path_; }
+
+  LogSinkFlightRecorder(const LogSinkFlightRecorder&) = delete;
+  LogSinkFlightRecorder& operator=(const LogSinkFlightRecorder&) = delete;
+  LogSinkFlightRecorder(const LogSinkFlightRecorder&&) = delete;
+  LogSinkFlightRecorder& operator=(const LogSinkFlightRecorder&&) = delete;
+
+ private:
+  std::string dump_path_;
+  size_t thread_capacity_;
+  uint64_t id_;
+  // Read by the dump, so a fixed array rather than a growing container.
+  std::array<std::atomic<LineRing*>, kMaxThreads> rings_{};
+  std::vector<std::shared_ptr<LineRing>> owned_rings_;
+  std::mutex mutex_;
+
+  LineRing* GetRing();
+  std::shared_ptr<LineRing> AcquireRing();
+};
+}  // namespace rtb_h
@@ -0,0 +1,45 @@
+// @file      grace_period.cpp
+// @author    Roger Davies     [rdavies3000@gmail.com]
+//
+// Copyright (c) 2022 Roger Davies, all rights reserved
+
+#include "grace_period.hpp"
+
+#include <thread>
+
+namespace rtb_h {
+/**
+ * @brief Wait until every read section that began before the call has ended.
+ * What the caller replaced before calling can then be freed. A section may
+ * have counted itself in either phase, so both are drained in turn, each
+ * while new sections count in the other one.
+ *
+ */
+void GracePeriod::Synchronize() {
+  // Orders the caller's publication before the counters are read: a section
+  // not seen by the wait loads the new data.
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  const std::lock_guard<std::mutex> lock(mutex_);
+  for (int i = 0; i < 2; i++) {
+    const size_t phase = phase_.load(std::memory_order_relaxed);
+    phase_.store(phase ^ 1, std::memory_order_seq_cst);
+    WaitForPhase(phase);
+  }
+}
+
+/**
+ * @brief Wait until the counters of a phase have all been zero. The mutex is
+ * held.
+ *
+ * @param phase The phase.
+ */
+void GracePeriod::WaitForPhase(size_t phase) const {
+  for (size_t stripe = 0; stripe < kStripes; stripe++) {
+    const std::atomic<int64_t>& readers =
+        readers_[phase * kStripes + stripe].count;
+    while (readers.load(std::memory_order_seq_cst) != 0) {
+      std::this_thread::yield();
+    }
+  }
+}
+}  // namespace rtb_h
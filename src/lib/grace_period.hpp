@@ -0,0 +1,77 @@
+// @file      grace_period.hpp
+// @author    Roger Davies     [rdavies3000@gmail.com]
+//
+// Copyright (c) 2022 Roger Davies, all rights reserved
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+namespace rtb_h {
+/**
+ * @brief Tells when data read without a lock and replaced by publishing a
+ * new copy can be freed. Readers hold a ReadSection while they use what they
+ * loaded; Synchronize() returns once every section that began before it has
+ * ended. Entering a section is one atomic increment on a counter chosen per
+ * thread, so threads rarely share its cache line. Sections are short and a
+ * thread must not call Synchronize() inside one.
+ *
+ */
+class GracePeriod {
+ public:
+  class ReadSection {
+   public:
+    explicit ReadSection(GracePeriod* grace_period)
+        : p_readers_(grace_period->Enter()) {}
+    ~ReadSection() { p_readers_->fetch_sub(1, std::memory_order_release); }
+
+    ReadSection(const ReadSection&) = delete;
+    ReadSection& operator=(const ReadSection&) = delete;
+    ReadSection(const ReadSection&&) = delete;
+    ReadSection& operator=(const ReadSection&&) = delete;
+
+   private:
+    std::atomic<int64_t>* p_readers_;
+  };
+
+  void Synchronize();
+
+ private:
+  static constexpr size_t kStripes = 32;
+  struct alignas(64) Readers {
+    std::atomic<int64_t> count{0};
+  };
+
+  // New sections count themselves in the readers of the current phase, so
+  // that those of the other phase drain while Synchronize() waits for them.
+  std::atomic<size_t> phase_{0};
+  std::array<Readers, 2 * kStripes> readers_{};
+  std::mutex mutex_;
+
+  /**
+   * @brief Count a section in. The increment is sequentially consistent, so
+   * either Synchronize() sees it or the section loads what was published
+   * before Synchronize() was called.
+   *
+   * @return std::atomic<int64_t>*  The counter to decrement on leaving.
+   */
+  std::atomic<int64_t>* Enter() {
+    static std::atomic<size_t> next_stripe{0};
+    thread_local const size_t stripe =
+        next_stripe.fetch_add(1, std::memory_order_relaxed) % kStripes;
+    const size_t phase = phase_.load(std::memory_order_seq_cst);
+    std::atomic<int64_t>& readers = readers_[phase * kStripes + stripe].count;
+    readers.fetch_add(1, std::memory_order_seq_cst);
+    return &readers;
+  }
+
+  void WaitForPhase(size_t phase) const;
+};
+
+// Log calls in progress. Sink configurations and module sinks replaced while
+// the logger runs are freed after a grace period.
+inline GracePeriod g_log_readers;
+}  // namespace rtb_h
@@ -22,6 +22,7 @@ void Instrumentor::EndSession() {
 }
 
 void Instrumentor::WriteProfile(const rtb_h::ProfileResult& result) {
+  const std::lock_guard<std::mutex> lock(mutex_);
   if (profile_count_++ > 0) {
     output_stream_ << ",";
   }
@@ -9,6 +9,7 @@
 #include <chrono>
 #include <fstream>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <thread>
 
@@ -40,6 +41,8 @@ class Instrumentor {
 
  private:
   std::unique_ptr<rtb_h::InstrumentationSession> current_session_ptr_;
+  // Timers stop on any thread.
+  std::mutex mutex_;
   std::ofstream output_stream_;
   int profile_count_{};
 
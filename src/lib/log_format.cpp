@@ -0,0 +1,110 @@
+// @file      log_format.cpp
+// @author    Roger Davies     [rdavies3000@gmail.com]
+//
+// Copyright (c) 2022 Roger Davies, all rights reserved
+
+#include "log_format.hpp"
+
+#include <algorithm>
+#include <array>
+
+namespace rtb_h {
+// Number of nested log calls per thread served from the buffer stack.
+const size_t kLogBufferStackDepth = 4;
+
+/**
+ * @brief The per-thread stack of log buffers.
+ *
+ */
+struct LogBufferStack {
+  std::array<std::unique_ptr<LogBuffer>, kLogBufferStackDepth> buffers;
+  size_t depth{0};
+};
+
+thread_local LogBufferStack tls_log_buffers;
+
+/**
+ * @brief Construct a new LogBuffer object.
+ *
+ */
+LogBuffer::LogBuffer()
+    : data_(new char[kInitialCapacity]),
+      capacity_(kInitialCapacity),
+      streambuf_(this),
+      stream_(&streambuf_) {}
+
+/**
+ * @brief Get a stream that appends to the buffer, with default formatting.
+ *
+ * @return std::ostream&
+ */
+std::ostream& LogBuffer::Stream() {
+  stream_.clear();
+  stream_.flags(std::ios_base::dec | std::ios_base::skipws);
+  stream_.precision(6);
+  stream_.width(0);
+  stream_.fill(' ');
+  return stream_;
+}
+
+/**
+ * @brief Increase the capacity, at least doubling it.
+ *
+ * @param min_capacity The required capacity.
+ */
+void LogBuffer::Grow(size_t min_capacity) {
+  const size_t capacity = std::max(min_capacity, 2 * capacity_);
+  std::unique_ptr<char[]> data(new char[capacity]);
+  std::memcpy(data.get(), data_.get(), size_);
+  data_ = std::move(data);
+  capacity_ = capacity;
+}
+
+/**
+ * @brief Append a character written to the stream.
+ *
+ */
+LogBuffer::StreamBuf::int_type LogBuffer::StreamBuf::overflow(int_type c) {
+  if (!traits_type::eq_int_type(c, traits_type::eof())) {
+    buffer_->Append(traits_type::to_char_type(c));
+  }
+  return traits_type::not_eof(c);
+}
+
+/**
+ * @brief Append characters written to the stream.
+ *
+ */
+std::streamsize LogBuffer::StreamBuf::xsputn(const char* s,
+                                             std::streamsize n) {
+  buffer_->Append(std::string_view(s, static_cast<size_t>(n)));
+  return n;
+}
+
+/**
+ * @brief Take the next buffer of the calling thread's stack, or a temporary
+ * one if log calls are nested too deeply.
+ *
+ */
+ScopedLogBuffer::ScopedLogBuffer() {
+  LogBufferStack& stack = tls_log_buffers;
+  if (stack.depth < kLogBufferStackDepth) {
+    std::unique_ptr<LogBuffer>& buffer = stack.buffers[stack.depth];
+    if (buffer == nullptr) {
+      buffer = std::make_unique<LogBuffer>();
+    }
+    buffer_ = buffer.get();
+  } else {
+    overflow_ = std::make_unique<LogBuffer>();
+    buffer_ = overflow_.get();
+  }
+  stack.depth++;
+  buffer_->Clear();
+}
+
+/**
+ * @brief Return the buffer to the stack.
+ *
+ */
+ScopedLogBuffer::~ScopedLogBuffer() { tls_log_buffers.depth--; }
+}  // namespace rtb_h
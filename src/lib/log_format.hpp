@@ -0,0 +1,252 @@
+// @file      log_format.hpp
+// @author    Roger Davies     [rdavies3000@gmail.com]
+//
+// Copyright (c) 2022 Roger Davies, all rights reserved
+#pragma once
+
+#include <charconv>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+namespace rtb_h {
+/**
+ * @brief Character buffer that log lines are formatted into. It grows when a
+ * line does not fit but never shrinks, so once a thread has logged its
+ * longest line formatting does not allocate any more.
+ *
+ */
+class LogBuffer {
+ public:
+  static constexpr size_t kInitialCapacity = 1024;
+
+  LogBuffer();
+
+  void Clear() { size_ = 0; }
+  void Append(std::string_view text) {
+    char* dst = Reserve(text.size());
+    std::memcpy(dst, text.data(), text.size());
+    size_ += text.size();
+  }
+  void Append(char c) {
+    *Reserve(1) = c;
+    size_++;
+  }
+
+  // Get space for at least n characters at the end of the buffer, then call
+  // Commit() with the number of characters written to it.
+  char* Reserve(size_t n) {
+    if (capacity_ - size_ < n) {
+      Grow(size_ + n);
+    }
+    return data_.get() + size_;
+  }
+  void Commit(size_t n) { size_ += n; }
+
+  [[nodiscard]] std::string_view View() const { return {data_.get(), size_}; }
+  [[nodiscard]] std::ostream& Stream();
+
+  LogBuffer(const LogBuffer&) = delete;
+  LogBuffer& operator=(const LogBuffer&) = delete;
+  LogBuffer(const LogBuffer&&) = delete;
+  LogBuffer& operator=(const LogBuffer&&) = delete;
+
+ private:
+  // Stream buffer that appends to the LogBuffer, used for types that are only
+  // printable with operator<<.
+  class StreamBuf : public std::streambuf {
+   public:
+    explicit StreamBuf(LogBuffer* buffer) : buffer_(buffer) {}
+
+   protected:
+    int_type overflow(int_type c) override;
+    std::streamsize xsputn(const char* s, std::streamsize n) override;
+
+   private:
+    LogBuffer* buffer_;
+  };
+
+  std::unique_ptr<char[]> data_;
+  size_t size_{0};
+  size_t capacity_{0};
+  StreamBuf streambuf_;
+  std::ostream stream_;
+
+  void Grow(size_t min_capacity);
+};
+
+/**
+ * @brief Lends the calling thread a cleared LogBuffer for the lifetime of the
+ * object. Every thread keeps a small stack of buffers so that a value whose
+ * formatting logs itself does not overwrite the outer line.
+ *
+ */
+class ScopedLogBuffer {
+ public:
+  ScopedLogBuffer();
+  ~ScopedLogBuffer();
+
+  LogBuffer& operator*() const { return *buffer_; }
+  LogBuffer* operator->() const { return buffer_; }
+
+  ScopedLogBuffer(const ScopedLogBuffer&) = delete;
+  ScopedLogBuffer& operator=(const ScopedLogBuffer&) = delete;
+  ScopedLogBuffer(const ScopedLogBuffer&&) = delete;
+  ScopedLogBuffer& operator=(const ScopedLogBuffer&&) = delete;
+
+ private:
+  LogBuffer* buffer_;
+  std::unique_ptr<LogBuffer> overflow_;
+};
+
+// Character types are printed as characters, like std::ostream does.
+template <typename T>
+constexpr bool kIsCharacter =
+    std::is_same_v<T, char> || std::is_same_v<T, signed char> ||
+    std::is_same_v<T, unsigned char> || std::is_same_v<T, wchar_t> ||
+    std::is_same_v<T, char16_t> || std::is_same_v<T, char32_t>;
+
+template <typename T, typename = void>
+struct IsStreamable : std::false_type {};
+
+template <typename T>
+struct IsStreamable<T, std::void_t<decltype(std::declval<std::ostream&>()
+                                            << std::declval<const T&>())>>
+    : std::true_type {};
+}  // namespace rtb_h
+
+namespace rtb {
+template <typename F>
+class LazyLogValue;
+}  // namespace rtb
+
+namespace rtb_h {
+template <typename T>
+constexpr bool kIsLazyLogValue = false;
+
+template <typename F>
+constexpr bool kIsLazyLogValue<rtb::LazyLogValue<F>> = true;
+}  // namespace rtb_h
+
+namespace rtb {
+/**
+ * @brief Customisation point that appends a value to a log line. It is
+ * specialised for arithmetic and string types; any other type is printed
+ * with its operator<<. Specialise it to log a user type without going
+ * through std::ostream:
+ *
+ *   template <>
+ *   struct rtb::LogFormatter<Point> {
+ *     static void Format(const Point& p, rtb_h::LogBuffer* buffer) { ... }
+ *   };
+ *
+ */
+template <typename T, typename Enable = void>
+struct LogFormatter {
+  static void Format(const T& value, rtb_h::LogBuffer* buffer) {
+    static_assert(rtb_h::IsStreamable<T>::value,
+                  "Specialise rtb::LogFormatter or implement operator<<");
+    buffer->Stream() << value;
+  }
+};
+
+template <typename T>
+struct LogFormatter<
+    T, std::enable_if_t<std::is_integral_v<T> && !rtb_h::kIsCharacter<T> &&
+                        !std::is_same_v<T, bool>>> {
+  static void Format(const T& value, rtb_h::LogBuffer* buffer) {
+    // Enough for any 64-bit integer with sign.
+    char* first = buffer->Reserve(24);
+    const auto result = std::to_chars(first, first + 24, value);
+    buffer->Commit(result.ptr - first);
+  }
+};
+
+template <typename T>
+struct LogFormatter<T, std::enable_if_t<std::is_floating_point_v<T>>> {
+  static void Format(const T& value, rtb_h::LogBuffer* buffer) {
+    // The same output as std::ostream with its default precision of 6.
+    char* first = buffer->Reserve(32);
+    const auto result =
+        std::to_chars(first, first + 32, value, std::chars_format::general, 6);
+    buffer->Commit(result.ptr - first);
+  }
+};
+
+template <>
+struct LogFormatter<bool> {
+  static void Format(bool value, rtb_h::LogBuffer* buffer) {
+    buffer->Append(value ? '1' : '0');
+  }
+};
+
+template <>
+struct LogFormatter<char> {
+  static void Format(char value, rtb_h::LogBuffer* buffer) {
+    buffer->Append(value);
+  }
+};
+
+template <typename T>
+struct LogFormatter<
+    T, std::enable_if_t<std::is_convertible_v<const T&, std::string_view>>> {
+  static void Format(const T& value, rtb_h::LogBuffer* buffer) {
+    buffer->Append(std::string_view(value));
+  }
+};
+
+/**
+ * @brief Append a value to a log line with its LogFormatter.
+ *
+ * @param value   The value.
+ * @param buffer  The log line.
+ */
+template <typename T>
+void FormatLogValue(const T& value, rtb_h::LogBuffer* buffer) {
+  // Arrays decay to pointers to const, other types lose their const.
+  LogFormatter<std::decay_t<const T>>::Format(value, buffer);
+}
+
+/**
+ * @brief A log value computed by a callable when the line is formatted,
+ * i.e. only when the message is enabled and goes to a sink that does not
+ * discard it. The callable may run once per line format, text and JSON,
+ * when both kinds of sinks take the message.
+ *
+ */
+template <typename F>
+class LazyLogValue {
+ public:
+  explicit LazyLogValue(F function) : function_(std::move(function)) {}
+
+  decltype(auto) operator()() const { return function_(); }
+
+ private:
+  F function_;
+};
+
+/**
+ * @brief Wrap a callable returning a loggable value, e.g.
+ * Logger::LogInfo(rtb::Lazy([&]() { return ToString(m); }), "state").
+ *
+ * @param function          The callable.
+ * @return LazyLogValue<F>  The log value.
+ */
+template <typename F>
+LazyLogValue<F> Lazy(F function) {
+  return LazyLogValue<F>(std::move(function));
+}
+
+template <typename F>
+struct LogFormatter<LazyLogValue<F>> {
+  static void Format(const LazyLogValue<F>& value, rtb_h::LogBuffer* buffer) {
+    FormatLogValue(value(), buffer);
+  }
+};
+}  // namespace rtb
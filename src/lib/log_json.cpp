@@ -0,0 +1,129 @@
+// @file      log_json.cpp
+// @author    Roger Davies     [rdavies3000@gmail.com]
+//
+// Copyright (c) 2022 Roger Davies, all rights reserved
+
+#include "log_json.hpp"
+
+#include <cstdint>
+#include <cstring>
+
+namespace rtb_h {
+/**
+ * @brief Whether a character has to be escaped in a JSON string.
+ *
+ */
+inline bool NeedsJsonEscape(char c) {
+  const auto u = static_cast<unsigned char>(c);
+  return u < 0x20 || u == '"' || u == '\\';
+}
+
+/**
+ * @brief Get the length of the prefix of a text that needs no escaping. Eight
+ * characters are tested at a time: a byte is flagged if it is below 0x20 or
+ * equal to '"' or '\\' (SWAR zero byte tests).
+ *
+ * @param text      The text.
+ * @return size_t   The length of the prefix.
+ */
+size_t CleanJsonPrefix(std::string_view text) {
+  constexpr uint64_t kOnes = 0x0101010101010101ULL;
+  constexpr uint64_t kHighBits = 0x8080808080808080ULL;
+  size_t i = 0;
+  for (; i + 8 <= text.size(); i += 8) {
+    uint64_t word = 0;
+    std::memcpy(&word, text.data() + i, sizeof(word));
+    const uint64_t quote = word ^ (kOnes * '"');
+    const uint64_t backslash = word ^ (kOnes * '\\');
+    const uint64_t flagged = ((word - kOnes * 0x20) & ~word) |
+                             ((quote - kOnes) & ~quote) |
+                             ((backslash - kOnes) & ~backslash);
+    if ((flagged & kHighBits) != 0) {
+      break;
+    }
+  }
+  while (i < text.size() && !NeedsJsonEscape(text[i])) {
+    i++;
+  }
+  return i;
+}
+
+/**
+ * @brief Append a quoted JSON string, escaping quotes, backslashes and
+ * control characters. Text that needs no escaping, the common case, is
+ * copied with a single memcpy.
+ *
+ * @param text    The text, UTF-8.
+ * @param buffer  The log line.
+ */
+void AppendJsonString(std::string_view text, LogBuffer* buffer) {
+  const size_t clean = CleanJsonPrefix(text);
+  char* dst = buffer->Reserve(text.size() + 2);
+  dst[0] = '"';
+  std::memcpy(dst + 1, text.data(), clean);
+  buffer->Commit(clean + 1);
+  if (clean == text.size()) {
+    buffer->Append('"');
+    return;
+  }
+
+  static const char kHex[] = "0123456789abcdef";
+  size_t run = clean;
+  for (size_t i = clean; i < text.size(); i++) {
+    const auto c = static_cast<unsigned char>(text[i]);
+    if (!NeedsJsonEscape(text[i])) {
+      continue;
+    }
+    buffer->Append(text.substr(run, i - run));
+    run = i + 1;
+    switch (c) {
+      case '"':
+        buffer->Append("\\\"");
+        break;
+      case '\\':
+        buffer->Append("\\\\");
+        break;
+      case '\n':
+        buffer->Append("\\n");
+        break;
+      case '\r':
+        buffer->Append("\\r");
+        break;
+      case '\t':
+        buffer->Append("\\t");
+        break;
+      default: {
+        char escape[] = {'\\', 'u', '0', '0', kHex[c >> 4U], kHex[c & 0xfU]};
+        buffer->Append(std::string_view(escape, sizeof(escape)));
+        break;
+      }
+    }
+  }
+  buffer->Append(text.substr(run));
+  buffer->Append('"');
+}
+
+/**
+ * @brief Get the name of a message type as written to structured logs.
+ *
+ * @param type              The message type.
+ * @return std::string_view The name.
+ */
+std::string_view MessageTypeName(MessageType type) {
+  switch (type) {
+    case kTrace:
+      return "trace";
+    case kDebug:
+      return "debug";
+    case kInfo:
+      return "info";
+    case kWarning:
+      return "warning";
+    case kError:
+      return "error";
+    case kFatal:
+      return "fatal";
+  }
+  return "info";
+}
+}  // namespace rtb_h
@@ -0,0 +1,103 @@
+// @file      log_json.hpp
+// @author    Roger Davies     [rdavies3000@gmail.com]
+//
+// Copyright (c) 2022 Roger Davies, all rights reserved
+#pragma once
+
+#include <charconv>
+#include <cmath>
+#include <string_view>
+#include <type_traits>
+
+#include "log_format.hpp"
+#include "log_level.hpp"
+
+namespace rtb {
+/**
+ * @brief A named value of a structured log message. It refers to the value,
+ * so it must not outlive the log call; create it with rtb::Field().
+ *
+ */
+template <typename T>
+struct LogField {
+  std::string_view key;
+  const T& value;
+};
+
+template <typename T>
+LogField<T> Field(std::string_view key, const T& value) {
+  return {key, value};
+}
+}  // namespace rtb
+
+namespace rtb_h {
+void AppendJsonString(std::string_view text, LogBuffer* buffer);
+std::string_view MessageTypeName(MessageType type);
+
+/**
+ * @brief Append a value as JSON: numbers and booleans as such, strings and
+ * characters as escaped strings, non-finite numbers as null and any other
+ * type as the string its rtb::LogFormatter produces.
+ *
+ * @param value   The value.
+ * @param buffer  The log line.
+ */
+template <typename T>
+void AppendJsonValue(const T& value, LogBuffer* buffer) {
+  using U = std::decay_t<const T>;
+  if constexpr (kIsLazyLogValue<U>) {
+    AppendJsonValue(value(), buffer);
+  } else if constexpr (std::is_same_v<U, bool>) {
+    buffer->Append(value ? std::string_view("true")
+                         : std::string_view("false"));
+  } else if constexpr (std::is_integral_v<U> && !kIsCharacter<U>) {
+    rtb::FormatLogValue(value, buffer);
+  } else if constexpr (std::is_floating_point_v<U>) {
+    if (!std::isfinite(value)) {
+      buffer->Append("null");
+      return;
+    }
+    // The shortest representation that reads back as the same value.
+    char* first = buffer->Reserve(32);
+    const auto result = std::to_chars(first, first + 32, value);
+    buffer->Commit(result.ptr - first);
+  } else if constexpr (std::is_same_v<U, char>) {
+    AppendJsonString(std::string_view(&value, 1), buffer);
+  } else if constexpr (std::is_convertible_v<const T&, std::string_view>) {
+    AppendJsonString(std::string_view(value), buffer);
+  } else {
+    ScopedLogBuffer text;
+    rtb::FormatLogValue(value, &*text);
+    AppendJsonString(text->View(), buffer);
+  }
+}
+
+/**
+ * @brief Append a field as a JSON member, preceded by a comma.
+ *
+ * @param field   The field.
+ * @param buffer  The log line.
+ */
+template <typename T>
+void AppendJsonField(const rtb::LogField<T>& field, LogBuffer* buffer) {
+  buffer->Append(',');
+  AppendJsonString(field.key, buffer);
+  buffer->Append(':');
+  AppendJsonValue(field.value, buffer);
+}
+
+/**
+ * @brief Append a field as key=value for text log lines, preceded by a
+ * space.
+ *
+ * @param field   The field.
+ * @param buffer  The log line.
+ */
+template <typename T>
+void AppendTextField(const rtb::LogField<T>& field, LogBuffer* buffer) {
+  buffer->Append(' ');
+  buffer->Append(field.key);
+  buffer->Append('=');
+  rtb::FormatLogValue(field.value, buffer);
+}
+}  // namespace rtb_h
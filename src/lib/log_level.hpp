@@ -0,0 +1,50 @@
+// @file      log_level.hpp
+// @author    Roger Davies     [rdavies3000@gmail.com]
+//
+// Copyright (c) 2022 Roger Davies, all rights reserved
+#pragma once
+
+#include <atomic>
+
+//  Severity levels for RTB_MIN_LOG_LEVEL, in increasing order.
+#define RTB_LOG_LEVEL_TRACE 0
+#define RTB_LOG_LEVEL_DEBUG 1
+#define RTB_LOG_LEVEL_INFO 2
+#define RTB_LOG_LEVEL_WARNING 3
+#define RTB_LOG_LEVEL_ERROR 4
+#define RTB_LOG_LEVEL_FATAL 5
+#define RTB_LOG_LEVEL_OFF 6
+
+//  Log calls made through the RTB_LOG macros below this level are removed at
+//  compile time, e.g. -DRTB_MIN_LOG_LEVEL=RTB_LOG_LEVEL_INFO.
+#ifndef RTB_MIN_LOG_LEVEL
+#define RTB_MIN_LOG_LEVEL RTB_LOG_LEVEL_TRACE
+#endif
+
+namespace rtb_h {
+enum MessageType {
+  kTrace = RTB_LOG_LEVEL_TRACE,
+  kDebug = RTB_LOG_LEVEL_DEBUG,
+  kInfo = RTB_LOG_LEVEL_INFO,
+  kWarning = RTB_LOG_LEVEL_WARNING,
+  kError = RTB_LOG_LEVEL_ERROR,
+  kFatal = RTB_LOG_LEVEL_FATAL
+};
+
+constexpr int kMessageTypeCount = kFatal + 1;
+
+// The runtime minimum level, shared by all loggers.
+inline std::atomic<int> g_log_level{kInfo};
+
+/**
+ * @brief Test whether messages of a type are logged, both at compile time
+ * and at runtime.
+ *
+ * @param type    The message type.
+ * @return true   The message type is enabled.
+ */
+inline bool LogLevelEnabled(MessageType type) {
+  return type >= RTB_MIN_LOG_LEVEL &&
+         type >= g_log_level.load(std::memory_order_relaxed);
+}
+}  // namespace rtb_h
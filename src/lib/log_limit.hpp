@@ -0,0 +1,144 @@
+// @file      log_limit.hpp
+// @author    Roger Davies     [rdavies3000@gmail.com]
+//
+// Copyright (c) 2022 Roger Davies, all rights reserved
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string_view>
+
+namespace rtb_h {
+/**
+ * @brief Per call site token bucket, implemented as a generic cell rate
+ * algorithm on a single atomic: a call is allowed if it is not earlier than
+ * the theoretical arrival time minus the burst tolerance. Constant
+ * initialised when the arguments are constants. Rates below one call an
+ * hour, including zero, negative and NaN rates, are raised to it.
+ *
+ */
+class LogRateLimiter {
+ public:
+  static constexpr double kMinPerSecond = 1.0 / 3600;
+
+  constexpr LogRateLimiter(double per_second, uint32_t burst)
+      : interval_ns_(static_cast<int64_t>(
+            1e9 / (per_second > kMinPerSecond ? per_second : kMinPerSecond))),
+        tolerance_ns_(interval_ns_ * (burst > 0 ? burst - 1 : 0)) {}
+
+  /**
+   * @brief Take a token.
+   *
+   * @param suppressed  Receives the number of calls refused since the last
+   *                    allowed one.
+   * @return true       The call may log.
+   */
+  bool Allow(uint64_t* suppressed) {
+    const int64_t now =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+    int64_t tat = tat_.load(std::memory_order_relaxed);
+    do {
+      if (now < tat - tolerance_ns_) {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        return false;
+      }
+    } while (!tat_.compare_exchange_weak(
+        tat, (tat > now ? tat : now) + interval_ns_,
+        std::memory_order_relaxed));
+    *suppressed = dropped_.load(std::memory_order_relaxed) > 0
+                      ? dropped_.exchange(0, std::memory_order_relaxed)
+                      : 0;
+    return true;
+  }
+
+ private:
+  int64_t interval_ns_;
+  int64_t tolerance_ns_;
+  std::atomic<int64_t> tat_{0};
+  std::atomic<uint64_t> dropped_{0};
+};
+
+/**
+ * @brief Per call site 1-in-N sampler. The first call and every Nth after it
+ * are allowed.
+ *
+ */
+class LogSampler {
+ public:
+  constexpr explicit LogSampler(uint64_t n) : n_(n > 0 ? n : 1) {}
+
+  bool Sample() {
+    return count_.fetch_add(1, std::memory_order_relaxed) % n_ == 0;
+  }
+
+ private:
+  uint64_t n_;
+  std::atomic<uint64_t> count_{0};
+};
+
+/**
+ * @brief Per call site detector of repeated messages. It remembers a hash of
+ * the last message text and counts consecutive repeats of it. The count is
+ * reported when a different message follows, and while the message keeps
+ * repeating once max_repeats have accumulated or interval has passed since
+ * the last report, so a message that repeats forever is not silenced.
+ * Threads that log different messages from one site at the same time may
+ * see the counts shift between messages, but none is lost.
+ *
+ */
+class LogDeduplicator {
+ public:
+  constexpr explicit LogDeduplicator(
+      std::chrono::nanoseconds interval = std::chrono::seconds(10),
+      uint64_t max_repeats = 1000)
+      : interval_ns_(interval.count()),
+        max_repeats_(max_repeats > 0 ? max_repeats : 1) {}
+
+  /**
+   * @brief Check a message.
+   *
+   * @param text      The message text, without prefix and timestamp.
+   * @param repeats   Receives how often the previous message was repeated
+   *                  if that is to be reported now, else zero.
+   * @return true     The message differs from the previous one.
+   */
+  bool Check(std::string_view text, uint64_t* repeats) {
+    // FNV-1a.
+    uint64_t hash = 14695981039346656037ULL;
+    for (const char c : text) {
+      hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ULL;
+    }
+    const int64_t now =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+    if (last_hash_.load(std::memory_order_relaxed) == hash ||
+        last_hash_.exchange(hash, std::memory_order_relaxed) == hash) {
+      const uint64_t count =
+          repeats_.fetch_add(1, std::memory_order_relaxed) + 1;
+      // One of the threads crossing a threshold together reports.
+      int64_t last = last_report_.load(std::memory_order_relaxed);
+      if ((count >= max_repeats_ || now - last >= interval_ns_) &&
+          last_report_.compare_exchange_strong(last, now,
+                                               std::memory_order_relaxed)) {
+        *repeats = repeats_.exchange(0, std::memory_order_relaxed);
+      }
+      return false;
+    }
+    last_report_.store(now, std::memory_order_relaxed);
+    *repeats = repeats_.exchange(0, std::memory_order_relaxed);
+    return true;
+  }
+
+ private:
+  int64_t interval_ns_;
+  uint64_t max_repeats_;
+  std::atomic<uint64_t> last_hash_{0};
+  std::atomic<uint64_t> repeats_{0};
+  // When the last line of the site was logged or its repeats reported.
+  std::atomic<int64_t> last_report_{0};
+};
+}  // namespace rtb_h
@@ -0,0 +1,193 @@
+// @file      log_rotation.cpp
+// @author    Roger Davies     [rdavies3000@gmail.com]
+//
+// Copyright (c) 2022 Roger Davies, all rights reserved
+
+#include "log_rotation.hpp"
+
+#include <array>
+#include <cstdio>
+#include <filesystem>
+#include <iostream>
+#include <system_error>
+#include <utility>
+
+#ifdef RTB_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+namespace rtb_h {
+/**
+ * @brief Get the path of a rotated generation.
+ *
+ * @param file        The rotated file.
+ * @param generation  The generation, 1 is the newest.
+ * @param compressed  Whether the generation is gzipped.
+ * @return std::string
+ */
+std::string GenerationPath(const RotatedLogFile& file, size_t generation,
+                           bool compressed) {
+  std::string path = file.base_path + "." + std::to_string(generation);
+  if (compressed) {
+    path += ".gz";
+  }
+  return path;
+}
+
+/**
+ * @brief Gzip a file.
+ *
+ * @param source      The file to compress.
+ * @param destination The compressed file.
+ * @return true       The file was compressed.
+ */
+bool CompressFile(const std::string& source, const std::string& destination) {
+#ifdef RTB_HAVE_ZLIB
+  FILE* in = std::fopen(source.c_str(), "rb");
+  if (in == nullptr) {
+    return false;
+  }
+  gzFile out = gzopen(destination.c_str(), "wb");
+  if (out == nullptr) {
+    std::fclose(in);
+    return false;
+  }
+  std::array<char, 64 * 1024> buffer{};
+  bool ok = true;
+  size_t n = 0;
+  while (ok && (n = std::fread(buffer.data(), 1, buffer.size(), in)) > 0) {
+    ok = gzwrite(out, buffer.data(), static_cast<unsigned>(n)) ==
+         static_cast<int>(n);
+  }
+  ok = ok && std::ferror(in) == 0;
+  std::fclose(in);
+  return gzclose(out) == Z_OK && ok;
+#else
+  (void)source;
+  (void)destination;
+  return false;
+#endif
+}
+
+/**
+ * @brief Make a rotated file the newest generation, renumbering and deleting
+ * the older ones.
+ *
+ * @param file The rotated file.
+ */
+void FileGeneration(const RotatedLogFile& file) {
+  namespace fs = std::filesystem;
+  std::error_code error;
+  if (file.max_files == 0) {
+    fs::remove(file.path, error);
+    return;
+  }
+
+  for (const bool compressed : {false, true}) {
+    fs::remove(GenerationPath(file, file.max_files, compressed), error);
+    for (size_t generation = file.max_files - 1; generation > 0;
+         generation--) {
+      const std::string from = GenerationPath(file, generation, compressed);
+      if (fs::exists(from, error)) {
+        fs::rename(from, GenerationPath(file, generation + 1, compressed),
+                   error);
+      }
+    }
+  }
+
+  if (file.compress && LogCompressionAvailable()) {
+    // Compress next to the destination and rename, so a partially written
+    // generation is never visible.
+    const std::string destination = GenerationPath(file, 1, true);
+    const std::string partial = destination + ".tmp";
+    if (CompressFile(file.path, partial)) {
+      fs::rename(partial, destination, error);
+      if (!error) {
+        fs::remove(file.path, error);
+        return;
+      }
+    }
+    fs::remove(partial, error);
+    std::cerr << "Error compressing log file " << file.path << std::endl;
+  }
+  fs::rename(file.path, GenerationPath(file, 1, false), error);
+}
+
+/**
+ * @brief Whether rotated log files can be compressed, i.e. the library was
+ * built with zlib.
+ *
+ */
+bool LogCompressionAvailable() {
+#ifdef RTB_HAVE_ZLIB
+  return true;
+#else
+  return false;
+#endif
+}
+
+/**
+ * @brief Construct a new LogRotator object and start its thread.
+ *
+ */
+LogRotator::LogRotator() : thread_(&LogRotator::Run, this) {}
+
+/**
+ * @brief Destroy the LogRotator object after handling the queued files.
+ *
+ */
+LogRotator::~LogRotator() {
+  {
+    const std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  work_cv_.notify_one();
+  thread_.join();
+}
+
+/**
+ * @brief Queue a rotated file.
+ *
+ * @param file The rotated file.
+ */
+void LogRotator::Enqueue(RotatedLogFile&& file) {
+  {
+    const std::lock_guard<std::mutex> lock(mutex_);
+    queue_.push_back(std::move(file));
+  }
+  work_cv_.notify_one();
+}
+
+/**
+ * @brief Wait until every queued file has been handled.
+ *
+ */
+void LogRotator::Wait() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  idle_cv_.wait(lock, [this]() { return queue_.empty() && !busy_; });
+}
+
+/**
+ * @brief The rotator thread loop.
+ *
+ */
+void LogRotator::Run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    work_cv_.wait(lock, [this]() { return stop_ || !queue_.empty(); });
+    if (queue_.empty()) {
+      break;
+    }
+    RotatedLogFile file = std::move(queue_.front());
+    queue_.pop_front();
+    busy_ = true;
+    lock.unlock();
+    FileGeneration(file);
+    lock.lock();
+    busy_ = false;
+    if (queue_.empty()) {
+      idle_cv_.notify_all();
+    }
+  }
+}
+}  // namespace rtb_h
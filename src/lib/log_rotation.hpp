@@ -0,0 +1,60 @@
+// @file      log_rotation.hpp
+// @author    Roger Davies     [rdavies3000@gmail.com]
+//
+// Copyright (c) 2022 Roger Davies, all rights reserved
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace rtb_h {
+/**
+ * @brief A log file that has been moved aside by a rotation.
+ *
+ */
+struct RotatedLogFile {
+  std::string path;       // Where the file was moved to.
+  std::string base_path;  // The path of the log file.
+  size_t max_files;       // Rotated generations to keep.
+  bool compress;          // Whether to gzip the newest generation.
+};
+
+/**
+ * @brief Files rotated log files into their generations on a background
+ * thread. The newest generation is base_path.1, or base_path.1.gz when
+ * compressed; older generations are renumbered and those beyond max_files
+ * are deleted. Jobs are handled in the order they were queued, so only this
+ * thread touches the generations. The destructor finishes the queued jobs.
+ *
+ */
+class LogRotator {
+ public:
+  LogRotator();
+  ~LogRotator();
+
+  void Enqueue(RotatedLogFile&& file);
+  void Wait();
+
+  LogRotator(const LogRotator&) = delete;
+  LogRotator& operator=(const LogRotator&) = delete;
+  LogRotator(const LogRotator&&) = delete;
+  LogRotator& operator=(const LogRotator&&) = delete;
+
+ private:
+  std::deque<RotatedLogFile> queue_;
+  bool busy_{false};
+  bool stop_{false};
+  std::mutex mutex_;
+  std::condition_variable work_cv_;
+  std::condition_variable idle_cv_;
+  std::thread thread_;
+
+  void Run();
+};
+
+bool LogCompressionAvailable();
+}  // namespace rtb_h
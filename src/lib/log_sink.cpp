@@ -5,84 +5,223 @@
 
 #include "log_sink.hpp"
 
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstring>
 #include <utility>
 
+#include "log_rotation.hpp"
+
 namespace rtb_h {
 // Message text colour escape sequences.
-const std::string kTextColorRed{"\033[0;31m"};
-const std::string kTextColorYellow{"\033[0;33m"};
-const std::string kTextColorReset{"\033[0m"};
+const std::string_view kTextColorRed{"\033[0;31m"};
+const std::string_view kTextColorYellow{"\033[0;33m"};
+const std::string_view kTextColorReset{"\033[0m"};
 
 /**
- * @brief Log a message to stdout.
+ * @brief Write a list of buffers to a file descriptor, retrying after short
+ * writes and interruptions.
  *
- * @param message       The message.
- * @param message_type  The message type.
+ * @param fd      The file descriptor.
+ * @param iov     The buffers, modified.
+ * @param count   The number of buffers.
+ * @return true   Everything was written.
  */
-void LogSinkCout::Log(const std::string& message,
-                      const MessageType message_type) {
-  switch (message_type) {
-    case kError:
-      std::cout << kTextColorRed + message + kTextColorReset << std::endl;
-      break;
-    case kWarning:
-      std::cout << kTextColorYellow + message + kTextColorReset << std::endl;
-      break;
-    case kInfo:
-      std::cout << message << std::endl;
-      break;
+bool WriteVector(int fd, iovec* iov, int count) {
+  while (count > 0) {
+    const ssize_t written = ::writev(fd, iov, count);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    auto remaining = static_cast<size_t>(written);
+    while (count > 0 && remaining >= iov->iov_len) {
+      remaining -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0) {
+      iov->iov_base = static_cast<char*>(iov->iov_base) + remaining;
+      iov->iov_len -= remaining;
+    }
   }
+  return true;
 }
 
 /**
- * @brief Log a message to stderr.
+ * @brief Construct a new LogSinkConsole object.
+ *
+ * @param fd The file descriptor, usually STDOUT_FILENO or STDERR_FILENO.
+ */
+LogSinkConsole::LogSinkConsole(int fd)
+    : fd_(fd),
+      interactive_(::isatty(fd) == 1),
+      last_write_(std::chrono::steady_clock::now()) {
+  if (!interactive_) {
+    buffer_ = std::make_unique<char[]>(kBufferSize);
+  }
+}
+
+/**
+ * @brief Destroy the LogSinkConsole object after writing the buffered lines.
+ *
+ */
+LogSinkConsole::~LogSinkConsole() { Flush(); }
+
+/**
+ * @brief Log a message to the console.
  *
  * @param message       The message.
  * @param message_type  The message type.
  */
-void LogSinkCerr::Log(const std::string& message,
-                      const MessageType message_type) {
-  switch (message_type) {
-    case kError:
-      std::cerr << kTextColorRed + message + kTextColorReset << std::endl;
-      break;
-    case kWarning:
-      std::cerr << kTextColorYellow + message + kTextColorReset << std::endl;
-      break;
-    case kInfo:
-      std::cerr << message << std::endl;
-      break;
+void LogSinkConsole::Log(std::string_view message,
+                         const MessageType message_type) {
+  if (interactive_) {
+    std::string_view color;
+    if (message_type >= kError) {
+      color = kTextColorRed;
+    } else if (message_type == kWarning) {
+      color = kTextColorYellow;
+    }
+    const std::string_view reset = color.empty() ? color : kTextColorReset;
+    std::array<iovec, 4> iov = {
+        {{const_cast<char*>(color.data()), color.size()},
+         {const_cast<char*>(message.data()), message.size()},
+         {const_cast<char*>(reset.data()), reset.size()},
+         {const_cast<char*>("\n"), 1}}};
+    WriteVector(fd_, iov.data(), static_cast<int>(iov.size()));
+    return;
+  }
+
+  const std::lock_guard<std::mutex> lock(mutex_);
+  if (kBufferSize - size_ < message.size() + 1) {
+    // Write the buffer and the line that does not fit in one call.
+    WriteBuffer(message);
+    return;
+  }
+  std::memcpy(buffer_.get() + size_, message.data(), message.size());
+  size_ += message.size();
+  buffer_[size_++] = '\n';
+  if (message_type >= kWarning ||
+      std::chrono::steady_clock::now() - last_write_ >= kFlushInterval) {
+    WriteBuffer({});
   }
 }
 
+/**
+ * @brief Write the buffered lines.
+ *
+ */
+void LogSinkConsole::Flush() {
+  if (!interactive_) {
+    const std::lock_guard<std::mutex> lock(mutex_);
+    WriteBuffer({});
+  }
+}
+
+/**
+ * @brief Write the buffer, followed by a line that did not fit in it. The
+ * mutex is held.
+ *
+ * @param message The line, or empty.
+ */
+void LogSinkConsole::WriteBuffer(std::string_view message) {
+  std::array<iovec, 3> iov = {
+      {{buffer_.get(), size_},
+       {const_cast<char*>(message.data()), message.size()},
+       {const_cast<char*>("\n"), message.empty() ? 0U : 1U}}};
+  // Output that cannot be written, e.g. to a closed pipe, is dropped.
+  WriteVector(fd_, iov.data(), static_cast<int>(iov.size()));
+  size_ = 0;
+  last_write_ = std::chrono::steady_clock::now();
+}
+
+/**
+ * @brief Construct a new LogSinkCout object.
+ *
+ */
+LogSinkCout::LogSinkCout() : LogSinkConsole(STDOUT_FILENO) {}
+
+/**
+ * @brief Construct a new LogSinkCerr object.
+ *
+ */
+LogSinkCerr::LogSinkCerr() : LogSinkConsole(STDERR_FILENO) {}
+
 /**
  * @brief Construct a new LogSinkFile object and open the log file.
  *
- * @param filepath
+ * @param filepath  The log file path.
+ * @param options   The buffering and flush policy.
  */
-LogSinkFile::LogSinkFile(std::string filepath)
-    : filepath_(std::move(filepath)) {
+LogSinkFile::LogSinkFile(std::string filepath,
+                         const rtb::FileSinkOptions& options)
+    : filepath_(std::move(filepath)),
+      options_(options),
+      buffer_(new char[options.buffer_size]),
+      last_write_(std::chrono::steady_clock::now()) {
   OpenLogFile();
 }
 
 /**
- * @brief Destroy the LogSinkFile object and clode the log file.
- * 
+ * @brief Destroy the LogSinkFile object, writing any buffered lines and
+ * closing the log file.
+ *
  */
-LogSinkFile::~LogSinkFile() {
-  if (fs_.is_open()) {
-    fs_.close();
-  }
-}
+LogSinkFile::~LogSinkFile() { CloseLogFile(); }
 
 /**
- * @brief Log a message to the log file.
+ * @brief Log a message to the log file. The line is buffered unless the
+ * flush policy says it has to be written now.
  *
  * @param message       The message.
  * @param message_type  The message type.
  */
-void LogSinkFile::Log(const std::string& message, const MessageType) {
-  fs_ << message << std::endl;
+void LogSinkFile::Log(std::string_view message,
+                      const MessageType message_type) {
+  const std::lock_guard<std::mutex> lock(mutex_);
+  RotateIfDue(message.size() + 1);
+  if (fd_ < 0) {
+    return;
+  }
+  file_size_ += message.size() + 1;
+  const bool urgent = message_type >= options_.flush_level;
+  const bool sync =
+      options_.sync == rtb::FileSyncPolicy::kEveryFlush ||
+      (urgent && options_.sync == rtb::FileSyncPolicy::kOnSeverity);
+  if (options_.buffer_size - size_ < message.size() + 1) {
+    // Write the buffer and the line that does not fit in one call.
+    WriteBuffer(message, sync);
+    return;
+  }
+
+  std::memcpy(buffer_.get() + size_, message.data(), message.size());
+  size_ += message.size();
+  buffer_[size_++] = '\n';
+  if (urgent || std::chrono::steady_clock::now() - last_write_ >=
+                    options_.flush_interval) {
+    WriteBuffer({}, sync);
+  }
+}
+
+/**
+ * @brief Write the buffered lines to the log file.
+ *
+ */
+void LogSinkFile::Flush() {
+  const std::lock_guard<std::mutex> lock(mutex_);
+  if (fd_ >= 0) {
+    WriteBuffer({}, options_.sync == rtb::FileSyncPolicy::kEveryFlush);
+  }
 }
 
 /**
@@ -91,6 +230,7 @@ void LogSinkFile::Log(const std::string& message, const MessageType) {
  * @param filepath 
  */
 void LogSinkFile::SetFilePath(const std::string& filepath) {
+  const std::lock_guard<std::mutex> lock(mutex_);
   if (filepath != filepath_) {
     filepath_ = filepath;
     OpenLogFile();
@@ -98,16 +238,333 @@ void LogSinkFile::SetFilePath(const std::string& filepath) {
 }
 
 /**
- * @brief Open the log file.
- * 
+ * @brief Change the buffering and flush policy. Buffered lines are written
+ * first.
+ *
+ * @param options The new policy.
+ */
+void LogSinkFile::SetOptions(const rtb::FileSinkOptions& options) {
+  const std::lock_guard<std::mutex> lock(mutex_);
+  if (fd_ >= 0) {
+    WriteBuffer({}, false);
+  }
+  if (options.buffer_size != options_.buffer_size) {
+    buffer_.reset(new char[options.buffer_size]);
+  }
+  options_ = options;
+  ScheduleRotation();
+}
+
+/**
+ * @brief Open the log file, closing the current one.
+ *
+ * @param append  Append to an existing file instead of truncating it.
+ */
+void LogSinkFile::OpenLogFile(bool append) {
+  CloseLogFile();
+  fd_ = ::open(filepath_.c_str(),
+               O_WRONLY | O_CREAT | O_CLOEXEC | (append ? O_APPEND : O_TRUNC),
+               0644);
+  if (fd_ < 0) {
+    std::cerr << "Error opening log file " << filepath_ << std::endl;
+  }
+  last_write_ = std::chrono::steady_clock::now();
+  // Appending continues a file that counts towards the rotation size.
+  const off_t end = append && fd_ >= 0 ? ::lseek(fd_, 0, SEEK_END) : 0;
+  file_size_ = end > 0 ? static_cast<size_t>(end) : 0;
+  ScheduleRotation();
+}
+
+/**
+ * @brief Set the time of the next rotation to the next multiple of the
+ * rotation interval.
+ *
+ */
+void LogSinkFile::ScheduleRotation() {
+  if (options_.rotate_interval.count() > 0) {
+    const auto interval = std::chrono::duration_cast<
+        std::chrono::system_clock::duration>(options_.rotate_interval);
+    const auto now = std::chrono::system_clock::now().time_since_epoch();
+    next_rotation_ = std::chrono::system_clock::time_point(
+        (now / interval + 1) * interval);
+  }
+}
+
+/**
+ * @brief Rotate the log file if a line of the given length would make it
+ * larger than the rotation size, or a rotation time has been reached.
+ *
+ * @param length The length of the next line.
+ */
+void LogSinkFile::RotateIfDue(size_t length) {
+  if (fd_ < 0) {
+    return;
+  }
+  const bool full = options_.rotate_size > 0 &&
+                    file_size_ + length > options_.rotate_size;
+  const bool due = options_.rotate_interval.count() > 0 &&
+                   std::chrono::system_clock::now() >= next_rotation_;
+  if (file_size_ == 0) {
+    // Nothing to rotate yet.
+    if (due) {
+      ScheduleRotation();
+    }
+  } else if (full || due) {
+    Rotate();
+  }
+}
+
+/**
+ * @brief Move the log file aside, start a new one and leave compressing and
+ * numbering the old one to the rotator thread. The sink's mutex is held, so
+ * no line is written while the files are switched.
+ *
  */
-void LogSinkFile::OpenLogFile() {
-  if (fs_.is_open()) {
-    fs_.close();
+void LogSinkFile::Rotate() {
+  CloseLogFile();
+  // The name must not replace a file left unfiled by an earlier process,
+  // which may have had the same pid.
+  std::string rotated;
+  do {
+    rotated = filepath_ + ".rotating." + std::to_string(::getpid()) + "." +
+              std::to_string(rotations_++);
+  } while (::access(rotated.c_str(), F_OK) == 0);
+  if (::rename(filepath_.c_str(), rotated.c_str()) != 0) {
+    if (!rotate_failed_) {
+      std::cerr << "Error rotating log file " << filepath_ << ": "
+                << std::strerror(errno) << std::endl;
+      rotate_failed_ = true;
+    }
+    OpenLogFile(true);
+    return;
   }
-  fs_ = std::ofstream(filepath_, std::ios::out);
-  if (!fs_.good()) {
+  rotate_failed_ = false;
+  OpenLogFile();
+  if (p_rotator_ == nullptr) {
+    p_rotator_ = std::make_unique<LogRotator>();
+  }
+  p_rotator_->Enqueue(RotatedLogFile{rotated, filepath_, options_.max_files,
+                                     options_.compress});
+}
+
+/**
+ * @brief Write the buffered lines and close the log file.
+ *
+ */
+void LogSinkFile::CloseLogFile() {
+  if (fd_ >= 0) {
+    WriteBuffer({}, options_.sync != rtb::FileSyncPolicy::kNone);
+    ::close(fd_);
+    fd_ = -1;
+  }
+}
+
+/**
+ * @brief Write the buffer, followed by a message that did not fit into it,
+ * with a single writev() and empty the buffer.
+ *
+ * @param message A line to write after the buffer, may be empty.
+ * @param sync    Whether to fsync the file afterwards.
+ */
+void LogSinkFile::WriteBuffer(std::string_view message, bool sync) {
+  char newline = '\n';
+  std::array<iovec, 3> iov{};
+  int count = 0;
+  if (size_ > 0) {
+    iov[count++] = {buffer_.get(), size_};
+  }
+  if (!message.empty()) {
+    iov[count++] = {const_cast<char*>(message.data()), message.size()};
+    iov[count++] = {&newline, 1};
+  }
+  if (count > 0) {
+    WriteAll(iov.data(), count);
+  }
+  size_ = 0;
+  last_write_ = std::chrono::steady_clock::now();
+  if (sync) {
+    ::fsync(fd_);
+  }
+}
+
+/**
+ * @brief Write the whole of an I/O vector, continuing after partial writes
+ * and interruptions. The lines are dropped if the file cannot be written.
+ *
+ * @param iov   The I/O vector, modified.
+ * @param count The number of entries.
+ */
+void LogSinkFile::WriteAll(iovec* iov, int count) {
+  if (!WriteVector(fd_, iov, count)) {
+    std::cerr << "Error writing log file " << filepath_ << std::endl;
+  }
+}
+
+/**
+ * @brief Construct a new LogSinkMmap object, create the log file and map its
+ * first two segments.
+ *
+ * @param filepath      The log file path.
+ * @param segment_size  The size of the segments the file grows by.
+ */
+LogSinkMmap::LogSinkMmap(const std::string& filepath, size_t segment_size)
+    : filepath_(filepath), segments_(new Segment[kMaxSegments]) {
+  const auto page_size = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+  segment_size_ =
+      std::max<size_t>(1, (segment_size + page_size - 1) / page_size) *
+      page_size;
+  fd_ = ::open(filepath_.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+               0644);
+  if (fd_ < 0) {
     std::cerr << "Error opening log file " << filepath_ << std::endl;
+    return;
+  }
+  GetSegment(0);
+  GetSegment(1);
+}
+
+/**
+ * @brief Destroy the LogSinkMmap object, unmap the segments and cut the file
+ * back to the lines written.
+ *
+ */
+LogSinkMmap::~LogSinkMmap() {
+  for (size_t i = 0; i < kMaxSegments; i++) {
+    char* data = segments_[i].data.load();
+    if (data != nullptr) {
+      ::munmap(data, segment_size_);
+    }
+  }
+  if (fd_ >= 0) {
+    const uint64_t size = std::min<uint64_t>(
+        position_.load(), uint64_t{kMaxSegments} * segment_size_);
+    if (::ftruncate(fd_, static_cast<off_t>(size)) != 0) {
+      std::cerr << "Error truncating log file " << filepath_ << std::endl;
+    }
+    ::close(fd_);
+  }
+}
+
+/**
+ * @brief Log a message to the mapped file.
+ *
+ * @param message       The message.
+ * @param message_type  The message type.
+ */
+void LogSinkMmap::Log(std::string_view message, const MessageType) {
+  const uint64_t position =
+      position_.fetch_add(message.size() + 1, std::memory_order_relaxed);
+  const bool copied = Copy(position, message.data(), message.size());
+  if (!Copy(position + message.size(), "\n", 1) || !copied) {
+    lost_lines_.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+/**
+ * @brief Copy data to reserved space, which may span segments. Completed
+ * segments are unmapped, and the segment after the one a copy enters is
+ * mapped so that writers seldom wait for it.
+ *
+ * @param position  The file offset.
+ * @param data      The data.
+ * @param length    The number of bytes.
+ * @return true     All bytes were copied, false if a segment could not be
+ *                  mapped or the file is full.
+ */
+bool LogSinkMmap::Copy(uint64_t position, const char* data, size_t length) {
+  bool copied = true;
+  while (length > 0) {
+    const size_t index = position / segment_size_;
+    const size_t offset = position % segment_size_;
+    const size_t count = std::min(length, segment_size_ - offset);
+    if (index >= kMaxSegments) {
+      if (!full_.exchange(true)) {
+        std::cerr << "Log file full " << filepath_ << std::endl;
+      }
+      return false;
+    }
+
+    char* segment = GetSegment(index);
+    if (segment != nullptr) {
+      std::memcpy(segment + offset, data, count);
+    } else {
+      copied = false;
+    }
+    if (offset == 0 && index + 1 < kMaxSegments) {
+      GetSegment(index + 1);
+    }
+    Segment& s = segments_[index];
+    if (s.committed.fetch_add(count, std::memory_order_acq_rel) + count ==
+        segment_size_) {
+      // Every byte of the segment has been written.
+      const std::lock_guard<std::mutex> lock(map_mutex_);
+      char* full = s.data.exchange(nullptr);
+      if (full != nullptr) {
+        ::munmap(full, segment_size_);
+      }
+      s.state.store(kRetired, std::memory_order_relaxed);
+    }
+    position += count;
+    data += count;
+    length -= count;
+  }
+  return copied;
+}
+
+/**
+ * @brief Get the mapping of a segment, mapping it first if necessary.
+ *
+ * @param index   The segment index.
+ * @return char*  The mapping, or nullptr if it could not be mapped or the
+ *                segment has been completed.
+ */
+char* LogSinkMmap::GetSegment(size_t index) {
+  char* data = segments_[index].data.load(std::memory_order_acquire);
+  if (data != nullptr || fd_ < 0) {
+    return data;
+  }
+  const std::lock_guard<std::mutex> lock(map_mutex_);
+  if (segments_[index].state.load(std::memory_order_relaxed) != kUnmapped) {
+    return segments_[index].data.load(std::memory_order_relaxed);
+  }
+  return MapSegment(index);
+}
+
+/**
+ * @brief Allocate a segment in the file and map it. The map mutex is held.
+ *
+ * @param index   The segment index.
+ * @return char*  The mapping, or nullptr on failure.
+ */
+char* LogSinkMmap::MapSegment(size_t index) {
+  Segment& segment = segments_[index];
+  const auto offset = static_cast<off_t>(index * segment_size_);
+  const auto length = static_cast<off_t>(segment_size_);
+  // Fall back to a sparse file only where fallocate is not supported. Any
+  // other failure, e.g. a full disk, would leave the mapping without blocks
+  // behind it, and writing to it would raise SIGBUS, so the segment is given
+  // up and its lines are lost instead.
+  if (::fallocate(fd_, 0, offset, length) != 0) {
+    const int error = errno;
+    struct stat st {};
+    if ((error != EOPNOTSUPP && error != ENOSYS) || ::fstat(fd_, &st) != 0 ||
+        (st.st_size < offset + length &&
+         ::ftruncate(fd_, offset + length) != 0)) {
+      std::cerr << "Error extending log file " << filepath_ << ": "
+                << std::strerror(error) << std::endl;
+      segment.state.store(kRetired, std::memory_order_relaxed);
+      return nullptr;
+    }
+  }
+  void* data = ::mmap(nullptr, segment_size_, PROT_READ | PROT_WRITE,
+                      MAP_SHARED, fd_, offset);
+  if (data == MAP_FAILED) {
+    std::cerr << "Error mapping log file " << filepath_ << std::endl;
+    segment.state.store(kRetired, std::memory_order_relaxed);
+    return nullptr;
   }
+  segment.data.store(static_cast<char*>(data), std::memory_order_release);
+  segment.state.store(kMapped, std::memory_order_relaxed);
+  return static_cast<char*>(data);
 }
-}  // namespace rtb_h
\ No newline at end of file
+}  // namespace rtb_h
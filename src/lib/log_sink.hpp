@@ -4,11 +4,53 @@
 // Copyright (c) 2021 Roger Davies, all rights reserved
 #pragma once
 
-#include <fstream>
+#include <sys/uio.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+#include "log_level.hpp"
+
+namespace rtb {
+enum class FileSyncPolicy : uint8_t {
+  kNone = 0,    // Leave writing back to the kernel.
+  kOnSeverity,  // fsync when a message at the flush level is logged.
+  kEveryFlush   // fsync whenever the buffer is written.
+};
+
+/**
+ * @brief When the file sink writes its buffer to the file. The buffer is
+ * written when the next line does not fit, when a line at or above
+ * flush_level is logged, when a line is logged more than flush_interval after
+ * the last write, and on Logger::Flush().
+ *
+ * The file is rotated before it grows beyond rotate_size bytes and at every
+ * multiple of rotate_interval since the epoch; zero disables either. Rotated
+ * files become path.1, path.2, ... up to max_files, gzipped if compress is
+ * set and zlib is available, on a background thread.
+ *
+ */
+struct FileSinkOptions {
+  size_t buffer_size{64 * 1024};
+  std::chrono::milliseconds flush_interval{1000};
+  rtb_h::MessageType flush_level{rtb_h::kError};
+  FileSyncPolicy sync{FileSyncPolicy::kNone};
+  size_t rotate_size{0};
+  std::chrono::seconds rotate_interval{0};
+  size_t max_files{5};
+  bool compress{true};
+};
+}  // namespace rtb
 
 namespace rtb_h {
-enum MessageType { kInfo, kWarning, kError };
+class LogRotator;
 
 /**
  * @brief Abstract class for log sinks.
@@ -18,25 +60,66 @@ class LogSink {
  public:
   virtual ~LogSink() = default;
 
-  virtual void Log(const std::string& message, MessageType message_type) = 0;
+  virtual void Log(std::string_view message, MessageType message_type) = 0;
+  virtual void Flush() {}
+  // Whether the sink takes JSON Lines records instead of text lines.
+  [[nodiscard]] virtual bool IsStructured() const { return false; }
+};
+
+/**
+ * @brief Log to a terminal or to a redirected standard stream, writing to the
+ * file descriptor directly rather than through iostreams. On a terminal each
+ * line is written at once with one writev() of colour, line, reset and
+ * newline; warnings are yellow, errors red. Otherwise lines are written
+ * without colour and collected in a buffer that is written when it is full,
+ * when a warning or worse is logged, when a line is logged more than
+ * kFlushInterval after the last write, and on Flush().
+ *
+ */
+class LogSinkConsole : public LogSink {
+ public:
+  static constexpr size_t kBufferSize = 32 * 1024;
+  static constexpr std::chrono::milliseconds kFlushInterval{100};
+
+  explicit LogSinkConsole(int fd);
+  ~LogSinkConsole() override;
+  void Log(std::string_view message, MessageType message_type) override;
+  void Flush() override;
+  [[nodiscard]] bool IsInteractive() const { return interactive_; }
+
+  LogSinkConsole(const LogSinkConsole&) = delete;
+  LogSinkConsole& operator=(const LogSinkConsole&) = delete;
+  LogSinkConsole(const LogSinkConsole&&) = delete;
+  LogSinkConsole& operator=(const LogSinkConsole&&) = delete;
+
+ private:
+  int fd_;
+  bool interactive_;
+  // Guards the buffer, which is only used when not interactive.
+  std::mutex mutex_;
+  std::unique_ptr<char[]> buffer_;
+  size_t size_{0};
+  std::chrono::steady_clock::time_point last_write_;
+
+  void WriteBuffer(std::string_view message);
 };
 
 /**
  * @brief Log to stdout.
  *
  */
-class LogSinkCout : public LogSink {
+class LogSinkCout : public LogSinkConsole {
  public:
-  void Log(const std::string& message, MessageType message_type) override;
+  LogSinkCout();
 };
 
 /**
  * @brief Log to stderr.
  *
  */
-class LogSinkCerr : public LogSink {
+class LogSinkCerr : public LogSinkConsole {
  public:
-  void Log(const std::string& message, MessageType message_type) override;
+  LogSinkCerr();
 };
 
 /**
@@ -45,20 +128,24 @@ class LogSinkCerr : public LogSink {
  */
 class LogSinkNull : public LogSink {
  public:
-  void Log(const std::string&, MessageType) override {}
+  void Log(std::string_view, MessageType) override {}
 };
 
 /**
- * @brief Log to a file.
+ * @brief Log to a file. Lines are collected in a buffer and written with one
+ * system call per buffer rather than per line, see rtb::FileSinkOptions.
  *
  */
 class LogSinkFile : public LogSink {
  public:
   LogSinkFile() = delete;
-  explicit LogSinkFile(std::string filepath);
+  explicit LogSinkFile(std::string filepath,
+                       const rtb::FileSinkOptions& options = {});
   ~LogSinkFile() override;
-  void Log(const std::string& message, MessageType message_type) override;
+  void Log(std::string_view message, MessageType message_type) override;
+  void Flush() override;
   void SetFilePath(const std::string& filepath);
+  void SetOptions(const rtb::FileSinkOptions& options);
 
   LogSinkFile(const LogSinkFile&) = delete;
   LogSinkFile& operator=(const LogSinkFile&) = delete;
@@ -66,9 +153,100 @@ class LogSinkFile : public LogSink {
   LogSinkFile& operator=(const LogSinkFile&&) = delete;
 
  private:
-  std::ofstream fs_;
+  // Serialises writes with each other and with reopening the file, so lines
+  // written while the path changes are neither torn nor lost.
+  std::mutex mutex_;
+  int fd_{-1};
+  std::string filepath_;
+  rtb::FileSinkOptions options_;
+  std::unique_ptr<char[]> buffer_;
+  size_t size_{0};
+  std::chrono::steady_clock::time_point last_write_;
+  // Bytes in the file including the buffer, and when to rotate next.
+  size_t file_size_{0};
+  std::chrono::system_clock::time_point next_rotation_;
+  uint64_t rotations_{0};
+  // Whether the last rotation failed, so that the error is reported once.
+  bool rotate_failed_{false};
+  std::unique_ptr<LogRotator> p_rotator_;
+
+  void OpenLogFile(bool append = false);
+  void CloseLogFile();
+  void ScheduleRotation();
+  void RotateIfDue(size_t length);
+  void Rotate();
+  void WriteBuffer(std::string_view message, bool sync);
+  void WriteAll(iovec* iov, int count);
+};
+
+/**
+ * @brief Log JSON Lines records to a file, one object per message with the
+ * members time, level, message and either value or the message's fields.
+ * Buffering, flushing and rotation work as for LogSinkFile.
+ *
+ */
+class LogSinkJsonLines : public LogSinkFile {
+ public:
+  using LogSinkFile::LogSinkFile;
+  [[nodiscard]] bool IsStructured() const override { return true; }
+};
+
+/**
+ * @brief Log to a memory-mapped file. The file grows in preallocated segments
+ * that are mapped ahead of the writers; a writer reserves space for its line
+ * with an atomic fetch-add and copies the line into the mapping, so logging
+ * takes no lock and no system call except when a new segment is mapped.
+ * Lines written before a crash survive it because the pages belong to the
+ * kernel's page cache. The file is truncated to its contents when the sink is
+ * destroyed; after a crash it ends with the zero bytes of the unused part of
+ * the last segment.
+ *
+ */
+class LogSinkMmap : public LogSink {
+ public:
+  static constexpr size_t kDefaultSegmentSize = 64 * 1024 * 1024;
+  // Segments per file, the file holds up to kMaxSegments * segment size.
+  static constexpr size_t kMaxSegments = 4096;
+
+  LogSinkMmap() = delete;
+  // The segment size is rounded up to a multiple of the page size.
+  explicit LogSinkMmap(const std::string& filepath,
+                       size_t segment_size = kDefaultSegmentSize);
+  ~LogSinkMmap() override;
+  void Log(std::string_view message, MessageType message_type) override;
+
+  [[nodiscard]] size_t segment_size() const { return segment_size_; }
+  // Lines not written because their segment could not be allocated, e.g. on
+  // a full disk, or because the file is full.
+  [[nodiscard]] uint64_t LostLines() const {
+    return lost_lines_.load(std::memory_order_relaxed);
+  }
+
+  LogSinkMmap(const LogSinkMmap&) = delete;
+  LogSinkMmap& operator=(const LogSinkMmap&) = delete;
+  LogSinkMmap(const LogSinkMmap&&) = delete;
+  LogSinkMmap& operator=(const LogSinkMmap&&) = delete;
+
+ private:
+  // A segment is unmapped by the writer that completes it.
+  enum SegmentState : int { kUnmapped = 0, kMapped, kRetired };
+  struct Segment {
+    std::atomic<char*> data{nullptr};
+    std::atomic<int> state{kUnmapped};
+    std::atomic<size_t> committed{0};
+  };
+
+  int fd_{-1};
   std::string filepath_;
+  size_t segment_size_;
+  std::atomic<uint64_t> position_{0};
+  std::unique_ptr<Segment[]> segments_;
+  std::mutex map_mutex_;
+  std::atomic<bool> full_{false};
+  std::atomic<uint64_t> lost_lines_{0};
 
-  void OpenLogFile();
+  bool Copy(uint64_t position, const char* data, size_t length);
+  char* GetSegment(size_t index);
+  char* MapSegment(size_t index);
 };
 }  // namespace rtb_h
\ No newline at end of file
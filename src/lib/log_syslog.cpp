@@ -0,0 +1,319 @@
+// @file      log_syslog.cpp
+// @author    Roger Davies     [rdavies3000@gmail.com]
+//
+// Copyright (c) 2022 Roger Davies, all rights reserved
+
+#include "log_syslog.hpp"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <utility>
+#include <vector>
+
+namespace rtb_h {
+namespace {
+// RFC 5424 severities by message type: trace and debug are debug, fatal is
+// critical.
+constexpr std::array<int, kMessageTypeCount> kSeverities = {7, 7, 6, 4, 3, 2};
+
+// RFC 5424 limits APP-NAME to 48 printable characters without spaces.
+constexpr size_t kMaxAppName = 48;
+
+/**
+ * @brief Make a header field printable and non-empty.
+ *
+ * @param field       The field.
+ * @param max_length  The maximum length.
+ * @return std::string The field, or "-".
+ */
+std::string HeaderField(std::string field, size_t max_length) {
+  field.resize(std::min(field.size(), max_length));
+  for (char& c : field) {
+    if (c <= ' ' || c > '~') {
+      c = '_';
+    }
+  }
+  return field.empty() ? "-" : field;
+}
+}  // namespace
+
+/**
+ * @brief Construct a new LogSinkSyslog object and connect to the collector if
+ * it is listening.
+ *
+ * @param socket_path The path of the collector's socket.
+ * @param options     The socket type, batching and buffering.
+ */
+LogSinkSyslog::LogSinkSyslog(std::string socket_path,
+                             rtb::SyslogSinkOptions options)
+    : socket_path_(std::move(socket_path)),
+      options_(std::move(options)),
+      last_send_(std::chrono::steady_clock::now()) {
+  options_.batch_size = std::max<size_t>(options_.batch_size, 1);
+  send_at_ = options_.batch_size;
+  if (socket_path_.size() >= sizeof(sockaddr_un::sun_path)) {
+    std::cerr << "Syslog socket path too long " << socket_path_ << std::endl;
+  }
+
+  std::array<char, 256> hostname{};
+  if (::gethostname(hostname.data(), hostname.size() - 1) != 0) {
+    hostname[0] = '\0';
+  }
+  std::string app_name = options_.app_name;
+#ifdef __GLIBC__
+  if (app_name.empty()) {
+    app_name = program_invocation_short_name;
+  }
+#endif
+  header_ = " " + HeaderField(hostname.data(), 255) + " " +
+            HeaderField(app_name, kMaxAppName) + " " +
+            std::to_string(::getpid()) + " - - ";
+  Connect();
+}
+
+/**
+ * @brief Destroy the LogSinkSyslog object after sending the records the
+ * collector takes without blocking.
+ *
+ */
+LogSinkSyslog::~LogSinkSyslog() {
+  Flush();
+  Disconnect();
+}
+
+/**
+ * @brief Log a message as a syslog record.
+ *
+ * @param message       The message.
+ * @param message_type  The message type.
+ */
+void LogSinkSyslog::Log(std::string_view message,
+                        const MessageType message_type) {
+  std::string record = FormatRecord(message, message_type);
+  const std::lock_guard<std::mutex> lock(mutex_);
+  buffered_ += record.size();
+  records_.push_back(std::move(record));
+  Trim();
+  if (records_.size() >= send_at_ || message_type >= options_.flush_level ||
+      std::chrono::steady_clock::now() - last_send_ >=
+          options_.flush_interval) {
+    Send();
+  }
+}
+
+/**
+ * @brief Send the buffered records, as far as the collector takes them
+ * without blocking.
+ *
+ */
+void LogSinkSyslog::Flush() {
+  const std::lock_guard<std::mutex> lock(mutex_);
+  Send();
+}
+
+/**
+ * @brief Format a record, with its octet count on a stream.
+ *
+ * @param message       The message.
+ * @param message_type  The message type.
+ * @return std::string  The record.
+ */
+std::string LogSinkSyslog::FormatRecord(std::string_view message,
+                                        MessageType message_type) const {
+  std::array<char, rtb::TimestampFormatter::kMaxLength> timestamp{};
+  const size_t timestamp_length = timestamp_formatter_.Format(
+      std::chrono::system_clock::now(), timestamp.data());
+  const std::string priority =
+      std::to_string(options_.facility * 8 + kSeverities[message_type]);
+
+  std::string record;
+  record.reserve(priority.size() + timestamp_length + header_.size() +
+                 message.size() + 16);
+  record.append("<").append(priority).append(">1 ");
+  record.append(timestamp.data(), timestamp_length);
+  record.append(header_).append(message);
+  if (options_.socket_type == rtb::SocketType::kStream) {
+    record.insert(0, std::to_string(record.size()) + " ");
+  }
+  return record;
+}
+
+/**
+ * @brief Drop the oldest records while the buffer is over its limit. A
+ * record partly sent on a stream is kept, so that it can be completed. The
+ * mutex is held.
+ *
+ */
+void LogSinkSyslog::Trim() {
+  const size_t keep = sent_ > 0 ? 1 : 0;
+  while (buffered_ > options_.max_buffered && records_.size() > keep) {
+    const auto oldest = records_.begin() + static_cast<std::ptrdiff_t>(keep);
+    buffered_ -= oldest->size();
+    records_.erase(oldest);
+    dropped_.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+/**
+ * @brief Send batches of records until they are all sent or the collector
+ * takes no more. The mutex is held.
+ *
+ */
+void LogSinkSyslog::Send() {
+  last_send_ = std::chrono::steady_clock::now();
+  if (fd_ < 0) {
+    Connect();
+  }
+  bool more = true;
+  while (more && fd_ >= 0 && !records_.empty()) {
+    more = options_.socket_type == rtb::SocketType::kStream ? SendStream()
+                                                             : SendDatagrams();
+  }
+  // Records the collector did not take wait for another batch, rather than
+  // being retried by every log call.
+  send_at_ = records_.size() + options_.batch_size;
+}
+
+/**
+ * @brief Send up to batch_size records as datagrams with one system call.
+ * The mutex is held.
+ *
+ * @return true   Sending may continue.
+ */
+bool LogSinkSyslog::SendDatagrams() {
+  const size_t count = std::min(records_.size(), options_.batch_size);
+  std::vector<iovec> iov(count);
+  std::vector<mmsghdr> messages(count);
+  for (size_t i = 0; i < count; i++) {
+    iov[i] = {records_[i].data(), records_[i].size()};
+    messages[i].msg_hdr.msg_iov = &iov[i];
+    messages[i].msg_hdr.msg_iovlen = 1;
+  }
+  const int sent = ::sendmmsg(fd_, messages.data(),
+                              static_cast<unsigned>(count), MSG_DONTWAIT);
+  if (sent < 0) {
+    return HandleError(errno);
+  }
+  for (int i = 0; i < sent; i++) {
+    buffered_ -= records_.front().size();
+    records_.pop_front();
+  }
+  return true;
+}
+
+/**
+ * @brief Send up to batch_size records on the stream with one system call.
+ * The mutex is held.
+ *
+ * @return true   Sending may continue.
+ */
+bool LogSinkSyslog::SendStream() {
+  const size_t count = std::min(records_.size(), options_.batch_size);
+  std::vector<iovec> iov(count);
+  for (size_t i = 0; i < count; i++) {
+    iov[i] = {records_[i].data(), records_[i].size()};
+  }
+  iov[0].iov_base = records_[0].data() + sent_;
+  iov[0].iov_len -= sent_;
+  msghdr header{};
+  header.msg_iov = iov.data();
+  header.msg_iovlen = count;
+  const ssize_t sent = ::sendmsg(fd_, &header, MSG_DONTWAIT | MSG_NOSIGNAL);
+  if (sent < 0) {
+    return HandleError(errno);
+  }
+  size_t done = sent_ + static_cast<size_t>(sent);
+  while (!records_.empty() && done >= records_.front().size()) {
+    done -= records_.front().size();
+    buffered_ -= records_.front().size();
+    records_.pop_front();
+  }
+  sent_ = done;
+  return true;
+}
+
+/**
+ * @brief Handle a failed send. The mutex is held.
+ *
+ * @param error   The errno of the send.
+ * @return true   Sending may continue.
+ */
+bool LogSinkSyslog::HandleError(int error) {
+  switch (error) {
+    case EINTR:
+      return true;
+    case EAGAIN:
+#if EWOULDBLOCK != EAGAIN
+    case EWOULDBLOCK:
+#endif
+    case ENOBUFS:
+      // The collector is behind, keep the records for the next batch.
+      return false;
+    case EMSGSIZE:
+      buffered_ -= records_.front().size();
+      records_.pop_front();
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+      return true;
+    default:
+      // The collector has gone, e.g. it is restarting.
+      Disconnect();
+      return false;
+  }
+}
+
+/**
+ * @brief Connect to the collector, at most once per reconnect_interval. Unix
+ * domain sockets connect or fail immediately, so this does not block. The
+ * mutex is held, or the sink is being constructed.
+ *
+ */
+void LogSinkSyslog::Connect() {
+  const auto now = std::chrono::steady_clock::now();
+  if (now < next_connect_) {
+    return;
+  }
+  next_connect_ = now + options_.reconnect_interval;
+
+  sockaddr_un address{};
+  if (socket_path_.size() >= sizeof(address.sun_path)) {
+    return;
+  }
+  address.sun_family = AF_UNIX;
+  std::memcpy(address.sun_path, socket_path_.c_str(), socket_path_.size());
+  const int type = options_.socket_type == rtb::SocketType::kStream
+                       ? SOCK_STREAM
+                       : SOCK_DGRAM;
+  const int fd = ::socket(AF_UNIX, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return;
+  }
+  if (::connect(fd, reinterpret_cast<const sockaddr*>(&address),
+                sizeof(address)) != 0) {
+    ::close(fd);
+    return;
+  }
+  fd_ = fd;
+  connected_.store(true, std::memory_order_relaxed);
+}
+
+/**
+ * @brief Close the connection. A record partly sent on it is sent again in
+ * full on the next one. The mutex is held, or the sink is being destroyed.
+ *
+ */
+void LogSinkSyslog::Disconnect() {
+  if (fd_ >= 0) {
+    ::close(fd_);
+    fd_ = -1;
+  }
+  sent_ = 0;
+  connected_.store(false, std::memory_order_relaxed);
+}
+}  // namespace rtb_h
@@ -0,0 +1,111 @@
+// @file      log_syslog.hpp
+// @author    Roger Davies     [rdavies3000@gmail.com]
+//
+// Copyright (c) 2022 Roger Davies, all rights reserved
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+#include "log_sink.hpp"
+#include "timestamp.hpp"
+
+namespace rtb {
+enum class SocketType : uint8_t {
+  kDatagram = 0,  // One record per datagram, like /dev/log.
+  kStream         // Octet-counted records on a connection (RFC 6587).
+};
+
+/**
+ * @brief How the syslog sink batches and buffers records. Records are sent
+ * when batch_size of them are waiting, when a record at or above flush_level
+ * is logged, when a record is logged more than flush_interval after the last
+ * send, and on Logger::Flush(). While the collector is unavailable records
+ * are kept, up to max_buffered bytes after which the oldest are dropped, and
+ * a connection is attempted at most once per reconnect_interval.
+ *
+ */
+struct SyslogSinkOptions {
+  SocketType socket_type{SocketType::kDatagram};
+  int facility{1};       // user-level messages
+  std::string app_name;  // The program name if empty.
+  size_t batch_size{64};
+  size_t max_buffered{1024 * 1024};
+  std::chrono::milliseconds flush_interval{100};
+  rtb_h::MessageType flush_level{rtb_h::kWarning};
+  std::chrono::milliseconds reconnect_interval{1000};
+};
+}  // namespace rtb
+
+namespace rtb_h {
+/**
+ * @brief Log to a collector listening on a Unix domain socket, as RFC 5424
+ * records: "<PRI>1 TIMESTAMP HOSTNAME APP-NAME PROCID - - MSG" where MSG is
+ * the log line. A batch of datagrams is sent with one sendmmsg(2), a batch
+ * of stream records with one sendmsg(2). The socket is non-blocking, so a
+ * slow or restarting collector never stalls a log call; records it cannot
+ * take yet stay buffered and are sent with the next batch.
+ *
+ */
+class LogSinkSyslog : public LogSink {
+ public:
+  LogSinkSyslog() = delete;
+  explicit LogSinkSyslog(std::string socket_path,
+                         rtb::SyslogSinkOptions options = {});
+  ~LogSinkSyslog() override;
+  void Log(std::string_view message, MessageType message_type) override;
+  void Flush() override;
+
+  [[nodiscard]] bool IsConnected() const {
+    return connected_.load(std::memory_order_relaxed);
+  }
+  // Records dropped because the buffer was full or the collector refused
+  // them.
+  [[nodiscard]] uint64_t Dropped() const {
+    return dropped_.load(std::memory_order_relaxed);
+  }
+
+  LogSinkSyslog(const LogSinkSyslog&) = delete;
+  LogSinkSyslog& operator=(const LogSinkSyslog&) = delete;
+  LogSinkSyslog(const LogSinkSyslog&&) = delete;
+  LogSinkSyslog& operator=(const LogSinkSyslog&&) = delete;
+
+ private:
+  std::string socket_path_;
+  rtb::SyslogSinkOptions options_;
+  // " HOSTNAME APP-NAME PROCID - - ", the same for every record.
+  std::string header_;
+  rtb::TimestampFormatter timestamp_formatter_{
+      rtb::TimestampStyle::kIso8601Utc, rtb::TimestampPrecision::kMicroseconds};
+
+  // Guards everything below.
+  std::mutex mutex_;
+  int fd_{-1};
+  std::deque<std::string> records_;
+  size_t buffered_{0};
+  // The number of records at which the next batch is sent.
+  size_t send_at_{0};
+  // Bytes of the first record already sent on a stream.
+  size_t sent_{0};
+  std::chrono::steady_clock::time_point last_send_;
+  std::chrono::steady_clock::time_point next_connect_;
+  std::atomic<bool> connected_{false};
+  std::atomic<uint64_t> dropped_{0};
+
+  [[nodiscard]] std::string FormatRecord(std::string_view message,
+                                         MessageType message_type) const;
+  void Trim();
+  void Send();
+  bool SendDatagrams();
+  bool SendStream();
+  bool HandleError(int error);
+  void Connect();
+  void Disconnect();
+};
+}  // namespace rtb_h
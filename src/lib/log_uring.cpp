@@ -0,0 +1,569 @@
+// @file      log_uring.cpp
+// @author    Roger Davies     [rdavies3000@gmail.com]
+//
+// Copyright (c) 2022 Roger Davies, all rights reserved
+
+#include "log_uring.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <utility>
+
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define RTB_HAVE_IO_URING 1
+#endif
+
+namespace rtb_h {
+#ifdef RTB_HAVE_IO_URING
+/**
+ * @brief Minimal io_uring for one submitter, set up with the raw system calls
+ * so that liburing is not needed. The caller serialises all calls.
+ *
+ */
+class IoUring {
+ public:
+  static std::unique_ptr<IoUring> Create(unsigned entries,
+                                         const iovec* buffers,
+                                         unsigned count,
+                                         bool register_buffers);
+  ~IoUring();
+
+  bool SubmitWrite(int fd, unsigned buffer, const char* data, size_t size,
+                   uint64_t offset, uint64_t user_data);
+  bool Peek(uint64_t* user_data, int* result);
+  bool Wait();
+
+  IoUring(const IoUring&) = delete;
+  IoUring& operator=(const IoUring&) = delete;
+  IoUring(const IoUring&&) = delete;
+  IoUring& operator=(const IoUring&&) = delete;
+
+ private:
+  IoUring() = default;
+
+  int fd_{-1};
+  bool fixed_buffers_{false};
+  void* sq_ring_{MAP_FAILED};
+  size_t sq_ring_size_{0};
+  void* cq_ring_{MAP_FAILED};
+  size_t cq_ring_size_{0};
+  io_uring_sqe* sqes_{nullptr};
+  size_t sqes_size_{0};
+  unsigned* sq_tail_{nullptr};
+  unsigned* sq_mask_{nullptr};
+  unsigned* sq_array_{nullptr};
+  unsigned* cq_head_{nullptr};
+  unsigned* cq_tail_{nullptr};
+  unsigned* cq_mask_{nullptr};
+  io_uring_cqe* cqes_{nullptr};
+
+  int Enter(unsigned submit, unsigned min_complete, unsigned flags) const {
+    return static_cast<int>(::syscall(__NR_io_uring_enter, fd_, submit,
+                                      min_complete, flags, nullptr, 0));
+  }
+  [[nodiscard]] bool Supports(unsigned opcode) const;
+};
+
+/**
+ * @brief Set up a ring and register the buffers with it. Registration may be
+ * refused, e.g. over the locked memory limit, and then plain writes are
+ * used if the kernel has them (5.6 and later).
+ *
+ * @param entries           The number of submission queue entries.
+ * @param buffers           The buffers.
+ * @param count             The number of buffers.
+ * @param register_buffers  Whether to try registering the buffers.
+ * @return std::unique_ptr<IoUring> The ring, or nullptr if io_uring is not
+ *                                  available or cannot write the buffers.
+ */
+std::unique_ptr<IoUring> IoUring::Create(unsigned entries,
+                                         const iovec* buffers,
+                                         unsigned count,
+                                         bool register_buffers) {
+  io_uring_params params{};
+  std::unique_ptr<IoUring> ring(new IoUring());
+  ring->fd_ =
+      static_cast<int>(::syscall(__NR_io_uring_setup, entries, &params));
+  if (ring->fd_ < 0 || (params.features & IORING_FEAT_SINGLE_MMAP) == 0) {
+    return nullptr;
+  }
+
+  // With IORING_FEAT_SINGLE_MMAP both rings share one mapping.
+  ring->sq_ring_size_ = std::max<size_t>(
+      params.sq_off.array + params.sq_entries * sizeof(unsigned),
+      params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+  ring->sq_ring_ =
+      ::mmap(nullptr, ring->sq_ring_size_, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_POPULATE, ring->fd_, IORING_OFF_SQ_RING);
+  if (ring->sq_ring_ == MAP_FAILED) {
+    return nullptr;
+  }
+  ring->sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+  void* sqes = ::mmap(nullptr, ring->sqes_size_, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd_, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) {
+    return nullptr;
+  }
+  ring->sqes_ = static_cast<io_uring_sqe*>(sqes);
+
+  char* sq = static_cast<char*>(ring->sq_ring_);
+  ring->sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+  ring->sq_mask_ = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+  ring->sq_array_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+  ring->cq_head_ = reinterpret_cast<unsigned*>(sq + params.cq_off.head);
+  ring->cq_tail_ = reinterpret_cast<unsigned*>(sq + params.cq_off.tail);
+  ring->cq_mask_ = reinterpret_cast<unsigned*>(sq + params.cq_off.ring_mask);
+  ring->cqes_ = reinterpret_cast<io_uring_cqe*>(sq + params.cq_off.cqes);
+
+  ring->fixed_buffers_ =
+      register_buffers &&
+      ::syscall(__NR_io_uring_register, ring->fd_, IORING_REGISTER_BUFFERS,
+                buffers, count) == 0;
+  if (!ring->Supports(ring->fixed_buffers_ ? IORING_OP_WRITE_FIXED
+                                           : IORING_OP_WRITE)) {
+    return nullptr;
+  }
+  return ring;
+}
+
+/**
+ * @brief Check whether the kernel supports an operation. Kernels without
+ * IORING_REGISTER_PROBE predate 5.6 and, of the writes, only have
+ * IORING_OP_WRITE_FIXED.
+ *
+ * @param opcode  The operation.
+ * @return true   The operation is supported.
+ */
+bool IoUring::Supports(unsigned opcode) const {
+#ifdef IO_URING_OP_SUPPORTED
+  constexpr unsigned kProbeOps = 256;
+  alignas(io_uring_probe) unsigned char
+      storage[sizeof(io_uring_probe) + kProbeOps * sizeof(io_uring_probe_op)] =
+          {};
+  auto* probe = reinterpret_cast<io_uring_probe*>(storage);
+  if (::syscall(__NR_io_uring_register, fd_, IORING_REGISTER_PROBE, probe,
+                kProbeOps) == 0) {
+    return opcode < probe->ops_len &&
+           (probe->ops[opcode].flags & IO_URING_OP_SUPPORTED) != 0;
+  }
+#endif
+  return opcode == IORING_OP_WRITE_FIXED;
+}
+
+/**
+ * @brief Destroy the IoUring object. Writes still in flight complete in the
+ * kernel.
+ *
+ */
+IoUring::~IoUring() {
+  if (sqes_ != nullptr) {
+    ::munmap(sqes_, sqes_size_);
+  }
+  if (sq_ring_ != MAP_FAILED) {
+    ::munmap(sq_ring_, sq_ring_size_);
+  }
+  if (fd_ >= 0) {
+    ::close(fd_);
+  }
+}
+
+/**
+ * @brief Submit a write of a registered buffer. There is always a free
+ * entry because the caller has no more writes in flight than entries.
+ *
+ * @param fd        The file descriptor.
+ * @param buffer    The index of the registered buffer.
+ * @param data      The data, within the buffer.
+ * @param size      The number of bytes.
+ * @param offset    The file offset.
+ * @param user_data Returned with the completion.
+ * @return true     The write was submitted.
+ */
+bool IoUring::SubmitWrite(int fd, unsigned buffer, const char* data,
+                          size_t size, uint64_t offset, uint64_t user_data) {
+  const unsigned tail = *sq_tail_;
+  const unsigned index = tail & *sq_mask_;
+  io_uring_sqe* sqe = &sqes_[index];
+  std::memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = fixed_buffers_ ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+  sqe->fd = fd;
+  sqe->addr = reinterpret_cast<uint64_t>(data);
+  sqe->len = static_cast<uint32_t>(size);
+  sqe->off = offset;
+  sqe->buf_index = static_cast<uint16_t>(buffer);
+  sqe->user_data = user_data;
+  sq_array_[index] = index;
+  // The kernel reads the entry after it sees the new tail.
+  __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+
+  int submitted = 0;
+  do {
+    submitted = Enter(1, 0, 0);
+  } while (submitted < 0 && errno == EINTR);
+  if (submitted != 1) {
+    // Without SQPOLL the kernel only reads the ring in io_uring_enter(2), so
+    // the entry can be taken back and written synchronously instead.
+    __atomic_store_n(sq_tail_, tail, __ATOMIC_RELEASE);
+    return false;
+  }
+  return true;
+}
+
+/**
+ * @brief Take a completion if there is one, without a system call.
+ *
+ * @param user_data Receives the user data of the write.
+ * @param result    Receives the number of bytes written or -errno.
+ * @return true     A completion was taken.
+ */
+bool IoUring::Peek(uint64_t* user_data, int* result) {
+  const unsigned head = *cq_head_;
+  if (head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+    return false;
+  }
+  const io_uring_cqe& cqe = cqes_[head & *cq_mask_];
+  *user_data = cqe.user_data;
+  *result = cqe.res;
+  __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+/**
+ * @brief Wait until there is at least one completion.
+ *
+ * @return true The wait succeeded.
+ */
+bool IoUring::Wait() {
+  return Enter(0, 1, IORING_ENTER_GETEVENTS) >= 0 || errno == EINTR;
+}
+#else
+// Without the io_uring header the writer threads are always used.
+class IoUring {
+ public:
+  static std::unique_ptr<IoUring> Create(unsigned, const iovec*, unsigned,
+                                         bool) {
+    return nullptr;
+  }
+  bool SubmitWrite(int, unsigned, const char*, size_t, uint64_t, uint64_t) {
+    return false;
+  }
+  bool Peek(uint64_t*, int*) { return false; }
+  bool Wait() { return false; }
+};
+#endif
+
+/**
+ * @brief Write a whole buffer at a file offset.
+ *
+ * @param fd        The file descriptor.
+ * @param data      The data.
+ * @param size      The number of bytes.
+ * @param offset    The file offset.
+ * @return int64_t  The number of bytes written, or -errno.
+ */
+int64_t WriteAt(int fd, const char* data, size_t size, uint64_t offset) {
+  size_t done = 0;
+  while (done < size) {
+    const ssize_t written = ::pwrite(fd, data + done, size - done,
+                                     static_cast<off_t>(offset + done));
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -errno;
+    }
+    done += static_cast<size_t>(written);
+  }
+  return static_cast<int64_t>(done);
+}
+
+/**
+ * @brief Construct a new LogSinkUring object, create the log file and set up
+ * io_uring or the writer threads.
+ *
+ * @param filepath      The log file path.
+ * @param slot_size     The size of each buffer.
+ * @param use_io_uring  Whether to try io_uring, otherwise the writer threads
+ *                      are used.
+ * @param register_buffers  Whether to register the buffers with io_uring,
+ *                          otherwise they are written with IORING_OP_WRITE.
+ */
+LogSinkUring::LogSinkUring(std::string filepath, size_t slot_size,
+                           bool use_io_uring, bool register_buffers)
+    : filepath_(std::move(filepath)),
+      slot_size_(std::max<size_t>(slot_size, 1)),
+      last_submit_(std::chrono::steady_clock::now()) {
+  fd_ = ::open(filepath_.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+               0644);
+  if (fd_ < 0) {
+    std::cerr << "Error opening log file " << filepath_ << std::endl;
+    return;
+  }
+  std::array<iovec, kSlots> buffers{};
+  for (size_t i = 0; i < kSlots; i++) {
+    slots_[i].data = std::make_unique<char[]>(slot_size_);
+    buffers[i] = {slots_[i].data.get(), slot_size_};
+  }
+  if (use_io_uring) {
+    p_ring_ = IoUring::Create(kSlots * 2, buffers.data(), kSlots,
+                              register_buffers);
+  }
+  if (p_ring_ == nullptr) {
+    StartWriters();
+  }
+}
+
+/**
+ * @brief Destroy the LogSinkUring object after writing the buffered lines.
+ *
+ */
+LogSinkUring::~LogSinkUring() {
+  Flush();
+  {
+    const std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  work_cv_.notify_all();
+  for (auto& writer : writers_) {
+    writer.join();
+  }
+  p_ring_.reset();
+  if (fd_ >= 0) {
+    ::close(fd_);
+  }
+}
+
+/**
+ * @brief Log a message to the current buffer.
+ *
+ * @param message       The message.
+ * @param message_type  The message type.
+ */
+void LogSinkUring::Log(std::string_view message,
+                       const MessageType message_type) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (fd_ < 0) {
+    return;
+  }
+  WaitForCurrent(&lock);
+  if (message.size() + 1 > slot_size_) {
+    Submit(&lock);
+    WriteDirect(message);
+    return;
+  }
+  // Other threads may fill the next buffer while Submit() waits for it.
+  while (slot_size_ - slots_[current_].size < message.size() + 1) {
+    Submit(&lock);
+  }
+
+  Slot& slot = slots_[current_];
+  std::memcpy(slot.data.get() + slot.size, message.data(), message.size());
+  slot.size += message.size();
+  slot.data[slot.size++] = '\n';
+  if (message_type >= kError ||
+      std::chrono::steady_clock::now() - last_submit_ >= kFlushInterval) {
+    Submit(&lock);
+  }
+}
+
+/**
+ * @brief Submit the current buffer and wait until every write has completed.
+ *
+ */
+void LogSinkUring::Flush() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (fd_ < 0) {
+    return;
+  }
+  Submit(&lock);
+  while (in_flight_ > 0) {
+    Reap(&lock, true);
+  }
+}
+
+/**
+ * @brief Submit the current buffer, if it holds any lines, and move on to the
+ * next one, waiting for it to be written if it is still in flight. The mutex
+ * is held.
+ *
+ * @param lock The lock on the mutex.
+ */
+void LogSinkUring::Submit(std::unique_lock<std::mutex>* lock) {
+  if (ring_unsupported_) {
+    // Every write still in the ring completes before the threads take over.
+    while (in_flight_ > 0) {
+      Reap(lock, true);
+    }
+    p_ring_.reset();
+    ring_unsupported_ = false;
+    StartWriters();
+  }
+  WaitForCurrent(lock);
+  Slot& slot = slots_[current_];
+  if (slot.size == 0) {
+    return;
+  }
+  slot.offset = offset_;
+  slot.in_flight = true;
+  offset_ += slot.size;
+  in_flight_++;
+  if (p_ring_ != nullptr) {
+    if (!p_ring_->SubmitWrite(fd_, static_cast<unsigned>(current_),
+                              slot.data.get(), slot.size, slot.offset,
+                              current_)) {
+      Complete(current_, WriteAt(fd_, slot.data.get(), slot.size,
+                                 slot.offset));
+    }
+  } else {
+    queue_.push_back(current_);
+    work_cv_.notify_one();
+  }
+  last_submit_ = std::chrono::steady_clock::now();
+
+  current_ = (current_ + 1) % kSlots;
+  WaitForCurrent(lock);
+  Reap(lock, false);
+}
+
+/**
+ * @brief Wait until the current buffer has been written. Waiting for the
+ * writer threads releases the mutex, so every log call checks again. The
+ * mutex is held.
+ *
+ * @param lock The lock on the mutex.
+ */
+void LogSinkUring::WaitForCurrent(std::unique_lock<std::mutex>* lock) {
+  while (slots_[current_].in_flight) {
+    Reap(lock, true);
+  }
+}
+
+/**
+ * @brief Hand a written buffer back. A short write is completed
+ * synchronously, as is a write the ring failed; if the ring cannot write at
+ * all the writer threads take over at the next submission. The mutex is
+ * held.
+ *
+ * @param index   The buffer.
+ * @param result  The number of bytes written, or -errno.
+ */
+void LogSinkUring::Complete(size_t index, int64_t result) {
+  Slot& slot = slots_[index];
+  if (result < 0 && p_ring_ != nullptr) {
+    if (result == -EINVAL || result == -EOPNOTSUPP) {
+      ring_unsupported_ = true;
+    }
+    result = WriteAt(fd_, slot.data.get(), slot.size, slot.offset);
+  } else if (result >= 0 && static_cast<size_t>(result) < slot.size) {
+    const auto written = static_cast<size_t>(result);
+    result = WriteAt(fd_, slot.data.get() + written, slot.size - written,
+                     slot.offset + written);
+  }
+  ReportError(result);
+  slot.size = 0;
+  slot.in_flight = false;
+  in_flight_--;
+}
+
+/**
+ * @brief Hand back the buffers whose writes have completed. The mutex is
+ * held.
+ *
+ * @param lock The lock on the mutex.
+ * @param wait Whether to wait for at least one completion.
+ */
+void LogSinkUring::Reap(std::unique_lock<std::mutex>* lock, bool wait) {
+  if (p_ring_ == nullptr) {
+    if (wait) {
+      done_cv_.wait(*lock);
+    }
+    return;
+  }
+  uint64_t index = 0;
+  int result = 0;
+  bool reaped = false;
+  while (true) {
+    while (p_ring_->Peek(&index, &result)) {
+      Complete(index, result);
+      reaped = true;
+    }
+    if (reaped || !wait || !p_ring_->Wait()) {
+      return;
+    }
+  }
+}
+
+/**
+ * @brief Write a line that does not fit in a buffer at the end of the file.
+ * The mutex is held.
+ *
+ * @param message The line.
+ */
+void LogSinkUring::WriteDirect(std::string_view message) {
+  const uint64_t offset = offset_;
+  offset_ += message.size() + 1;
+  int64_t result = WriteAt(fd_, message.data(), message.size(), offset);
+  if (result >= 0) {
+    result = WriteAt(fd_, "\n", 1, offset + message.size());
+  }
+  ReportError(result);
+}
+
+/**
+ * @brief Report the first failed write. The mutex is held.
+ *
+ * @param result The number of bytes written, or -errno.
+ */
+void LogSinkUring::ReportError(int64_t result) {
+  if (result < 0 && !write_failed_) {
+    write_failed_ = true;
+    std::cerr << "Error writing log file " << filepath_ << ": "
+              << std::strerror(static_cast<int>(-result)) << std::endl;
+  }
+}
+
+/**
+ * @brief Start the writer threads, used when there is no ring.
+ *
+ */
+void LogSinkUring::StartWriters() {
+  for (size_t i = 0; i < kWriterThreads; i++) {
+    writers_.emplace_back(&LogSinkUring::WriterLoop, this);
+  }
+}
+
+/**
+ * @brief Writer thread loop, used when there is no ring.
+ *
+ */
+void LogSinkUring::WriterLoop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    work_cv_.wait(lock, [this]() { return stop_ || !queue_.empty(); });
+    if (queue_.empty()) {
+      return;
+    }
+    const size_t index = queue_.front();
+    queue_.pop_front();
+    const Slot& slot = slots_[index];
+    const char* data = slot.data.get();
+    const size_t size = slot.size;
+    const uint64_t offset = slot.offset;
+
+    lock.unlock();
+    const int64_t result = WriteAt(fd_, data, size, offset);
+    lock.lock();
+    Complete(index, result);
+    done_cv_.notify_all();
+  }
+}
+}  // namespace rtb_h
@@ -0,0 +1,106 @@
+// @file      log_uring.hpp
+// @author    Roger Davies     [rdavies3000@gmail.com]
+//
+// Copyright (c) 2022 Roger Davies, all rights reserved
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "log_sink.hpp"
+
+namespace rtb_h {
+class IoUring;
+
+/**
+ * @brief Log to a file without blocking in write(2). Lines are collected in
+ * one of kSlots buffers; a full buffer is submitted as an asynchronous write
+ * at its file offset and logging continues in the next free buffer. With
+ * io_uring the buffers are registered with the kernel and written with
+ * IORING_OP_WRITE_FIXED, and completions are read from the completion ring
+ * without a system call when a buffer is needed again. Where io_uring is not
+ * available, or not wanted, or the kernel turns out not to support its
+ * writes, kWriterThreads threads write the buffers with pwrite(2) instead. A
+ * log call only waits when every buffer is being written.
+ *
+ * A buffer is submitted when it is full, when an error or worse is logged
+ * and when a line is logged more than kFlushInterval after the last
+ * submission. Flush() submits the current buffer and waits until all
+ * writes have completed. Lines longer than a buffer are written directly.
+ *
+ */
+class LogSinkUring : public LogSink {
+ public:
+  static constexpr size_t kSlots = 4;
+  static constexpr size_t kWriterThreads = 2;
+  static constexpr size_t kDefaultSlotSize = 64 * 1024;
+  static constexpr std::chrono::milliseconds kFlushInterval{1000};
+
+  LogSinkUring() = delete;
+  explicit LogSinkUring(std::string filepath,
+                        size_t slot_size = kDefaultSlotSize,
+                        bool use_io_uring = true,
+                        bool register_buffers = true);
+  ~LogSinkUring() override;
+  void Log(std::string_view message, MessageType message_type) override;
+  void Flush() override;
+
+  // Whether writes go through io_uring rather than the writer threads.
+  [[nodiscard]] bool UsesIoUring() const { return p_ring_ != nullptr; }
+
+  LogSinkUring(const LogSinkUring&) = delete;
+  LogSinkUring& operator=(const LogSinkUring&) = delete;
+  LogSinkUring(const LogSinkUring&&) = delete;
+  LogSinkUring& operator=(const LogSinkUring&&) = delete;
+
+ private:
+  struct Slot {
+    std::unique_ptr<char[]> data;
+    size_t size{0};
+    uint64_t offset{0};
+    bool in_flight{false};
+  };
+
+  std::string filepath_;
+  int fd_{-1};
+  size_t slot_size_;
+  // Guards everything below, the writer threads only take it to hand a
+  // buffer back.
+  std::mutex mutex_;
+  std::array<Slot, kSlots> slots_;
+  size_t current_{0};
+  size_t in_flight_{0};
+  uint64_t offset_{0};
+  bool write_failed_{false};
+  // Set when the ring rejected a write as unsupported.
+  bool ring_unsupported_{false};
+  std::chrono::steady_clock::time_point last_submit_;
+  std::unique_ptr<IoUring> p_ring_;
+
+  // Writer threads, used when there is no ring.
+  std::condition_variable work_cv_;
+  std::condition_variable done_cv_;
+  std::deque<size_t> queue_;
+  bool stop_{false};
+  std::vector<std::thread> writers_;
+
+  void Submit(std::unique_lock<std::mutex>* lock);
+  void WaitForCurrent(std::unique_lock<std::mutex>* lock);
+  void Complete(size_t index, int64_t result);
+  void Reap(std::unique_lock<std::mutex>* lock, bool wait);
+  void WriteDirect(std::string_view message);
+  void ReportError(int64_t result);
+  void StartWriters();
+  void WriterLoop();
+};
+}  // namespace rtb_h
@@ -5,13 +5,15 @@
 
 #include "logger.hpp"
 
+#include <algorithm>
 #include <chrono>
-#include <iomanip>
 #include <mutex>
 #include <sstream>
 #include <thread>
 #include <utility>
 
+#include "module_logger.hpp"
+
 namespace rtb {
 /**
  * @brief Construct a new Logger object.
@@ -25,9 +27,12 @@ Logger::Logger(std::string file_sink_path)
       p_file_sink_(nullptr),
       file_sink_path_(std::move(file_sink_path)) {
   // Set the default mapping of log types to log sinks.
-  p_error_ = p_cerr_sink_;
-  p_warning_ = p_cerr_sink_;
-  p_info_ = p_cout_sink_;
+  auto config = std::make_unique<SinkConfig>();
+  config->sinks.fill(p_cout_sink_.get());
+  config->sinks[rtb_h::kWarning] = p_cerr_sink_.get();
+  config->sinks[rtb_h::kError] = p_cerr_sink_.get();
+  config->sinks[rtb_h::kFatal] = p_cerr_sink_.get();
+  Publish(std::move(config));
 }
 
 /**
@@ -65,26 +70,51 @@ void Logger::SetWarningSink(SinkType type) {
  */
 void Logger::SetInfoSink(SinkType type) { GetInstance().SetInfoSinkImpl(type); }
 
+/**
+ * @brief Set the minimum level of the messages that are logged.
+ *
+ * @param level The minimum level.
+ */
+void Logger::SetLevel(rtb_h::MessageType level) {
+  rtb_h::LoggerRegistry::Get().SetRootLevel(level);
+}
+
+/**
+ * @brief Get the minimum level of the messages that are logged.
+ *
+ * @return rtb_h::MessageType
+ */
+rtb_h::MessageType Logger::GetLevel() {
+  return static_cast<rtb_h::MessageType>(
+      rtb_h::g_log_level.load(std::memory_order_relaxed));
+}
+
 /**
  * @brief Set the error sink implementation.
  * 
  * @param type 
  */
-void Logger::SetErrorSinkImpl(SinkType type) { SetSink(type, &p_error_); }
+void Logger::SetErrorSinkImpl(SinkType type) {
+  SetSink(type, rtb_h::kError, rtb_h::kFatal);
+}
 
 /**
  * @brief Set the warning sink implementation.
  * 
  * @param type 
  */
-void Logger::SetWarningSinkImpl(SinkType type) { SetSink(type, &p_warning_); }
+void Logger::SetWarningSinkImpl(SinkType type) {
+  SetSink(type, rtb_h::kWarning, rtb_h::kWarning);
+}
 
 /**
  * @brief Set the info sink implementation.
  * 
  * @param type 
  */
-void Logger::SetInfoSinkImpl(SinkType type) { SetSink(type, &p_info_); }
+void Logger::SetInfoSinkImpl(SinkType type) {
+  SetSink(type, rtb_h::kTrace, rtb_h::kInfo);
+}
 
 /**
  * @brief Set the path to the log file.
@@ -101,7 +131,15 @@ void Logger::SetFileSinkPath(const std::string& filepath) {
  * @param filepath 
  */
 void Logger::SetFileSinkPathImpl(const std::string& filepath) {
+  const std::lock_guard<std::mutex> config_lock(config_mutex_);
   file_sink_path_ = filepath;
+  // Queued messages belong to the old file.
+  {
+    const std::lock_guard<std::mutex> lock(async_mutex_);
+    if (p_async_writer_ != nullptr) {
+      p_async_writer_->Flush();
+    }
+  }
   if (p_file_sink_ != nullptr) {
     auto p = std::dynamic_pointer_cast<rtb_h::LogSinkFile>(p_file_sink_);
     if (p != nullptr) {
@@ -111,30 +149,447 @@ void Logger::SetFileSinkPathImpl(const std::string& filepath) {
 }
 
 /**
- * @brief Assign a sink to the sink type.
- * 
- * @param type      The sink type.
- * @param sink_ptr  A pointer to the sink.
+ * @brief Set the path of the JSON Lines sink's file.
+ *
+ * @param filepath The file path.
+ */
+void Logger::SetJsonSinkPath(const std::string& filepath) {
+  GetInstance().SetJsonSinkPathImpl(filepath);
+}
+
+/**
+ * @brief Set the JSON Lines sink file path implementation.
+ *
+ * @param filepath The file path.
  */
-void Logger::SetSink(SinkType type, std::shared_ptr<rtb_h::LogSink>* sink_ptr) {
+void Logger::SetJsonSinkPathImpl(const std::string& filepath) {
+  const std::lock_guard<std::mutex> config_lock(config_mutex_);
+  json_sink_path_ = filepath;
+  {
+    const std::lock_guard<std::mutex> lock(async_mutex_);
+    if (p_async_writer_ != nullptr) {
+      p_async_writer_->Flush();
+    }
+  }
+  if (p_json_sink_ != nullptr) {
+    auto p = std::dynamic_pointer_cast<rtb_h::LogSinkJsonLines>(p_json_sink_);
+    if (p != nullptr) {
+      p->SetFilePath(filepath);
+    }
+  }
+}
+
+/**
+ * @brief Set how the file and JSON Lines sinks buffer lines and when they
+ * write them to their files.
+ *
+ * @param options The buffering and flush policy.
+ */
+void Logger::SetFileSinkOptions(const FileSinkOptions& options) {
+  GetInstance().SetFileSinkOptionsImpl(options);
+}
+
+/**
+ * @brief Set the file sink options implementation.
+ *
+ * @param options The buffering and flush policy.
+ */
+void Logger::SetFileSinkOptionsImpl(const FileSinkOptions& options) {
+  const std::lock_guard<std::mutex> config_lock(config_mutex_);
+  file_sink_options_ = options;
+  for (const auto& sink : {p_file_sink_, p_json_sink_}) {
+    auto p = std::dynamic_pointer_cast<rtb_h::LogSinkFile>(sink);
+    if (p != nullptr) {
+      p->SetOptions(options);
+    }
+  }
+}
+
+/**
+ * @brief Enable or disable asynchronous logging. When enabled, log calls
+ * only format the message and queue it; a background thread writes the
+ * queued messages to the sinks. Disabling it waits until the queue is empty.
+ *
+ * @param enabled
+ */
+void Logger::SetAsync(bool enabled) { GetInstance().SetAsyncImpl(enabled); }
+
+/**
+ * @brief Set what asynchronous log calls do when the queue is full. By
+ * default they wait for the writer.
+ *
+ * @param policy The backpressure policy.
+ */
+void Logger::SetBackpressure(const BackpressurePolicy& policy) {
+  GetInstance().SetBackpressureImpl(policy);
+}
+
+/**
+ * @brief Get the counters of the asynchronous logging queue. They are all
+ * zero until asynchronous logging is first enabled.
+ *
+ * @return AsyncLogStats The counters.
+ */
+AsyncLogStats Logger::GetAsyncStats() {
+  return GetInstance().GetAsyncStatsImpl();
+}
+
+/**
+ * @brief Wait until all queued messages have been written and flush the
+ * sinks.
+ *
+ */
+void Logger::Flush() { GetInstance().FlushImpl(); }
+
+/**
+ * @brief Enable or disable asynchronous logging implementation. The writer is
+ * created on first use and kept until the Logger is destroyed, so callers
+ * that still see the old setting can safely use it.
+ *
+ * @param enabled
+ */
+void Logger::SetAsyncImpl(bool enabled) {
+  const std::lock_guard<std::mutex> lock(async_mutex_);
+  if (enabled && p_async_writer_ == nullptr) {
+    p_async_writer_ = std::make_unique<rtb_h::AsyncLogWriter>(
+        kAsyncQueueCapacity, backpressure_);
+  }
+  async_.store(enabled, std::memory_order_release);
+  if (!enabled && p_async_writer_ != nullptr) {
+    p_async_writer_->Flush();
+  }
+}
+
+/**
+ * @brief Set backpressure implementation.
+ *
+ */
+void Logger::SetBackpressureImpl(const BackpressurePolicy& policy) {
+  const std::lock_guard<std::mutex> lock(async_mutex_);
+  backpressure_ = policy;
+  if (p_async_writer_ != nullptr) {
+    p_async_writer_->SetPolicy(policy);
+  }
+}
+
+/**
+ * @brief Get async stats implementation.
+ *
+ */
+AsyncLogStats Logger::GetAsyncStatsImpl() {
+  const std::lock_guard<std::mutex> lock(async_mutex_);
+  if (p_async_writer_ == nullptr) {
+    return AsyncLogStats{};
+  }
+  return p_async_writer_->GetStats();
+}
+
+/**
+ * @brief Flush implementation.
+ *
+ */
+void Logger::FlushImpl() {
+  {
+    const std::lock_guard<std::mutex> lock(async_mutex_);
+    if (p_async_writer_ != nullptr) {
+      p_async_writer_->Flush();
+    }
+  }
+  const std::lock_guard<std::mutex> lock(config_mutex_);
+  const SinkConfig* config = current_config_.get();
+  for (rtb_h::LogSink* sink : config->sinks) {
+    sink->Flush();
+  }
+  rtb_h::LoggerRegistry::Get().Flush();
+  for (const auto& targets : config->fanout) {
+    for (const SinkTarget& target : targets) {
+      if (target.writer != nullptr) {
+        target.writer->Flush();
+      } else {
+        target.sink->Flush();
+      }
+    }
+  }
+}
+
+/**
+ * @brief Write a formatted message to a sink, or queue it for the background
+ * writer if asynchronous logging is enabled.
+ *
+ * @param sink    The sink.
+ * @param message The formatted message.
+ * @param type    The message type.
+ */
+void Logger::Write(rtb_h::LogSink* sink, std::string_view message,
+                   rtb_h::MessageType type) const {
+  // Fatal messages are flushed at once, the program may be about to end.
+  if (async_.load(std::memory_order_acquire)) {
+    p_async_writer_->Enqueue(
+        rtb_h::LogRecord{sink, type, std::string(message)});
+    if (type == rtb_h::kFatal) {
+      p_async_writer_->Flush();
+    }
+  } else {
+    sink->Log(message, type);
+    if (type == rtb_h::kFatal) {
+      sink->Flush();
+    }
+  }
+}
+
+/**
+ * @brief Write a formatted message to an added sink, through its own queue
+ * if it has one.
+ *
+ * @param target  The sink.
+ * @param message The formatted message.
+ * @param type    The message type.
+ */
+void Logger::WriteTarget(const SinkTarget& target, std::string_view message,
+                         rtb_h::MessageType type) const {
+  if (target.writer != nullptr) {
+    target.writer->Enqueue(
+        rtb_h::LogRecord{target.sink, type, std::string(message)});
+    if (type == rtb_h::kFatal) {
+      target.writer->Flush();
+    }
+  } else {
+    target.sink->Log(message, type);
+    if (type == rtb_h::kFatal) {
+      target.sink->Flush();
+    }
+  }
+}
+
+/**
+ * @brief Add a sink that receives every message at or above a level, in
+ * addition to the sink selected for the message type. Messages are still
+ * filtered by the logger level first. A sink written synchronously is
+ * called by the logging threads concurrently; an asynchronous sink gets its
+ * own queue and background thread, so a slow sink does not delay the others.
+ *
+ * @param sink          The sink.
+ * @param min_level     The lowest message type written to the sink.
+ * @param async         Whether to write to the sink on its own thread.
+ * @param backpressure  What log calls do when the sink's queue is full.
+ * @return SinkId       Identifies the sink for RemoveSink().
+ */
+Logger::SinkId Logger::AddSink(std::shared_ptr<rtb_h::LogSink> sink,
+                               rtb_h::MessageType min_level, bool async,
+                               const BackpressurePolicy& backpressure) {
+  return GetInstance().AddSinkImpl(std::move(sink), min_level, async,
+                                   backpressure);
+}
+
+/**
+ * @brief Stop writing to an added sink. Queued messages are written first,
+ * then the sink's writer thread stops. Waits for the log calls in progress,
+ * so it must not be called from a sink.
+ *
+ * @param id The sink id returned by AddSink().
+ */
+void Logger::RemoveSink(SinkId id) { GetInstance().RemoveSinkImpl(id); }
+
+/**
+ * @brief Get the queue counters of a sink added with async set. They are all
+ * zero for other sinks.
+ *
+ * @param id              The sink id returned by AddSink().
+ * @return AsyncLogStats  The counters.
+ */
+AsyncLogStats Logger::GetSinkStats(SinkId id) {
+  return GetInstance().GetSinkStatsImpl(id);
+}
+
+/**
+ * @brief Add sink implementation.
+ *
+ */
+Logger::SinkId Logger::AddSinkImpl(std::shared_ptr<rtb_h::LogSink> sink,
+                                   rtb_h::MessageType min_level, bool async,
+                                   const BackpressurePolicy& backpressure) {
+  const std::lock_guard<std::mutex> lock(config_mutex_);
+  SinkRegistration registration{next_sink_id_++, min_level, std::move(sink),
+                                nullptr};
+  if (async) {
+    registration.writer = std::make_unique<rtb_h::AsyncLogWriter>(
+        kAsyncQueueCapacity, backpressure);
+  }
+  registrations_.push_back(std::move(registration));
+  PublishFanout();
+  return registrations_.back().id;
+}
+
+/**
+ * @brief Remove sink implementation.
+ *
+ */
+void Logger::RemoveSinkImpl(SinkId id) {
+  const std::lock_guard<std::mutex> lock(config_mutex_);
+  const auto it = std::find_if(
+      registrations_.begin(), registrations_.end(),
+      [id](const SinkRegistration& r) { return r.id == id; });
+  if (it == registrations_.end()) {
+    return;
+  }
+  SinkRegistration removed = std::move(*it);
+  registrations_.erase(it);
+  // Returns once no log call can still reach the sink, so nothing is queued
+  // after the flush. The writer thread then stops and only its counters are
+  // kept.
+  PublishFanout();
+  if (removed.writer != nullptr) {
+    removed.writer->Flush();
+    removed_stats_.emplace_back(id, removed.writer->GetStats());
+    removed.writer.reset();
+  }
+  removed.sink->Flush();
+}
+
+/**
+ * @brief Get sink stats implementation. Removed sinks keep their counters.
+ *
+ */
+AsyncLogStats Logger::GetSinkStatsImpl(SinkId id) {
+  const std::lock_guard<std::mutex> lock(config_mutex_);
+  for (const SinkRegistration& r : registrations_) {
+    if (r.id == id && r.writer != nullptr) {
+      return r.writer->GetStats();
+    }
+  }
+  for (const auto& [removed_id, stats] : removed_stats_) {
+    if (removed_id == id) {
+      return stats;
+    }
+  }
+  return AsyncLogStats{};
+}
+
+/**
+ * @brief Publish a configuration with the fan-out lists rebuilt from the
+ * added sinks. The configuration mutex is held.
+ *
+ */
+void Logger::PublishFanout() {
+  auto config =
+      std::make_unique<SinkConfig>(*current_config_);
+  for (auto& targets : config->fanout) {
+    targets.clear();
+  }
+  for (const SinkRegistration& r : registrations_) {
+    for (int t = r.min_level; t < rtb_h::kMessageTypeCount; t++) {
+      config->fanout[t].push_back(SinkTarget{r.sink.get(), r.writer.get()});
+    }
+  }
+  Publish(std::move(config));
+}
+
+/**
+ * @brief Assign a sink to a range of message types by publishing a new sink
+ * configuration.
+ *
+ * @param type  The sink type.
+ * @param first The first message type.
+ * @param last  The last message type.
+ */
+void Logger::SetSink(SinkType type, rtb_h::MessageType first,
+                     rtb_h::MessageType last) {
+  const std::lock_guard<std::mutex> lock(config_mutex_);
+  rtb_h::LogSink* sink = nullptr;
   switch (type) {
     case kSinkCerr:
-      *sink_ptr = p_cerr_sink_;
+      sink = p_cerr_sink_.get();
       break;
     case kSinkCout:
-      *sink_ptr = p_cout_sink_;
+      sink = p_cout_sink_.get();
       break;
     case kSinkNull:
-      *sink_ptr = p_null_sink_;
+      sink = p_null_sink_.get();
       break;
     case kSinkFile:
       if (p_file_sink_ == nullptr) {
-        p_file_sink_ = std::make_shared<rtb_h::LogSinkFile>(file_sink_path_);
+        p_file_sink_ = std::make_shared<rtb_h::LogSinkFile>(file_sink_path_,
+                                                           file_sink_options_);
       }
-      *sink_ptr = p_file_sink_;
-    default:
+      sink = p_file_sink_.get();
+      break;
+    case kSinkJson:
+      if (p_json_sink_ == nullptr) {
+        p_json_sink_ = std::make_shared<rtb_h::LogSinkJsonLines>(
+            json_sink_path_, file_sink_options_);
+      }
+      sink = p_json_sink_.get();
       break;
+    default:
+      return;
+  }
+
+  auto config =
+      std::make_unique<SinkConfig>(*current_config_);
+  for (int t = first; t <= last; t++) {
+    config->sinks[t] = sink;
+  }
+  Publish(std::move(config));
+}
+
+/**
+ * @brief Make a sink configuration the current one, and free the previous
+ * one once the log calls that may still be reading it have returned. The
+ * configuration mutex is held, except in the constructor.
+ *
+ * @param config The configuration.
+ */
+void Logger::Publish(std::unique_ptr<SinkConfig> config) {
+  unsigned discarded = 0;
+  for (int t = 0; t < rtb_h::kMessageTypeCount; t++) {
+    if (config->sinks[t] == p_null_sink_.get() && config->fanout[t].empty()) {
+      discarded |= 1U << t;
+    }
+  }
+  p_config_.store(config.get(), std::memory_order_seq_cst);
+  discarded_types_.store(discarded, std::memory_order_relaxed);
+  std::unique_ptr<const SinkConfig> replaced =
+      std::exchange(current_config_, std::move(config));
+  if (replaced != nullptr) {
+    rtb_h::g_log_readers.Synchronize();
+  }
+}
+
+/**
+ * @brief Get the log line prefix of a message type.
+ *
+ * @param type              The message type.
+ * @return std::string_view The prefix.
+ */
+std::string_view Logger::Prefix(rtb_h::MessageType type) const {
+  switch (type) {
+    case rtb_h::kTrace:
+      return kTracePrefix;
+    case rtb_h::kDebug:
+      return kDebugPrefix;
+    case rtb_h::kInfo:
+      return kInfoPrefix;
+    case rtb_h::kWarning:
+      return kWarningPrefix;
+    case rtb_h::kError:
+      return kErrorPrefix;
+    case rtb_h::kFatal:
+      return kFatalPrefix;
   }
+  return kInfoPrefix;
+}
+
+/**
+ * @brief Set how the timestamps of log lines are formatted.
+ *
+ * @param style     The timestamp style.
+ * @param precision The fraction of a second shown.
+ */
+void Logger::SetTimestampFormat(TimestampStyle style,
+                                TimestampPrecision precision) {
+  Logger& logger = GetInstance();
+  logger.timestamp_style_.store(style, std::memory_order_relaxed);
+  logger.timestamp_precision_.store(precision, std::memory_order_relaxed);
 }
 
 /**
@@ -143,15 +598,47 @@ void Logger::SetSink(SinkType type, std::shared_ptr<rtb_h::LogSink>* sink_ptr) {
  * @return std::string The timestamp as a formattted string.
  */
 std::string Logger::GetTimestamp() {
-  auto in_time_t =
-      std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
-  std::ostringstream ss;
+  rtb_h::ScopedLogBuffer buffer;
+  GetInstance().AppendTimestamp(&*buffer);
+  return std::string(buffer->View());
+}
 
-  // Because std::localtime is not thread-safe protect access with a mutex.
-  std::mutex localtime_mutex;
-  const std::lock_guard<std::mutex> lock(localtime_mutex);
+/**
+ * @brief Append the current timestamp and a separator to a log line.
+ *
+ * @param buffer    The log line.
+ * @param separator The character after the timestamp.
+ */
+void Logger::AppendTimestamp(rtb_h::LogBuffer* buffer, char separator) const {
+  const TimestampFormatter formatter(
+      timestamp_style_.load(std::memory_order_relaxed),
+      timestamp_precision_.load(std::memory_order_relaxed));
+  char* dst = buffer->Reserve(TimestampFormatter::kMaxLength + 1);
+  const size_t length =
+      formatter.Format(std::chrono::system_clock::now(), dst);
+  dst[length] = separator;
+  buffer->Commit(length + 1);
+}
 
-  ss << std::put_time(std::localtime(&in_time_t), "%Y-%m-%d %X ");
-  return ss.str();
+/**
+ * @brief Start a JSON Lines record with the time, level and message members.
+ * The caller appends further members and the closing brace.
+ *
+ * @param type    The message type.
+ * @param message The message, or nullptr.
+ * @param buffer  The log line.
+ */
+void Logger::AppendJsonHeader(rtb_h::MessageType type,
+                              const std::string_view* message,
+                              rtb_h::LogBuffer* buffer) const {
+  buffer->Append("{\"time\":\"");
+  AppendTimestamp(buffer, '"');
+  buffer->Append(",\"level\":\"");
+  buffer->Append(rtb_h::MessageTypeName(type));
+  buffer->Append('"');
+  if (message != nullptr) {
+    buffer->Append(",\"message\":");
+    rtb_h::AppendJsonString(*message, buffer);
+  }
 }
 }  // namespace rtb
\ No newline at end of file
@@ -4,58 +4,256 @@
 // Copyright (c) 2021 Roger Davies, all rights reserved
 #pragma once
 
+#include <array>
+#include <atomic>
 #include <memory>
-#include <sstream>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
 
+#include "async_log_writer.hpp"
+#include "grace_period.hpp"
+#include "log_format.hpp"
+#include "log_json.hpp"
+#include "log_limit.hpp"
 #include "log_sink.hpp"
+#include "timestamp.hpp"
+
+//  Log through these macros so that the arguments of disabled messages are
+//  never evaluated. Calls below RTB_MIN_LOG_LEVEL are removed at compile time.
+#define RTB_LOG(level, function, ...)                                       \
+  do {                                                                      \
+    if ((level) >= RTB_MIN_LOG_LEVEL && rtb_h::LogLevelEnabled(level)) {   \
+      rtb::Logger::function(__VA_ARGS__);                                   \
+    }                                                                       \
+  } while (false)
+#define RTB_LOG_TRACE(...) RTB_LOG(rtb_h::kTrace, LogTrace, __VA_ARGS__)
+#define RTB_LOG_DEBUG(...) RTB_LOG(rtb_h::kDebug, LogDebug, __VA_ARGS__)
+#define RTB_LOG_INFO(...) RTB_LOG(rtb_h::kInfo, LogInfo, __VA_ARGS__)
+#define RTB_LOG_WARNING(...) RTB_LOG(rtb_h::kWarning, LogWarning, __VA_ARGS__)
+#define RTB_LOG_ERROR(...) RTB_LOG(rtb_h::kError, LogError, __VA_ARGS__)
+#define RTB_LOG_FATAL(...) RTB_LOG(rtb_h::kFatal, LogFatal, __VA_ARGS__)
+
+//  Log a value computed by an expression that is only evaluated if the
+//  message is enabled and its sinks do not all discard it, e.g.
+//  RTB_LOG_LAZY(rtb_h::kDebug, "state", MatrixToString(m)).
+#define RTB_LOG_LAZY(level, message, ...)                                  \
+  RTB_LOG(level, Log, level, rtb::Lazy([&]() { return (__VA_ARGS__); }),  \
+          message)
+
+//  Log a message with fields created by rtb::Field(key, value).
+#define RTB_LOG_FIELDS(level, ...) RTB_LOG(level, LogFields, level, __VA_ARGS__)
+
+//  Log at most burst messages at once and per_second on average from this
+//  call site. The number of refused messages is logged before the next one
+//  that is allowed.
+#define RTB_LOG_RATE_LIMITED(level, per_second, burst, ...)                \
+  do {                                                                      \
+    if ((level) >= RTB_MIN_LOG_LEVEL && rtb_h::LogLevelEnabled(level)) {   \
+      static rtb_h::LogRateLimiter rtb_log_limiter(per_second, burst);      \
+      uint64_t rtb_log_suppressed = 0;                                      \
+      if (rtb_log_limiter.Allow(&rtb_log_suppressed)) {                     \
+        if (rtb_log_suppressed > 0) {                                       \
+          rtb::Logger::Log(level, rtb_log_suppressed,                       \
+                           "messages suppressed by rate limit");            \
+        }                                                                   \
+        rtb::Logger::Log(level, __VA_ARGS__);                               \
+      }                                                                     \
+    }                                                                       \
+  } while (false)
+
+//  Log the first and then every nth message from this call site.
+#define RTB_LOG_EVERY_N(level, n, ...)                                      \
+  do {                                                                      \
+    if ((level) >= RTB_MIN_LOG_LEVEL && rtb_h::LogLevelEnabled(level)) {   \
+      static rtb_h::LogSampler rtb_log_sampler(n);                          \
+      if (rtb_log_sampler.Sample()) {                                       \
+        rtb::Logger::Log(level, __VA_ARGS__);                               \
+      }                                                                     \
+    }                                                                       \
+  } while (false)
+
+//  Collapse consecutive identical messages from this call site into one
+//  line and a count, logged when a different message follows and every
+//  1000 repeats or 10 seconds while the message keeps repeating.
+#define RTB_LOG_DEDUP(level, ...)                                           \
+  do {                                                                      \
+    if ((level) >= RTB_MIN_LOG_LEVEL && rtb_h::LogLevelEnabled(level)) {   \
+      static rtb_h::LogDeduplicator rtb_log_dedup;                          \
+      rtb::Logger::LogDeduplicated(&rtb_log_dedup, level, __VA_ARGS__);     \
+    }                                                                       \
+  } while (false)
 
 namespace rtb {
 /**
  * @brief Singleton class for logging errors, warnings and information. The
- * class can handle any type that implements operator<<.
+ * class can handle any type that implements operator<<. Messages below the
+ * runtime level (SetLevel(), kInfo by default) are discarded before they are
+ * formatted. Trace and debug messages go to the info sink, fatal messages to
+ * the error sink.
  *
  */
 class Logger {
  public:
-  enum SinkType { kSinkCerr = 0, kSinkCout, kSinkNull, kSinkFile };
+  enum SinkType { kSinkCerr = 0, kSinkCout, kSinkNull, kSinkFile, kSinkJson };
+  using SinkId = int;
 
   explicit Logger(std::string file_sink_path);
   ~Logger() = default;
 
   template <typename T>
-  static void LogError(const T& value) {
-    GetInstance().LogErrorImpl(value);
+  static void LogTrace(const T& value) {
+    if (rtb_h::LogLevelEnabled(rtb_h::kTrace)) {
+      GetInstance().LogTraceImpl(value);
+    }
   }
 
   template <typename T>
-  static void LogError(const T& value, const std::string& message) {
-    GetInstance().LogErrorImpl(value, message);
+  static void LogTrace(const T& value, std::string_view message) {
+    if (rtb_h::LogLevelEnabled(rtb_h::kTrace)) {
+      GetInstance().LogTraceImpl(value, message);
+    }
   }
 
   template <typename T>
-  static void LogWarning(const T& value) {
-    GetInstance().LogWarningImpl(value);
+  static void LogDebug(const T& value) {
+    if (rtb_h::LogLevelEnabled(rtb_h::kDebug)) {
+      GetInstance().LogDebugImpl(value);
+    }
   }
 
   template <typename T>
-  static void LogWarning(const T& value, const std::string& message) {
-    GetInstance().LogWarningImpl(value, message);
+  static void LogDebug(const T& value, std::string_view message) {
+    if (rtb_h::LogLevelEnabled(rtb_h::kDebug)) {
+      GetInstance().LogDebugImpl(value, message);
+    }
   }
 
   template <typename T>
   static void LogInfo(const T& value) {
-    GetInstance().LogInfoImpl(value);
+    if (rtb_h::LogLevelEnabled(rtb_h::kInfo)) {
+      GetInstance().LogInfoImpl(value);
+    }
+  }
+
+  template <typename T>
+  static void LogInfo(const T& value, std::string_view message) {
+    if (rtb_h::LogLevelEnabled(rtb_h::kInfo)) {
+      GetInstance().LogInfoImpl(value, message);
+    }
+  }
+
+  template <typename T>
+  static void LogWarning(const T& value) {
+    if (rtb_h::LogLevelEnabled(rtb_h::kWarning)) {
+      GetInstance().LogWarningImpl(value);
+    }
+  }
+
+  template <typename T>
+  static void LogWarning(const T& value, std::string_view message) {
+    if (rtb_h::LogLevelEnabled(rtb_h::kWarning)) {
+      GetInstance().LogWarningImpl(value, message);
+    }
+  }
+
+  template <typename T>
+  static void LogError(const T& value) {
+    if (rtb_h::LogLevelEnabled(rtb_h::kError)) {
+      GetInstance().LogErrorImpl(value);
+    }
   }
 
   template <typename T>
-  static void LogInfo(const T& value, const std::string& message) {
-    GetInstance().LogInfoImpl(value, message);
+  static void LogError(const T& value, std::string_view message) {
+    if (rtb_h::LogLevelEnabled(rtb_h::kError)) {
+      GetInstance().LogErrorImpl(value, message);
+    }
+  }
+
+  template <typename T>
+  static void LogFatal(const T& value) {
+    if (rtb_h::LogLevelEnabled(rtb_h::kFatal)) {
+      GetInstance().LogFatalImpl(value);
+    }
+  }
+
+  template <typename T>
+  static void LogFatal(const T& value, std::string_view message) {
+    if (rtb_h::LogLevelEnabled(rtb_h::kFatal)) {
+      GetInstance().LogFatalImpl(value, message);
+    }
+  }
+
+  template <typename T>
+  static void Log(rtb_h::MessageType type, const T& value) {
+    if (rtb_h::LogLevelEnabled(type)) {
+      Logger& logger = GetInstance();
+      logger.LogImpl(type, logger.Prefix(type), nullptr, value);
+    }
+  }
+
+  template <typename T>
+  static void Log(rtb_h::MessageType type, const T& value,
+                  std::string_view message) {
+    if (rtb_h::LogLevelEnabled(type)) {
+      Logger& logger = GetInstance();
+      logger.LogImpl(type, logger.Prefix(type), &message, value);
+    }
+  }
+
+  template <typename T>
+  static void LogDeduplicated(rtb_h::LogDeduplicator* site,
+                              rtb_h::MessageType type, const T& value) {
+    if (rtb_h::LogLevelEnabled(type)) {
+      GetInstance().LogDeduplicatedImpl(site, type, nullptr, value);
+    }
+  }
+
+  template <typename T>
+  static void LogDeduplicated(rtb_h::LogDeduplicator* site,
+                              rtb_h::MessageType type, const T& value,
+                              std::string_view message) {
+    if (rtb_h::LogLevelEnabled(type)) {
+      GetInstance().LogDeduplicatedImpl(site, type, &message, value);
+    }
+  }
+
+  template <typename... Fields>
+  static void LogFields(rtb_h::MessageType type, std::string_view message,
+                        const LogField<Fields>&... fields) {
+    if (rtb_h::LogLevelEnabled(type)) {
+      GetInstance().LogFieldsImpl(type, message, fields...);
+    }
   }
 
   static void SetErrorSink(SinkType type);
   static void SetWarningSink(SinkType type);
   static void SetInfoSink(SinkType type);
+  static SinkId AddSink(std::shared_ptr<rtb_h::LogSink> sink,
+                        rtb_h::MessageType min_level = rtb_h::kTrace,
+                        bool async = false,
+                        const BackpressurePolicy& backpressure = {});
+  static void RemoveSink(SinkId id);
+  static AsyncLogStats GetSinkStats(SinkId id);
+  static void SetLevel(rtb_h::MessageType level);
+  static rtb_h::MessageType GetLevel();
+  static bool IsEnabled(rtb_h::MessageType level) {
+    return rtb_h::LogLevelEnabled(level);
+  }
   static void SetFileSinkPath(const std::string& filepath);
+  static void SetJsonSinkPath(const std::string& filepath);
+  static void SetFileSinkOptions(const FileSinkOptions& options);
+  static void SetAsync(bool enabled);
+  static void SetBackpressure(const BackpressurePolicy& policy);
+  static AsyncLogStats GetAsyncStats();
+  static void Flush();
+  static void SetTimestampFormat(
+      TimestampStyle style,
+      TimestampPrecision precision = TimestampPrecision::kSeconds);
   static std::string GetTimestamp();
 
   Logger() = delete;
@@ -65,74 +263,339 @@ class Logger {
   Logger& operator=(const Logger&&) = delete;
 
  private:
+  friend class ModuleLogger;
+
   // Log line prefixes.
-  const std::string kErrorPrefix = "[Error  ] ";
-  const std::string kWarningPrefix = "[Warning] ";
+  const std::string kTracePrefix = "[Trace  ] ";
+  const std::string kDebugPrefix = "[Debug  ] ";
   const std::string kInfoPrefix = "[Info   ] ";
+  const std::string kWarningPrefix = "[Warning] ";
+  const std::string kErrorPrefix = "[Error  ] ";
+  const std::string kFatalPrefix = "[Fatal  ] ";
 
   // Pointers to the different possible sinks.
   std::shared_ptr<rtb_h::LogSink> p_cout_sink_;
   std::shared_ptr<rtb_h::LogSink> p_cerr_sink_;
   std::shared_ptr<rtb_h::LogSink> p_null_sink_;
   std::shared_ptr<rtb_h::LogSink> p_file_sink_;
+  std::shared_ptr<rtb_h::LogSink> p_json_sink_;
+
+  // The sinks associated with each message type. Log calls read the current
+  // configuration with one atomic load and no lock; changes publish a
+  // modified copy. A replaced configuration is freed once the log calls
+  // that may still be reading it have returned, see rtb_h::g_log_readers.
+  // Besides the sink selected for its type, each message type fans out to
+  // the added sinks whose level it reaches.
+  struct SinkTarget {
+    rtb_h::LogSink* sink;
+    rtb_h::AsyncLogWriter* writer;  // The sink's own queue, or nullptr.
+  };
+  struct SinkConfig {
+    std::array<rtb_h::LogSink*, rtb_h::kMessageTypeCount> sinks{};
+    std::array<std::vector<SinkTarget>, rtb_h::kMessageTypeCount> fanout;
+  };
+  std::atomic<const SinkConfig*> p_config_{nullptr};
+  std::unique_ptr<const SinkConfig> current_config_;
+  // Bit t is set when message type t goes to the null sink only, its lines
+  // are then not formatted.
+  std::atomic<unsigned> discarded_types_{0};
+  std::mutex config_mutex_;
 
-  // Pointers to the sinks associated with each log type.
-  std::shared_ptr<rtb_h::LogSink> p_error_;
-  std::shared_ptr<rtb_h::LogSink> p_warning_;
-  std::shared_ptr<rtb_h::LogSink> p_info_;
+  // Sinks added with AddSink(). Of a removed sink only the queue counters
+  // are kept. The writer is declared after the sink so that it drains its
+  // queue first.
+  struct SinkRegistration {
+    SinkId id;
+    rtb_h::MessageType min_level;
+    std::shared_ptr<rtb_h::LogSink> sink;
+    std::unique_ptr<rtb_h::AsyncLogWriter> writer;
+  };
+  std::vector<SinkRegistration> registrations_;
+  std::vector<std::pair<SinkId, AsyncLogStats>> removed_stats_;
+  SinkId next_sink_id_{1};
 
   std::string file_sink_path_;
+  std::string json_sink_path_{"rtb.jsonl"};
+  FileSinkOptions file_sink_options_;
+
+  std::atomic<TimestampStyle> timestamp_style_{TimestampStyle::kLocal};
+  std::atomic<TimestampPrecision> timestamp_precision_{
+      TimestampPrecision::kSeconds};
+
+  // Background writer for asynchronous logging. Declared after the sinks so
+  // that it is destroyed, and drains its queue, before them.
+  static constexpr size_t kAsyncQueueCapacity = 8192;
+  std::atomic<bool> async_{false};
+  std::mutex async_mutex_;
+  BackpressurePolicy backpressure_;
+  std::unique_ptr<rtb_h::AsyncLogWriter> p_async_writer_;
 
   static Logger& GetInstance();
 
+  void Write(rtb_h::LogSink* sink, std::string_view message,
+             rtb_h::MessageType type) const;
+  void WriteTarget(const SinkTarget& target, std::string_view message,
+                   rtb_h::MessageType type) const;
+
+  /**
+   * @brief Write a message to the sink of its type and to the added sinks.
+   * The line is formatted at most once as text and once as JSON, and the
+   * same buffer is shared by all sinks taking that format.
+   *
+   * @param type        The message type.
+   * @param format      Callable formatting the line: (bool structured,
+   *                    rtb_h::LogBuffer*).
+   * @param module_sink The module sink, read inside the log call. Unless it
+   *                    holds nullptr it replaces the sink of the type.
+   */
+  template <typename Format>
+  void Dispatch(
+      rtb_h::MessageType type, const Format& format,
+      const std::atomic<rtb_h::LogSink*>* module_sink = nullptr) const {
+    // Checked before the read section, so that discarded lines cost one
+    // load.
+    if ((module_sink == nullptr ||
+         module_sink->load(std::memory_order_relaxed) == nullptr) &&
+        (discarded_types_.load(std::memory_order_relaxed) & (1U << type)) !=
+            0) {
+      return;
+    }
+    const rtb_h::GracePeriod::ReadSection section(&rtb_h::g_log_readers);
+    const SinkConfig* config = p_config_.load(std::memory_order_seq_cst);
+    rtb_h::LogSink* sink = module_sink != nullptr
+                               ? module_sink->load(std::memory_order_seq_cst)
+                               : nullptr;
+    if (sink == nullptr) {
+      sink = config->sinks[type];
+    }
+    std::optional<rtb_h::ScopedLogBuffer> lines[2];
+    auto line = [&lines, &format](const rtb_h::LogSink* sink) {
+      const bool structured = sink->IsStructured();
+      std::optional<rtb_h::ScopedLogBuffer>& buffer = lines[structured];
+      if (!buffer.has_value()) {
+        buffer.emplace();
+        format(structured, &**buffer);
+      }
+      return (*buffer)->View();
+    };
+    Write(sink, line(sink), type);
+    for (const SinkTarget& target : config->fanout[type]) {
+      WriteTarget(target, line(target.sink), type);
+    }
+  }
+
+  void AppendTimestamp(rtb_h::LogBuffer* buffer, char separator = ' ') const;
+  void AppendJsonHeader(rtb_h::MessageType type,
+                        const std::string_view* message,
+                        rtb_h::LogBuffer* buffer) const;
+  [[nodiscard]] std::string_view Prefix(rtb_h::MessageType type) const;
+
   template <typename T>
-  void LogErrorImpl(const T& value) const {
-    std::ostringstream buffer;
-    buffer << kErrorPrefix << GetTimestamp() << value;
-    p_error_->Log(buffer.str(), rtb_h::kError);
+  void LogTraceImpl(const T& value) const {
+    LogImpl(rtb_h::kTrace, kTracePrefix, nullptr, value);
   }
 
   template <typename T>
-  void LogErrorImpl(const T& value, const std::string& message) const {
-    std::ostringstream buffer;
-    buffer  << kErrorPrefix << GetTimestamp() << message << ": "
-           << value;
-    p_error_->Log(buffer.str(), rtb_h::kError);
+  void LogTraceImpl(const T& value, std::string_view message) const {
+    LogImpl(rtb_h::kTrace, kTracePrefix, &message, value);
   }
 
   template <typename T>
-  void LogWarningImpl(const T& value) const {
-    std::ostringstream buffer;
-    buffer << kWarningPrefix << GetTimestamp() << value;
-    p_warning_->Log(buffer.str(), rtb_h::kWarning);
+  void LogDebugImpl(const T& value) const {
+    LogImpl(rtb_h::kDebug, kDebugPrefix, nullptr, value);
   }
 
   template <typename T>
-  void LogWarningImpl(const T& value, const std::string& message) const {
-    std::ostringstream buffer;
-    buffer  << kWarningPrefix << GetTimestamp() << message
-           << ": " << value;
-    p_warning_->Log(buffer.str(), rtb_h::kWarning);
+  void LogDebugImpl(const T& value, std::string_view message) const {
+    LogImpl(rtb_h::kDebug, kDebugPrefix, &message, value);
   }
 
   template <typename T>
   void LogInfoImpl(const T& value) const {
-    std::ostringstream buffer;
-    buffer << kInfoPrefix << GetTimestamp() << value;
-    p_info_->Log(buffer.str(), rtb_h::kInfo);
+    LogImpl(rtb_h::kInfo, kInfoPrefix, nullptr, value);
+  }
+
+  template <typename T>
+  void LogInfoImpl(const T& value, std::string_view message) const {
+    LogImpl(rtb_h::kInfo, kInfoPrefix, &message, value);
+  }
+
+  template <typename T>
+  void LogWarningImpl(const T& value) const {
+    LogImpl(rtb_h::kWarning, kWarningPrefix, nullptr, value);
+  }
+
+  template <typename T>
+  void LogWarningImpl(const T& value, std::string_view message) const {
+    LogImpl(rtb_h::kWarning, kWarningPrefix, &message, value);
+  }
+
+  template <typename T>
+  void LogErrorImpl(const T& value) const {
+    LogImpl(rtb_h::kError, kErrorPrefix, nullptr, value);
+  }
+
+  template <typename T>
+  void LogErrorImpl(const T& value, std::string_view message) const {
+    LogImpl(rtb_h::kError, kErrorPrefix, &message, value);
+  }
+
+  template <typename T>
+  void LogFatalImpl(const T& value) const {
+    LogImpl(rtb_h::kFatal, kFatalPrefix, nullptr, value);
+  }
+
+  template <typename T>
+  void LogFatalImpl(const T& value, std::string_view message) const {
+    LogImpl(rtb_h::kFatal, kFatalPrefix, &message, value);
+  }
+
+  /**
+   * @brief Format a log line into a per-thread buffer and write it.
+   *
+   * @param type    The message type.
+   * @param prefix  The line prefix.
+   * @param message The message, or nullptr.
+   * @param value   The value.
+   */
+  template <typename T>
+  void LogImpl(rtb_h::MessageType type, std::string_view prefix,
+               const std::string_view* message, const T& value) const {
+    Dispatch(type, [&](bool structured, rtb_h::LogBuffer* buffer) {
+      if (structured) {
+        AppendJsonHeader(type, message, buffer);
+        buffer->Append(",\"value\":");
+        rtb_h::AppendJsonValue(value, buffer);
+        buffer->Append('}');
+      } else {
+        buffer->Append(prefix);
+        AppendTimestamp(buffer);
+        if (message != nullptr) {
+          buffer->Append(*message);
+          buffer->Append(": ");
+        }
+        FormatLogValue(value, buffer);
+      }
+    });
+  }
+
+  /**
+   * @brief Log a line of a named module, see ModuleLogger. The level has been
+   * checked against the module level.
+   *
+   * @param module  The module name.
+   * @param sink    The module sink, holding nullptr for the sink of the
+   *                type.
+   * @param type    The message type.
+   * @param message The message, or nullptr.
+   * @param value   The value.
+   */
+  template <typename T>
+  void LogModuleImpl(std::string_view module,
+                     const std::atomic<rtb_h::LogSink*>& sink,
+                     rtb_h::MessageType type, const std::string_view* message,
+                     const T& value) const {
+    Dispatch(
+        type,
+        [&](bool structured, rtb_h::LogBuffer* buffer) {
+          if (structured) {
+            AppendJsonHeader(type, message, buffer);
+            buffer->Append(",\"logger\":");
+            rtb_h::AppendJsonString(module, buffer);
+            buffer->Append(",\"value\":");
+            rtb_h::AppendJsonValue(value, buffer);
+            buffer->Append('}');
+          } else {
+            buffer->Append(Prefix(type));
+            AppendTimestamp(buffer);
+            buffer->Append('[');
+            buffer->Append(module);
+            buffer->Append("] ");
+            if (message != nullptr) {
+              buffer->Append(*message);
+              buffer->Append(": ");
+            }
+            FormatLogValue(value, buffer);
+          }
+        },
+        &sink);
+  }
+
+  /**
+   * @brief Log a message with fields, as JSON members for structured sinks
+   * and as key=value pairs after the message otherwise.
+   *
+   * @param type    The message type.
+   * @param message The message.
+   * @param fields  The fields.
+   */
+  template <typename... Fields>
+  void LogFieldsImpl(rtb_h::MessageType type, std::string_view message,
+                     const LogField<Fields>&... fields) const {
+    Dispatch(type, [&](bool structured, rtb_h::LogBuffer* buffer) {
+      if (structured) {
+        AppendJsonHeader(type, &message, buffer);
+        (rtb_h::AppendJsonField(fields, buffer), ...);
+        buffer->Append('}');
+      } else {
+        buffer->Append(Prefix(type));
+        AppendTimestamp(buffer);
+        buffer->Append(message);
+        (rtb_h::AppendTextField(fields, buffer), ...);
+      }
+    });
   }
 
+  /**
+   * @brief Log a message unless it repeats the previous message of its call
+   * site. The message text is formatted first to compare it.
+   *
+   * @param site    The call site.
+   * @param type    The message type.
+   * @param message The message, or nullptr.
+   * @param value   The value.
+   */
   template <typename T>
-  void LogInfoImpl(const T& value, const std::string& message) const {
-    std::ostringstream buffer;
-    buffer << kInfoPrefix << GetTimestamp() << message << ": " << value;
-    p_info_->Log(buffer.str(), rtb_h::kInfo);
+  void LogDeduplicatedImpl(rtb_h::LogDeduplicator* site,
+                           rtb_h::MessageType type,
+                           const std::string_view* message,
+                           const T& value) const {
+    rtb_h::ScopedLogBuffer text;
+    if (message != nullptr) {
+      text->Append(*message);
+      text->Append(": ");
+    }
+    FormatLogValue(value, &*text);
+    uint64_t repeats = 0;
+    const bool differs = site->Check(text->View(), &repeats);
+    if (repeats > 0) {
+      const std::string_view repeated = "last message repeated";
+      LogImpl(type, Prefix(type), &repeated, repeats);
+    }
+    if (differs) {
+      const std::string_view body = text->View();
+      LogImpl(type, Prefix(type), nullptr, body);
+    }
   }
 
   void SetErrorSinkImpl(SinkType type);
   void SetWarningSinkImpl(SinkType type);
   void SetInfoSinkImpl(SinkType type);
   void SetFileSinkPathImpl(const std::string& filepath);
-  void SetSink(SinkType type, std::shared_ptr<rtb_h::LogSink>* sink_ptr);
+  void SetJsonSinkPathImpl(const std::string& filepath);
+  void SetFileSinkOptionsImpl(const FileSinkOptions& options);
+  void SetAsyncImpl(bool enabled);
+  void SetBackpressureImpl(const BackpressurePolicy& policy);
+  AsyncLogStats GetAsyncStatsImpl();
+  void FlushImpl();
+  void SetSink(SinkType type, rtb_h::MessageType first,
+               rtb_h::MessageType last);
+  SinkId AddSinkImpl(std::shared_ptr<rtb_h::LogSink> sink,
+                     rtb_h::MessageType min_level, bool async,
+                     const BackpressurePolicy& backpressure);
+  void RemoveSinkImpl(SinkId id);
+  AsyncLogStats GetSinkStatsImpl(SinkId id);
+  void PublishFanout();
+  void Publish(std::unique_ptr<SinkConfig> config);
 };
 }  // namespace rtb
\ No newline at end of file
@@ -6,9 +6,95 @@
 #include "matrix.hpp"
 
 #include <math.h>
+#include <unistd.h>
 
+#include <algorithm>
+#include <array>
+#include <limits>
 #include <stdexcept>
 
+namespace rtb_h {
+// Minimum work (multiply-adds) per Multiply task.
+const size_t kMultiplyParallelWork = 1U << 18U;
+// Blocking plans cached per thread.
+constexpr size_t kMultiplyPlanCacheSize = 16;
+
+/**
+ * @brief Get the size of a data cache level in bytes, or a fallback if the
+ * system does not report it.
+ *
+ * @param name      The sysconf name of the cache size.
+ * @param fallback  The size to use if it is unknown.
+ * @return size_t   The cache size in bytes.
+ */
+size_t CacheSize(int name, size_t fallback) {
+  long size = sysconf(name);
+  return size > 0 ? static_cast<size_t>(size) : fallback;
+}
+
+/**
+ * @brief Compute the blocking plan for a matrix product of the given shape.
+ * The inner loop streams a row of a (block_inner x block_cols) panel of the
+ * right-hand matrix, which is sized to stay resident in L2 while a block of
+ * rows of the left-hand matrix is processed.
+ *
+ * @param m             The rows of the left-hand matrix.
+ * @param k             The inner dimension.
+ * @param n             The columns of the right-hand matrix.
+ * @return MultiplyPlan The plan.
+ */
+MultiplyPlan MakeMultiplyPlan(size_t m, size_t k, size_t n) {
+  static const size_t l1_size = CacheSize(_SC_LEVEL1_DCACHE_SIZE, 32U << 10U);
+  static const size_t l2_size = CacheSize(_SC_LEVEL2_CACHE_SIZE, 256U << 10U);
+
+  MultiplyPlan plan{};
+  // A row segment of the product and of the right-hand panel fit in L1.
+  plan.block_cols =
+      std::max<size_t>(1, std::min(n, l1_size / (4 * sizeof(double))));
+  // Half of L2 holds the right-hand panel.
+  plan.block_inner = std::max<size_t>(
+      1, std::min(k, l2_size / (2 * sizeof(double) * plan.block_cols)));
+  plan.block_rows = std::max<size_t>(1, std::min<size_t>(m, 32));
+  // Give each task at least kMultiplyParallelWork multiply-adds.
+  const size_t row_block_work = plan.block_rows * std::max<size_t>(1, k * n);
+  plan.row_block_grain =
+      std::max<size_t>(1, kMultiplyParallelWork / row_block_work);
+  return plan;
+}
+
+/**
+ * @brief Get the (cached) blocking plan for a matrix product of the given
+ * shape. Each thread keeps its own small direct-mapped cache, so the lookup
+ * does not lock and a workload with many shapes does not grow it; a shape
+ * that misses simply has its plan recomputed.
+ *
+ * @param m             The rows of the left-hand matrix.
+ * @param k             The inner dimension.
+ * @param n             The columns of the right-hand matrix.
+ * @return MultiplyPlan The plan.
+ */
+MultiplyPlan GetMultiplyPlan(size_t m, size_t k, size_t n) {
+  struct CachedPlan {
+    std::array<size_t, 3> shape{};
+    MultiplyPlan plan{};
+    bool valid{false};
+  };
+  thread_local std::array<CachedPlan, kMultiplyPlanCacheSize> plans;
+
+  const std::array<size_t, 3> shape{m, k, n};
+  size_t hash = m;
+  hash = hash * 1000003U ^ k;
+  hash = hash * 1000003U ^ n;
+  CachedPlan& cached = plans[hash % plans.size()];
+  if (!cached.valid || cached.shape != shape) {
+    cached.shape = shape;
+    cached.plan = MakeMultiplyPlan(m, k, n);
+    cached.valid = true;
+  }
+  return cached.plan;
+}
+}  // namespace rtb_h
+
 namespace rtb {
 /**
  * @brief Construct a new Matrix object.
@@ -59,11 +145,7 @@ Matrix Matrix::operator+(const Matrix& other) const {
         "operator+: Cannot add matrices of different size");
   }
 
-  Matrix m(rows_, cols_);
-  for (size_t k = 0; k < rows_ * cols_; k++) {
-    m.elements_[k] = elements_[k] + other.elements_[k];
-  }
-  return m;
+  return Zip(other, [](double a, double b) { return a + b; });
 }
 
 /**
@@ -78,11 +160,7 @@ Matrix Matrix::operator-(const Matrix& other) const {
         "operator-: Cannot subtract matrices of different size");
   }
 
-  Matrix m(rows_, cols_);
-  for (size_t k = 0; k < rows_ * cols_; k++) {
-    m.elements_[k] = elements_[k] - other.elements_[k];
-  }
-  return m;
+  return Zip(other, [](double a, double b) { return a - b; });
 }
 
 /**
@@ -92,11 +170,7 @@ Matrix Matrix::operator-(const Matrix& other) const {
  * @return Matrix  The result
  */
 Matrix Matrix::operator*(double scalar) const {
-  Matrix m(rows_, cols_);
-  for (size_t k = 0; k < rows_ * cols_; k++) {
-    m.elements_[k] = elements_[k] * scalar;
-  }
-  return m;
+  return Map([scalar](double a) { return a * scalar; });
 }
 
 /**
@@ -161,16 +235,181 @@ Matrix Matrix::Multiply(const Matrix& other) const {
   }
 
   rtb::Matrix product(rows_, other.cols_);
-  for (size_t i = 0; i < product.rows_; i++) {
-    for (size_t j = 0; j < product.cols_; j++) {
-      for (size_t k = 0; k < cols_; k++) {
-        product(i, j) +=
-            elements_[(i * cols_) + k] * other.elements_[j + (k * other.cols_)];
+  MultiplyInto(*this, other, &product);
+  return product;
+}
+
+/**
+ * @brief Multiply two matrices of compatible size into an existing product
+ * matrix of the right size, overwriting its elements. The product must not
+ * alias either operand.
+ *
+ * @param a       The left-hand matrix
+ * @param b       The right-hand matrix
+ * @param product The result
+ */
+void Matrix::MultiplyInto(const Matrix& a, const Matrix& b, Matrix* product) {
+  const size_t m = a.rows_;
+  const size_t k = a.cols_;
+  const size_t n = b.cols_;
+  const rtb_h::MultiplyPlan plan = rtb_h::GetMultiplyPlan(m, k, n);
+
+  const double* lhs = a.elements_.data();
+  const double* rhs = b.elements_.data();
+  double* dst = product->elements_.data();
+  std::fill(product->elements_.begin(), product->elements_.end(), 0.0);
+
+  const size_t row_blocks = (m + plan.block_rows - 1) / plan.block_rows;
+  auto multiply_row_blocks = [&](size_t rb_begin, size_t rb_end) {
+    const size_t i_begin = rb_begin * plan.block_rows;
+    const size_t i_end = std::min(m, rb_end * plan.block_rows);
+    for (size_t ii = i_begin; ii < i_end; ii += plan.block_rows) {
+      const size_t ii_end = std::min(i_end, ii + plan.block_rows);
+      for (size_t kk = 0; kk < k; kk += plan.block_inner) {
+        const size_t k_end = std::min(k, kk + plan.block_inner);
+        for (size_t jj = 0; jj < n; jj += plan.block_cols) {
+          const size_t j_end = std::min(n, jj + plan.block_cols);
+          for (size_t i = ii; i < ii_end; i++) {
+            double* dst_row = dst + i * n;
+            for (size_t p = kk; p < k_end; p++) {
+              const double lhs_ip = lhs[i * k + p];
+              const double* rhs_row = rhs + p * n;
+#pragma omp simd
+              for (size_t j = jj; j < j_end; j++) {
+                dst_row[j] += lhs_ip * rhs_row[j];
+              }
+            }
+          }
+        }
+      }
+    }
+  };
+  ParallelFor(0, row_blocks, plan.row_block_grain, multiply_row_blocks);
+}
+
+/**
+ * @brief Create an nxn identity matrix.
+ *
+ * @param n       The number of rows and columns.
+ * @return Matrix The identity matrix.
+ */
+Matrix Matrix::Identity(size_t n) {
+  Matrix m(n, n);
+  for (size_t i = 0; i < n; i++) {
+    m.elements_[i * n + i] = 1.0;
+  }
+  return m;
+}
+
+/**
+ * @brief Raise this square matrix to a non-negative integer power by repeated
+ * squaring, which needs O(log k) products. The intermediate products reuse
+ * two scratch buffers instead of allocating a new matrix per step.
+ *
+ * @param k       The exponent.
+ * @return Matrix The result, the identity matrix if k is 0.
+ */
+Matrix Matrix::Power(unsigned int k) const {
+  if (!IsSquare()) {
+    throw std::invalid_argument("Power: Matrix is not square");
+  }
+
+  Matrix result = Identity(rows_);
+  if (k == 0) {
+    return result;
+  }
+
+  Matrix base(*this);
+  Matrix scratch(rows_, cols_);
+  bool result_is_identity = true;
+  while (true) {
+    if ((k & 1U) != 0) {
+      if (result_is_identity) {
+        result = base;
+        result_is_identity = false;
+      } else {
+        MultiplyInto(result, base, &scratch);
+        std::swap(result.elements_, scratch.elements_);
       }
     }
+    k >>= 1U;
+    if (k == 0) {
+      break;
+    }
+    MultiplyInto(base, base, &scratch);
+    std::swap(base.elements_, scratch.elements_);
   }
 
-  return product;
+  return result;
+}
+
+/**
+ * @brief Multiply a chain of matrices, e.g. A*B*C*D. The order of evaluation
+ * is chosen by dynamic programming over the matrix dimensions so that the
+ * total number of scalar multiplications is minimal.
+ *
+ * @param matrices  The matrices in the order they are multiplied.
+ * @return Matrix   The product.
+ */
+Matrix Matrix::MultiplyChain(
+    const std::vector<std::reference_wrapper<const Matrix>>& matrices) {
+  const size_t count = matrices.size();
+  if (count == 0) {
+    throw std::invalid_argument("MultiplyChain: No matrices");
+  }
+
+  // Matrix i has dimensions dims[i] x dims[i + 1].
+  std::vector<size_t> dims(count + 1);
+  dims[0] = matrices[0].get().rows_;
+  for (size_t i = 0; i < count; i++) {
+    if (matrices[i].get().rows_ != dims[i]) {
+      throw std::invalid_argument(
+          "MultiplyChain: Number of rows in a matrix must equal the number of "
+          "columns in the previous one");
+    }
+    dims[i + 1] = matrices[i].get().cols_;
+  }
+
+  // cost[i][j] is the minimal cost of multiplying matrices i..j, split[i][j]
+  // the index after which that product is split.
+  std::vector<std::vector<double>> cost(count, std::vector<double>(count, 0.0));
+  std::vector<std::vector<size_t>> split(count, std::vector<size_t>(count, 0));
+  for (size_t length = 2; length <= count; length++) {
+    for (size_t i = 0; i + length - 1 < count; i++) {
+      const size_t j = i + length - 1;
+      cost[i][j] = std::numeric_limits<double>::infinity();
+      for (size_t s = i; s < j; s++) {
+        const double c = cost[i][s] + cost[s + 1][j] +
+                         static_cast<double>(dims[i]) *
+                             static_cast<double>(dims[s + 1]) *
+                             static_cast<double>(dims[j + 1]);
+        if (c < cost[i][j]) {
+          cost[i][j] = c;
+          split[i][j] = s;
+        }
+      }
+    }
+  }
+
+  std::function<Matrix(size_t, size_t)> evaluate = [&](size_t i, size_t j) {
+    if (i == j) {
+      return matrices[i].get();
+    }
+    const size_t s = split[i][j];
+    // Avoid copying single matrices that are used as operands.
+    if (s == i && s + 1 == j) {
+      return matrices[i].get().Multiply(matrices[j].get());
+    }
+    if (s == i) {
+      return matrices[i].get().Multiply(evaluate(s + 1, j));
+    }
+    if (s + 1 == j) {
+      return evaluate(i, s).Multiply(matrices[j].get());
+    }
+    return evaluate(i, s).Multiply(evaluate(s + 1, j));
+  };
+
+  return evaluate(0, count - 1);
 }
 
 /**
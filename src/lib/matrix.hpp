@@ -5,9 +5,31 @@
 
 #pragma once
 
+#include <algorithm>
 #include <cstddef>
+#include <functional>
+#include <stdexcept>
 #include <vector>
 
+#include "task_scheduler.hpp"
+
+namespace rtb_h {
+/**
+ * @brief Cache blocking parameters for multiplying an (m x k) matrix with a
+ * (k x n) matrix. Plans depend only on the shape, so the plans of recently
+ * used shapes are cached.
+ *
+ */
+struct MultiplyPlan {
+  size_t block_rows;
+  size_t block_inner;
+  size_t block_cols;
+  size_t row_block_grain;
+};
+
+MultiplyPlan GetMultiplyPlan(size_t m, size_t k, size_t n);
+}  // namespace rtb_h
+
 namespace rtb {
 /**
  * @brief A class that represents a matrix of real numbers.
@@ -15,6 +37,17 @@ namespace rtb {
  */
 class Matrix {
  public:
+  /**
+   * @brief How Convolve2D and Correlate2D treat elements outside the matrix.
+   *
+   */
+  enum class BorderMode {
+    kZero,       // 000|abcd|000
+    kReplicate,  // aaa|abcd|ddd
+    kReflect,    // dcb|abcd|cba
+    kWrap        // bcd|abcd|abc
+  };
+
   Matrix(size_t rows, size_t cols);
   double& operator()(size_t i, size_t j);
   double operator()(size_t i, size_t j) const;
@@ -29,13 +62,175 @@ class Matrix {
   [[nodiscard]] Matrix Transpose() const;
   [[nodiscard]] double DotProduct(const Matrix& other) const;
   [[nodiscard]] Matrix Multiply(const Matrix& other) const;
+  [[nodiscard]] Matrix Power(unsigned int k) const;
+  static Matrix Identity(size_t n);
+  static Matrix MultiplyChain(
+      const std::vector<std::reference_wrapper<const Matrix>>& matrices);
+  [[nodiscard]] Matrix Convolve2D(
+      const Matrix& kernel, BorderMode border = BorderMode::kZero) const;
+  [[nodiscard]] Matrix Correlate2D(
+      const Matrix& kernel, BorderMode border = BorderMode::kZero) const;
   [[nodiscard]] Matrix GetRow(size_t index) const;
   void AddRowToRow(size_t row_index, const Matrix& row_vector);
   void SwapRows(size_t row_index_1, size_t row_index_2);
 
+  template <typename F>
+  void Apply(F f);
+  template <typename F>
+  [[nodiscard]] Matrix Map(F f) const;
+  template <typename F>
+  [[nodiscard]] Matrix Zip(const Matrix& other, F f) const;
+  template <typename T, typename Op>
+  [[nodiscard]] T Reduce(T identity, Op op) const;
+  template <typename T, typename Op, typename Combine>
+  [[nodiscard]] T Reduce(T identity, Op op, Combine combine) const;
+
  private:
+  // Number of elements the element-wise kernels process per task. Smaller
+  // matrices are processed on the calling thread because the threading
+  // overhead would outweigh the gain.
+  static constexpr size_t kParallelGrain = 1U << 14U;
+
   size_t rows_;
   size_t cols_;
   std::vector<double> elements_;
+
+  static void MultiplyInto(const Matrix& a, const Matrix& b, Matrix* product);
+  [[nodiscard]] Matrix Pad(size_t top, size_t left, size_t bottom,
+                           size_t right, BorderMode border) const;
+  [[nodiscard]] Matrix CorrelateImpl(const Matrix& kernel, size_t anchor_row,
+                                     size_t anchor_col,
+                                     BorderMode border) const;
 };
+
+/**
+ * @brief Apply a function to every element of this matrix in place, i.e.
+ * element = f(element). The function must not throw and must be safe to call
+ * concurrently, since large matrices are processed by several threads.
+ *
+ * @param f A callable double(double).
+ */
+template <typename F>
+void Matrix::Apply(F f) {
+  double* data = elements_.data();
+  ParallelFor(0, elements_.size(), kParallelGrain,
+              [data, &f](size_t begin, size_t end) {
+#pragma omp simd
+                for (size_t k = begin; k < end; k++) {
+                  data[k] = f(data[k]);
+                }
+              });
+}
+
+/**
+ * @brief Apply a function to every element of this matrix and return the
+ * results in a new matrix of the same size.
+ *
+ * @param f       A callable double(double).
+ * @return Matrix The result
+ */
+template <typename F>
+Matrix Matrix::Map(F f) const {
+  Matrix m(rows_, cols_);
+  const double* src = elements_.data();
+  double* dst = m.elements_.data();
+  ParallelFor(0, elements_.size(), kParallelGrain,
+              [src, dst, &f](size_t begin, size_t end) {
+#pragma omp simd
+                for (size_t k = begin; k < end; k++) {
+                  dst[k] = f(src[k]);
+                }
+              });
+  return m;
+}
+
+/**
+ * @brief Combine the corresponding elements of this matrix and another of the
+ * same size, i.e. result[k] = f(this[k], other[k]).
+ *
+ * @param other   The other matrix
+ * @param f       A callable double(double, double).
+ * @return Matrix The result
+ */
+template <typename F>
+Matrix Matrix::Zip(const Matrix& other, F f) const {
+  if (rows_ != other.rows_ || cols_ != other.cols_) {
+    throw std::invalid_argument("Zip: Matrices are not the same size");
+  }
+
+  Matrix m(rows_, cols_);
+  const double* lhs = elements_.data();
+  const double* rhs = other.elements_.data();
+  double* dst = m.elements_.data();
+  ParallelFor(0, elements_.size(), kParallelGrain,
+              [lhs, rhs, dst, &f](size_t begin, size_t end) {
+#pragma omp simd
+                for (size_t k = begin; k < end; k++) {
+                  dst[k] = f(lhs[k], rhs[k]);
+                }
+              });
+  return m;
+}
+
+/**
+ * @brief Fold all elements of this matrix into a single value. Large matrices
+ * are reduced in independent chunks, so identity must be the identity element
+ * of op (e.g. 0.0 for a sum) and op must be associative.
+ *
+ * @param identity  The identity value; also the result for an empty matrix.
+ * @param op        A callable T(T, double) that accumulates an element.
+ * @return T        The reduced value.
+ */
+template <typename T, typename Op>
+T Matrix::Reduce(T identity, Op op) const {
+  return Reduce(identity, op, op);
+}
+
+/**
+ * @brief Fold all elements of this matrix into a single value, using a
+ * separate operation to combine the partial results of each chunk. Use this
+ * overload when the accumulator type differs from the element type, e.g. when
+ * counting elements that satisfy a predicate.
+ *
+ * @param identity  The identity value of op and combine.
+ * @param op        A callable T(T, double) that accumulates an element.
+ * @param combine   A callable T(T, T) that merges two partial results.
+ * @return T        The reduced value.
+ */
+template <typename T, typename Op, typename Combine>
+T Matrix::Reduce(T identity, Op op, Combine combine) const {
+  const size_t n = elements_.size();
+  const double* data = elements_.data();
+  const size_t chunk_count = (n + kParallelGrain - 1) / kParallelGrain;
+  auto fold = [identity, data, &op](size_t begin, size_t end) {
+    T partial = identity;
+    for (size_t k = begin; k < end; k++) {
+      partial = op(partial, data[k]);
+    }
+    return partial;
+  };
+  if (chunk_count <= 1) {
+    return fold(0, n);
+  }
+
+  // One partial result per chunk, combined in order so the result does not
+  // depend on how the chunks were scheduled. Each has its own cache line, so
+  // neighbouring chunks neither share a line nor, for T = bool, a word.
+  struct alignas(64) Partial {
+    T value;
+  };
+  std::vector<Partial> partials(chunk_count, Partial{identity});
+  ParallelFor(0, chunk_count, 1, [&](size_t chunk_begin, size_t chunk_end) {
+    for (size_t c = chunk_begin; c < chunk_end; c++) {
+      partials[c].value =
+          fold(c * kParallelGrain, std::min(n, (c + 1) * kParallelGrain));
+    }
+  });
+
+  T result = identity;
+  for (const Partial& partial : partials) {
+    result = combine(result, partial.value);
+  }
+  return result;
+}
 }  // namespace rtb
\ No newline at end of file
@@ -0,0 +1,280 @@
+// @file      matrix_convolution.cpp
+// @author    Roger Davies     [rdavies3000@gmail.com]
+//
+// Copyright (c) 2022 Roger Davies, all rights reserved
+
+#include "matrix.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+namespace rtb_h {
+// Minimum work (multiply-adds) per filtering task.
+const size_t kConvolutionParallelWork = 1U << 16U;
+
+// Relative tolerance when testing whether a kernel is separable.
+const double kSeparableTolerance = 1e-12;
+
+/**
+ * @brief Map an index that may lie outside [0, size) to an index inside it
+ * according to the border mode.
+ *
+ * @param index   The (possibly out of range) index.
+ * @param size    The size of the dimension.
+ * @param border  The border mode.
+ * @return long   The mapped index, or -1 if the element is zero.
+ */
+long BorderIndex(long index, long size, rtb::Matrix::BorderMode border) {
+  if (index >= 0 && index < size) {
+    return index;
+  }
+
+  switch (border) {
+    case rtb::Matrix::BorderMode::kZero:
+      return -1;
+    case rtb::Matrix::BorderMode::kReplicate:
+      return index < 0 ? 0 : size - 1;
+    case rtb::Matrix::BorderMode::kReflect:
+      if (size == 1) {
+        return 0;
+      }
+      while (index < 0 || index >= size) {
+        index = index < 0 ? -index : 2 * (size - 1) - index;
+      }
+      return index;
+    case rtb::Matrix::BorderMode::kWrap:
+      return ((index % size) + size) % size;
+  }
+  return -1;
+}
+
+/**
+ * @brief Test whether a kernel is the outer product of a column and a row
+ * vector, in which case one 2D pass can be replaced by two 1D passes.
+ *
+ * @param kernel  The kernel.
+ * @param col     The column factor (kernel rows elements).
+ * @param row     The row factor (kernel columns elements).
+ * @return true   The kernel is separable.
+ */
+bool SeparateKernel(const rtb::Matrix& kernel, std::vector<double>* col,
+                    std::vector<double>* row) {
+  const size_t kr = kernel.Rows();
+  const size_t kc = kernel.Cols();
+
+  // Use the largest element as pivot for numerical stability.
+  size_t pivot_row = 0;
+  size_t pivot_col = 0;
+  double pivot = 0.0;
+  for (size_t a = 0; a < kr; a++) {
+    for (size_t b = 0; b < kc; b++) {
+      if (std::abs(kernel(a, b)) > std::abs(pivot)) {
+        pivot = kernel(a, b);
+        pivot_row = a;
+        pivot_col = b;
+      }
+    }
+  }
+  if (pivot == 0.0) {
+    return false;
+  }
+
+  col->resize(kr);
+  row->resize(kc);
+  for (size_t a = 0; a < kr; a++) {
+    (*col)[a] = kernel(a, pivot_col);
+  }
+  for (size_t b = 0; b < kc; b++) {
+    (*row)[b] = kernel(pivot_row, b) / pivot;
+  }
+
+  const double tolerance = kSeparableTolerance * std::abs(pivot);
+  for (size_t a = 0; a < kr; a++) {
+    for (size_t b = 0; b < kc; b++) {
+      if (std::abs(kernel(a, b) - (*col)[a] * (*row)[b]) > tolerance) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+}  // namespace rtb_h
+
+namespace rtb {
+/**
+ * @brief Convolve this matrix with a kernel. The result has the same size as
+ * this matrix and the kernel is anchored at its centre element.
+ *
+ * @param kernel  The kernel, it must not be empty.
+ * @param border  How elements outside this matrix are treated.
+ * @return Matrix The result
+ */
+Matrix Matrix::Convolve2D(const Matrix& kernel, BorderMode border) const {
+  if (kernel.rows_ == 0 || kernel.cols_ == 0) {
+    throw std::invalid_argument("Convolve2D: Kernel is empty");
+  }
+
+  // Convolution is correlation with the kernel rotated by 180 degrees, which
+  // moves the anchor of an even-sized kernel by one element.
+  Matrix flipped(kernel.rows_, kernel.cols_);
+  std::reverse_copy(kernel.elements_.begin(), kernel.elements_.end(),
+                    flipped.elements_.begin());
+  return CorrelateImpl(flipped, kernel.rows_ - 1 - kernel.rows_ / 2,
+                       kernel.cols_ - 1 - kernel.cols_ / 2, border);
+}
+
+/**
+ * @brief Correlate this matrix with a kernel. The result has the same size as
+ * this matrix and the kernel is anchored at its centre element.
+ *
+ * @param kernel  The kernel, it must not be empty.
+ * @param border  How elements outside this matrix are treated.
+ * @return Matrix The result
+ */
+Matrix Matrix::Correlate2D(const Matrix& kernel, BorderMode border) const {
+  if (kernel.rows_ == 0 || kernel.cols_ == 0) {
+    throw std::invalid_argument("Correlate2D: Kernel is empty");
+  }
+
+  return CorrelateImpl(kernel, kernel.rows_ / 2, kernel.cols_ / 2, border);
+}
+
+/**
+ * @brief Copy this matrix into a larger one, filling the margins according to
+ * the border mode.
+ *
+ * @param top     The number of rows added above.
+ * @param left    The number of columns added to the left.
+ * @param bottom  The number of rows added below.
+ * @param right   The number of columns added to the right.
+ * @param border  The border mode.
+ * @return Matrix The padded matrix.
+ */
+Matrix Matrix::Pad(size_t top, size_t left, size_t bottom, size_t right,
+                   BorderMode border) const {
+  Matrix padded(rows_ + top + bottom, cols_ + left + right);
+  const auto rows = static_cast<long>(rows_);
+  const auto cols = static_cast<long>(cols_);
+
+  // Precompute the column mapping, it is the same for every row.
+  std::vector<long> col_index(padded.cols_);
+  for (size_t c = 0; c < padded.cols_; c++) {
+    col_index[c] = rtb_h::BorderIndex(
+        static_cast<long>(c) - static_cast<long>(left), cols, border);
+  }
+
+  for (size_t r = 0; r < padded.rows_; r++) {
+    const long src_row = rtb_h::BorderIndex(
+        static_cast<long>(r) - static_cast<long>(top), rows, border);
+    if (src_row < 0) {
+      continue;
+    }
+    const double* src = elements_.data() + src_row * cols;
+    double* dst = padded.elements_.data() + r * padded.cols_;
+    std::memcpy(dst + left, src, cols_ * sizeof(double));
+    for (size_t c = 0; c < left; c++) {
+      dst[c] = col_index[c] < 0 ? 0.0 : src[col_index[c]];
+    }
+    for (size_t c = left + cols_; c < padded.cols_; c++) {
+      dst[c] = col_index[c] < 0 ? 0.0 : src[col_index[c]];
+    }
+  }
+
+  return padded;
+}
+
+/**
+ * @brief Correlate this matrix with a kernel anchored at the given element.
+ * The input is padded once so that all kernels below run without bounds
+ * checks over contiguous rows. Separable kernels are applied as a horizontal
+ * and a vertical 1D pass, all others directly: every kernel element adds a
+ * scaled, contiguous row of the padded input to an output row, which the
+ * compiler vectorises. Output rows are distributed over threads.
+ *
+ * @param kernel      The kernel.
+ * @param anchor_row  The kernel row aligned with the output element.
+ * @param anchor_col  The kernel column aligned with the output element.
+ * @param border      The border mode.
+ * @return Matrix     The result
+ */
+Matrix Matrix::CorrelateImpl(const Matrix& kernel, size_t anchor_row,
+                             size_t anchor_col, BorderMode border) const {
+  Matrix out(rows_, cols_);
+  if (rows_ == 0 || cols_ == 0) {
+    return out;
+  }
+
+  const size_t kr = kernel.rows_;
+  const size_t kc = kernel.cols_;
+  const Matrix padded =
+      Pad(anchor_row, anchor_col, kr - 1 - anchor_row, kc - 1 - anchor_col,
+          border);
+  const size_t pc = padded.cols_;
+  const double* src = padded.elements_.data();
+  double* dst = out.elements_.data();
+  // Rows per task, so that every task does enough work.
+  const size_t grain = std::max<size_t>(
+      1, rtb_h::kConvolutionParallelWork / (cols_ * kr * kc));
+
+  std::vector<double> col_factor;
+  std::vector<double> row_factor;
+  if (kr > 1 && kc > 1 &&
+      rtb_h::SeparateKernel(kernel, &col_factor, &row_factor)) {
+    // Horizontal pass over every padded row, then a vertical pass.
+    std::vector<double> horizontal(padded.rows_ * cols_, 0.0);
+    double* tmp = horizontal.data();
+    ParallelFor(0, padded.rows_, grain, [&](size_t r_begin, size_t r_end) {
+      for (size_t r = r_begin; r < r_end; r++) {
+        double* tmp_row = tmp + r * cols_;
+        for (size_t b = 0; b < kc; b++) {
+          const double w = row_factor[b];
+          const double* src_row = src + r * pc + b;
+#pragma omp simd
+          for (size_t j = 0; j < cols_; j++) {
+            tmp_row[j] += w * src_row[j];
+          }
+        }
+      }
+    });
+    ParallelFor(0, rows_, grain, [&](size_t i_begin, size_t i_end) {
+      for (size_t i = i_begin; i < i_end; i++) {
+        double* dst_row = dst + i * cols_;
+        for (size_t a = 0; a < kr; a++) {
+          const double w = col_factor[a];
+          const double* tmp_row = tmp + (i + a) * cols_;
+#pragma omp simd
+          for (size_t j = 0; j < cols_; j++) {
+            dst_row[j] += w * tmp_row[j];
+          }
+        }
+      }
+    });
+    return out;
+  }
+
+  const double* weights = kernel.elements_.data();
+  ParallelFor(0, rows_, grain, [&](size_t i_begin, size_t i_end) {
+    for (size_t i = i_begin; i < i_end; i++) {
+      double* dst_row = dst + i * cols_;
+      for (size_t a = 0; a < kr; a++) {
+        for (size_t b = 0; b < kc; b++) {
+          const double w = weights[a * kc + b];
+          if (w == 0.0) {
+            continue;
+          }
+          const double* src_row = src + (i + a) * pc + b;
+#pragma omp simd
+          for (size_t j = 0; j < cols_; j++) {
+            dst_row[j] += w * src_row[j];
+          }
+        }
+      }
+    }
+  });
+
+  return out;
+}
+}  // namespace rtb
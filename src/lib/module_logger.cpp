@@ -0,0 +1,194 @@
+// @file      module_logger.cpp
+// @author    Roger Davies     [rdavies3000@gmail.com]
+//
+// Copyright (c) 2022 Roger Davies, all rights reserved
+
+#include "module_logger.hpp"
+
+#include <utility>
+
+namespace rtb_h {
+/**
+ * @brief Get the registry. It is never destroyed, because handles and queued
+ * log records may refer to its nodes and sinks until the process exits.
+ *
+ * @return LoggerRegistry&
+ */
+LoggerRegistry& LoggerRegistry::Get() {
+  static auto* registry = new LoggerRegistry();
+  return *registry;
+}
+
+/**
+ * @brief Construct a new LoggerRegistry object with the root at the logger
+ * level.
+ *
+ */
+LoggerRegistry::LoggerRegistry() {
+  const auto level =
+      static_cast<MessageType>(g_log_level.load(std::memory_order_relaxed));
+  root_.own_level = level;
+  root_.level.store(level, std::memory_order_relaxed);
+}
+
+/**
+ * @brief Find a node by name, creating it and its missing parents.
+ *
+ * @param name          The dotted name, empty for the root.
+ * @return LoggerNode*  The node.
+ */
+LoggerNode* LoggerRegistry::Find(std::string_view name) {
+  const std::lock_guard<std::mutex> lock(mutex_);
+  return FindLocked(name);
+}
+
+/**
+ * @brief Find a node with the mutex held.
+ *
+ */
+LoggerNode* LoggerRegistry::FindLocked(std::string_view name) {
+  if (name.empty()) {
+    return &root_;
+  }
+  const auto it = nodes_.find(name);
+  if (it != nodes_.end()) {
+    return it->second.get();
+  }
+
+  const size_t dot = name.rfind('.');
+  LoggerNode* parent =
+      FindLocked(dot == std::string_view::npos ? std::string_view()
+                                               : name.substr(0, dot));
+  auto node = std::make_unique<LoggerNode>();
+  node->name = std::string(name);
+  node->parent = parent;
+  parent->children.push_back(node.get());
+  Resolve(node.get());
+  LoggerNode* p_node = node.get();
+  nodes_.emplace(p_node->name, std::move(node));
+  return p_node;
+}
+
+/**
+ * @brief Set the root level, which modules without a level of their own
+ * inherit.
+ *
+ * @param level The level.
+ */
+void LoggerRegistry::SetRootLevel(MessageType level) {
+  SetLevel(&root_, level);
+}
+
+/**
+ * @brief Set or clear the level of a module and update the modules that
+ * inherit it. The root level is the logger level and cannot be cleared.
+ *
+ * @param node  The module.
+ * @param level The level, or std::nullopt to inherit the parent level.
+ */
+void LoggerRegistry::SetLevel(LoggerNode* node,
+                              std::optional<MessageType> level) {
+  const std::lock_guard<std::mutex> lock(mutex_);
+  if (node == &root_) {
+    if (!level.has_value()) {
+      return;
+    }
+    g_log_level.store(*level, std::memory_order_relaxed);
+  }
+  node->own_level = level;
+  Resolve(node);
+}
+
+/**
+ * @brief Set or clear the sink of a module and update the modules that
+ * inherit it. The replaced sink is released after the log calls that may
+ * still use it have returned and its queued lines are written, so this must
+ * not be called from a sink.
+ *
+ * @param node  The module.
+ * @param sink  The sink, or nullptr to inherit the parent sink.
+ */
+void LoggerRegistry::SetSink(LoggerNode* node, std::shared_ptr<LogSink> sink) {
+  std::shared_ptr<LogSink> replaced;
+  {
+    const std::lock_guard<std::mutex> lock(mutex_);
+    replaced = std::exchange(node->own_sink, std::move(sink));
+    Resolve(node);
+  }
+  if (replaced != nullptr) {
+    g_log_readers.Synchronize();
+    rtb::Logger::Flush();
+  }
+}
+
+/**
+ * @brief Flush the module sinks.
+ *
+ */
+void LoggerRegistry::Flush() {
+  const std::lock_guard<std::mutex> lock(mutex_);
+  if (root_.own_sink != nullptr) {
+    root_.own_sink->Flush();
+  }
+  for (const auto& [name, node] : nodes_) {
+    if (node->own_sink != nullptr) {
+      node->own_sink->Flush();
+    }
+  }
+}
+
+/**
+ * @brief Recompute the cached level and sink of a node and its descendants.
+ * The mutex is held.
+ *
+ * @param node The node.
+ */
+void LoggerRegistry::Resolve(LoggerNode* node) {
+  // The root always has a level.
+  const LoggerNode* parent = node->parent;
+  const int level = node->own_level.has_value()
+                        ? *node->own_level
+                        : parent->level.load(std::memory_order_relaxed);
+  LogSink* sink = node->own_sink.get();
+  if (sink == nullptr && parent != nullptr) {
+    sink = parent->sink.load(std::memory_order_relaxed);
+  }
+  node->level.store(level, std::memory_order_relaxed);
+  node->sink.store(sink, std::memory_order_release);
+  for (LoggerNode* child : node->children) {
+    Resolve(child);
+  }
+}
+}  // namespace rtb_h
+
+namespace rtb {
+/**
+ * @brief Set the minimum level of the messages logged by this module and by
+ * the modules below it that have no level of their own. It may be lower
+ * than the logger level.
+ *
+ * @param level The level.
+ */
+void ModuleLogger::SetLevel(rtb_h::MessageType level) {
+  rtb_h::LoggerRegistry::Get().SetLevel(p_node_, level);
+}
+
+/**
+ * @brief Inherit the level of the parent module again.
+ *
+ */
+void ModuleLogger::ClearLevel() {
+  rtb_h::LoggerRegistry::Get().SetLevel(p_node_, std::nullopt);
+}
+
+/**
+ * @brief Send the messages of this module, and of the modules below it that
+ * have no sink of their own, to a sink instead of the sink of their message
+ * type. Sinks added with Logger::AddSink() still receive them.
+ *
+ * @param sink The sink, or nullptr to inherit the sink of the parent.
+ */
+void ModuleLogger::SetSink(std::shared_ptr<rtb_h::LogSink> sink) {
+  rtb_h::LoggerRegistry::Get().SetSink(p_node_, std::move(sink));
+}
+}  // namespace rtb
@@ -0,0 +1,126 @@
+// @file      module_logger.hpp
+// @author    Roger Davies     [rdavies3000@gmail.com]
+//
+// Copyright (c) 2022 Roger Davies, all rights reserved
+#pragma once
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "logger.hpp"
+
+//  Log through a rtb::ModuleLogger without evaluating the arguments of
+//  disabled messages, e.g. RTB_MODULE_LOG(net_log, rtb_h::kDebug, bytes,
+//  "received").
+#define RTB_MODULE_LOG(module, level, ...)                                 \
+  do {                                                                      \
+    if ((module).IsEnabled(level)) {                                        \
+      (module).Log(level, __VA_ARGS__);                                     \
+    }                                                                       \
+  } while (false)
+
+namespace rtb_h {
+/**
+ * @brief A named logger in the module tree. "net.http" is a child of "net",
+ * which is a child of the root. The effective level and sink are resolved
+ * from the nearest node that sets them whenever the configuration changes,
+ * and cached in atomics for the log calls.
+ *
+ */
+struct LoggerNode {
+  std::string name;
+  LoggerNode* parent{nullptr};
+  std::atomic<int> level{kInfo};
+  // Replaces the sink of the message type, or nullptr.
+  std::atomic<LogSink*> sink{nullptr};
+
+  // The registry mutex guards the rest.
+  std::optional<MessageType> own_level;
+  std::shared_ptr<LogSink> own_sink;
+  std::vector<LoggerNode*> children;
+};
+
+/**
+ * @brief Owns the module tree. The root level is the logger level,
+ * Logger::SetLevel(). Nodes are never destroyed, so handles stay valid. A
+ * replaced sink is released once the log calls that may still be using it
+ * have returned and its queued lines are written.
+ *
+ */
+class LoggerRegistry {
+ public:
+  static LoggerRegistry& Get();
+
+  LoggerNode* Find(std::string_view name);
+  void SetRootLevel(MessageType level);
+  void SetLevel(LoggerNode* node, std::optional<MessageType> level);
+  void SetSink(LoggerNode* node, std::shared_ptr<LogSink> sink);
+  void Flush();
+
+ private:
+  std::mutex mutex_;
+  LoggerNode root_;
+  std::map<std::string, std::unique_ptr<LoggerNode>, std::less<>> nodes_;
+
+  LoggerRegistry();
+  LoggerNode* FindLocked(std::string_view name);
+  void Resolve(LoggerNode* node);
+};
+}  // namespace rtb_h
+
+namespace rtb {
+/**
+ * @brief Handle to a named logger. Creating a handle looks the name up once;
+ * afterwards IsEnabled() is one relaxed atomic load, and levels and sinks
+ * set later, on the module or on a parent, apply to existing handles.
+ * Without a level of their own modules follow Logger::SetLevel(), without a
+ * sink of their own they use the sink of the message type. Lines carry the
+ * module name after the timestamp.
+ *
+ */
+class ModuleLogger {
+ public:
+  explicit ModuleLogger(std::string_view name)
+      : p_node_(rtb_h::LoggerRegistry::Get().Find(name)) {}
+
+  [[nodiscard]] bool IsEnabled(rtb_h::MessageType type) const {
+    return type >= RTB_MIN_LOG_LEVEL &&
+           type >= p_node_->level.load(std::memory_order_relaxed);
+  }
+
+  template <typename T>
+  void Log(rtb_h::MessageType type, const T& value) const {
+    if (IsEnabled(type)) {
+      Logger::GetInstance().LogModuleImpl(p_node_->name, p_node_->sink, type,
+                                          nullptr, value);
+    }
+  }
+
+  template <typename T>
+  void Log(rtb_h::MessageType type, const T& value,
+           std::string_view message) const {
+    if (IsEnabled(type)) {
+      Logger::GetInstance().LogModuleImpl(p_node_->name, p_node_->sink, type,
+                                          &message, value);
+    }
+  }
+
+  [[nodiscard]] const std::string& Name() const { return p_node_->name; }
+  [[nodiscard]] rtb_h::MessageType GetLevel() const {
+    return static_cast<rtb_h::MessageType>(
+        p_node_->level.load(std::memory_order_relaxed));
+  }
+  void SetLevel(rtb_h::MessageType level);
+  void ClearLevel();
+  void SetSink(std::shared_ptr<rtb_h::LogSink> sink);
+
+ private:
+  rtb_h::LoggerNode* p_node_;
+};
+}  // namespace rtb
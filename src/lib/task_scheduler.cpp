@@ -0,0 +1,414 @@
+// @file      task_scheduler.cpp
+// @author    Roger Davies     [rdavies3000@gmail.com]
+//
+// Copyright (c) 2022 Roger Davies, all rights reserved
+
+#include "task_scheduler.hpp"
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <algorithm>
+#include <functional>
+
+namespace rtb_h {
+// The scheduler and worker index of the current thread, if it is a worker.
+thread_local const rtb::TaskScheduler* tls_scheduler = nullptr;
+thread_local size_t tls_worker_index = 0;
+
+// Number of unsuccessful search rounds before an idle worker goes to sleep.
+const int kIdleSpinRounds = 64;
+
+/**
+ * @brief Construct a new WorkStealingDeque object.
+ *
+ * @param capacity The initial capacity, rounded up to a power of two.
+ */
+WorkStealingDeque::WorkStealingDeque(size_t capacity) {
+  int64_t size = 1;
+  while (size < static_cast<int64_t>(capacity)) {
+    size <<= 1;
+  }
+  buffers_.push_back(std::make_unique<Buffer>(size));
+  buffer_.store(buffers_.back().get(), std::memory_order_relaxed);
+}
+
+/**
+ * @brief Push a task onto the bottom of the deque. Only the owner may call
+ * this.
+ *
+ * @param task The task.
+ */
+void WorkStealingDeque::Push(Task* task) {
+  const int64_t bottom = bottom_.load(std::memory_order_relaxed);
+  const int64_t top = top_.load(std::memory_order_acquire);
+  Buffer* buffer = buffer_.load(std::memory_order_relaxed);
+  if (bottom - top > buffer->capacity - 1) {
+    buffer = Grow(buffer, bottom, top);
+  }
+  buffer->Put(bottom, task);
+  bottom_.store(bottom + 1, std::memory_order_release);
+}
+
+/**
+ * @brief Pop the most recently pushed task. Only the owner may call this.
+ *
+ * @return Task* The task, or nullptr if the deque is empty.
+ */
+Task* WorkStealingDeque::Pop() {
+  const int64_t bottom = bottom_.load(std::memory_order_relaxed) - 1;
+  Buffer* buffer = buffer_.load(std::memory_order_relaxed);
+  bottom_.store(bottom, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  int64_t top = top_.load(std::memory_order_relaxed);
+
+  if (top > bottom) {
+    // Empty.
+    bottom_.store(bottom + 1, std::memory_order_relaxed);
+    return nullptr;
+  }
+
+  Task* task = buffer->Get(bottom);
+  if (top == bottom) {
+    // Last element, race against thieves for it.
+    if (!top_.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst,
+                                      std::memory_order_relaxed)) {
+      task = nullptr;
+    }
+    bottom_.store(bottom + 1, std::memory_order_relaxed);
+  }
+  return task;
+}
+
+/**
+ * @brief Steal the oldest task. Any thread may call this.
+ *
+ * @return Task* The task, or nullptr if the deque is empty or the steal lost a
+ * race.
+ */
+Task* WorkStealingDeque::Steal() {
+  int64_t top = top_.load(std::memory_order_acquire);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  const int64_t bottom = bottom_.load(std::memory_order_acquire);
+  if (top >= bottom) {
+    return nullptr;
+  }
+
+  Buffer* buffer = buffer_.load(std::memory_order_acquire);
+  Task* task = buffer->Get(top);
+  if (!top_.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst,
+                                    std::memory_order_relaxed)) {
+    return nullptr;
+  }
+  return task;
+}
+
+/**
+ * @brief Check whether the deque looks empty. The answer may be stale by the
+ * time it is used.
+ *
+ * @return true The deque is empty.
+ */
+bool WorkStealingDeque::Empty() const {
+  return top_.load(std::memory_order_relaxed) >=
+         bottom_.load(std::memory_order_relaxed);
+}
+
+/**
+ * @brief Replace the buffer with one twice the size.
+ *
+ * @param old       The current buffer.
+ * @param bottom    The current bottom index.
+ * @param top       The current top index.
+ * @return Buffer*  The new buffer.
+ */
+WorkStealingDeque::Buffer* WorkStealingDeque::Grow(Buffer* old, int64_t bottom,
+                                                   int64_t top) {
+  buffers_.push_back(std::make_unique<Buffer>(old->capacity * 2));
+  Buffer* buffer = buffers_.back().get();
+  for (int64_t i = top; i < bottom; i++) {
+    buffer->Put(i, old->Get(i));
+  }
+  buffer_.store(buffer, std::memory_order_release);
+  return buffer;
+}
+}  // namespace rtb_h
+
+namespace rtb {
+/**
+ * @brief Construct a new TaskGroup object that uses the shared scheduler.
+ *
+ */
+TaskGroup::TaskGroup() : scheduler_(TaskScheduler::GetInstance()) {}
+
+/**
+ * @brief Destroy the TaskGroup object after all its tasks have finished.
+ * Exceptions that were not collected by Wait() are discarded.
+ *
+ */
+TaskGroup::~TaskGroup() {
+  while (pending_.load(std::memory_order_acquire) > 0) {
+    if (!scheduler_.ExecuteOne()) {
+      std::this_thread::yield();
+    }
+  }
+}
+
+/**
+ * @brief Wait until all tasks of this group have finished, executing queued
+ * tasks on this thread in the meantime.
+ *
+ */
+void TaskGroup::Wait() {
+  while (pending_.load(std::memory_order_acquire) > 0) {
+    if (!scheduler_.ExecuteOne()) {
+      std::this_thread::yield();
+    }
+  }
+
+  std::exception_ptr exception;
+  {
+    const std::lock_guard<std::mutex> lock(exception_mutex_);
+    std::swap(exception, exception_);
+  }
+  if (exception) {
+    std::rethrow_exception(exception);
+  }
+}
+
+/**
+ * @brief Mark one task of this group as finished.
+ *
+ * @param exception The exception thrown by the task, if any.
+ */
+void TaskGroup::Complete(std::exception_ptr exception) {
+  if (exception) {
+    const std::lock_guard<std::mutex> lock(exception_mutex_);
+    if (!exception_) {
+      exception_ = std::move(exception);
+    }
+  }
+  pending_.fetch_sub(1, std::memory_order_release);
+}
+
+/**
+ * @brief Construct a new TaskScheduler object and start its workers.
+ *
+ * @param worker_count  The number of worker threads, may be 0.
+ * @param pin_threads   Pin worker i to CPU (i + 1) modulo the CPU count,
+ * leaving CPU 0 to the thread that created the scheduler.
+ */
+TaskScheduler::TaskScheduler(size_t worker_count, bool pin_threads) {
+  workers_.reserve(worker_count);
+  for (size_t i = 0; i < worker_count; i++) {
+    workers_.push_back(std::make_unique<Worker>());
+    workers_.back()->rng_state = 0x9E3779B97F4A7C15ULL * (i + 1);
+  }
+  // Start the threads only once every worker exists, they steal from each
+  // other right away.
+  for (size_t i = 0; i < worker_count; i++) {
+    workers_[i]->thread =
+        std::thread(&TaskScheduler::WorkerLoop, this, i, pin_threads);
+  }
+}
+
+/**
+ * @brief Destroy the TaskScheduler object. Queued tasks are still executed
+ * before the workers stop.
+ *
+ */
+TaskScheduler::~TaskScheduler() {
+  while (ExecuteOne()) {
+  }
+  stop_.store(true);
+  {
+    const std::lock_guard<std::mutex> lock(sleep_mutex_);
+    sleep_cv_.notify_all();
+  }
+  for (auto& worker : workers_) {
+    worker->thread.join();
+  }
+}
+
+/**
+ * @brief Get the shared TaskScheduler instance. It has one worker less than
+ * there are hardware threads, because waiting threads execute tasks as well.
+ *
+ * @return TaskScheduler&
+ */
+TaskScheduler& TaskScheduler::GetInstance() {
+  static TaskScheduler instance(
+      std::max(1U, std::thread::hardware_concurrency()) - 1);
+  return instance;
+}
+
+/**
+ * @brief Get the index of the calling thread.
+ *
+ * @return size_t The worker index, or WorkerCount() for threads that are not
+ * workers of this scheduler.
+ */
+size_t TaskScheduler::WorkerIndex() const {
+  return rtb_h::tls_scheduler == this ? rtb_h::tls_worker_index
+                                      : workers_.size();
+}
+
+/**
+ * @brief Queue a task. Called from a worker the task goes to its own deque,
+ * otherwise to the injection queue. The scheduler takes ownership.
+ *
+ * @param task The task.
+ */
+void TaskScheduler::Submit(rtb_h::Task* task) {
+  if (workers_.empty()) {
+    // Nobody else would run it, so run it now.
+    Execute(task);
+    return;
+  }
+
+  // Count the task before it becomes visible, so that the count never drops
+  // below zero when it is taken right away.
+  queued_.fetch_add(1);
+  if (rtb_h::tls_scheduler == this) {
+    workers_[rtb_h::tls_worker_index]->deque.Push(task);
+  } else {
+    const std::lock_guard<std::mutex> lock(injection_mutex_);
+    injection_queue_.push_back(task);
+  }
+
+  if (sleeping_.load() > 0) {
+    const std::lock_guard<std::mutex> lock(sleep_mutex_);
+    sleep_cv_.notify_one();
+  }
+}
+
+/**
+ * @brief Execute one queued task on the calling thread, if there is one.
+ *
+ * @return true A task was executed.
+ */
+bool TaskScheduler::ExecuteOne() {
+  Worker* self = rtb_h::tls_scheduler == this
+                     ? workers_[rtb_h::tls_worker_index].get()
+                     : nullptr;
+  rtb_h::Task* task = FindTask(self);
+  if (task == nullptr) {
+    return false;
+  }
+  Execute(task);
+  return true;
+}
+
+/**
+ * @brief The main loop of a worker thread.
+ *
+ * @param index       The worker index.
+ * @param pin_thread  Pin the thread to a CPU.
+ */
+void TaskScheduler::WorkerLoop(size_t index, bool pin_thread) {
+  rtb_h::tls_scheduler = this;
+  rtb_h::tls_worker_index = index;
+
+  if (pin_thread) {
+    const unsigned int cpu_count =
+        std::max(1U, std::thread::hardware_concurrency());
+    cpu_set_t cpu_set;
+    CPU_ZERO(&cpu_set);
+    CPU_SET((index + 1) % cpu_count, &cpu_set);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set);
+  }
+
+  Worker* self = workers_[index].get();
+  int idle_rounds = 0;
+  while (!stop_.load(std::memory_order_relaxed)) {
+    rtb_h::Task* task = FindTask(self);
+    if (task != nullptr) {
+      Execute(task);
+      idle_rounds = 0;
+      continue;
+    }
+
+    if (++idle_rounds < rtb_h::kIdleSpinRounds) {
+      std::this_thread::yield();
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock(sleep_mutex_);
+    sleeping_.fetch_add(1);
+    sleep_cv_.wait(lock,
+                   [this]() { return stop_.load() || queued_.load() > 0; });
+    sleeping_.fetch_sub(1);
+    idle_rounds = 0;
+  }
+}
+
+/**
+ * @brief Find a task to execute: first from the own deque, then from the
+ * injection queue, then by stealing from a random victim.
+ *
+ * @param self          The calling worker, or nullptr for other threads.
+ * @return rtb_h::Task* The task, or nullptr if none was found.
+ */
+rtb_h::Task* TaskScheduler::FindTask(Worker* self) {
+  rtb_h::Task* task = nullptr;
+  if (self != nullptr) {
+    task = self->deque.Pop();
+  }
+
+  if (task == nullptr && queued_.load(std::memory_order_relaxed) > 0) {
+    const std::lock_guard<std::mutex> lock(injection_mutex_);
+    if (!injection_queue_.empty()) {
+      task = injection_queue_.front();
+      injection_queue_.pop_front();
+    }
+  }
+
+  if (task == nullptr && !workers_.empty()) {
+    // Start at a random victim so thieves spread over the workers.
+    uint64_t random = 0;
+    if (self != nullptr) {
+      self->rng_state ^= self->rng_state << 13U;
+      self->rng_state ^= self->rng_state >> 7U;
+      self->rng_state ^= self->rng_state << 17U;
+      random = self->rng_state;
+    } else {
+      random = std::hash<std::thread::id>{}(std::this_thread::get_id());
+    }
+    const size_t count = workers_.size();
+    const size_t start = random % count;
+    for (size_t k = 0; k < count && task == nullptr; k++) {
+      Worker* victim = workers_[(start + k) % count].get();
+      if (victim != self) {
+        task = victim->deque.Steal();
+      }
+    }
+    if (task != nullptr) {
+      steal_count_.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+  if (task != nullptr) {
+    queued_.fetch_sub(1, std::memory_order_relaxed);
+  }
+  return task;
+}
+
+/**
+ * @brief Execute a task, report its completion to its group and delete it.
+ *
+ * @param task The task.
+ */
+void TaskScheduler::Execute(rtb_h::Task* task) {
+  std::exception_ptr exception;
+  try {
+    task->Execute();
+  } catch (...) {
+    exception = std::current_exception();
+  }
+  TaskGroup* group = task->group();
+  delete task;
+  if (group != nullptr) {
+    group->Complete(std::move(exception));
+  }
+}
+}  // namespace rtb
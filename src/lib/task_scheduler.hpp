@@ -0,0 +1,271 @@
+// @file      task_scheduler.hpp
+// @author    Roger Davies     [rdavies3000@gmail.com]
+//
+// Copyright (c) 2022 Roger Davies, all rights reserved
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace rtb {
+class TaskGroup;
+}  // namespace rtb
+
+namespace rtb_h {
+/**
+ * @brief Abstract unit of work executed by the TaskScheduler.
+ *
+ */
+class Task {
+ public:
+  explicit Task(rtb::TaskGroup* group) : group_(group) {}
+  virtual ~Task() = default;
+  virtual void Execute() = 0;
+  [[nodiscard]] rtb::TaskGroup* group() const { return group_; }
+
+  Task(const Task&) = delete;
+  Task& operator=(const Task&) = delete;
+  Task(const Task&&) = delete;
+  Task& operator=(const Task&&) = delete;
+
+ private:
+  rtb::TaskGroup* group_;
+};
+
+/**
+ * @brief A task that runs a callable.
+ *
+ */
+template <typename F>
+class FunctionTask : public Task {
+ public:
+  FunctionTask(rtb::TaskGroup* group, F f) : Task(group), f_(std::move(f)) {}
+  void Execute() override { f_(); }
+
+ private:
+  F f_;
+};
+
+/**
+ * @brief Lock-free work-stealing deque (Chase-Lev). The owning worker pushes
+ * and pops at the bottom, any other thread may steal from the top. The buffer
+ * grows on demand; replaced buffers are kept until the deque is destroyed
+ * because a thief may still be reading from them.
+ *
+ */
+class WorkStealingDeque {
+ public:
+  explicit WorkStealingDeque(size_t capacity = 256);
+  ~WorkStealingDeque() = default;
+
+  void Push(Task* task);
+  Task* Pop();
+  Task* Steal();
+  [[nodiscard]] bool Empty() const;
+
+  WorkStealingDeque(const WorkStealingDeque&) = delete;
+  WorkStealingDeque& operator=(const WorkStealingDeque&) = delete;
+  WorkStealingDeque(const WorkStealingDeque&&) = delete;
+  WorkStealingDeque& operator=(const WorkStealingDeque&&) = delete;
+
+ private:
+  struct Buffer {
+    explicit Buffer(int64_t size)
+        : capacity(size), slots(new std::atomic<Task*>[size]) {}
+    Task* Get(int64_t index) const {
+      return slots[index & (capacity - 1)].load(std::memory_order_relaxed);
+    }
+    void Put(int64_t index, Task* task) {
+      slots[index & (capacity - 1)].store(task, std::memory_order_relaxed);
+    }
+    int64_t capacity;
+    std::unique_ptr<std::atomic<Task*>[]> slots;
+  };
+
+  alignas(64) std::atomic<int64_t> top_{0};
+  alignas(64) std::atomic<int64_t> bottom_{0};
+  std::atomic<Buffer*> buffer_;
+  std::vector<std::unique_ptr<Buffer>> buffers_;
+
+  Buffer* Grow(Buffer* old, int64_t bottom, int64_t top);
+};
+}  // namespace rtb_h
+
+namespace rtb {
+class TaskScheduler;
+
+/**
+ * @brief A set of tasks that can be waited for. Wait() executes pending tasks
+ * on the calling thread instead of blocking, so groups may be nested and
+ * waited for from inside other tasks. The first exception thrown by a task is
+ * rethrown by Wait().
+ *
+ */
+class TaskGroup {
+ public:
+  TaskGroup();
+  explicit TaskGroup(TaskScheduler& scheduler) : scheduler_(scheduler) {}
+  ~TaskGroup();
+
+  template <typename F>
+  void Run(F f);
+  void Wait();
+
+  TaskGroup(const TaskGroup&) = delete;
+  TaskGroup& operator=(const TaskGroup&) = delete;
+  TaskGroup(const TaskGroup&&) = delete;
+  TaskGroup& operator=(const TaskGroup&&) = delete;
+
+ private:
+  friend class TaskScheduler;
+
+  TaskScheduler& scheduler_;
+  std::atomic<size_t> pending_{0};
+  std::mutex exception_mutex_;
+  std::exception_ptr exception_;
+
+  void Complete(std::exception_ptr exception);
+};
+
+/**
+ * @brief Work-stealing thread pool shared by the toolbox parallel algorithms.
+ * Every worker owns a lock-free deque: tasks spawned by a worker go to its own
+ * deque and are executed LIFO for locality, idle workers steal the oldest
+ * tasks from the others. Tasks submitted from other threads go to a shared
+ * injection queue. Threads that wait for a TaskGroup help executing tasks, so
+ * a scheduler with zero workers runs everything on the calling thread.
+ *
+ */
+class TaskScheduler {
+ public:
+  explicit TaskScheduler(size_t worker_count, bool pin_threads = false);
+  ~TaskScheduler();
+
+  static TaskScheduler& GetInstance();
+
+  [[nodiscard]] size_t WorkerCount() const { return workers_.size(); }
+  [[nodiscard]] size_t WorkerIndex() const;
+  [[nodiscard]] size_t StealCount() const {
+    return steal_count_.load(std::memory_order_relaxed);
+  }
+
+  void Submit(rtb_h::Task* task);
+  bool ExecuteOne();
+
+  template <typename F>
+  void ParallelFor(size_t begin, size_t end, size_t grain, const F& f);
+
+  TaskScheduler(const TaskScheduler&) = delete;
+  TaskScheduler& operator=(const TaskScheduler&) = delete;
+  TaskScheduler(const TaskScheduler&&) = delete;
+  TaskScheduler& operator=(const TaskScheduler&&) = delete;
+
+ private:
+  struct Worker {
+    rtb_h::WorkStealingDeque deque;
+    std::thread thread;
+    uint64_t rng_state{};
+  };
+
+  std::vector<std::unique_ptr<Worker>> workers_;
+  std::mutex injection_mutex_;
+  std::deque<rtb_h::Task*> injection_queue_;
+
+  // Tasks that are queued but not yet taken, used to put idle workers to
+  // sleep without missing new work.
+  std::atomic<size_t> queued_{0};
+  std::atomic<size_t> sleeping_{0};
+  std::atomic<size_t> steal_count_{0};
+  std::atomic<bool> stop_{false};
+  std::mutex sleep_mutex_;
+  std::condition_variable sleep_cv_;
+
+  void WorkerLoop(size_t index, bool pin_thread);
+  rtb_h::Task* FindTask(Worker* self);
+  static void Execute(rtb_h::Task* task);
+
+  template <typename F>
+  void ParallelForSplit(TaskGroup* group, size_t begin, size_t end,
+                        size_t grain, const F& f);
+};
+
+/**
+ * @brief Spawn a task that runs f.
+ *
+ * @param f A callable void().
+ */
+template <typename F>
+void TaskGroup::Run(F f) {
+  pending_.fetch_add(1, std::memory_order_relaxed);
+  scheduler_.Submit(new rtb_h::FunctionTask<F>(this, std::move(f)));
+}
+
+/**
+ * @brief Call f(chunk_begin, chunk_end) for disjoint chunks that cover
+ * [begin, end). The range is split recursively in halves until a chunk has at
+ * most grain elements; the halves are spawned as tasks so idle workers can
+ * steal large pieces of the remaining work. Returns once all chunks are done.
+ *
+ * @param begin The first index.
+ * @param end   One past the last index.
+ * @param grain The maximum chunk size, at least 1.
+ * @param f     A callable void(size_t, size_t).
+ */
+template <typename F>
+void TaskScheduler::ParallelFor(size_t begin, size_t end, size_t grain,
+                                const F& f) {
+  if (end <= begin) {
+    return;
+  }
+  grain = grain == 0 ? 1 : grain;
+  if (end - begin <= grain || workers_.empty()) {
+    f(begin, end);
+    return;
+  }
+
+  TaskGroup group(*this);
+  ParallelForSplit(&group, begin, end, grain, f);
+  group.Wait();
+}
+
+/**
+ * @brief Split [begin, end) for ParallelFor, spawning the upper halves and
+ * processing the lowest chunk on the calling thread.
+ *
+ */
+template <typename F>
+void TaskScheduler::ParallelForSplit(TaskGroup* group, size_t begin,
+                                     size_t end, size_t grain, const F& f) {
+  while (end - begin > grain) {
+    const size_t mid = begin + (end - begin) / 2;
+    group->Run([this, group, mid, end, grain, &f]() {
+      ParallelForSplit(group, mid, end, grain, f);
+    });
+    end = mid;
+  }
+  f(begin, end);
+}
+
+/**
+ * @brief Run ParallelFor on the shared scheduler instance.
+ *
+ * @param begin The first index.
+ * @param end   One past the last index.
+ * @param grain The maximum chunk size, at least 1.
+ * @param f     A callable void(size_t, size_t).
+ */
+template <typename F>
+void ParallelFor(size_t begin, size_t end, size_t grain, const F& f) {
+  TaskScheduler::GetInstance().ParallelFor(begin, end, grain, f);
+}
+}  // namespace rtb
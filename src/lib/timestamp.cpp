@@ -0,0 +1,140 @@
+// @file      timestamp.cpp
+// @author    Roger Davies     [rdavies3000@gmail.com]
+//
+// Copyright (c) 2022 Roger Davies, all rights reserved
+
+#include "timestamp.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <limits>
+
+namespace rtb_h {
+/**
+ * @brief The rendered parts of a timestamp that only change once a second.
+ *
+ */
+struct TimestampCache {
+  int64_t second{std::numeric_limits<int64_t>::min()};
+  rtb::TimestampStyle style{rtb::TimestampStyle::kLocal};
+  char prefix[32]{};
+  size_t prefix_length{0};
+  char suffix[8]{};
+  size_t suffix_length{0};
+};
+
+/**
+ * @brief Render the date, time of day and zone suffix of a second.
+ *
+ * @param second  Seconds since the epoch.
+ * @param style   The timestamp style.
+ * @param cache   Receives the rendered parts.
+ */
+void RenderSecond(int64_t second, rtb::TimestampStyle style,
+                  TimestampCache* cache) {
+  const auto time = static_cast<std::time_t>(second);
+  const bool utc = style == rtb::TimestampStyle::kUtc ||
+                   style == rtb::TimestampStyle::kIso8601Utc;
+  const bool iso8601 = style == rtb::TimestampStyle::kIso8601Local ||
+                       style == rtb::TimestampStyle::kIso8601Utc;
+  std::tm tm{};
+  if (utc) {
+    gmtime_r(&time, &tm);
+  } else {
+    localtime_r(&time, &tm);
+  }
+
+  cache->prefix_length =
+      std::strftime(cache->prefix, sizeof(cache->prefix),
+                    iso8601 ? "%Y-%m-%dT%H:%M:%S" : "%Y-%m-%d %H:%M:%S", &tm);
+
+  switch (style) {
+    case rtb::TimestampStyle::kLocal:
+      cache->suffix_length = 0;
+      break;
+    case rtb::TimestampStyle::kUtc:
+      cache->suffix_length =
+          std::snprintf(cache->suffix, sizeof(cache->suffix), " UTC");
+      break;
+    case rtb::TimestampStyle::kIso8601Local: {
+      const long offset = std::labs(tm.tm_gmtoff / 60);
+      cache->suffix_length = std::snprintf(
+          cache->suffix, sizeof(cache->suffix), "%c%02ld:%02ld",
+          tm.tm_gmtoff < 0 ? '-' : '+', offset / 60, offset % 60);
+      break;
+    }
+    case rtb::TimestampStyle::kIso8601Utc:
+      cache->suffix_length =
+          std::snprintf(cache->suffix, sizeof(cache->suffix), "Z");
+      break;
+  }
+  cache->second = second;
+  cache->style = style;
+}
+
+/**
+ * @brief Write a zero padded decimal number.
+ *
+ * @param value   The number.
+ * @param digits  The number of digits.
+ * @param buffer  The output.
+ */
+void WriteDigits(uint32_t value, size_t digits, char* buffer) {
+  for (size_t i = digits; i > 0; i--) {
+    buffer[i - 1] = static_cast<char>('0' + value % 10);
+    value /= 10;
+  }
+}
+}  // namespace rtb_h
+
+namespace rtb {
+/**
+ * @brief Format a time into a buffer.
+ *
+ * @param time    The time.
+ * @param buffer  At least kMaxLength characters, not null terminated.
+ * @return size_t The number of characters written.
+ */
+size_t TimestampFormatter::Format(std::chrono::system_clock::time_point time,
+                                  char* buffer) const {
+  thread_local rtb_h::TimestampCache cache;
+
+  const auto second = std::chrono::floor<std::chrono::seconds>(time);
+  const int64_t seconds = second.time_since_epoch().count();
+  if (seconds != cache.second || style_ != cache.style) {
+    rtb_h::RenderSecond(seconds, style_, &cache);
+  }
+
+  std::memcpy(buffer, cache.prefix, cache.prefix_length);
+  size_t length = cache.prefix_length;
+  const auto fraction =
+      std::chrono::duration_cast<std::chrono::microseconds>(time - second)
+          .count();
+  if (precision_ == TimestampPrecision::kMilliseconds) {
+    buffer[length] = '.';
+    rtb_h::WriteDigits(static_cast<uint32_t>(fraction / 1000), 3,
+                       buffer + length + 1);
+    length += 4;
+  } else if (precision_ == TimestampPrecision::kMicroseconds) {
+    buffer[length] = '.';
+    rtb_h::WriteDigits(static_cast<uint32_t>(fraction), 6, buffer + length + 1);
+    length += 7;
+  }
+  std::memcpy(buffer + length, cache.suffix, cache.suffix_length);
+  return length + cache.suffix_length;
+}
+
+/**
+ * @brief Format a time.
+ *
+ * @param time          The time.
+ * @return std::string  The formatted time.
+ */
+std::string TimestampFormatter::Format(
+    std::chrono::system_clock::time_point time) const {
+  char buffer[kMaxLength];
+  return std::string(buffer, Format(time, buffer));
+}
+}  // namespace rtb
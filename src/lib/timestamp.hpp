@@ -0,0 +1,55 @@
+// @file      timestamp.hpp
+// @author    Roger Davies     [rdavies3000@gmail.com]
+//
+// Copyright (c) 2022 Roger Davies, all rights reserved
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace rtb {
+enum class TimestampStyle : uint8_t {
+  kLocal = 0,    // 2022-03-04 05:06:07
+  kUtc,          // 2022-03-04 05:06:07 UTC
+  kIso8601Local, // 2022-03-04T05:06:07+01:00
+  kIso8601Utc    // 2022-03-04T05:06:07Z
+};
+
+enum class TimestampPrecision : uint8_t {
+  kSeconds = 0,
+  kMilliseconds,
+  kMicroseconds
+};
+
+/**
+ * @brief Formats wall clock times for log lines. The date and time of day are
+ * rendered only when the second changes and are cached per thread, so
+ * formatting a timestamp usually only appends the fraction of a second.
+ * Calendar conversion uses localtime_r/gmtime_r and is thread-safe.
+ *
+ */
+class TimestampFormatter {
+ public:
+  // Maximum number of characters written by Format().
+  static constexpr size_t kMaxLength = 40;
+
+  explicit TimestampFormatter(
+      TimestampStyle style = TimestampStyle::kLocal,
+      TimestampPrecision precision = TimestampPrecision::kSeconds)
+      : style_(style), precision_(precision) {}
+
+  size_t Format(std::chrono::system_clock::time_point time,
+                char* buffer) const;
+  [[nodiscard]] std::string Format(
+      std::chrono::system_clock::time_point time) const;
+
+  [[nodiscard]] TimestampStyle style() const { return style_; }
+  [[nodiscard]] TimestampPrecision precision() const { return precision_; }
+
+ private:
+  TimestampStyle style_;
+  TimestampPrecision precision_;
+};
+}  // namespace rtb
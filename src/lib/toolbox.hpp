@@ -5,7 +5,16 @@
 #pragma once
 
 #include "logger.hpp"
+#include "binary_logger.hpp"
+#include "log_level.hpp"
 #include "timer.hpp"
 #include "instrumentor.hpp"
 #include "clarg_parser.hpp"
-#include "matrix.hpp"
\ No newline at end of file
+#include "matrix.hpp"
+#include "task_scheduler.hpp"
+#include "timestamp.hpp"
+#include "log_rotation.hpp"
+#include "flight_recorder.hpp"
+#include "module_logger.hpp"
+#include "log_uring.hpp"
+#include "log_syslog.hpp"
\ No newline at end of file
@@ -5,11 +5,121 @@
 #include <gmock/gmock-matchers.h>
 #include <gtest/gtest.h>
 
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <deque>
 #include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <sstream>
 #include <thread>
+#include <vector>
 
 #include "lib/toolbox.hpp"
 
+#ifdef RTB_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+// Counts the heap allocations of threads that set t_count_allocations. Every
+// form of operator new and delete is replaced, so that they all pair up.
+std::atomic<size_t> g_allocations{0};
+thread_local bool t_count_allocations = false;
+
+void* CountedAllocate(size_t size, size_t alignment) noexcept {
+  if (t_count_allocations) {
+    g_allocations++;
+  }
+  size = size == 0 ? 1 : size;
+  if (alignment <= alignof(std::max_align_t)) {
+    return std::malloc(size);
+  }
+  void* p = nullptr;
+  return ::posix_memalign(&p, alignment, size) == 0 ? p : nullptr;
+}
+
+// Not inlined, so that the compiler does not see the pointers from operator
+// new reach free() and warn about a mismatch.
+__attribute__((noinline)) void CountedFree(void* p) noexcept { std::free(p); }
+
+void* operator new(size_t size) {
+  void* p = CountedAllocate(size, 0);
+  if (p == nullptr) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+void* operator new[](size_t size) { return operator new(size); }
+void* operator new(size_t size, std::align_val_t alignment) {
+  void* p = CountedAllocate(size, static_cast<size_t>(alignment));
+  if (p == nullptr) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+void* operator new[](size_t size, std::align_val_t alignment) {
+  return operator new(size, alignment);
+}
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+  return CountedAllocate(size, 0);
+}
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+  return CountedAllocate(size, 0);
+}
+void* operator new(size_t size, std::align_val_t alignment,
+                   const std::nothrow_t&) noexcept {
+  return CountedAllocate(size, static_cast<size_t>(alignment));
+}
+void* operator new[](size_t size, std::align_val_t alignment,
+                     const std::nothrow_t&) noexcept {
+  return CountedAllocate(size, static_cast<size_t>(alignment));
+}
+
+void operator delete(void* p) noexcept { CountedFree(p); }
+void operator delete[](void* p) noexcept { CountedFree(p); }
+void operator delete(void* p, size_t) noexcept { CountedFree(p); }
+void operator delete[](void* p, size_t) noexcept { CountedFree(p); }
+void operator delete(void* p, std::align_val_t) noexcept { CountedFree(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { CountedFree(p); }
+void operator delete(void* p, size_t, std::align_val_t) noexcept {
+  CountedFree(p);
+}
+void operator delete[](void* p, size_t, std::align_val_t) noexcept {
+  CountedFree(p);
+}
+void operator delete(void* p, const std::nothrow_t&) noexcept {
+  CountedFree(p);
+}
+void operator delete[](void* p, const std::nothrow_t&) noexcept {
+  CountedFree(p);
+}
+void operator delete(void* p, std::align_val_t,
+                     const std::nothrow_t&) noexcept {
+  CountedFree(p);
+}
+void operator delete[](void* p, std::align_val_t,
+                       const std::nothrow_t&) noexcept {
+  CountedFree(p);
+}
+
 struct Loggable {
   Loggable(std::string str, const int i) : str_(std::move(str)), i_(i) {}
   std::string str_;
@@ -610,6 +720,1598 @@ TEST(TestClargParser, StringWithQuotesParam) {
   rtb::Logger::LogInfo(value.c_str());
 } */
 
+// The console sinks batch lines when stdout is not a terminal, as while it is
+// captured, so flush them around the capture.
+void CaptureLogStdout() {
+  rtb::Logger::Flush();
+  testing::internal::CaptureStdout();
+}
+
+std::string GetCapturedLogStdout() {
+  rtb::Logger::Flush();
+  return testing::internal::GetCapturedStdout();
+}
+
+TEST(TestLogger, MpmcRingBufferPushPop) {
+  rtb_h::MpmcRingBuffer<int> queue(3);
+  ASSERT_EQ(queue.Capacity(), 4);
+  for (int i = 0; i < 4; i++) {
+    ASSERT_TRUE(queue.TryPush(int(i)));
+  }
+  ASSERT_FALSE(queue.TryPush(4));
+
+  int value = -1;
+  for (int i = 0; i < 4; i++) {
+    ASSERT_TRUE(queue.TryPop(&value));
+    ASSERT_EQ(value, i);
+  }
+  ASSERT_FALSE(queue.TryPop(&value));
+}
+
+TEST(TestLogger, AsyncWriterDrainsQueue) {
+  struct CountingSink : public rtb_h::LogSink {
+    void Log(std::string_view, rtb_h::MessageType) override { count++; }
+    size_t count{0};
+  };
+  CountingSink sink;
+  const size_t kThreads = 4;
+  const size_t kMessages = 10000;
+  {
+    // A small queue makes the producers wait for the writer.
+    rtb_h::AsyncLogWriter writer(64);
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < kThreads; t++) {
+      threads.emplace_back([&writer, &sink]() {
+        for (size_t i = 0; i < kMessages; i++) {
+          writer.Enqueue(rtb_h::LogRecord{&sink, rtb_h::kInfo, "message"});
+        }
+      });
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+    writer.Flush();
+    ASSERT_EQ(sink.count, kThreads * kMessages);
+
+    // Records still queued are written by the destructor.
+    for (size_t i = 0; i < kMessages; i++) {
+      writer.Enqueue(rtb_h::LogRecord{&sink, rtb_h::kInfo, "message"});
+    }
+  }
+  ASSERT_EQ(sink.count, (kThreads + 1) * kMessages);
+}
+
+namespace {
+// Read what is available from a non-blocking file descriptor.
+std::string ReadAvailable(int fd) {
+  std::string text;
+  char chunk[256];
+  ssize_t n = 0;
+  while ((n = ::read(fd, chunk, sizeof(chunk))) > 0) {
+    text.append(chunk, static_cast<size_t>(n));
+  }
+  return text;
+}
+}  // namespace
+
+TEST(TestLogger, ConsoleSinkBatchesWhenNotATerminal) {
+  int fds[2];
+  ASSERT_EQ(::pipe(fds), 0);
+  ::fcntl(fds[0], F_SETFL, O_NONBLOCK);
+  {
+    rtb_h::LogSinkConsole sink(fds[1]);
+    ASSERT_FALSE(sink.IsInteractive());
+    sink.Log("one", rtb_h::kInfo);
+    sink.Log("two", rtb_h::kDebug);
+    ASSERT_EQ(ReadAvailable(fds[0]), "");
+    // Warnings are written at once, without colour.
+    sink.Log("three", rtb_h::kWarning);
+    ASSERT_EQ(ReadAvailable(fds[0]), "one\ntwo\nthree\n");
+    sink.Log("four", rtb_h::kInfo);
+    sink.Flush();
+    ASSERT_EQ(ReadAvailable(fds[0]), "four\n");
+    // The destructor writes what is left.
+    sink.Log("five", rtb_h::kInfo);
+  }
+  ASSERT_EQ(ReadAvailable(fds[0]), "five\n");
+  ::close(fds[0]);
+  ::close(fds[1]);
+}
+
+TEST(TestLogger, ConsoleSinkColoursATerminal) {
+  const int master = ::posix_openpt(O_RDWR | O_NOCTTY);
+  if (master < 0 || ::grantpt(master) != 0 || ::unlockpt(master) != 0) {
+    GTEST_SKIP() << "no pseudo-terminal";
+  }
+  const int slave = ::open(::ptsname(master), O_RDWR | O_NOCTTY);
+  ASSERT_GE(slave, 0);
+  // Keep the newlines as they are.
+  termios attributes{};
+  ::tcgetattr(slave, &attributes);
+  ::cfmakeraw(&attributes);
+  ::tcsetattr(slave, TCSANOW, &attributes);
+  ::fcntl(master, F_SETFL, O_NONBLOCK);
+
+  rtb_h::LogSinkConsole sink(slave);
+  ASSERT_TRUE(sink.IsInteractive());
+  sink.Log("info", rtb_h::kInfo);
+  sink.Log("error", rtb_h::kError);
+  std::string output;
+  const auto deadline =
+      std::chrono::steady_clock::now() + std::chrono::seconds(1);
+  while (output.size() < 22 && std::chrono::steady_clock::now() < deadline) {
+    output += ReadAvailable(master);
+  }
+  ASSERT_EQ(output, "info\n\033[0;31merror\033[0m\n");
+  ::close(slave);
+  ::close(master);
+}
+
+namespace {
+// Holds the writer thread inside Log() until released, so that the queue
+// behind it fills up.
+class GatedSink : public rtb_h::LogSink {
+ public:
+  void Log(std::string_view message, rtb_h::MessageType) override {
+    std::unique_lock<std::mutex> lock(mutex_);
+    lines_.emplace_back(message);
+    entered_ = true;
+    cv_.notify_all();
+    cv_.wait(lock, [this]() { return open_; });
+  }
+  void WaitEntered() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this]() { return entered_; });
+  }
+  void Open() {
+    const std::lock_guard<std::mutex> lock(mutex_);
+    open_ = true;
+    cv_.notify_all();
+  }
+  std::vector<std::string> Lines() {
+    const std::lock_guard<std::mutex> lock(mutex_);
+    return lines_;
+  }
+
+ private:
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  bool entered_{false};
+  bool open_{false};
+  std::vector<std::string> lines_;
+};
+
+// Blocks the writer on the first of the messages, then queues the others.
+void FillAsyncQueue(rtb_h::AsyncLogWriter* writer, GatedSink* sink,
+                    rtb_h::MessageType type, int first, int last) {
+  writer->Enqueue(rtb_h::LogRecord{sink, type, std::to_string(first)});
+  sink->WaitEntered();
+  for (int i = first + 1; i < last; i++) {
+    writer->Enqueue(rtb_h::LogRecord{sink, type, std::to_string(i)});
+  }
+}
+}  // namespace
+
+TEST(TestLogger, AsyncDropNewest) {
+  GatedSink sink;
+  rtb_h::AsyncLogWriter writer(4, {rtb::Backpressure::kDropNewest});
+  // The writer holds 0, the queue 1-4, 5-7 are dropped.
+  FillAsyncQueue(&writer, &sink, rtb_h::kInfo, 0, 8);
+  sink.Open();
+  writer.Flush();
+  ASSERT_EQ(sink.Lines(), (std::vector<std::string>{"0", "1", "2", "3", "4"}));
+  const rtb::AsyncLogStats stats = writer.GetStats();
+  ASSERT_EQ(stats.enqueued[rtb_h::kInfo], 5U);
+  ASSERT_EQ(stats.written[rtb_h::kInfo], 5U);
+  ASSERT_EQ(stats.dropped[rtb_h::kInfo], 3U);
+  ASSERT_EQ(stats.blocked, 0U);
+  ASSERT_EQ(stats.high_water, 4U);
+  ASSERT_EQ(stats.capacity, 4U);
+}
+
+TEST(TestLogger, AsyncDropOldest) {
+  GatedSink sink;
+  rtb_h::AsyncLogWriter writer(4, {rtb::Backpressure::kDropOldest});
+  // 5-7 evict 1-3.
+  FillAsyncQueue(&writer, &sink, rtb_h::kInfo, 0, 8);
+  sink.Open();
+  writer.Flush();
+  ASSERT_EQ(sink.Lines(), (std::vector<std::string>{"0", "4", "5", "6", "7"}));
+  const rtb::AsyncLogStats stats = writer.GetStats();
+  ASSERT_EQ(stats.enqueued[rtb_h::kInfo], 8U);
+  ASSERT_EQ(stats.written[rtb_h::kInfo], 5U);
+  ASSERT_EQ(stats.dropped[rtb_h::kInfo], 3U);
+}
+
+TEST(TestLogger, AsyncDropBelowLevel) {
+  GatedSink sink;
+  rtb_h::AsyncLogWriter writer(
+      4, {rtb::Backpressure::kDropBelowLevel, rtb_h::kWarning});
+  FillAsyncQueue(&writer, &sink, rtb_h::kInfo, 0, 6);
+  // An error waits for room instead of being dropped.
+  std::thread producer([&writer, &sink]() {
+    writer.Enqueue(rtb_h::LogRecord{&sink, rtb_h::kError, "error"});
+  });
+  while (writer.GetStats().blocked == 0) {
+    std::this_thread::yield();
+  }
+  sink.Open();
+  producer.join();
+  writer.Flush();
+  ASSERT_EQ(sink.Lines(),
+            (std::vector<std::string>{"0", "1", "2", "3", "4", "error"}));
+  const rtb::AsyncLogStats stats = writer.GetStats();
+  ASSERT_EQ(stats.dropped[rtb_h::kInfo], 1U);
+  ASSERT_EQ(stats.written[rtb_h::kError], 1U);
+  ASSERT_EQ(stats.blocked, 1U);
+}
+
+TEST(TestLogger, AsyncStatsThroughLogger) {
+  auto sink = std::make_shared<GatedSink>();
+  const rtb::Logger::SinkId id = rtb::Logger::AddSink(
+      sink, rtb_h::kError, true, {rtb::Backpressure::kDropNewest});
+  rtb::Logger::SetErrorSink(rtb::Logger::kSinkNull);
+  rtb::Logger::LogError(0);
+  sink->WaitEntered();
+  for (int i = 0; i < 10000; i++) {
+    rtb::Logger::LogError(i);
+  }
+  const rtb::AsyncLogStats stats = rtb::Logger::GetSinkStats(id);
+  sink->Open();
+  rtb::Logger::RemoveSink(id);
+  rtb::Logger::SetErrorSink(rtb::Logger::kSinkCerr);
+
+  ASSERT_EQ(stats.enqueued[rtb_h::kError] + stats.dropped[rtb_h::kError],
+            10001U);
+  ASSERT_GT(stats.dropped[rtb_h::kError], 0U);
+  ASSERT_EQ(stats.high_water, stats.capacity);
+  ASSERT_EQ(rtb::Logger::GetSinkStats(id).written[rtb_h::kError],
+            stats.enqueued[rtb_h::kError]);
+}
+
+TEST(TestLogger, AsyncFlushWritesFile) {
+  const std::string log_filename("rtb_async.log");
+  if (std::filesystem::exists(log_filename)) {
+    std::filesystem::remove(log_filename);
+  }
+
+  rtb::Logger::SetFileSinkPath(log_filename);
+  rtb::Logger::SetErrorSink(rtb::Logger::kSinkFile);
+  rtb::Logger::SetAsync(true);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; t++) {
+    threads.emplace_back([]() {
+      for (int i = 0; i < 1000; i++) {
+        rtb::Logger::LogError(i, "async");
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  rtb::Logger::Flush();
+
+  std::ifstream file(log_filename);
+  size_t lines = 0;
+  std::string line;
+  while (std::getline(file, line)) {
+    lines++;
+  }
+  file.close();
+  std::filesystem::remove(log_filename);
+  rtb::Logger::SetAsync(false);
+  rtb::Logger::SetErrorSink(rtb::Logger::kSinkCerr);
+  ASSERT_EQ(lines, 4000);
+}
+
+struct Point {
+  int x;
+  int y;
+};
+
+template <>
+struct rtb::LogFormatter<Point> {
+  static void Format(const Point& p, rtb_h::LogBuffer* buffer) {
+    buffer->Append('(');
+    rtb::FormatLogValue(p.x, buffer);
+    buffer->Append(", ");
+    rtb::FormatLogValue(p.y, buffer);
+    buffer->Append(')');
+  }
+};
+
+TEST(TestLogFormat, ValuesMatchOstream) {
+  const auto format = [](const auto& value) {
+    rtb_h::ScopedLogBuffer buffer;
+    rtb::FormatLogValue(value, &*buffer);
+    return std::string(buffer->View());
+  };
+  const auto stream = [](const auto& value) {
+    std::ostringstream out;
+    out << value;
+    return out.str();
+  };
+
+  ASSERT_EQ(format(-42), stream(-42));
+  ASSERT_EQ(format(18446744073709551615ULL), stream(18446744073709551615ULL));
+  ASSERT_EQ(format(12.25F), stream(12.25F));
+  ASSERT_EQ(format(1.0 / 3.0), stream(1.0 / 3.0));
+  ASSERT_EQ(format(1e-7), stream(1e-7));
+  ASSERT_EQ(format(123456789.0), stream(123456789.0));
+  ASSERT_EQ(format(true), stream(true));
+  ASSERT_EQ(format('c'), stream('c'));
+  ASSERT_EQ(format("literal"), "literal");
+  ASSERT_EQ(format(std::string("string")), "string");
+  ASSERT_EQ(format(Loggable("loggable", 3)), "loggable: 3");
+  ASSERT_EQ(format(Point{1, -2}), "(1, -2)");
+}
+
+TEST(TestLogFormat, SteadyStateLogCallDoesNotAllocate) {
+  // Messages for the null sink are not formatted at all, so the lines go to
+  // a sink that only counts them.
+  struct CountingSink : rtb_h::LogSink {
+    void Log(std::string_view message, rtb_h::MessageType) override {
+      lines++;
+      bytes += message.size();
+    }
+    size_t lines{0};
+    size_t bytes{0};
+  };
+  rtb::Logger::SetErrorSink(rtb::Logger::kSinkNull);
+  auto sink = std::make_shared<CountingSink>();
+  const rtb::Logger::SinkId id = rtb::Logger::AddSink(sink);
+  const Loggable loggable("loggable", 1);
+  const std::string long_message(200, 'm');
+
+  // The first calls create the thread's buffers and caches.
+  rtb::Logger::LogError(42, long_message);
+  rtb::Logger::LogError(loggable, "loggable");
+
+  g_allocations = 0;
+  sink->lines = 0;
+  sink->bytes = 0;
+  t_count_allocations = true;
+  for (int i = 0; i < 1000; i++) {
+    rtb::Logger::LogError(i, long_message);
+    rtb::Logger::LogError(i * 0.5, "double");
+    rtb::Logger::LogError(Point{i, i}, "point");
+    rtb::Logger::LogError(loggable, "loggable");
+    rtb::Logger::LogError("text");
+  }
+  t_count_allocations = false;
+  rtb::Logger::RemoveSink(id);
+  rtb::Logger::SetErrorSink(rtb::Logger::kSinkCerr);
+  ASSERT_EQ(sink->lines, 5000U);
+  ASSERT_GT(sink->bytes, 1000U * long_message.size());
+  ASSERT_EQ(g_allocations.load(), 0);
+}
+
+TEST(TestLogLevel, DisabledArgumentsAreNotEvaluated) {
+  int evaluated = 0;
+  const auto expensive = [&evaluated]() {
+    evaluated++;
+    return 42;
+  };
+
+  rtb::Logger::SetErrorSink(rtb::Logger::kSinkNull);
+  rtb::Logger::SetInfoSink(rtb::Logger::kSinkNull);
+  ASSERT_EQ(rtb::Logger::GetLevel(), rtb_h::kInfo);
+  RTB_LOG_DEBUG(expensive(), "debug");
+  RTB_LOG_TRACE(expensive());
+  ASSERT_EQ(evaluated, 0);
+  RTB_LOG_INFO(expensive(), "info");
+  ASSERT_EQ(evaluated, 1);
+
+  rtb::Logger::SetLevel(rtb_h::kError);
+  ASSERT_FALSE(rtb::Logger::IsEnabled(rtb_h::kWarning));
+  ASSERT_TRUE(rtb::Logger::IsEnabled(rtb_h::kFatal));
+  RTB_LOG_INFO(expensive());
+  RTB_LOG_WARNING(expensive());
+  RTB_LOG_ERROR(expensive());
+  RTB_LOG_FATAL(expensive(), "fatal");
+  ASSERT_EQ(evaluated, 3);
+
+  rtb::Logger::SetLevel(rtb_h::kTrace);
+  RTB_LOG_TRACE(expensive());
+  ASSERT_EQ(evaluated, 4);
+
+  rtb::Logger::SetLevel(rtb_h::kInfo);
+  rtb::Logger::SetErrorSink(rtb::Logger::kSinkCerr);
+  rtb::Logger::SetInfoSink(rtb::Logger::kSinkCout);
+}
+
+TEST(TestLogLevel, LevelsRouteToSinks) {
+  rtb::Logger::SetLevel(rtb_h::kTrace);
+  rtb::Logger::SetInfoSink(rtb::Logger::kSinkCout);
+  rtb::Logger::SetErrorSink(rtb::Logger::kSinkCout);
+  CaptureLogStdout();
+  rtb::Logger::LogTrace(1);
+  rtb::Logger::LogDebug(2, "debug");
+  rtb::Logger::LogFatal(3, "fatal");
+  const std::string output = GetCapturedLogStdout();
+  rtb::Logger::SetLevel(rtb_h::kInfo);
+  rtb::Logger::SetErrorSink(rtb::Logger::kSinkCerr);
+
+  ASSERT_THAT(output, testing::HasSubstr("[Trace  ] "));
+  ASSERT_THAT(output, testing::HasSubstr("[Debug  ] "));
+  ASSERT_THAT(output, testing::HasSubstr("debug: 2"));
+  ASSERT_THAT(output, testing::HasSubstr("[Fatal  ] "));
+  ASSERT_THAT(output, testing::HasSubstr("fatal: 3"));
+}
+
+TEST(TestLogger, ReconfigureWhileLogging) {
+  // Threads log to the file sink while another thread keeps moving it to a
+  // new file and switching the other sinks. No line may be lost or torn.
+  const int kThreads = 4;
+  const int kMessages = 2000;
+  const int kSwitches = 20;
+  rtb::Logger::SetFileSinkPath("rtb_reconfig_0.log");
+  rtb::Logger::SetInfoSink(rtb::Logger::kSinkFile);
+
+  std::atomic<bool> done{false};
+  std::thread reconfigure([&done] {
+    for (int i = 1; i <= kSwitches; i++) {
+      rtb::Logger::SetFileSinkPath("rtb_reconfig_" + std::to_string(i) +
+                                   ".log");
+      rtb::Logger::SetWarningSink(i % 2 == 0 ? rtb::Logger::kSinkNull
+                                             : rtb::Logger::kSinkFile);
+      std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }
+    done = true;
+  });
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreads; t++) {
+    threads.emplace_back([] {
+      for (int i = 0; i < kMessages; i++) {
+        rtb::Logger::LogInfo(i, "reconfig");
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  reconfigure.join();
+  rtb::Logger::Flush();
+  rtb::Logger::SetInfoSink(rtb::Logger::kSinkCout);
+  rtb::Logger::SetWarningSink(rtb::Logger::kSinkCerr);
+  ASSERT_TRUE(done);
+
+  int lines = 0;
+  for (int i = 0; i <= kSwitches; i++) {
+    const std::string path = "rtb_reconfig_" + std::to_string(i) + ".log";
+    std::ifstream file(path);
+    std::string line;
+    while (std::getline(file, line)) {
+      ASSERT_EQ(line.rfind("[Info   ] ", 0), 0U) << line;
+      ASSERT_THAT(line, testing::HasSubstr(" reconfig: "));
+      lines++;
+    }
+    file.close();
+    std::filesystem::remove(path);
+  }
+  ASSERT_EQ(lines, kThreads * kMessages);
+}
+
+TEST(TestLogger, FileSinkFlushPolicy) {
+  const std::string log_filename("rtb_buffered.log");
+  auto line_count = [&log_filename]() {
+    std::ifstream file(log_filename);
+    size_t lines = 0;
+    std::string line;
+    while (std::getline(file, line)) {
+      lines++;
+    }
+    return lines;
+  };
+
+  rtb::FileSinkOptions options;
+  options.buffer_size = 256;
+  options.flush_interval = std::chrono::hours(1);
+  options.flush_level = rtb_h::kError;
+  {
+    rtb_h::LogSinkFile sink(log_filename, options);
+    // Lines stay in the buffer until it is full.
+    sink.Log("one", rtb_h::kInfo);
+    sink.Log("two", rtb_h::kWarning);
+    ASSERT_EQ(line_count(), 0U);
+    // A line at the flush level is written at once, with the buffer.
+    sink.Log("three", rtb_h::kError);
+    ASSERT_EQ(line_count(), 3U);
+    // A line longer than the buffer is written after what is buffered.
+    sink.Log("four", rtb_h::kInfo);
+    sink.Log(std::string(1000, 'x'), rtb_h::kInfo);
+    ASSERT_EQ(line_count(), 5U);
+    sink.Log("five", rtb_h::kInfo);
+    sink.Flush();
+    ASSERT_EQ(line_count(), 6U);
+
+    options.flush_interval = std::chrono::milliseconds(0);
+    sink.SetOptions(options);
+    sink.Log("six", rtb_h::kDebug);
+    ASSERT_EQ(line_count(), 7U);
+    options.flush_interval = std::chrono::hours(1);
+    sink.SetOptions(options);
+    sink.Log("seven", rtb_h::kDebug);
+  }
+  // Destroying the sink writes the rest.
+  ASSERT_EQ(line_count(), 8U);
+
+  std::ifstream file(log_filename);
+  std::string line;
+  std::getline(file, line);
+  ASSERT_EQ(line, "one");
+  for (int i = 0; i < 4; i++) {
+    std::getline(file, line);
+  }
+  ASSERT_EQ(line, std::string(1000, 'x'));
+  file.close();
+  std::filesystem::remove(log_filename);
+}
+
+// Read the lines of a log file, decompressing it if it is gzipped.
+std::vector<std::string> ReadLogLines(const std::string& path) {
+  std::string text;
+#ifdef RTB_HAVE_ZLIB
+  gzFile file = gzopen(path.c_str(), "rb");
+  if (file != nullptr) {
+    char buffer[4096];
+    int n = 0;
+    while ((n = gzread(file, buffer, sizeof(buffer))) > 0) {
+      text.append(buffer, static_cast<size_t>(n));
+    }
+    gzclose(file);
+  }
+#else
+  std::ifstream file(path);
+  text.assign(std::istreambuf_iterator<char>(file), {});
+#endif
+  std::vector<std::string> lines;
+  std::istringstream stream(text);
+  std::string line;
+  while (std::getline(stream, line)) {
+    lines.push_back(line);
+  }
+  return lines;
+}
+
+TEST(TestLogger, FileSinkRotatesBySize) {
+  const std::string log_filename("rtb_rotate.log");
+  const bool compressed = rtb_h::LogCompressionAvailable();
+  auto generation = [&](int i) {
+    return log_filename + "." + std::to_string(i) + (compressed ? ".gz" : "");
+  };
+
+  rtb::FileSinkOptions options;
+  options.buffer_size = 256;
+  options.rotate_size = 1000;
+  options.max_files = 3;
+  {
+    rtb_h::LogSinkFile sink(log_filename, options);
+    for (int i = 0; i < 100; i++) {
+      std::string line = std::to_string(i);
+      line.resize(100, '.');
+      sink.Log(line, rtb_h::kInfo);
+    }
+  }
+
+  ASSERT_FALSE(std::filesystem::exists(generation(4)));
+  std::vector<std::string> lines;
+  for (int i = 3; i >= 0; i--) {
+    const std::string path = i == 0 ? log_filename : generation(i);
+    ASSERT_TRUE(std::filesystem::exists(path)) << path;
+    const std::vector<std::string> file_lines = ReadLogLines(path);
+    ASSERT_LE(file_lines.size() * 101, 1000U);
+    lines.insert(lines.end(), file_lines.begin(), file_lines.end());
+    std::filesystem::remove(path);
+  }
+  // The newest lines are kept, in order and complete.
+  ASSERT_GT(lines.size(), 20U);
+  const int first = 100 - static_cast<int>(lines.size());
+  for (size_t i = 0; i < lines.size(); i++) {
+    ASSERT_EQ(lines[i].size(), 100U);
+    ASSERT_EQ(std::stoi(lines[i]), first + static_cast<int>(i));
+  }
+}
+
+TEST(TestLogger, FileSinkRotationKeepsLeftoverFiles) {
+  const std::string log_filename("rtb_rotate_leftover.log");
+  // As if left by an earlier process with this pid that did not file it.
+  const std::string leftover =
+      log_filename + ".rotating." + std::to_string(::getpid()) + ".0";
+  std::ofstream(leftover) << "leftover\n";
+
+  rtb::FileSinkOptions options;
+  options.rotate_size = 1000;
+  options.max_files = 1;
+  options.compress = false;
+  {
+    rtb_h::LogSinkFile sink(log_filename, options);
+    for (int i = 0; i < 15; i++) {
+      sink.Log(std::string(99, 'x'), rtb_h::kInfo);
+    }
+  }
+
+  const std::vector<std::string> lines = ReadLogLines(leftover);
+  std::filesystem::remove(leftover);
+  std::filesystem::remove(log_filename);
+  std::filesystem::remove(log_filename + ".1");
+  ASSERT_EQ(lines, std::vector<std::string>{"leftover"});
+}
+
+TEST(TestLogger, FileSinkRotatesByTime) {
+  const std::string log_filename("rtb_rotate_time.log");
+  rtb::FileSinkOptions options;
+  options.rotate_interval = std::chrono::seconds(1);
+  options.compress = false;
+  {
+    rtb_h::LogSinkFile sink(log_filename, options);
+    sink.Log("before", rtb_h::kInfo);
+    std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+    sink.Log("after", rtb_h::kInfo);
+  }
+
+  ASSERT_EQ(ReadLogLines(log_filename), std::vector<std::string>{"after"});
+  ASSERT_EQ(ReadLogLines(log_filename + ".1"),
+            std::vector<std::string>{"before"});
+  std::filesystem::remove(log_filename);
+  std::filesystem::remove(log_filename + ".1");
+}
+
+TEST(TestLogger, MmapSinkConcurrentWriters) {
+  const std::string log_filename("rtb_mmap.log");
+  const int kThreads = 4;
+  const int kMessages = 2000;
+  size_t expected_size = 0;
+  {
+    // Small segments so that lines often straddle two of them.
+    rtb_h::LogSinkMmap sink(log_filename, 4096);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < kThreads; t++) {
+      threads.emplace_back([&sink, t]() {
+        for (int i = 0; i < kMessages; i++) {
+          sink.Log("thread " + std::to_string(t) + " line " + std::to_string(i),
+                   rtb_h::kInfo);
+        }
+      });
+      for (int i = 0; i < kMessages; i++) {
+        expected_size += ("thread " + std::to_string(t) + " line " +
+                          std::to_string(i) + "\n")
+                             .size();
+      }
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+  }
+
+  // The file is cut back to its contents and holds every line once, with
+  // each thread's lines in order.
+  ASSERT_EQ(std::filesystem::file_size(log_filename), expected_size);
+  std::vector<int> next(kThreads, 0);
+  std::ifstream file(log_filename);
+  std::string line;
+  int lines = 0;
+  while (std::getline(file, line)) {
+    int thread = -1;
+    int index = -1;
+    ASSERT_EQ(std::sscanf(line.c_str(), "thread %d line %d", &thread, &index),
+              2)
+        << line;
+    ASSERT_EQ(index, next[thread]++);
+    lines++;
+  }
+  ASSERT_EQ(lines, kThreads * kMessages);
+  file.close();
+  std::filesystem::remove(log_filename);
+}
+
+TEST(TestLogger, MmapSinkLosesLinesWhenSpaceRunsOut) {
+  const std::string log_filename("rtb_mmap_full.log");
+  // A file size limit makes allocating the segments after the two mapped up
+  // front fail, as a full disk would. Their lines are counted as lost instead
+  // of raising SIGBUS.
+  rlimit saved{};
+  ::getrlimit(RLIMIT_FSIZE, &saved);
+  auto* const saved_handler = std::signal(SIGXFSZ, SIG_IGN);
+  {
+    rtb_h::LogSinkMmap sink(log_filename, 4096);
+    rlimit limit = saved;
+    limit.rlim_cur = sink.segment_size();
+    ASSERT_EQ(::setrlimit(RLIMIT_FSIZE, &limit), 0);
+    const std::string line(99, 'x');
+    const size_t kLines = 2 * sink.segment_size() / 100 + 10;
+    for (size_t i = 0; i < kLines; i++) {
+      sink.Log(line, rtb_h::kInfo);
+    }
+    ASSERT_GT(sink.LostLines(), 0U);
+    ASSERT_LT(sink.LostLines(), kLines);
+    ::setrlimit(RLIMIT_FSIZE, &saved);
+  }
+  std::signal(SIGXFSZ, saved_handler);
+  std::filesystem::remove(log_filename);
+}
+
+// Both the io_uring and the writer thread backends keep every line, in order
+// per thread, including lines longer than a buffer.
+void CheckUringSink(bool use_io_uring, bool register_buffers = true) {
+  const std::string log_filename("rtb_uring.log");
+  const int kThreads = 4;
+  const int kMessages = 2000;
+  const std::string long_line(300, 'x');
+  {
+    // Small buffers so that all of them are often in flight.
+    rtb_h::LogSinkUring sink(log_filename, 256, use_io_uring,
+                             register_buffers);
+    if (!use_io_uring) {
+      ASSERT_FALSE(sink.UsesIoUring());
+    }
+    std::vector<std::thread> threads;
+    for (int t = 0; t < kThreads; t++) {
+      threads.emplace_back([&sink, t]() {
+        for (int i = 0; i < kMessages; i++) {
+          sink.Log("thread " + std::to_string(t) + " line " + std::to_string(i),
+                   i % 500 == 0 ? rtb_h::kError : rtb_h::kInfo);
+        }
+      });
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+    sink.Log(long_line, rtb_h::kInfo);
+    sink.Log("last", rtb_h::kInfo);
+    sink.Flush();
+    const std::vector<std::string> lines = ReadLogLines(log_filename);
+    ASSERT_EQ(lines.size(), kThreads * kMessages + 2U);
+    ASSERT_EQ(lines[lines.size() - 2], long_line);
+    ASSERT_EQ(lines.back(), "last");
+    std::vector<int> next(kThreads, 0);
+    for (size_t i = 0; i + 2 < lines.size(); i++) {
+      int thread = -1;
+      int index = -1;
+      ASSERT_EQ(
+          std::sscanf(lines[i].c_str(), "thread %d line %d", &thread, &index),
+          2)
+          << lines[i];
+      ASSERT_EQ(index, next[thread]++);
+    }
+  }
+  std::filesystem::remove(log_filename);
+}
+
+TEST(TestLogger, UringSinkWritesEveryLine) { CheckUringSink(true); }
+
+TEST(TestLogger, UringSinkWriterThreadsWriteEveryLine) {
+  CheckUringSink(false);
+}
+
+// Without registered buffers the ring writes with IORING_OP_WRITE, or, on
+// kernels without it, the writer threads are used.
+TEST(TestLogger, UringSinkUnregisteredBuffersWriteEveryLine) {
+  CheckUringSink(true, false);
+}
+
+TEST(TestFlightRecorder, DumpKeepsNewestLinesPerThread) {
+  const std::string dump_filename("rtb_flight.log");
+  rtb_h::LogSinkFlightRecorder recorder(dump_filename, 1024);
+  std::thread other([&recorder]() {
+    recorder.Log("other thread", rtb_h::kDebug);
+  });
+  other.join();
+  for (int i = 0; i < 200; i++) {
+    recorder.Log("line " + std::to_string(i), rtb_h::kTrace);
+  }
+  ASSERT_TRUE(recorder.Dump());
+
+  std::ifstream file(dump_filename);
+  std::vector<std::string> lines;
+  std::string line;
+  while (std::getline(file, line)) {
+    lines.push_back(line);
+  }
+  file.close();
+  std::filesystem::remove(dump_filename);
+
+  // The exited thread's ring was reused by this thread.
+  ASSERT_EQ(lines.front().rfind("--- thread ", 0), 0U);
+  ASSERT_EQ(std::count(lines.begin(), lines.end(), "other thread"), 0);
+  // Only the newest lines fit, in order.
+  ASSERT_EQ(lines.back(), "line 199");
+  ASSERT_GT(lines.size(), 50U);
+  ASSERT_LT(lines.size(), 150U);
+  const int first = std::stoi(lines[1].substr(5));
+  for (size_t i = 1; i < lines.size(); i++) {
+    ASSERT_EQ(lines[i], "line " + std::to_string(first + i - 1));
+  }
+}
+
+TEST(TestFlightRecorder, DumpsOnFatalSignal) {
+  const std::string dump_filename("rtb_flight_crash.log");
+  std::filesystem::remove(dump_filename);
+  ASSERT_DEATH(
+      {
+        rtb_h::LogSinkFlightRecorder recorder(dump_filename);
+        recorder.InstallSignalHandlers();
+        recorder.Log("last words", rtb_h::kDebug);
+        std::abort();
+      },
+      "");
+
+  std::ifstream file(dump_filename);
+  std::string header;
+  std::string line;
+  std::getline(file, header);
+  std::getline(file, line);
+  ASSERT_EQ(header.rfind("--- thread ", 0), 0U);
+  ASSERT_EQ(line, "last words");
+  file.close();
+  std::filesystem::remove(dump_filename);
+}
+
+namespace {
+// Recurses until the stack overflows.
+int Overflow(int depth) {
+  volatile char frame[1024];
+  frame[0] = static_cast<char>(depth);
+  if (depth < 0) {
+    return frame[0];
+  }
+  return Overflow(depth + 1) + frame[0];
+}
+}  // namespace
+
+TEST(TestFlightRecorder, DumpsOnStackOverflow) {
+  const std::string dump_filename("rtb_flight_overflow.log");
+  std::filesystem::remove(dump_filename);
+  ASSERT_DEATH(
+      {
+        rtb_h::LogSinkFlightRecorder recorder(dump_filename);
+        recorder.InstallSignalHandlers();
+        recorder.Log("last words", rtb_h::kDebug);
+        Overflow(0);
+      },
+      "");
+
+  std::ifstream file(dump_filename);
+  std::string header;
+  std::string line;
+  std::getline(file, header);
+  std::getline(file, line);
+  ASSERT_EQ(line, "last words");
+  file.close();
+  std::filesystem::remove(dump_filename);
+}
+
+TEST(TestFlightRecorder, ThreadKeepsARingPerRecorder) {
+  const std::string first_filename("rtb_flight_first.log");
+  const std::string second_filename("rtb_flight_second.log");
+  rtb_h::LogSinkFlightRecorder first(first_filename);
+  rtb_h::LogSinkFlightRecorder second(second_filename);
+  for (int i = 0; i < 100; i++) {
+    first.Log("first " + std::to_string(i), rtb_h::kInfo);
+    second.Log("second " + std::to_string(i), rtb_h::kInfo);
+  }
+  ASSERT_TRUE(first.Dump());
+  ASSERT_TRUE(second.Dump());
+
+  for (const auto& [filename, name] :
+       {std::pair(first_filename, "first "),
+        std::pair(second_filename, "second ")}) {
+    std::ifstream file(filename);
+    std::vector<std::string> lines;
+    std::string line;
+    while (std::getline(file, line)) {
+      lines.push_back(line);
+    }
+    file.close();
+    std::filesystem::remove(filename);
+    ASSERT_EQ(lines.size(), 101U);
+    ASSERT_EQ(lines[0].rfind("--- thread ", 0), 0U);
+    ASSERT_EQ(lines[100], name + std::to_string(99));
+  }
+}
+
+// Split captured output into lines.
+std::vector<std::string> SplitLines(const std::string& text) {
+  std::vector<std::string> lines;
+  std::istringstream stream(text);
+  std::string line;
+  while (std::getline(stream, line)) {
+    lines.push_back(line);
+  }
+  return lines;
+}
+
+TEST(TestLogLimit, EveryNSamples) {
+  CaptureLogStdout();
+  for (int i = 0; i < 100; i++) {
+    RTB_LOG_EVERY_N(rtb_h::kInfo, 10, i, "sampled");
+  }
+  const std::vector<std::string> lines = SplitLines(GetCapturedLogStdout());
+
+  ASSERT_EQ(lines.size(), 10U);
+  ASSERT_THAT(lines[0], testing::EndsWith("sampled: 0"));
+  ASSERT_THAT(lines[9], testing::EndsWith("sampled: 90"));
+}
+
+TEST(TestLogLimit, RateLimitReportsSuppressed) {
+  CaptureLogStdout();
+  auto log = [](int i) {
+    // A burst of 3, then one message per 100 ms.
+    RTB_LOG_RATE_LIMITED(rtb_h::kInfo, 10, 3, i, "limited");
+  };
+  for (int i = 0; i < 50; i++) {
+    log(i);
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(150));
+  log(50);
+  const std::vector<std::string> lines = SplitLines(GetCapturedLogStdout());
+
+  ASSERT_EQ(lines.size(), 5U);
+  ASSERT_THAT(lines[2], testing::EndsWith("limited: 2"));
+  ASSERT_THAT(lines[3],
+              testing::EndsWith("messages suppressed by rate limit: 47"));
+  ASSERT_THAT(lines[4], testing::EndsWith("limited: 50"));
+}
+
+TEST(TestLogLimit, DuplicatesCollapse) {
+  CaptureLogStdout();
+  for (int i = 0; i < 12; i++) {
+    RTB_LOG_DEDUP(rtb_h::kInfo, i < 10 ? 1 : i, "dedup");
+  }
+  const std::vector<std::string> lines = SplitLines(GetCapturedLogStdout());
+
+  ASSERT_EQ(lines.size(), 4U);
+  ASSERT_THAT(lines[0], testing::EndsWith("dedup: 1"));
+  ASSERT_THAT(lines[1], testing::EndsWith("last message repeated: 9"));
+  ASSERT_THAT(lines[2], testing::EndsWith("dedup: 10"));
+  ASSERT_THAT(lines[3], testing::EndsWith("dedup: 11"));
+}
+
+TEST(TestLogLimit, EndlessDuplicatesAreReported) {
+  CaptureLogStdout();
+  rtb_h::LogDeduplicator site(std::chrono::milliseconds(50), 5);
+  for (int i = 0; i < 12; i++) {
+    rtb::Logger::LogDeduplicated(&site, rtb_h::kInfo, 1, "dedup");
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(60));
+  rtb::Logger::LogDeduplicated(&site, rtb_h::kInfo, 1, "dedup");
+  const std::vector<std::string> lines = SplitLines(GetCapturedLogStdout());
+
+  ASSERT_EQ(lines.size(), 4U);
+  ASSERT_THAT(lines[0], testing::EndsWith("dedup: 1"));
+  ASSERT_THAT(lines[1], testing::EndsWith("last message repeated: 5"));
+  ASSERT_THAT(lines[2], testing::EndsWith("last message repeated: 5"));
+  ASSERT_THAT(lines[3], testing::EndsWith("last message repeated: 2"));
+}
+
+TEST(TestLogLimit, NonPositiveRatesAreClamped) {
+  for (const double per_second : {0.0, -1.0, std::nan("")}) {
+    rtb_h::LogRateLimiter limiter(per_second, 2);
+    uint64_t suppressed = 0;
+    ASSERT_TRUE(limiter.Allow(&suppressed));
+    ASSERT_TRUE(limiter.Allow(&suppressed));
+    ASSERT_FALSE(limiter.Allow(&suppressed));
+  }
+}
+
+TEST(TestStructuredLog, JsonEscapingAndValues) {
+  rtb_h::LogBuffer buffer;
+  rtb_h::AppendJsonString("a\"b\\c\nd\x01", &buffer);
+  ASSERT_EQ(buffer.View(), R"("a\"b\\c\nd\u0001")");
+
+  buffer.Clear();
+  rtb_h::AppendJsonValue(true, &buffer);
+  buffer.Append(' ');
+  rtb_h::AppendJsonValue(-42, &buffer);
+  buffer.Append(' ');
+  rtb_h::AppendJsonValue(0.1, &buffer);
+  buffer.Append(' ');
+  rtb_h::AppendJsonValue(std::nan(""), &buffer);
+  buffer.Append(' ');
+  rtb_h::AppendJsonValue('x', &buffer);
+  buffer.Append(' ');
+  rtb_h::AppendJsonValue(Point{1, 2}, &buffer);
+  ASSERT_EQ(buffer.View(), R"json(true -42 0.1 null "x" "(1, 2)")json");
+}
+
+TEST(TestStructuredLog, JsonLinesSink) {
+  const std::string log_filename("rtb_structured.jsonl");
+  rtb::Logger::SetTimestampFormat(rtb::TimestampStyle::kIso8601Utc);
+  rtb::Logger::SetJsonSinkPath(log_filename);
+  rtb::Logger::SetErrorSink(rtb::Logger::kSinkJson);
+  const std::string path = "/api/\"v1\"";
+  RTB_LOG_FIELDS(rtb_h::kError, "request failed", rtb::Field("status", 503),
+                 rtb::Field("path", path), rtb::Field("retry", false));
+  rtb::Logger::LogError(2.5, "plain");
+  rtb::Logger::Flush();
+  rtb::Logger::SetErrorSink(rtb::Logger::kSinkCerr);
+  rtb::Logger::SetTimestampFormat(rtb::TimestampStyle::kLocal);
+
+  const std::vector<std::string> lines = ReadLogLines(log_filename);
+  std::filesystem::remove(log_filename);
+  ASSERT_EQ(lines.size(), 2U);
+  // {"time":"2022-03-04T05:06:07Z",...
+  ASSERT_EQ(lines[0].rfind(R"({"time":")", 0), 0U);
+  ASSERT_EQ(lines[0].substr(28),
+            R"(Z","level":"error","message":"request failed","status":503,)"
+            R"("path":"/api/\"v1\"","retry":false})");
+  ASSERT_EQ(lines[1].substr(28),
+            R"(Z","level":"error","message":"plain","value":2.5})");
+}
+
+TEST(TestStructuredLog, FieldsOnTextSink) {
+  CaptureLogStdout();
+  rtb::Logger::LogFields(rtb_h::kInfo, "request", rtb::Field("status", 200),
+                         rtb::Field("path", "/"));
+  const std::string output = GetCapturedLogStdout();
+  ASSERT_THAT(output, testing::EndsWith("request status=200 path=/\n"));
+}
+
+namespace {
+// Records the lines written to it, from any thread.
+class RecordingSink : public rtb_h::LogSink {
+ public:
+  explicit RecordingSink(bool structured = false,
+                         std::chrono::microseconds delay = {})
+      : structured_(structured), delay_(delay) {}
+
+  void Log(std::string_view message, rtb_h::MessageType type) override {
+    std::this_thread::sleep_for(delay_);
+    const std::lock_guard<std::mutex> lock(mutex_);
+    lines_.emplace_back(message);
+    types_.push_back(type);
+  }
+  bool IsStructured() const override { return structured_; }
+
+  std::vector<std::string> Lines() const {
+    const std::lock_guard<std::mutex> lock(mutex_);
+    return lines_;
+  }
+  std::vector<rtb_h::MessageType> Types() const {
+    const std::lock_guard<std::mutex> lock(mutex_);
+    return types_;
+  }
+
+ private:
+  const bool structured_;
+  const std::chrono::microseconds delay_;
+  mutable std::mutex mutex_;
+  std::vector<std::string> lines_;
+  std::vector<rtb_h::MessageType> types_;
+};
+
+// Routes the default sinks to null for the lifetime of a test.
+struct SilencedDefaultSinks {
+  SilencedDefaultSinks() {
+    rtb::Logger::SetInfoSink(rtb::Logger::kSinkNull);
+    rtb::Logger::SetWarningSink(rtb::Logger::kSinkNull);
+    rtb::Logger::SetErrorSink(rtb::Logger::kSinkNull);
+  }
+  ~SilencedDefaultSinks() {
+    rtb::Logger::SetInfoSink(rtb::Logger::kSinkCout);
+    rtb::Logger::SetWarningSink(rtb::Logger::kSinkCerr);
+    rtb::Logger::SetErrorSink(rtb::Logger::kSinkCerr);
+  }
+};
+}  // namespace
+
+TEST(TestLogSinks, FanOutHonoursSinkLevels) {
+  const SilencedDefaultSinks silenced;
+  auto all = std::make_shared<RecordingSink>();
+  auto errors = std::make_shared<RecordingSink>();
+  const rtb::Logger::SinkId all_id = rtb::Logger::AddSink(all);
+  const rtb::Logger::SinkId errors_id =
+      rtb::Logger::AddSink(errors, rtb_h::kError);
+  rtb::Logger::LogInfo(1, "info");
+  rtb::Logger::LogWarning(2, "warning");
+  rtb::Logger::LogError(3, "error");
+  rtb::Logger::RemoveSink(all_id);
+  rtb::Logger::LogError(4, "after remove");
+  rtb::Logger::RemoveSink(errors_id);
+  rtb::Logger::LogError(5, "after remove");
+
+  ASSERT_EQ(all->Types(),
+            (std::vector<rtb_h::MessageType>{rtb_h::kInfo, rtb_h::kWarning,
+                                             rtb_h::kError}));
+  ASSERT_THAT(all->Lines()[1], testing::EndsWith("warning: 2"));
+  ASSERT_EQ(errors->Types(),
+            (std::vector<rtb_h::MessageType>{rtb_h::kError, rtb_h::kError}));
+  ASSERT_THAT(errors->Lines()[1], testing::EndsWith("after remove: 4"));
+}
+
+TEST(TestLogSinks, TextAndStructuredSinksShareAMessage) {
+  const SilencedDefaultSinks silenced;
+  auto text = std::make_shared<RecordingSink>();
+  auto json = std::make_shared<RecordingSink>(true);
+  const rtb::Logger::SinkId text_id = rtb::Logger::AddSink(text);
+  const rtb::Logger::SinkId json_id = rtb::Logger::AddSink(json);
+  RTB_LOG_FIELDS(rtb_h::kInfo, "request", rtb::Field("status", 200));
+  rtb::Logger::RemoveSink(text_id);
+  rtb::Logger::RemoveSink(json_id);
+
+  ASSERT_EQ(text->Lines().size(), 1U);
+  ASSERT_THAT(text->Lines()[0], testing::EndsWith("request status=200"));
+  ASSERT_EQ(json->Lines().size(), 1U);
+  ASSERT_THAT(json->Lines()[0],
+              testing::EndsWith(R"("message":"request","status":200})"));
+}
+
+TEST(TestLogSinks, SlowAsyncSinkDoesNotDelayOthers) {
+  const SilencedDefaultSinks silenced;
+  // 100 lines at 2ms each would take 200ms if written in the caller.
+  auto slow = std::make_shared<RecordingSink>(false,
+                                              std::chrono::milliseconds(2));
+  auto fast = std::make_shared<RecordingSink>();
+  const rtb::Logger::SinkId slow_id =
+      rtb::Logger::AddSink(slow, rtb_h::kTrace, true);
+  const rtb::Logger::SinkId fast_id = rtb::Logger::AddSink(fast);
+  const int kMessages = 100;
+  const auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < kMessages; i++) {
+    rtb::Logger::LogInfo(i);
+  }
+  const auto elapsed = std::chrono::steady_clock::now() - start;
+  ASSERT_EQ(fast->Lines().size(), static_cast<size_t>(kMessages));
+  ASSERT_LT(elapsed, std::chrono::milliseconds(100));
+
+  // Removing the sink writes what is still queued.
+  rtb::Logger::RemoveSink(slow_id);
+  rtb::Logger::RemoveSink(fast_id);
+  ASSERT_EQ(slow->Lines().size(), static_cast<size_t>(kMessages));
+}
+
+TEST(TestLogSinks, RemovedAsyncSinksStopTheirThreads) {
+  const SilencedDefaultSinks silenced;
+  auto thread_count = []() {
+    return std::distance(std::filesystem::directory_iterator("/proc/self/task"),
+                         std::filesystem::directory_iterator());
+  };
+  const auto threads = thread_count();
+  rtb::Logger::SinkId id = 0;
+  for (int i = 0; i < 20; i++) {
+    auto sink = std::make_shared<RecordingSink>();
+    id = rtb::Logger::AddSink(sink, rtb_h::kTrace, true);
+    rtb::Logger::LogInfo(i);
+    rtb::Logger::RemoveSink(id);
+    ASSERT_EQ(sink->Lines().size(), 1U);
+    ASSERT_EQ(sink.use_count(), 1);
+  }
+  ASSERT_EQ(thread_count(), threads);
+  // The counters of a removed sink are kept.
+  ASSERT_EQ(rtb::Logger::GetSinkStats(id).written[rtb_h::kInfo], 1U);
+}
+
+namespace {
+// Stand-in for a syslog collector listening on a Unix domain socket.
+class Collector {
+ public:
+  Collector(const std::string& path, int type) : path_(path) {
+    std::filesystem::remove(path_);
+    fd_ = ::socket(AF_UNIX, type, 0);
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    std::strncpy(address.sun_path, path_.c_str(), sizeof(address.sun_path) - 1);
+    ::bind(fd_, reinterpret_cast<const sockaddr*>(&address), sizeof(address));
+    if (type == SOCK_STREAM) {
+      ::listen(fd_, 1);
+    }
+  }
+  ~Collector() {
+    if (connection_ >= 0) {
+      ::close(connection_);
+    }
+    ::close(fd_);
+    std::filesystem::remove(path_);
+  }
+  Collector(const Collector&) = delete;
+  Collector& operator=(const Collector&) = delete;
+
+  // The messages of the next datagrams; the sink has already sent them.
+  std::vector<std::string> ReceiveDatagrams(size_t count) {
+    std::vector<std::string> messages;
+    char buffer[4096];
+    for (size_t i = 0; i < count; i++) {
+      const ssize_t size = ::recv(fd_, buffer, sizeof(buffer), MSG_DONTWAIT);
+      if (size < 0) {
+        break;
+      }
+      messages.emplace_back(buffer, static_cast<size_t>(size));
+    }
+    return messages;
+  }
+
+  // The messages of the octet-counted records sent so far on a stream.
+  std::vector<std::string> ReceiveRecords() {
+    if (connection_ < 0) {
+      connection_ = ::accept(fd_, nullptr, nullptr);
+      ::fcntl(connection_, F_SETFL, O_NONBLOCK);
+    }
+    std::string data = ReadAvailable(connection_);
+    std::vector<std::string> messages;
+    size_t position = 0;
+    while (position < data.size()) {
+      const size_t space = data.find(' ', position);
+      const size_t length =
+          std::stoul(data.substr(position, space - position));
+      messages.push_back(data.substr(space + 1, length));
+      position = space + 1 + length;
+    }
+    return messages;
+  }
+
+ private:
+  std::string path_;
+  int fd_{-1};
+  int connection_{-1};
+};
+
+// The MSG part of a record.
+std::string SyslogMessage(const std::string& record) {
+  return record.substr(record.find(" - - ") + 5);
+}
+}  // namespace
+
+TEST(TestLogSinks, SyslogDatagramsAreRfc5424) {
+  const std::string path("rtb_syslog_dgram.sock");
+  Collector collector(path, SOCK_DGRAM);
+  rtb::SyslogSinkOptions options;
+  options.app_name = "rtb test";
+  options.flush_interval = std::chrono::hours(1);
+  rtb_h::LogSinkSyslog sink(path, options);
+  ASSERT_TRUE(sink.IsConnected());
+
+  // Records wait for a batch until a warning is logged.
+  sink.Log("first", rtb_h::kInfo);
+  ASSERT_TRUE(collector.ReceiveDatagrams(1).empty());
+  sink.Log("second", rtb_h::kError);
+  const std::vector<std::string> records = collector.ReceiveDatagrams(3);
+  ASSERT_EQ(records.size(), 2U);
+
+  // <PRI>1 2022-03-04T05:06:07.123456Z HOSTNAME APP-NAME PROCID - - MSG
+  const std::string suffix =
+      " rtb_test " + std::to_string(::getpid()) + " - - ";
+  ASSERT_EQ(records[0].substr(0, 6), "<14>1 ");
+  ASSERT_EQ(records[1].substr(0, 6), "<11>1 ");
+  ASSERT_EQ(records[0][16], 'T');
+  ASSERT_EQ(records[0][25], '.');
+  ASSERT_EQ(records[0][32], 'Z');
+  ASSERT_NE(records[0].find(suffix + "first"), std::string::npos);
+  ASSERT_EQ(SyslogMessage(records[1]), "second");
+}
+
+TEST(TestLogSinks, SyslogStreamBuffersAcrossRestarts) {
+  const std::string path("rtb_syslog_stream.sock");
+  rtb::SyslogSinkOptions options;
+  options.socket_type = rtb::SocketType::kStream;
+  options.reconnect_interval = std::chrono::milliseconds(0);
+  rtb_h::LogSinkSyslog sink(path, options);
+
+  // Nothing is listening yet, the records are kept.
+  sink.Log("one", rtb_h::kInfo);
+  sink.Flush();
+  ASSERT_FALSE(sink.IsConnected());
+  std::vector<std::string> messages;
+  {
+    Collector collector(path, SOCK_STREAM);
+    sink.Log("two", rtb_h::kInfo);
+    sink.Flush();
+    ASSERT_TRUE(sink.IsConnected());
+    for (const auto& record : collector.ReceiveRecords()) {
+      messages.push_back(SyslogMessage(record));
+    }
+  }
+
+  // The collector restarts.
+  sink.Log("three", rtb_h::kInfo);
+  sink.Flush();
+  ASSERT_FALSE(sink.IsConnected());
+  Collector collector(path, SOCK_STREAM);
+  sink.Log("four", rtb_h::kInfo);
+  sink.Flush();
+  for (const auto& record : collector.ReceiveRecords()) {
+    messages.push_back(SyslogMessage(record));
+  }
+  ASSERT_EQ(messages,
+            (std::vector<std::string>{"one", "two", "three", "four"}));
+  ASSERT_EQ(sink.Dropped(), 0U);
+}
+
+TEST(TestLogSinks, SyslogBufferIsBounded) {
+  const std::string path("rtb_syslog_bounded.sock");
+  std::filesystem::remove(path);
+  rtb::SyslogSinkOptions options;
+  options.socket_type = rtb::SocketType::kStream;
+  options.reconnect_interval = std::chrono::milliseconds(0);
+  options.max_buffered = 1000;
+  rtb_h::LogSinkSyslog sink(path, options);
+  const int kMessages = 100;
+  for (int i = 0; i < kMessages; i++) {
+    sink.Log(std::to_string(i), rtb_h::kWarning);
+  }
+  ASSERT_GT(sink.Dropped(), 0U);
+
+  // The newest records are kept.
+  Collector collector(path, SOCK_STREAM);
+  sink.Flush();
+  const std::vector<std::string> records = collector.ReceiveRecords();
+  ASSERT_EQ(records.size() + sink.Dropped(), static_cast<size_t>(kMessages));
+  for (size_t i = 0; i < records.size(); i++) {
+    ASSERT_EQ(SyslogMessage(records[i]),
+              std::to_string(sink.Dropped() + i));
+  }
+}
+
+TEST(TestModuleLogger, LevelsAreInherited) {
+  rtb::ModuleLogger net("levels.net");
+  const rtb::ModuleLogger http("levels.net.http");
+  ASSERT_EQ(http.Name(), "levels.net.http");
+  ASSERT_EQ(http.GetLevel(), rtb::Logger::GetLevel());
+
+  net.SetLevel(rtb_h::kDebug);
+  ASSERT_TRUE(http.IsEnabled(rtb_h::kDebug));
+  ASSERT_FALSE(rtb::Logger::IsEnabled(rtb_h::kDebug));
+  // A handle created later sees the same node.
+  rtb::ModuleLogger("levels.net.http").SetLevel(rtb_h::kError);
+  ASSERT_FALSE(http.IsEnabled(rtb_h::kWarning));
+  rtb::ModuleLogger("levels.net.http").ClearLevel();
+  ASSERT_EQ(http.GetLevel(), rtb_h::kDebug);
+
+  net.ClearLevel();
+  rtb::Logger::SetLevel(rtb_h::kWarning);
+  ASSERT_EQ(http.GetLevel(), rtb_h::kWarning);
+  rtb::Logger::SetLevel(rtb_h::kInfo);
+  ASSERT_EQ(http.GetLevel(), rtb_h::kInfo);
+}
+
+TEST(TestModuleLogger, SinksAreInherited) {
+  auto text = std::make_shared<RecordingSink>();
+  auto json = std::make_shared<RecordingSink>(true);
+  rtb::ModuleLogger parent("sinks");
+  const rtb::ModuleLogger child("sinks.child");
+  parent.SetSink(text);
+  child.Log(rtb_h::kInfo, 1, "text");
+  RTB_MODULE_LOG(child, rtb_h::kDebug, 2, "disabled");
+  parent.SetSink(json);
+  child.Log(rtb_h::kWarning, 3);
+  parent.SetSink(nullptr);
+
+  ASSERT_EQ(text->Lines().size(), 1U);
+  ASSERT_THAT(text->Lines()[0], testing::StartsWith("[Info   ] "));
+  ASSERT_THAT(text->Lines()[0], testing::EndsWith("[sinks.child] text: 1"));
+  ASSERT_EQ(json->Lines().size(), 1U);
+  ASSERT_THAT(json->Lines()[0],
+              testing::EndsWith(R"("level":"warning","logger":"sinks.child",)"
+                                R"("value":3})"));
+}
+
+TEST(TestModuleLogger, ReplacedSinksAreReleasedWhileLogging) {
+  const SilencedDefaultSinks silenced;
+  const rtb::ModuleLogger module("released");
+  std::atomic<bool> done{false};
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; t++) {
+    threads.emplace_back([&module, &done]() {
+      while (!done.load()) {
+        module.Log(rtb_h::kInfo, 1, "line");
+      }
+    });
+  }
+  std::vector<std::weak_ptr<RecordingSink>> replaced;
+  for (int i = 0; i < 50; i++) {
+    auto sink = std::make_shared<RecordingSink>();
+    replaced.push_back(sink);
+    rtb::ModuleLogger("released").SetSink(std::move(sink));
+  }
+  rtb::ModuleLogger("released").SetSink(nullptr);
+  done.store(true);
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+
+  for (const std::weak_ptr<RecordingSink>& sink : replaced) {
+    ASSERT_TRUE(sink.expired());
+  }
+}
+
+TEST(TestLogger, LazyPayloadOnlyRunsWhenLogged) {
+  int calls = 0;
+  auto payload = [&calls]() {
+    calls++;
+    return 42;
+  };
+
+  // Below the level.
+  RTB_LOG_LAZY(rtb_h::kDebug, "debug", payload());
+  rtb::Logger::LogDebug(rtb::Lazy(payload), "debug");
+  // To the null sink.
+  rtb::Logger::SetInfoSink(rtb::Logger::kSinkNull);
+  RTB_LOG_LAZY(rtb_h::kInfo, "info", payload());
+  rtb::Logger::LogInfo(rtb::Lazy(payload), "info");
+  ASSERT_EQ(calls, 0);
+
+  // Once per line format.
+  auto text = std::make_shared<RecordingSink>();
+  auto json = std::make_shared<RecordingSink>(true);
+  const rtb::Logger::SinkId text_id = rtb::Logger::AddSink(text);
+  const rtb::Logger::SinkId json_id = rtb::Logger::AddSink(json);
+  RTB_LOG_LAZY(rtb_h::kInfo, "info", payload());
+  rtb::Logger::RemoveSink(text_id);
+  rtb::Logger::RemoveSink(json_id);
+  rtb::Logger::SetInfoSink(rtb::Logger::kSinkCout);
+  ASSERT_EQ(calls, 2);
+  ASSERT_THAT(text->Lines()[0], testing::EndsWith("info: 42"));
+  ASSERT_THAT(json->Lines()[0],
+              testing::EndsWith(R"("message":"info","value":42})"));
+}
+
+TEST(TestTimestamp, UtcStylesAndPrecision) {
+  // 2022-03-04 05:06:07.123456 UTC
+  const std::chrono::system_clock::time_point time(
+      std::chrono::duration_cast<std::chrono::system_clock::duration>(
+          std::chrono::microseconds(1646370367123456LL)));
+  using rtb::TimestampPrecision;
+  using rtb::TimestampStyle;
+
+  ASSERT_EQ(rtb::TimestampFormatter(TimestampStyle::kUtc).Format(time),
+            "2022-03-04 05:06:07 UTC");
+  ASSERT_EQ(rtb::TimestampFormatter(TimestampStyle::kUtc,
+                                    TimestampPrecision::kMilliseconds)
+                .Format(time),
+            "2022-03-04 05:06:07.123 UTC");
+  ASSERT_EQ(rtb::TimestampFormatter(TimestampStyle::kIso8601Utc,
+                                    TimestampPrecision::kMicroseconds)
+                .Format(time),
+            "2022-03-04T05:06:07.123456Z");
+
+  // A different second re-renders the cached part.
+  ASSERT_EQ(rtb::TimestampFormatter(TimestampStyle::kIso8601Utc)
+                .Format(time + std::chrono::seconds(60)),
+            "2022-03-04T05:07:07Z");
+}
+
+TEST(TestTimestamp, LocalMatchesLocaltime) {
+  const auto now = std::chrono::system_clock::now();
+  const std::time_t seconds = std::chrono::system_clock::to_time_t(now);
+  std::tm tm{};
+  localtime_r(&seconds, &tm);
+  char expected[32];
+  std::strftime(expected, sizeof(expected), "%Y-%m-%d %H:%M:%S", &tm);
+
+  const std::string local = rtb::TimestampFormatter().Format(now);
+  ASSERT_THAT(local, testing::StartsWith(expected));
+  const std::string iso = rtb::TimestampFormatter(
+      rtb::TimestampStyle::kIso8601Local).Format(now);
+  ASSERT_EQ(iso.size(), 25);
+  ASSERT_EQ(iso[10], 'T');
+  ASSERT_TRUE(iso[19] == '+' || iso[19] == '-');
+}
+
+TEST(TestTimestamp, LoggerTimestampFormat) {
+  ASSERT_EQ(rtb::Logger::GetTimestamp().size(), 20);
+  rtb::Logger::SetTimestampFormat(rtb::TimestampStyle::kIso8601Utc,
+                                  rtb::TimestampPrecision::kMilliseconds);
+  const std::string timestamp = rtb::Logger::GetTimestamp();
+  rtb::Logger::SetTimestampFormat(rtb::TimestampStyle::kLocal);
+  ASSERT_EQ(timestamp.size(), 25);
+  ASSERT_THAT(timestamp, testing::EndsWith("Z "));
+}
+
+TEST(TestBinaryLogger, DecodeMatchesTextFormat) {
+  const std::string log_filename("rtb_binary.log");
+  rtb::BinaryLogger::Open(log_filename);
+  const std::string name("matrix");
+  RTB_BINARY_LOG_ERROR("no arguments");
+  RTB_BINARY_LOG_WARNING("{} rows, {} cols of {}", 3, 4UL, name);
+  RTB_BINARY_LOG_INFO("value {} flag {} char {}", 2.5, true, 'x');
+  RTB_BINARY_LOG_INFO("missing {} {}", "one");
+  RTB_BINARY_LOG_INFO("extra", -7);
+  rtb::BinaryLogger::Close();
+
+  std::ifstream in(log_filename, std::ios::binary);
+  std::ostringstream out;
+  rtb::DecodeBinaryLog(in, out);
+  in.close();
+  std::filesystem::remove(log_filename);
+
+  std::istringstream text(out.str());
+  std::vector<std::string> lines;
+  std::string line;
+  while (std::getline(text, line)) {
+    lines.push_back(line);
+  }
+  ASSERT_EQ(lines.size(), 5);
+  ASSERT_THAT(lines[0], testing::StartsWith("[Error  ] "));
+  ASSERT_THAT(lines[0], testing::EndsWith(" no arguments"));
+  ASSERT_THAT(lines[1], testing::StartsWith("[Warning] "));
+  ASSERT_THAT(lines[1], testing::EndsWith(" 3 rows, 4 cols of matrix"));
+  ASSERT_THAT(lines[2], testing::EndsWith(" value 2.5 flag 1 char x"));
+  ASSERT_THAT(lines[3], testing::EndsWith(" missing one {}"));
+  ASSERT_THAT(lines[4], testing::EndsWith(" extra -7"));
+}
+
+TEST(TestBinaryLogger, ManyThreadsWrapBuffers) {
+  const std::string log_filename("rtb_binary_threads.log");
+  rtb::BinaryLogger::Open(log_filename);
+  const std::string padding(200, 'p');
+  const int kThreads = 4;
+  const int kMessages = 20000;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreads; t++) {
+    threads.emplace_back([t, &padding]() {
+      for (int i = 0; i < kMessages; i++) {
+        RTB_BINARY_LOG_INFO("{} {} {}", t, i, padding);
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  rtb::BinaryLogger::Flush();
+  rtb::BinaryLogger::Close();
+
+  std::ifstream in(log_filename, std::ios::binary);
+  std::ostringstream out;
+  rtb::DecodeBinaryLog(in, out);
+  in.close();
+  std::filesystem::remove(log_filename);
+
+  // The records of every thread are decoded in order.
+  std::vector<int> next(kThreads, 0);
+  std::istringstream text(out.str());
+  std::string line;
+  while (std::getline(text, line)) {
+    // Skip the prefix and the timestamp.
+    std::istringstream fields(line.substr(30));
+    int t = 0;
+    int i = 0;
+    std::string rest;
+    fields >> t >> i >> rest;
+    ASSERT_EQ(i, next[t]++);
+    ASSERT_EQ(rest, padding);
+  }
+  for (int t = 0; t < kThreads; t++) {
+    ASSERT_EQ(next[t], kMessages);
+  }
+}
+
+TEST(TestBinaryLogger, NewSitesAreDefinedBeforeTheirRecords) {
+  const std::string log_filename("rtb_binary_sites.log");
+  const int kThreads = 4;
+  const int kSites = 5000;
+  // Every record uses a site logged for the first time, while the background
+  // thread is writing.
+  for (int round = 0; round < 5; round++) {
+    rtb::BinaryLogger::Open(log_filename);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < kThreads; t++) {
+      threads.emplace_back([]() {
+        std::deque<rtb_h::LogSite> sites;
+        for (int i = 0; i < kSites; i++) {
+          sites.emplace_back(rtb_h::kInfo, "site {}");
+          rtb::BinaryLogger::Log(&sites.back(), i);
+        }
+      });
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+    rtb::BinaryLogger::Close();
+
+    std::ifstream in(log_filename, std::ios::binary);
+    std::ostringstream out;
+    ASSERT_NO_THROW(rtb::DecodeBinaryLog(in, out));
+    const std::string text = out.str();
+    ASSERT_EQ(std::count(text.begin(), text.end(), '\n'), kThreads * kSites);
+  }
+  std::filesystem::remove(log_filename);
+}
+
+TEST(TestBinaryLogger, DecodeRejectsInvalidInput) {
+  std::istringstream in("not a binary log");
+  std::ostringstream out;
+  ASSERT_THROW(rtb::DecodeBinaryLog(in, out), std::runtime_error);
+}
+
 TEST(TestMatrix, Constructor) {
   const size_t rows = 9;
   const size_t cols = 7;
@@ -1127,4 +2829,509 @@ TEST(TestMatrix, SwapInvalidRows) {
   a(1, 2) = 0.0;
 
   ASSERT_THROW(a.SwapRows(0, 2), std::invalid_argument);
-}
\ No newline at end of file
+}
+TEST(TestMatrix, Apply) {
+  rtb::Matrix a(2, 3);
+  a(0, 0) = -2.0;
+  a(0, 1) = 3.0;
+  a(0, 2) = -4.0;
+  a(1, 0) = 1.0;
+  a(1, 1) = 0.0;
+  a(1, 2) = 0.5;
+
+  a.Apply([](double x) { return x < 0.0 ? 0.0 : x; });
+
+  ASSERT_DOUBLE_EQ(a(0, 0), 0.0);
+  ASSERT_DOUBLE_EQ(a(0, 1), 3.0);
+  ASSERT_DOUBLE_EQ(a(0, 2), 0.0);
+  ASSERT_DOUBLE_EQ(a(1, 0), 1.0);
+  ASSERT_DOUBLE_EQ(a(1, 1), 0.0);
+  ASSERT_DOUBLE_EQ(a(1, 2), 0.5);
+}
+
+TEST(TestMatrix, Map) {
+  rtb::Matrix a(2, 3);
+  a(0, 0) = 2.0;
+  a(0, 1) = 3.0;
+  a(0, 2) = 4.0;
+  a(1, 0) = 1.0;
+  a(1, 1) = 0.0;
+  a(1, 2) = -1.0;
+
+  rtb::Matrix b = a.Map([](double x) { return x * x; });
+
+  ASSERT_EQ(b.Rows(), 2);
+  ASSERT_EQ(b.Cols(), 3);
+  ASSERT_DOUBLE_EQ(b(0, 0), 4.0);
+  ASSERT_DOUBLE_EQ(b(0, 1), 9.0);
+  ASSERT_DOUBLE_EQ(b(0, 2), 16.0);
+  ASSERT_DOUBLE_EQ(b(1, 0), 1.0);
+  ASSERT_DOUBLE_EQ(b(1, 1), 0.0);
+  ASSERT_DOUBLE_EQ(b(1, 2), 1.0);
+  // The source matrix is not modified.
+  ASSERT_DOUBLE_EQ(a(0, 0), 2.0);
+}
+
+TEST(TestMatrix, Zip) {
+  rtb::Matrix a(1, 3);
+  a(0, 0) = 2.0;
+  a(0, 1) = 3.0;
+  a(0, 2) = 4.0;
+  rtb::Matrix b(1, 3);
+  b(0, 0) = 5.0;
+  b(0, 1) = 1.0;
+  b(0, 2) = 4.0;
+
+  rtb::Matrix c = a.Zip(b, [](double x, double y) { return x > y ? x : y; });
+
+  ASSERT_DOUBLE_EQ(c(0, 0), 5.0);
+  ASSERT_DOUBLE_EQ(c(0, 1), 3.0);
+  ASSERT_DOUBLE_EQ(c(0, 2), 4.0);
+}
+
+TEST(TestMatrix, ZipSizeMismatch) {
+  rtb::Matrix a(2, 3);
+  rtb::Matrix b(3, 2);
+
+  ASSERT_THROW(
+      rtb::Matrix c = a.Zip(b, [](double x, double y) { return x * y; }),
+      std::invalid_argument);
+}
+
+TEST(TestMatrix, Reduce) {
+  rtb::Matrix a(2, 2);
+  a(0, 0) = 1.0;
+  a(0, 1) = -7.0;
+  a(1, 0) = 3.0;
+  a(1, 1) = 4.0;
+
+  double sum = a.Reduce(0.0, [](double acc, double x) { return acc + x; });
+  double max_abs = a.Reduce(
+      0.0, [](double acc, double x) { return std::max(acc, std::abs(x)); });
+
+  ASSERT_DOUBLE_EQ(sum, 1.0);
+  ASSERT_DOUBLE_EQ(max_abs, 7.0);
+}
+
+TEST(TestMatrix, ReduceWithCombine) {
+  rtb::Matrix a(2, 2);
+  a(0, 0) = 1.0;
+  a(1, 1) = 4.0;
+
+  size_t non_zero = a.Reduce(
+      size_t{0}, [](size_t acc, double x) { return acc + (x != 0.0 ? 1 : 0); },
+      [](size_t lhs, size_t rhs) { return lhs + rhs; });
+
+  ASSERT_EQ(non_zero, 2);
+}
+
+TEST(TestMatrix, LargeElementWise) {
+  // Large enough to take the multi-threaded path.
+  const size_t rows = 512;
+  const size_t cols = 300;
+  rtb::Matrix a(rows, cols);
+  a.Apply([](double) { return 1.5; });
+  rtb::Matrix b = a.Map([](double x) { return 2.0 * x; });
+  rtb::Matrix c = a.Zip(b, [](double x, double y) { return x + y; });
+
+  double sum = c.Reduce(0.0, [](double acc, double x) { return acc + x; });
+  size_t count = c.Reduce(
+      size_t{0}, [](size_t acc, double x) { return acc + (x == 4.5 ? 1 : 0); },
+      [](size_t lhs, size_t rhs) { return lhs + rhs; });
+  // Partials of a bool accumulator must not share a word between threads.
+  const bool all = c.Reduce(
+      true, [](bool acc, double x) { return acc && x == 4.5; },
+      [](bool lhs, bool rhs) { return lhs && rhs; });
+
+  ASSERT_DOUBLE_EQ(sum, 4.5 * rows * cols);
+  ASSERT_EQ(count, rows * cols);
+  ASSERT_TRUE(all);
+}
+
+TEST(TestMatrix, MultiplyPlansOfEvictedShapesAreRecomputed) {
+  const rtb_h::MultiplyPlan first = rtb_h::GetMultiplyPlan(300, 200, 100);
+  // More shapes than the per-thread cache holds.
+  for (size_t m = 1; m <= 1000; m++) {
+    rtb_h::GetMultiplyPlan(m, 64, 64);
+  }
+  const rtb_h::MultiplyPlan again = rtb_h::GetMultiplyPlan(300, 200, 100);
+
+  ASSERT_EQ(again.block_rows, first.block_rows);
+  ASSERT_EQ(again.block_inner, first.block_inner);
+  ASSERT_EQ(again.block_cols, first.block_cols);
+  ASSERT_EQ(again.row_block_grain, first.row_block_grain);
+}
+
+TEST(TestMatrix, ProductBlocked) {
+  // Large and odd-sized enough to span several cache blocks.
+  const size_t m = 67;
+  const size_t k = 301;
+  const size_t n = 45;
+  rtb::Matrix a(m, k);
+  rtb::Matrix b(k, n);
+  for (size_t i = 0; i < m; i++) {
+    for (size_t p = 0; p < k; p++) {
+      a(i, p) = static_cast<double>((i + 2 * p) % 7) - 3.0;
+    }
+  }
+  for (size_t p = 0; p < k; p++) {
+    for (size_t j = 0; j < n; j++) {
+      b(p, j) = static_cast<double>((3 * p + j) % 5) - 2.0;
+    }
+  }
+
+  rtb::Matrix product = a.Multiply(b);
+
+  for (size_t i = 0; i < m; i++) {
+    for (size_t j = 0; j < n; j++) {
+      double expected = 0.0;
+      for (size_t p = 0; p < k; p++) {
+        expected += a(i, p) * b(p, j);
+      }
+      ASSERT_DOUBLE_EQ(product(i, j), expected);
+    }
+  }
+}
+
+TEST(TestMatrix, Identity) {
+  rtb::Matrix id = rtb::Matrix::Identity(3);
+
+  for (size_t i = 0; i < 3; i++) {
+    for (size_t j = 0; j < 3; j++) {
+      ASSERT_DOUBLE_EQ(id(i, j), i == j ? 1.0 : 0.0);
+    }
+  }
+}
+
+TEST(TestMatrix, Power) {
+  rtb::Matrix a(2, 2);
+  a(0, 0) = 1.0;
+  a(0, 1) = 1.0;
+  a(1, 0) = 1.0;
+  a(1, 1) = 0.0;
+
+  // Powers of the Fibonacci matrix contain Fibonacci numbers.
+  rtb::Matrix p = a.Power(10);
+  ASSERT_DOUBLE_EQ(p(0, 0), 89.0);
+  ASSERT_DOUBLE_EQ(p(0, 1), 55.0);
+  ASSERT_DOUBLE_EQ(p(1, 0), 55.0);
+  ASSERT_DOUBLE_EQ(p(1, 1), 34.0);
+
+  rtb::Matrix p1 = a.Power(1);
+  ASSERT_DOUBLE_EQ(p1(0, 0), 1.0);
+  ASSERT_DOUBLE_EQ(p1(1, 1), 0.0);
+
+  rtb::Matrix p0 = a.Power(0);
+  ASSERT_DOUBLE_EQ(p0(0, 0), 1.0);
+  ASSERT_DOUBLE_EQ(p0(0, 1), 0.0);
+  ASSERT_DOUBLE_EQ(p0(1, 0), 0.0);
+  ASSERT_DOUBLE_EQ(p0(1, 1), 1.0);
+}
+
+TEST(TestMatrix, PowerNotSquare) {
+  rtb::Matrix a(2, 3);
+
+  ASSERT_THROW(rtb::Matrix p = a.Power(2), std::invalid_argument);
+}
+
+TEST(TestMatrix, MultiplyChain) {
+  rtb::Matrix a(10, 30);
+  rtb::Matrix b(30, 5);
+  rtb::Matrix c(5, 60);
+  rtb::Matrix d(60, 2);
+  a.Apply([](double) { return 0.5; });
+  b.Apply([](double) { return 2.0; });
+  c.Apply([](double) { return -1.0; });
+  d.Apply([](double) { return 0.25; });
+
+  rtb::Matrix chain = rtb::Matrix::MultiplyChain({a, b, c, d});
+  rtb::Matrix expected = a.Multiply(b).Multiply(c).Multiply(d);
+
+  ASSERT_EQ(chain.Rows(), 10);
+  ASSERT_EQ(chain.Cols(), 2);
+  for (size_t i = 0; i < chain.Rows(); i++) {
+    for (size_t j = 0; j < chain.Cols(); j++) {
+      ASSERT_DOUBLE_EQ(chain(i, j), expected(i, j));
+    }
+  }
+}
+
+TEST(TestMatrix, MultiplyChainSingle) {
+  rtb::Matrix a(2, 3);
+  a(1, 2) = 7.0;
+
+  rtb::Matrix chain = rtb::Matrix::MultiplyChain({a});
+
+  ASSERT_EQ(chain.Rows(), 2);
+  ASSERT_EQ(chain.Cols(), 3);
+  ASSERT_DOUBLE_EQ(chain(1, 2), 7.0);
+}
+
+TEST(TestMatrix, MultiplyChainSizeMismatch) {
+  rtb::Matrix a(2, 3);
+  rtb::Matrix b(3, 4);
+  rtb::Matrix c(5, 2);
+
+  ASSERT_THROW(rtb::Matrix chain = rtb::Matrix::MultiplyChain({a, b, c}),
+               std::invalid_argument);
+  ASSERT_THROW(rtb::Matrix chain = rtb::Matrix::MultiplyChain({}),
+               std::invalid_argument);
+}
+
+/**
+ * @brief Reference correlation with a zero border, kernel anchored at
+ * (anchor_row, anchor_col).
+ */
+rtb::Matrix NaiveCorrelate(const rtb::Matrix& m, const rtb::Matrix& kernel,
+                           size_t anchor_row, size_t anchor_col) {
+  rtb::Matrix out(m.Rows(), m.Cols());
+  for (size_t i = 0; i < m.Rows(); i++) {
+    for (size_t j = 0; j < m.Cols(); j++) {
+      double sum = 0.0;
+      for (size_t a = 0; a < kernel.Rows(); a++) {
+        for (size_t b = 0; b < kernel.Cols(); b++) {
+          const long r =
+              static_cast<long>(i + a) - static_cast<long>(anchor_row);
+          const long c =
+              static_cast<long>(j + b) - static_cast<long>(anchor_col);
+          if (r >= 0 && r < static_cast<long>(m.Rows()) && c >= 0 &&
+              c < static_cast<long>(m.Cols())) {
+            sum += kernel(a, b) * m(r, c);
+          }
+        }
+      }
+      out(i, j) = sum;
+    }
+  }
+  return out;
+}
+
+rtb::Matrix PatternMatrix(size_t rows, size_t cols, size_t seed) {
+  rtb::Matrix m(rows, cols);
+  for (size_t i = 0; i < rows; i++) {
+    for (size_t j = 0; j < cols; j++) {
+      m(i, j) = static_cast<double>((i * 13 + j * 7 + seed) % 11) - 5.0;
+    }
+  }
+  return m;
+}
+
+void ExpectMatrixNear(const rtb::Matrix& actual, const rtb::Matrix& expected) {
+  ASSERT_EQ(actual.Rows(), expected.Rows());
+  ASSERT_EQ(actual.Cols(), expected.Cols());
+  for (size_t i = 0; i < actual.Rows(); i++) {
+    for (size_t j = 0; j < actual.Cols(); j++) {
+      ASSERT_NEAR(actual(i, j), expected(i, j), 1e-9);
+    }
+  }
+}
+
+TEST(TestMatrix, Correlate2DSmallKernel) {
+  rtb::Matrix m = PatternMatrix(20, 23, 1);
+  rtb::Matrix kernel = PatternMatrix(3, 5, 4);
+
+  ExpectMatrixNear(m.Correlate2D(kernel), NaiveCorrelate(m, kernel, 1, 2));
+}
+
+TEST(TestMatrix, Correlate2DEvenKernel) {
+  rtb::Matrix m = PatternMatrix(9, 8, 2);
+  rtb::Matrix kernel = PatternMatrix(4, 2, 3);
+
+  ExpectMatrixNear(m.Correlate2D(kernel), NaiveCorrelate(m, kernel, 2, 1));
+}
+
+TEST(TestMatrix, Correlate2DLargeKernel) {
+  rtb::Matrix m = PatternMatrix(40, 37, 5);
+  rtb::Matrix kernel = PatternMatrix(17, 19, 6);
+
+  ExpectMatrixNear(m.Correlate2D(kernel), NaiveCorrelate(m, kernel, 8, 9));
+}
+
+TEST(TestMatrix, Correlate2DSeparableKernel) {
+  rtb::Matrix m = PatternMatrix(30, 25, 7);
+  rtb::Matrix kernel(3, 3);
+  const double weights[3]{1.0, 2.0, 1.0};
+  for (size_t a = 0; a < 3; a++) {
+    for (size_t b = 0; b < 3; b++) {
+      kernel(a, b) = weights[a] * weights[b] / 16.0;
+    }
+  }
+
+  ExpectMatrixNear(m.Correlate2D(kernel), NaiveCorrelate(m, kernel, 1, 1));
+}
+
+TEST(TestMatrix, Convolve2DFlipsKernel) {
+  rtb::Matrix m = PatternMatrix(12, 10, 8);
+  rtb::Matrix kernel = PatternMatrix(3, 4, 9);
+  rtb::Matrix flipped(3, 4);
+  for (size_t a = 0; a < 3; a++) {
+    for (size_t b = 0; b < 4; b++) {
+      flipped(a, b) = kernel(2 - a, 3 - b);
+    }
+  }
+
+  // For the 3x4 kernel the anchor (1, 2) moves to (1, 1) when flipped.
+  ExpectMatrixNear(m.Convolve2D(kernel), NaiveCorrelate(m, flipped, 1, 1));
+}
+
+TEST(TestMatrix, Correlate2DBorderModes) {
+  rtb::Matrix m(1, 4);
+  m(0, 0) = 1.0;
+  m(0, 1) = 2.0;
+  m(0, 2) = 3.0;
+  m(0, 3) = 4.0;
+  // Picks the element to the left of the anchor.
+  rtb::Matrix shift_left(1, 3);
+  shift_left(0, 0) = 1.0;
+  // Picks the element to the right of the anchor.
+  rtb::Matrix shift_right(1, 3);
+  shift_right(0, 2) = 1.0;
+
+  using Border = rtb::Matrix::BorderMode;
+  ASSERT_DOUBLE_EQ(m.Correlate2D(shift_left, Border::kZero)(0, 0), 0.0);
+  ASSERT_DOUBLE_EQ(m.Correlate2D(shift_left, Border::kReplicate)(0, 0), 1.0);
+  ASSERT_DOUBLE_EQ(m.Correlate2D(shift_left, Border::kReflect)(0, 0), 2.0);
+  ASSERT_DOUBLE_EQ(m.Correlate2D(shift_left, Border::kWrap)(0, 0), 4.0);
+  ASSERT_DOUBLE_EQ(m.Correlate2D(shift_right, Border::kZero)(0, 3), 0.0);
+  ASSERT_DOUBLE_EQ(m.Correlate2D(shift_right, Border::kReplicate)(0, 3), 4.0);
+  ASSERT_DOUBLE_EQ(m.Correlate2D(shift_right, Border::kReflect)(0, 3), 3.0);
+  ASSERT_DOUBLE_EQ(m.Correlate2D(shift_right, Border::kWrap)(0, 3), 1.0);
+  ASSERT_DOUBLE_EQ(m.Correlate2D(shift_right, Border::kWrap)(0, 1), 3.0);
+}
+
+TEST(TestMatrix, Correlate2DEmptyKernel) {
+  rtb::Matrix m(3, 3);
+  rtb::Matrix kernel(0, 3);
+
+  ASSERT_THROW(rtb::Matrix c = m.Correlate2D(kernel), std::invalid_argument);
+  ASSERT_THROW(rtb::Matrix c = m.Convolve2D(kernel), std::invalid_argument);
+}
+
+TEST(TestTaskScheduler, DequePushPopSteal) {
+  rtb_h::WorkStealingDeque deque(2);
+  std::vector<std::unique_ptr<rtb_h::FunctionTask<std::function<void()>>>>
+      tasks;
+  for (int i = 0; i < 5; i++) {
+    tasks.push_back(
+        std::make_unique<rtb_h::FunctionTask<std::function<void()>>>(
+            nullptr, []() {}));
+    deque.Push(tasks.back().get());
+  }
+
+  // The owner pops LIFO, thieves steal FIFO. The deque grew past its initial
+  // capacity of two.
+  ASSERT_EQ(deque.Pop(), tasks[4].get());
+  ASSERT_EQ(deque.Steal(), tasks[0].get());
+  ASSERT_EQ(deque.Steal(), tasks[1].get());
+  ASSERT_EQ(deque.Pop(), tasks[3].get());
+  ASSERT_EQ(deque.Pop(), tasks[2].get());
+  ASSERT_EQ(deque.Pop(), nullptr);
+  ASSERT_EQ(deque.Steal(), nullptr);
+  ASSERT_TRUE(deque.Empty());
+}
+
+TEST(TestTaskScheduler, TaskGroupRunsAllTasks) {
+  rtb::TaskScheduler scheduler(3);
+  std::atomic<int> count{0};
+
+  rtb::TaskGroup group(scheduler);
+  for (int i = 0; i < 1000; i++) {
+    group.Run([&count]() { count++; });
+  }
+  group.Wait();
+
+  ASSERT_EQ(count.load(), 1000);
+}
+
+TEST(TestTaskScheduler, NestedTaskGroups) {
+  rtb::TaskScheduler scheduler(2);
+  std::atomic<int> count{0};
+
+  rtb::TaskGroup outer(scheduler);
+  for (int i = 0; i < 10; i++) {
+    outer.Run([&scheduler, &count]() {
+      rtb::TaskGroup inner(scheduler);
+      for (int j = 0; j < 10; j++) {
+        inner.Run([&count]() { count++; });
+      }
+      inner.Wait();
+    });
+  }
+  outer.Wait();
+
+  ASSERT_EQ(count.load(), 100);
+}
+
+TEST(TestTaskScheduler, TaskGroupRethrows) {
+  rtb::TaskScheduler scheduler(2);
+
+  rtb::TaskGroup group(scheduler);
+  group.Run([]() { throw std::runtime_error("task failed"); });
+  group.Run([]() {});
+
+  ASSERT_THROW(group.Wait(), std::runtime_error);
+}
+
+TEST(TestTaskScheduler, ParallelForCoversRangeOnce) {
+  rtb::TaskScheduler scheduler(3);
+  const size_t n = 10007;
+  std::vector<std::atomic<int>> visits(n);
+
+  scheduler.ParallelFor(0, n, 64, [&visits](size_t begin, size_t end) {
+    ASSERT_LE(end - begin, 64);
+    for (size_t i = begin; i < end; i++) {
+      visits[i]++;
+    }
+  });
+
+  for (size_t i = 0; i < n; i++) {
+    ASSERT_EQ(visits[i].load(), 1);
+  }
+}
+
+TEST(TestTaskScheduler, ZeroWorkersRunInline) {
+  rtb::TaskScheduler scheduler(0);
+  const auto caller = std::this_thread::get_id();
+  size_t sum = 0;
+
+  scheduler.ParallelFor(0, 100, 10, [&](size_t begin, size_t end) {
+    ASSERT_EQ(std::this_thread::get_id(), caller);
+    for (size_t i = begin; i < end; i++) {
+      sum += i;
+    }
+  });
+  rtb::TaskGroup group(scheduler);
+  group.Run([&sum]() { sum += 1; });
+  group.Wait();
+
+  ASSERT_EQ(sum, 4951);
+}
+
+TEST(TestTaskScheduler, WorkIsStolen) {
+  rtb::TaskScheduler scheduler(2);
+  std::atomic<size_t> done{0};
+
+  // One task spawns sleeping children onto its worker's deque; the other
+  // worker can only get them by stealing. The test thread does not help, so
+  // the parent task is guaranteed to run on a worker.
+  std::atomic<bool> finished{false};
+  rtb::TaskGroup group(scheduler);
+  group.Run([&scheduler, &done, &finished]() {
+    rtb::TaskGroup children(scheduler);
+    for (int i = 0; i < 16; i++) {
+      children.Run([&done]() {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        done++;
+      });
+    }
+    children.Wait();
+    finished = true;
+  });
+  while (!finished) {
+    std::this_thread::yield();
+  }
+  group.Wait();
+
+  ASSERT_EQ(done.load(), 16);
+  ASSERT_GT(scheduler.StealCount(), 0);
+}